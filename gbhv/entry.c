@@ -1,5 +1,6 @@
 #include "vmm.h"
 #include "vmx.h"
+#include "exit.h"
 
 NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath);
 VOID
@@ -11,13 +12,16 @@ PVMM_CONTEXT GlobalContext;
 
 NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath)
 {
-	UNREFERENCED_PARAMETER(RegistryPath);
-	
+	BOOLEAN MapPhysicalMemoryOnly;
+
 	DriverObject->DriverUnload = DriverUnload;
 
 	HvUtilLog("--------------------------------------------------------------\n");
 
-	GlobalContext = HvInitializeAllProcessors();
+	// The compiled in setting can be overridden from the Parameters key of the service, see VMM_CONTEXT
+	MapPhysicalMemoryOnly = OsReadDriverParameter(RegistryPath, L"MapPhysicalMemoryOnly", VMM_SETTING_EPT_MAP_PHYSICAL_MEMORY_ONLY) != 0;
+
+	GlobalContext = HvInitializeAllProcessors(MapPhysicalMemoryOnly);
 
 	// Initialize Hypervisor
 	if(!GlobalContext)
@@ -50,9 +54,10 @@ VOID NTAPI ExitRootModeOnAllProcessors(_In_ struct _KDPC *Dpc,
 	// Get the logical processor context that was allocated for this current processor
 	CurrentContext = HvGetCurrentCPUContext(GlobalContext);
 
-	// Initialize processor for VMX
-	if (VmxExitRootMode(CurrentContext))
+	// VMCLEAR and VMXOFF raise #UD in the guest, so VMX is left from VMX root
+	if (CurrentContext->HasLaunched && __vmcall(VmmHypercallExitVmx, 0, 0))
 	{
+		CurrentContext->HasLaunched = FALSE;
 		HvUtilLogDebug("ExitRootModeOnAllProcessors[#%i]: Exiting VMX mode.\n", CurrentProcessorNumber);
 	}
 	else
@@ -60,6 +65,12 @@ VOID NTAPI ExitRootModeOnAllProcessors(_In_ struct _KDPC *Dpc,
 		HvUtilLogError("ExitRootModeOnAllProcessors[#%i]: Failed to exit VMX mode.\n", CurrentProcessorNumber);
 	}
 
+	// EPT violations can no longer raise #VE, so give the vector back to the OS
+	HvEptRestoreVirtualizationExceptionHandler(CurrentContext);
+
+	// Show how many VMREADs each kind of exit cost while we were running
+	HvExitReportStatistics(CurrentContext);
+
 	// These must be called for GenericDpcCall to signal other processors
 	// SimpleVisor code shows how to do this
 
@@ -44,6 +44,7 @@ BOOL HvEptCheckFeatures()
 BOOL HvEptBuildMTRRMap(PVMM_CONTEXT GlobalContext)
 {
 	IA32_MTRR_CAPABILITIES_REGISTER MTRRCap;
+	IA32_MTRR_DEF_TYPE_REGISTER MTRRDefType;
 	IA32_MTRR_PHYSBASE_REGISTER CurrentPhysBase;
 	IA32_MTRR_PHYSMASK_REGISTER CurrentPhysMask;
 	PMTRR_RANGE_DESCRIPTOR Descriptor;
@@ -52,6 +53,7 @@ BOOL HvEptBuildMTRRMap(PVMM_CONTEXT GlobalContext)
 
 
 	MTRRCap.Flags = ArchGetHostMSR(IA32_MTRR_CAPABILITIES);
+	MTRRDefType.Flags = ArchGetHostMSR(IA32_MTRR_DEF_TYPE);
 
 	HvUtilLogDebug("EPT: Number of dynamic ranges: %d\n", MTRRCap.VariableRangeCount);
 
@@ -79,122 +81,280 @@ BOOL HvEptBuildMTRRMap(PVMM_CONTEXT GlobalContext)
 			Descriptor->PhysicalEndAddress = Descriptor->PhysicalBaseAddress + ((1ULL << NumberOfBitsInMask) - 1ULL);
 
 			// Memory Type (cacheability attributes)
+			// WB ranges are kept, as the default type of memory not covered by any range is not necessarily WB.
 			Descriptor->MemoryType = (UCHAR) CurrentPhysBase.Type;
 
-			if(Descriptor->MemoryType == MEMORY_TYPE_WRITE_BACK)
-			{
-				/* This is already our default, so no need to store this range. 
-				 * Simply 'free' the range we just wrote. */
-				GlobalContext->NumberOfEnabledMemoryRanges--;
-			}
 			HvUtilLogDebug("MTRR Range: Base=0x%llX End=0x%llX Type=0x%X\n", Descriptor->PhysicalBaseAddress, Descriptor->PhysicalEndAddress, Descriptor->MemoryType);
 		}
 	}
 
 	HvUtilLogDebug("Total MTRR Ranges Committed: %d\n", GlobalContext->NumberOfEnabledMemoryRanges);
 
+	/* Memory above 512GB is only mapped on demand where there is RAM or a device, so find out where those are */
+	GlobalContext->NumberOfPhysicalMemoryRanges = OsGetPhysicalMemoryRanges(GlobalContext->PhysicalMemoryRanges, VMM_EPT_PHYSICAL_MEMORY_RANGE_MAX);
+	GlobalContext->NumberOfDeviceMemoryRanges = OsGetDeviceMemoryRanges(GlobalContext->DeviceMemoryRanges, VMM_EPT_DEVICE_MEMORY_RANGE_MAX);
+	GlobalContext->PhysicalAddressRangesKnown = GlobalContext->NumberOfPhysicalMemoryRanges != 0 && GlobalContext->NumberOfDeviceMemoryRanges != 0;
+
+	if (!GlobalContext->PhysicalAddressRangesKnown)
+	{
+		HvUtilLogError("EPT: Could not read the RAM and device ranges, so any address above 512GB will be mapped on demand.\n");
+	}
+
+	/* Only memory backed by RAM is mapped at load, which can't be done without the RAM ranges */
+	if (GlobalContext->MapPhysicalMemoryOnly && GlobalContext->NumberOfPhysicalMemoryRanges == 0)
+	{
+		HvUtilLogError("EPT: Could not read the RAM ranges, so memory can't be mapped only where there is RAM.\n");
+		return FALSE;
+	}
+
+	/* Resolve the ranges into runs of a single memory type */
+	if (!HvEptBuildMemoryRuns(GlobalContext, (UCHAR)MTRRDefType.DefaultMemoryType))
+	{
+		return FALSE;
+	}
+
+	/* 11.11.2.1 The fixed ranges are only used if they are both supported and enabled */
+	GlobalContext->FixedRangeMtrrsEnabled = MTRRCap.FixedRangeSupported && MTRRDefType.FixedRangeMtrrEnable;
+
+	if (GlobalContext->FixedRangeMtrrsEnabled)
+	{
+		for (CurrentRegister = 0; CurrentRegister < RTL_NUMBER_OF(HvEptFixedRangeMtrrs); CurrentRegister++)
+		{
+			HvEptDecodeFixedRangeMtrr(&HvEptFixedRangeMtrrs[CurrentRegister],
+				ArchGetHostMSR(HvEptFixedRangeMtrrs[CurrentRegister].Msr),
+				GlobalContext->FixedRangeMemoryTypes);
+		}
+
+		HvUtilLogDebug("EPT: Fixed range MTRRs enabled.\n");
+	}
+
 	return TRUE;
 }
 
+/**
+ * Free every frame of the pool, whether or not it is still in use.
+ */
+VOID HvEptPagePoolFree(PVMM_EPT_PAGE_POOL Pool)
+{
+	if (Pool->Frames)
+	{
+		OsFreeContiguousAlignedPages(Pool->Frames);
+		Pool->Frames = NULL;
+	}
+
+	if (Pool->Metadata)
+	{
+		OsFreeNonpagedMemory(Pool->Metadata);
+		Pool->Metadata = NULL;
+	}
 
-/*
- * Creates a 2MB identity mapped PML2 entry with a cacheability type specified by system MTRRs.
+	Pool->FreeHead = 0;
+}
+
+/**
+ * Take a zeroed frame from the pool in O(1), with its metadata zeroed too. Returns NULL if the pool is exhausted.
  * 
- * We must ensure that we map each 2MB entry with the correct cacheability type for performance. 
- * Unfortunately, the smallest paging structure is 4096 bytes so we have to mark the whole 2MB region as the least prohibitive cache type. 
- * In real systems, this not much of a problem, as there are just never single pages marked with certain cacheability attributes except for the first 1MB.
+ * Safe to call from VMX root, as it does not call into the OS. The free list is only ever changed with a single
+ * compare exchange, so a VM exit interrupting the guest in the middle of an allocation on the same processor
+ * (or any other processor) can safely use the pool too.
  */
-VOID HvEptSetupPML2Entry(PVMM_CONTEXT GlobalContext, PEPT_PML2_ENTRY NewEntry, SIZE_T PageFrameNumber)
+PVOID HvEptPagePoolAllocate(PVMM_EPT_PAGE_POOL Pool)
 {
-	SIZE_T AddressOfPage;
-	SIZE_T CurrentMtrrRange;
-	SIZE_T TargetMemoryType;
+	ULONG64 Head;
+	ULONG64 NewHead;
+	ULONG FrameIndex;
+	PCHAR Frame;
+	LONG InUseCount;
+	LONG HighWaterMark;
+
+	do
+	{
+		Head = (ULONG64)Pool->FreeHead;
 
-	/*
-	 * Each of the 512 collections of 512 PML2 entries is setup here.
-	 * This will, in total, identity map every physical address from 0x0 to physical address 0x8000000000 (512GB of memory)
-	 *
-	 * ((EntryGroupIndex * VMM_EPT_PML2E_COUNT) + EntryIndex) * 2MB is the actual physical address we're mapping
-	 */
-	NewEntry->PageFrameNumber = PageFrameNumber;
+		/* Index of the first free frame plus one, or zero if there are none */
+		FrameIndex = (ULONG)Head;
+		if (FrameIndex == 0)
+		{
+			InterlockedIncrement(&Pool->ExhaustedCount);
+			return NULL;
+		}
 
-	/* Size of 2MB page * PageFrameNumber == AddressOfPage (physical memory). */
-	AddressOfPage = PageFrameNumber * SIZE_2_MB;
+		Frame = Pool->Frames + ((SIZE_T)(FrameIndex - 1) * PAGE_SIZE);
 
-    /* To be safe, we will map the first page as UC as to not bring up any kind of undefined behavior from the 
-     * fixed MTRR section which we are not formally recognizing (typically there is MMIO memory in the first MB).
-	 *
-	 * I suggest reading up on the fixed MTRR section of the manual to see why the first entry is likely going to need to be UC.
-	 */
-	if(PageFrameNumber == 0)
+		/*
+		 * The link may be stale if another allocation takes this frame first. The tag in the upper half of the head
+		 * then no longer matches, so the exchange fails and the stale link is never used.
+		 */
+		NewHead = (((Head >> 32) + 1) << 32) | *(volatile ULONG*)Frame;
+	}
+	while ((ULONG64)InterlockedCompareExchange64(&Pool->FreeHead, (LONG64)NewHead, (LONG64)Head) != Head);
+
+	/* Keep track of the most frames ever in use, so the pool can be sized properly */
+	InUseCount = InterlockedIncrement(&Pool->InUseCount);
+	do
 	{
-		NewEntry->MemoryType = MEMORY_TYPE_UNCACHEABLE;
-		return;
+		HighWaterMark = Pool->HighWaterMark;
+		if (InUseCount <= HighWaterMark)
+		{
+			break;
+		}
+	}
+	while (InterlockedCompareExchange(&Pool->HighWaterMark, InUseCount, HighWaterMark) != HighWaterMark);
+
+	RtlZeroMemory(Frame, PAGE_SIZE);
+
+	if (Pool->Metadata)
+	{
+		RtlZeroMemory(Pool->Metadata + ((SIZE_T)(FrameIndex - 1) * Pool->MetadataSize), Pool->MetadataSize);
+	}
+
+	return Frame;
+}
+
+/**
+ * Return a frame to the pool in O(1). Safe to call from VMX root.
+ */
+VOID HvEptPagePoolRelease(PVMM_EPT_PAGE_POOL Pool, PVOID Frame)
+{
+	ULONG64 Head;
+	ULONG64 NewHead;
+	ULONG FrameIndex;
+
+	FrameIndex = (ULONG)(((PCHAR)Frame - Pool->Frames) / PAGE_SIZE) + 1;
+
+	do
+	{
+		Head = (ULONG64)Pool->FreeHead;
+
+		/* Link the frame to the current first free frame */
+		*(volatile ULONG*)Frame = (ULONG)Head;
+
+		NewHead = (((Head >> 32) + 1) << 32) | FrameIndex;
 	}
+	while ((ULONG64)InterlockedCompareExchange64(&Pool->FreeHead, (LONG64)NewHead, (LONG64)Head) != Head);
+
+	InterlockedDecrement(&Pool->InUseCount);
+}
+
+/**
+ * Reserve FrameCount page aligned frames of PAGE_SIZE bytes each, and MetadataSize bytes of metadata for each.
+ * 
+ * The frames are physically contiguous, so that the physical address of any frame can be computed without
+ * the Mm APIs, which cannot be called from VMX root (and which also fail to translate nonpaged pool allocations
+ * that Windows 10 v2004 and up map with large pages).
+ */
+BOOL HvEptPagePoolInitialize(PVMM_EPT_PAGE_POOL Pool, SIZE_T MetadataSize, SIZE_T FrameCount)
+{
+	SIZE_T FrameIndex;
 
-	/* Default memory type is always WB for performance. */
-	TargetMemoryType = MEMORY_TYPE_WRITE_BACK;
+	Pool->Frames = (PCHAR)OsAllocateContiguousAlignedPages(FrameCount);
+	if (!Pool->Frames)
+	{
+		HvUtilLogError("HvEptPagePoolInitialize: Failed to allocate %lld frames.\n", FrameCount);
+		return FALSE;
+	}
 
-	/* For each MTRR range */
-	for(CurrentMtrrRange = 0; CurrentMtrrRange < GlobalContext->NumberOfEnabledMemoryRanges; CurrentMtrrRange++)
+	Pool->Metadata = NULL;
+	if (MetadataSize)
 	{
-		/* If this page's address is below or equal to the max physical address of the range */
-		if(AddressOfPage <= GlobalContext->MemoryRanges[CurrentMtrrRange].PhysicalEndAddress)
+		Pool->Metadata = (PCHAR)OsAllocateNonpagedMemory(MetadataSize * FrameCount);
+		if (!Pool->Metadata)
 		{
-			/* And this page's last address is above or equal to the base physical address of the range */
-			if( (AddressOfPage + SIZE_2_MB - 1) >= GlobalContext->MemoryRanges[CurrentMtrrRange].PhysicalBaseAddress )
-			{
-				/* If we're here, this page fell within one of the ranges specified by the variable MTRRs
-				 * Therefore, we must mark this page as the same cache type exposed by the MTRR 
-				 */
-				TargetMemoryType = GlobalContext->MemoryRanges[CurrentMtrrRange].MemoryType;
-				//HvUtilLogDebug("0x%X> Range=%llX -> %llX | Begin=%llX End=%llX", PageFrameNumber, AddressOfPage, AddressOfPage + SIZE_2_MB - 1, GlobalContext->MemoryRanges[CurrentMtrrRange].PhysicalBaseAddress, GlobalContext->MemoryRanges[CurrentMtrrRange].PhysicalEndAddress);
-
-				/* 11.11.4.1 MTRR Precedences */
-				if(TargetMemoryType == MEMORY_TYPE_UNCACHEABLE)
-				{
-					/* If this is going to be marked uncacheable, then we stop the search as UC always takes precedent. */
-					break;
-				}
-			}
+			HvUtilLogError("HvEptPagePoolInitialize: Failed to allocate metadata for %lld frames.\n", FrameCount);
+			OsFreeContiguousAlignedPages(Pool->Frames);
+			Pool->Frames = NULL;
+			return FALSE;
 		}
 	}
 
-	/* Finally, commit the memory type to the entry. */
-	NewEntry->MemoryType = TargetMemoryType;
+	Pool->FramesPhysical = (SIZE_T)OsVirtualToPhysical(Pool->Frames);
+	Pool->MetadataSize = MetadataSize;
+	Pool->FrameCount = FrameCount;
+	Pool->InUseCount = 0;
+	Pool->HighWaterMark = 0;
+	Pool->ExhaustedCount = 0;
+
+	/* Chain every frame to the next one. Links are frame indices plus one, with zero ending the list. */
+	for (FrameIndex = 0; FrameIndex < FrameCount; FrameIndex++)
+	{
+		*(PULONG)(Pool->Frames + (FrameIndex * PAGE_SIZE)) = (FrameIndex + 1 < FrameCount) ? (ULONG)(FrameIndex + 2) : 0;
+	}
+
+	Pool->FreeHead = (FrameCount > 0) ? 1 : 0;
+
+	return TRUE;
+}
+
+/**
+ * Get the physical address of a frame of the pool, or of an address within one.
+ */
+SIZE_T HvEptPagePoolVirtualToPhysical(PVMM_EPT_PAGE_POOL Pool, PVOID VirtualAddress)
+{
+	return Pool->FramesPhysical + ((PCHAR)VirtualAddress - Pool->Frames);
 }
 
-PVMM_EPT_PAGE_TABLE HvEptAllocateAndCreateIdentityPageTable(PVMM_CONTEXT GlobalContext)
+/**
+ * Get the frame of the pool at PhysicalAddress, or NULL if the address is not within the pool.
+ */
+PVOID HvEptPagePoolPhysicalToVirtual(PVMM_EPT_PAGE_POOL Pool, SIZE_T PhysicalAddress)
 {
-	PVMM_EPT_PAGE_TABLE PageTable;
+	if (PhysicalAddress < Pool->FramesPhysical || PhysicalAddress - Pool->FramesPhysical >= Pool->FrameCount * PAGE_SIZE)
+	{
+		return NULL;
+	}
+
+	return Pool->Frames + ((PhysicalAddress - Pool->FramesPhysical) & ~(PAGE_SIZE - 1));
+}
+
+/**
+ * Get the metadata of a frame of the pool.
+ */
+PVOID HvEptPagePoolGetMetadata(PVMM_EPT_PAGE_POOL Pool, PVOID Frame)
+{
+	return Pool->Metadata + ((((PCHAR)Frame - Pool->Frames) / PAGE_SIZE) * Pool->MetadataSize);
+}
+
+/**
+ * Get the number of bytes reserved by the pool, whether or not its frames are in use.
+ */
+SIZE_T HvEptPagePoolGetReservedSize(PVMM_EPT_PAGE_POOL Pool)
+{
+	return Pool->FrameCount * (PAGE_SIZE + Pool->MetadataSize);
+}
+
+/**
+ * Build the identity map of the first 512GB of physical memory which is shared by all logical processors.
+ * 
+ * The identity map is only built once during initialization and is never modified after, so processors
+ * are free to reference its directories without any synchronization. The one exception are the pages of its splits
+ * left not present by VMM_CONTEXT::MapPhysicalMemoryOnly, which HvEptMapPageTableOnDemand maps in place. Every
+ * processor writes the same identity entry, so that is safe too.
+ */
+PVMM_EPT_IDENTITY_MAP HvEptAllocateAndCreateIdentityMap(PVMM_CONTEXT GlobalContext)
+{
+	PVMM_EPT_IDENTITY_MAP IdentityMap;
+	PVMM_EPT_PML2_DIRECTORY Directory;
+	IA32_VMX_EPT_VPID_CAP_REGISTER VpidRegister;
 	EPT_PML3_POINTER RWXTemplate;
-	EPT_PML2_ENTRY PML2EntryTemplate;
+	EPT_PML3_ENTRY LargePageEntry;
+	PMTRR_MEMORY_RUN Run;
 	SIZE_T EntryGroupIndex;
-	SIZE_T EntryIndex;
-	
-	/* Allocate all paging structures as 4KB aligned pages */
-	PageTable = OsAllocateContiguousAlignedPages(sizeof(VMM_EPT_PAGE_TABLE) / PAGE_SIZE);
 
-	if(PageTable == NULL)
+	/* Allocate the PML3 template as 4KB aligned pages */
+	IdentityMap = OsAllocateContiguousAlignedPages(sizeof(VMM_EPT_IDENTITY_MAP) / PAGE_SIZE);
+
+	if (IdentityMap == NULL)
 	{
-		HvUtilLogError("HvEptCreatePageTable: Failed to allocate memory for PageTable.\n");
+		HvUtilLogError("HvEptCreateIdentityMap: Failed to allocate memory for IdentityMap.\n");
 		return NULL;
 	}
 
 	/* Zero out all entries to ensure all unused entries are marked Not Present */
-	OsZeroMemory(PageTable, sizeof(VMM_EPT_PAGE_TABLE));
-
-	/* Initialize the dynamic split list which holds all dynamic page splits */
-	InitializeListHead(&PageTable->DynamicSplitList);
+	OsZeroMemory(IdentityMap, sizeof(VMM_EPT_IDENTITY_MAP));
 
-	/* Initialize the page hook list which holds information on currently hooked pages */
-	InitializeListHead(&PageTable->PageHookList);
+	IdentityMap->SizeInBytes = sizeof(VMM_EPT_IDENTITY_MAP);
 
-	/* Mark the first 512GB PML4 entry as present, which allows us to manage up to 512GB of discrete paging structures. */
-	PageTable->PML4[0].PageFrameNumber = (SIZE_T)OsVirtualToPhysical(&PageTable->PML3[0]) / PAGE_SIZE;
-	PageTable->PML4[0].ReadAccess = 1;
-	PageTable->PML4[0].WriteAccess = 1;
-	PageTable->PML4[0].ExecuteAccess = 1;
+	InitializeListHead(&IdentityMap->DynamicSplitList);
 
 	/* Now mark each 1GB PML3 entry as RWX and map each to their PML2 entry */
 
@@ -208,53 +368,157 @@ PVMM_EPT_PAGE_TABLE HvEptAllocateAndCreateIdentityPageTable(PVMM_CONTEXT GlobalC
 	RWXTemplate.ExecuteAccess = 1;
 
 	/* Copy the template into each of the 512 PML3 entry slots */
-	__stosq((SIZE_T*)&PageTable->PML3[0], RWXTemplate.Flags, VMM_EPT_PML3E_COUNT);
+	__stosq((SIZE_T*)&IdentityMap->PML3[0], RWXTemplate.Flags, VMM_EPT_PML3E_COUNT);
 
-	/* For each of the 512 PML3 entries */
-	for(EntryIndex = 0; EntryIndex < VMM_EPT_PML3E_COUNT; EntryIndex++)
+	/* Not all processors can map 1GB of memory with a single EPT entry. */
+	VpidRegister.Flags = ArchGetHostMSR(IA32_VMX_EPT_VPID_CAP);
+	IdentityMap->LargePage1GbSupported = (BOOLEAN)VpidRegister.Pdpte1GbPages;
+
+	/* For each of the 512 collections of 512 2MB PML2 entries */
+	for(EntryGroupIndex = 0; EntryGroupIndex < VMM_EPT_PML3E_COUNT; EntryGroupIndex++)
 	{
+		/*
+		 * If the whole gigabyte has a single memory type, map it with one 1GB large page. This saves the 4KB
+		 * directory and removes a level from every EPT walk into this region. The first gigabyte is never
+		 * mapped this way, as its first 2MB is always split for the fixed range MTRRs.
+		 */
+		Run = NULL;
+		if (EntryGroupIndex != 0)
+		{
+			Run = HvEptGetUniformMemoryRun(GlobalContext, EntryGroupIndex * SIZE_1_GB, SIZE_1_GB);
+		}
+
+		/* Nothing backs this gigabyte, so leave it not present without allocating a directory at all */
+		if (Run && !Run->Backed)
+		{
+			IdentityMap->PML3[EntryGroupIndex].Flags = VMM_EPT_NOT_PRESENT_ENTRY;
+			continue;
+		}
+
+		if (IdentityMap->LargePage1GbSupported && Run)
+		{
+			LargePageEntry.Flags = 0;
+			LargePageEntry.ReadAccess = 1;
+			LargePageEntry.WriteAccess = 1;
+			LargePageEntry.ExecuteAccess = 1;
+			LargePageEntry.LargePage = 1;
+			LargePageEntry.MemoryType = Run->MemoryType;
+			LargePageEntry.PageFrameNumber = EntryGroupIndex;
+
+			IdentityMap->PML3[EntryGroupIndex].Flags = LargePageEntry.Flags;
+			IdentityMap->LargePage1GbCount++;
+			continue;
+		}
+
+		/* Allocate the directory describing this 1GB region */
+		Directory = OsAllocateContiguousAlignedPages(sizeof(VMM_EPT_PML2_DIRECTORY) / PAGE_SIZE);
+
+		if (Directory == NULL)
+		{
+			HvUtilLogError("HvEptCreateIdentityMap: Failed to allocate memory for PML2 directory.\n");
+			HvEptFreeIdentityMap(IdentityMap);
+			return NULL;
+		}
+
+		OsZeroMemory(Directory, sizeof(VMM_EPT_PML2_DIRECTORY));
+		__stosq((SIZE_T*)&Directory->PML2[0], VMM_EPT_NOT_PRESENT_ENTRY, VMM_EPT_PML2E_COUNT);
+
+		IdentityMap->PML2[EntryGroupIndex] = Directory;
+		IdentityMap->SizeInBytes += sizeof(VMM_EPT_PML2_DIRECTORY);
+
 		/*
 		 * Map the 1GB PML3 entry to 512 PML2 (2MB) entries to describe each large page.
-		 * NOTE: We do *not* manage any PML1 (4096 byte) entries and do not allocate them.
+		 * NOTE: PML1 (4096 byte) entries are only allocated for 2MB regions with more than one memory type.
+		 */
+		IdentityMap->PML3[EntryGroupIndex].PageFrameNumber = (SIZE_T)OsVirtualToPhysical(&Directory->PML2[0]) / PAGE_SIZE;
+
+		/*
+		 * Mark each entry RWX and 'present'. Unless MapPhysicalMemoryOnly is set, this is regardless of if the actual
+		 * system has memory at this region or not.
 		 */
-		PageTable->PML3[EntryIndex].PageFrameNumber = (SIZE_T)OsVirtualToPhysical(&PageTable->PML2[EntryIndex][0]) / PAGE_SIZE;
+		if (!HvEptFillPml2Directory(GlobalContext, IdentityMap, Directory, EntryGroupIndex))
+		{
+			HvEptFreeIdentityMap(IdentityMap);
+			return NULL;
+		}
+	}
+
+	HvUtilLogDebug("EPT: Shared identity map uses %lld KB (%lld 1GB large pages, %lld mixed type 2MB regions split).\n",
+		IdentityMap->SizeInBytes / 1024, IdentityMap->LargePage1GbCount, IdentityMap->MixedRegionSplitCount);
+
+	return IdentityMap;
+}
+
+/**
+ * Allocate a page table of a single logical processor, for the processor itself or one of its views.
+ * 
+ * The page table only owns its PML4 and PML3. Every PML3 entry points to the shared directory of the identity
+ * map until this processor needs to modify that directory. Memory above the first 512GB is not mapped at all
+ * until the guest accesses it, see HvEptMapOnDemand. Private directories and splits come from the pools of the
+ * processor, which must already be reserved.
+ */
+PVMM_EPT_PAGE_TABLE HvEptAllocatePageTable(PVMM_PROCESSOR_CONTEXT ProcessorContext)
+{
+	PVMM_EPT_IDENTITY_MAP IdentityMap;
+	PVMM_EPT_PAGE_TABLE PageTable;
+
+	IdentityMap = ProcessorContext->GlobalContext->EptIdentityMap;
+	
+	/* Allocate all paging structures as 4KB aligned pages */
+	PageTable = OsAllocateContiguousAlignedPages(sizeof(VMM_EPT_PAGE_TABLE) / PAGE_SIZE);
+
+	if(PageTable == NULL)
+	{
+		HvUtilLogError("HvEptCreatePageTable: Failed to allocate memory for PageTable.\n");
+		return NULL;
 	}
 
-	PML2EntryTemplate.Flags = 0;
+	/* Zero out all entries to ensure all unused entries are marked Not Present */
+	OsZeroMemory(PageTable, sizeof(VMM_EPT_PAGE_TABLE));
+	__stosq((SIZE_T*)&PageTable->PML4[0], VMM_EPT_NOT_PRESENT_ENTRY, VMM_EPT_PML4E_COUNT);
 
-	/* All PML2 entries will be RWX and 'present' */
-	PML2EntryTemplate.WriteAccess = 1;
-	PML2EntryTemplate.ReadAccess = 1;
-	PML2EntryTemplate.ExecuteAccess = 1;
+	PageTable->IdentityMap = IdentityMap;
+	PageTable->TablePool = &ProcessorContext->EptTablePool;
+	PageTable->SplitPool = &ProcessorContext->EptSplitPool;
 
-	/* We are using 2MB large pages, so we must mark this 1 here. */
-	PML2EntryTemplate.LargePage = 1;
+	/* Initialize the dynamic split list which holds all dynamic page splits */
+	InitializeListHead(&PageTable->DynamicSplitList);
 
-	/* For each collection of 512 PML2 entries (512 collections * 512 entries per collection), mark it RWX using the same template above.
-	 * This marks the entries as "Present" regardless of if the actual system has memory at this region or not. We will cause a fault in our
-	 * EPT handler if the guest access a page outside a usable range, despite the EPT frame being present here.
-	 */
-	__stosq((SIZE_T*)&PageTable->PML2[0], PML2EntryTemplate.Flags, VMM_EPT_PML3E_COUNT * VMM_EPT_PML2E_COUNT);
+	/* Initialize the page hook list which holds information on currently hooked pages */
+	InitializeListHead(&PageTable->PageHookList);
 
-	/* For each of the 512 collections of 512 2MB PML2 entries */
-	for(EntryGroupIndex = 0; EntryGroupIndex < VMM_EPT_PML3E_COUNT; EntryGroupIndex++)
+	/* Allocate the index used to find a page hook from the faulting address of an EPT violation */
+	if (!HvEptHookIndexInitialize(&PageTable->HookIndex, VMM_SETTING_EPT_HOOK_INDEX_SIZE))
 	{
-		/* For each 2MB PML2 entry in the collection */
-		for(EntryIndex = 0; EntryIndex < VMM_EPT_PML2E_COUNT; EntryIndex++)
-		{
-			/* Setup the memory type and frame number of the PML2 entry. */
-			HvEptSetupPML2Entry(GlobalContext, &PageTable->PML2[EntryGroupIndex][EntryIndex], (EntryGroupIndex * VMM_EPT_PML2E_COUNT) + EntryIndex);
-		}
+		HvUtilLogError("HvEptCreatePageTable: Failed to allocate memory for HookIndex.\n");
+		OsFreeContiguousAlignedPages(PageTable);
+		return NULL;
 	}
 
+	/*
+	 * Mark the first 512GB PML4 entry as present, which allows us to manage up to 512GB of discrete paging structures.
+	 * The rest of the PML4 entries stay not present until the guest touches memory within them.
+	 */
+	PageTable->PML4[0].Flags = 0;
+	PageTable->PML4[0].PageFrameNumber = (SIZE_T)OsVirtualToPhysical(&PageTable->PML3[0]) / PAGE_SIZE;
+	PageTable->PML4[0].ReadAccess = 1;
+	PageTable->PML4[0].WriteAccess = 1;
+	PageTable->PML4[0].ExecuteAccess = 1;
+
+	/* Start with every 1GB entry pointing at the shared directories of the identity map */
+	RtlCopyMemory(&PageTable->PML3[0], &IdentityMap->PML3[0], sizeof(PageTable->PML3));
+	RtlCopyMemory(&PageTable->PML2[0], &IdentityMap->PML2[0], sizeof(PageTable->PML2));
+
 	return PageTable;
 }
 
 /**
  * Initializes any EPT components that are not local to a particular processor.
  * 
- * Checks to ensure EPT is supported by the processor and builds a map of system memory from
- * the MTRR registers.
+ * Checks to ensure EPT is supported by the processor, builds a map of system memory from
+ * the MTRR registers and builds the identity map shared by all processors.
+ * 
+ * Must be called before any logical processor context is allocated.
  */
 BOOL HvEptGlobalInitialize(PVMM_CONTEXT GlobalContext)
 {
@@ -265,6 +529,23 @@ BOOL HvEptGlobalInitialize(PVMM_CONTEXT GlobalContext)
 		return FALSE;
 	}
 
+	KeInitializeSpinLock(&GlobalContext->SharedEditLock);
+
+	KeInitializeSpinLock(&GlobalContext->TrampolineLock);
+	InitializeListHead(&GlobalContext->TrampolineList);
+
+#if VMM_SETTING_EPT_USE_VIRTUALIZATION_EXCEPTIONS
+	/*
+	 * With KVA shadow, user mode runs on page tables which only map the kernel's own interrupt entry stubs. A #VE
+	 * raised in user mode could not reach our handler, so #VE is not used at all on such systems.
+	 */
+	GlobalContext->KernelVaShadowEnabled = OsIsKernelVaShadowEnabled();
+	if (GlobalContext->KernelVaShadowEnabled)
+	{
+		HvUtilLogDebug("EPT: KVA shadow is enabled, #VE will not be used.\n");
+	}
+#endif
+
 	/* Build a map of the system memory as exposed by the BIOS */
 	if(!HvEptBuildMTRRMap(GlobalContext))
 	{
@@ -272,159 +553,632 @@ BOOL HvEptGlobalInitialize(PVMM_CONTEXT GlobalContext)
 		return FALSE;
 	}
 
+	/* Build the identity map all processors will start from */
+	GlobalContext->EptIdentityMap = HvEptAllocateAndCreateIdentityMap(GlobalContext);
+	if (!GlobalContext->EptIdentityMap)
+	{
+		HvUtilLogError("Could not build EPT identity map.\n");
+		return FALSE;
+	}
+
 	return TRUE;
 }
 
 /**
- * Get the PML2 entry for this physical address.
+ * Free EPT components allocated by HvEptGlobalInitialize.
+ * 
+ * Every logical processor page table must be freed first, as they reference the identity map.
  */
-PEPT_PML2_ENTRY HvEptGetPml2Entry(PVMM_PROCESSOR_CONTEXT ProcessorContext, SIZE_T PhysicalAddress)
+VOID HvEptGlobalFree(PVMM_CONTEXT GlobalContext)
 {
-	SIZE_T Directory, DirectoryPointer, PML4Entry;
-	PEPT_PML2_ENTRY PML2;
+	HvEptFreeIdentityMap(GlobalContext->EptIdentityMap);
+	GlobalContext->EptIdentityMap = NULL;
+}
 
-	Directory  = ADDRMASK_EPT_PML2_INDEX(PhysicalAddress);
-	DirectoryPointer = ADDRMASK_EPT_PML3_INDEX(PhysicalAddress);
-	PML4Entry = ADDRMASK_EPT_PML4_INDEX(PhysicalAddress);
+/**
+ * Get the directory that a 1GB entry above the first 512GB points to, or NULL if the entry is not present or a 1GB
+ * large page. Everything above 512GB comes from the table pool, so the directory is the pool frame it points to.
+ */
+PVMM_EPT_PML2_DIRECTORY HvEptGetPml3EntryDirectory(PVMM_EPT_PAGE_TABLE PageTable, PEPT_PML3_POINTER Pml3Entry)
+{
+	EPT_PML3_ENTRY LargePageEntry;
 
-	/* Addresses above 512GB are invalid because it is > physical address bus width */
-	if(PML4Entry > 0)
+	LargePageEntry.Flags = Pml3Entry->Flags;
+	if (!VMM_EPT_ENTRY_PRESENT(LargePageEntry) || LargePageEntry.LargePage)
 	{
 		return NULL;
 	}
 
-	PML2 = &ProcessorContext->EptPageTable->PML2[DirectoryPointer][Directory];
-	return PML2;
+	return (PVMM_EPT_PML2_DIRECTORY)HvEptPagePoolPhysicalToVirtual(PageTable->TablePool, Pml3Entry->PageFrameNumber * PAGE_SIZE);
 }
 
 /**
- * Get the PML1 entry for this physical address if the page is split. Return NULL if the address is invalid
- * or the page wasn't already split.
+ * Get the directory of PML2 entries for this physical address. The directory may be shared with other processors
+ * and must not be modified. Use HvEptGetPml2DirectoryForWrite to get a directory that can be modified.
+ * 
+ * Returns NULL if the address is not mapped or is mapped by a 1GB large page.
  */
-PEPT_PML1_ENTRY HvEptGetPml1Entry(PVMM_PROCESSOR_CONTEXT ProcessorContext, SIZE_T PhysicalAddress)
+PVMM_EPT_PML2_DIRECTORY HvEptGetPml2Directory(PVMM_EPT_PAGE_TABLE PageTable, SIZE_T PhysicalAddress)
 {
-	SIZE_T Directory, DirectoryPointer, PML4Entry;
-	PEPT_PML2_ENTRY PML2;
-	PEPT_PML1_ENTRY PML1;
-	PEPT_PML2_POINTER PML2Pointer;
-
-	Directory = ADDRMASK_EPT_PML2_INDEX(PhysicalAddress);
-	DirectoryPointer = ADDRMASK_EPT_PML3_INDEX(PhysicalAddress);
-	PML4Entry = ADDRMASK_EPT_PML4_INDEX(PhysicalAddress);
-
-	/* Addresses above 512GB are invalid because it is > physical address bus width */
-	if (PML4Entry > 0)
-	{
-		return NULL;
-	}
+	SIZE_T PML4Index;
 
-	PML2 = &ProcessorContext->EptPageTable->PML2[DirectoryPointer][Directory];
+	PML4Index = ADDRMASK_EPT_PML4_INDEX(PhysicalAddress);
 
-	/* Check to ensure the page is split */
-	if(PML2->LargePage)
+	/* The first 512GB is always mapped */
+	if (PML4Index == 0)
 	{
-		return NULL;
+		return PageTable->PML2[ADDRMASK_EPT_PML3_INDEX(PhysicalAddress)];
 	}
 
-	/* Conversion to get the right PageFrameNumber. These pointers occupy the same place in the
-	 * table and are directly convertable.
-	 */
-	PML2Pointer = (PEPT_PML2_POINTER) PML2;
-
-	/* If it is, translate to the PML1 pointer */
-	PML1 = (PEPT_PML1_ENTRY) OsPhysicalToVirtual((PPHYSVOID)(PML2Pointer->PageFrameNumber * PAGE_SIZE));
-
-	if(!PML1)
+	/* Above that, only regions the guest has touched are */
+	if (!PageTable->PML3Directory[PML4Index])
 	{
-		HvUtilLogError("Failed to get PML1 entry: Translating PA:%p to VA returned NULL.", PML2Pointer->PageFrameNumber * PAGE_SIZE);
 		return NULL;
 	}
 
-	/* Index into PML1 for that address */
-	PML1 = &PML1[ADDRMASK_EPT_PML1_INDEX(PhysicalAddress)];
-
-	return PML1;
+	return HvEptGetPml3EntryDirectory(PageTable, &PageTable->PML3Directory[PML4Index]->PML3[ADDRMASK_EPT_PML3_INDEX(PhysicalAddress)]);
 }
 
 /**
- * Split a large 2MB page into 512 smaller 4096 pages.
- * 
- * In order to set discrete EPT permissions on a singular 4096 byte page, we need to split our
- * default 2MB entries into 512 smaller 4096 byte entries. This function will replace the default
- * 2MB entry created for the page table at the specified PhysicalAddress and replace it with a 2MB
- * pointer entry. That pointer will point to a dynamically allocated set of 512 smaller 4096 byte
- * pages, which will become the new permission structures for that 2MB region.
+ * Demote the 1GB large page in Pml3Entry to a directory of 512 2MB large pages carrying the same memory type
+ * and permissions.
  */
-BOOL HvEptSplitLargePage(PVMM_PROCESSOR_CONTEXT ProcessorContext, SIZE_T PhysicalAddress)
+VOID HvEptDemoteLargePage1Gb(PVMM_EPT_PML2_DIRECTORY Directory, PEPT_PML3_POINTER Pml3Entry)
 {
-	PVMM_EPT_DYNAMIC_SPLIT NewSplit;
-	EPT_PML1_ENTRY EntryTemplate;
+	EPT_PML3_ENTRY LargePageEntry;
+	EPT_PML2_ENTRY EntryTemplate;
 	SIZE_T EntryIndex;
-	PEPT_PML2_ENTRY TargetEntry;
-	EPT_PML2_POINTER NewPointer;
 
-	HvUtilLog("Splitting large page @ PA:%p", PhysicalAddress);
+	LargePageEntry.Flags = Pml3Entry->Flags;
 
-	/* Find the PML2 entry that's currently used*/
-	TargetEntry = HvEptGetPml2Entry(ProcessorContext, PhysicalAddress);
-	if(!TargetEntry)
-	{
-		HvUtilLogError("HvEptSplitLargePage: Invalid physical address.\n");
-		return FALSE;
-	}
+	OsZeroMemory(Directory, sizeof(VMM_EPT_PML2_DIRECTORY));
 
-	/* If this large page is not marked a large page, that means it's a pointer already.
-	 * That page is therefore already split.
-	 */
-	if(!TargetEntry->LargePage)
-	{
-		return TRUE;
-	}
+	EntryTemplate.Flags = 0;
+	EntryTemplate.ReadAccess = LargePageEntry.ReadAccess;
+	EntryTemplate.WriteAccess = LargePageEntry.WriteAccess;
+	EntryTemplate.ExecuteAccess = LargePageEntry.ExecuteAccess;
+	EntryTemplate.MemoryType = LargePageEntry.MemoryType;
+	EntryTemplate.IgnorePat = LargePageEntry.IgnorePat;
+	EntryTemplate.SuppressVe = LargePageEntry.SuppressVe;
+	EntryTemplate.LargePage = 1;
 
-	/*
-	* Allocate the PML1 entries for the split.
-	* NOTE: This would *not* need to use contiguous aligned pages normally, except for a bug which is experienced
-	* in Windows 10 v2004 where changes to the nonpaged pool allocator resulted in some page aligned allocations
-	* being mapped as 4MB large pages rather than the expected 4KB pages. This causes the following VtoP and PtoV
-	* functions to fail, because the Mm APIs are not able to properly translate physical addresses within a large page
-	* back to its virtual address due to a null PTE pointer inside the PFN database entry for the large page.
-	* 
-	* From my testing, I was unable to find a way to coerce Mm to split a nonpaged pool large page for me, so the best
-	* alternative was to use the contiguous aligned pages allocator because, in my testing, it resulted in only 4KB virtual
-	* allocations. This allocator also utilizes nonpaged pool frames, so it is more-or-less the same as the other allocator.
-	*/
-	NewSplit = (PVMM_EPT_DYNAMIC_SPLIT) OsAllocateContiguousAlignedPages(sizeof(VMM_EPT_DYNAMIC_SPLIT)/PAGE_SIZE);
-	if(!NewSplit)
+	__stosq((SIZE_T*)&Directory->PML2[0], EntryTemplate.Flags, VMM_EPT_PML2E_COUNT);
+
+	for (EntryIndex = 0; EntryIndex < VMM_EPT_PML2E_COUNT; EntryIndex++)
 	{
-		HvUtilLogError("HvEptSplitLargePage: Failed to allocate dynamic split memory.\n");
-		return FALSE;
+		/* Convert the 1GB page frame number to the 2MB page entry number plus the offset into the frame. */
+		Directory->PML2[EntryIndex].PageFrameNumber = (LargePageEntry.PageFrameNumber * VMM_EPT_PML2E_COUNT) + EntryIndex;
 	}
+}
 
-	/*
-	 * Point back to the entry in the dynamic split for easy reference for which entry that
-	 * dynamic split is for.
+/**
+ * Get the directory of PML2 entries for this physical address, creating a private one for this processor first
+ * if it does not already own one.
+ * 
+ * If the address is currently inside of a shared directory, that directory is copied. If it is inside of a 1GB large
+ * page, the large page is demoted to a directory of 512 2MB pages carrying the same memory type and permissions.
+ * Either way the new directory translates exactly like the entry it replaces, so swapping the PML3 entry over to
+ * it requires no invalidation.
+ * 
+ * Private directories come from the table pool, so this is safe to call from VMX root.
+ * Returns NULL if the address is not mapped.
+ */
+PVMM_EPT_PML2_DIRECTORY HvEptGetPml2DirectoryForWrite(PVMM_EPT_PAGE_TABLE PageTable, SIZE_T PhysicalAddress)
+{
+	PVMM_EPT_PML3_DIRECTORY Pml3Directory;
+	PVMM_EPT_PML2_DIRECTORY Directory;
+	PVMM_EPT_PML2_DIRECTORY SharedDirectory;
+	PEPT_PML3_POINTER Pml3Entry;
+	EPT_PML3_POINTER NewPointer;
+	SIZE_T PML4Index;
+	SIZE_T DirectoryPointer;
+
+	PML4Index = ADDRMASK_EPT_PML4_INDEX(PhysicalAddress);
+	DirectoryPointer = ADDRMASK_EPT_PML3_INDEX(PhysicalAddress);
+	Pml3Directory = NULL;
+
+	if (PML4Index == 0)
+	{
+		/* Already ours to modify */
+		if (PageTable->PML2Private[DirectoryPointer])
+		{
+			return PageTable->PML2[DirectoryPointer];
+		}
+
+		Pml3Entry = &PageTable->PML3[DirectoryPointer];
+		SharedDirectory = PageTable->PML2[DirectoryPointer];
+	}
+	else
+	{
+		Pml3Directory = PageTable->PML3Directory[PML4Index];
+		if (!Pml3Directory)
+		{
+			return NULL;
+		}
+
+		Pml3Entry = &Pml3Directory->PML3[DirectoryPointer];
+		SharedDirectory = NULL;
+
+		/* Everything above 512GB is private to this page table already */
+		Directory = HvEptGetPml3EntryDirectory(PageTable, Pml3Entry);
+		if (Directory)
+		{
+			return Directory;
+		}
+	}
+
+	/* Not mapped yet */
+	if (!VMM_EPT_ENTRY_PRESENT(*Pml3Entry))
+	{
+		return NULL;
+	}
+
+	Directory = HvEptPagePoolAllocate(PageTable->TablePool);
+	if (!Directory)
+	{
+		HvUtilLogError("HvEptGetPml2DirectoryForWrite: Table pool exhausted. Increase VMM_SETTING_EPT_TABLE_POOL_SIZE.\n");
+		return NULL;
+	}
+
+	if (SharedDirectory)
+	{
+		/* Copy the shared entries. Split pointers keep pointing at the identity map's splits. */
+		RtlCopyMemory(Directory, SharedDirectory, sizeof(VMM_EPT_PML2_DIRECTORY));
+	}
+	else
+	{
+		/* Demote the 1GB large page into 512 2MB large pages */
+		HvEptDemoteLargePage1Gb(Directory, Pml3Entry);
+	}
+
+	if (!Pml3Directory)
+	{
+		PageTable->PML2[DirectoryPointer] = Directory;
+		PageTable->PML2Private[DirectoryPointer] = TRUE;
+		PageTable->PrivatePML2Count++;
+	}
+
+	/* Point the 1GB entry at the private directory from now on */
+	NewPointer.Flags = 0;
+	NewPointer.ReadAccess = 1;
+	NewPointer.WriteAccess = 1;
+	NewPointer.ExecuteAccess = 1;
+	NewPointer.PageFrameNumber = HvEptPagePoolVirtualToPhysical(PageTable->TablePool, &Directory->PML2[0]) / PAGE_SIZE;
+
+	Pml3Entry->Flags = NewPointer.Flags;
+
+	return Directory;
+}
+
+/**
+ * Map the region of physical memory containing PhysicalAddress in PageTable if nothing is mapped there yet. Returns
+ * FALSE if the address was already mapped or there was no memory left to map it with.
+ * 
+ * Called from VMX root when the guest touches memory that EPT does not map. Above 512GB, paging structures only exist
+ * for regions which are actually in use, such as the memory of large servers or 64-bit MMIO BARs. HvExitHandleEptViolation
+ * only gets here for such an address if the OS reports RAM or a device there. If MapPhysicalMemoryOnly is set in the
+ * global context, the same goes for memory below 512GB which is not backed by RAM.
+ * 
+ * The whole 1GB region is mapped with a 1GB page if it has a uniform memory type. Otherwise only the 2MB region
+ * containing the address is mapped, as UC if it does not have a uniform memory type, since there is no memory for
+ * a split in VMX root. A page left not present in a split 2MB region is mapped on its own. Memory not backed by RAM
+ * is typed as MMIO. Every structure comes from the table pool. Once the pool runs out the access can't be mapped, and
+ * the violation stops the hypervisor as unexpected. HvEptFreeLogicalProcessorContext logs how often that happened.
+ * Making an entry present needs no invalidation, as not present entries are never cached.
+ */
+BOOL HvEptMapPageTableOnDemand(PVMM_CONTEXT GlobalContext, PVMM_EPT_PAGE_TABLE PageTable, SIZE_T PhysicalAddress)
+{
+	PVMM_EPT_PML3_DIRECTORY Pml3Directory;
+	PVMM_EPT_PML2_DIRECTORY Directory;
+	PEPT_PML3_POINTER Pml3Entry;
+	PEPT_PML2_ENTRY Pml2Entry;
+	PEPT_PML1_ENTRY Pml1Entry;
+	PMTRR_MEMORY_RUN Run;
+	EPT_PML3_ENTRY LargePageEntry;
+	EPT_PML3_POINTER NewPointer;
+	EPT_PML2_ENTRY NewEntry;
+	EPT_PML1_ENTRY NewPageEntry;
+	SIZE_T PML4Index;
+	SIZE_T DirectoryPointer;
+	UCHAR MemoryType;
+
+	PML4Index = ADDRMASK_EPT_PML4_INDEX(PhysicalAddress);
+	DirectoryPointer = ADDRMASK_EPT_PML3_INDEX(PhysicalAddress);
+	Pml3Directory = NULL;
+
+	if (PML4Index == 0)
+	{
+		Pml3Entry = &PageTable->PML3[DirectoryPointer];
+	}
+	else
+	{
+		/* First access to this 512GB region, so it needs a PML3 of its own */
+		Pml3Directory = PageTable->PML3Directory[PML4Index];
+		if (!Pml3Directory)
+		{
+			Pml3Directory = HvEptPagePoolAllocate(PageTable->TablePool);
+			if (!Pml3Directory)
+			{
+				HvUtilLogError("HvEptMapOnDemand: Table pool exhausted. Increase VMM_SETTING_EPT_TABLE_POOL_SIZE.\n");
+				return FALSE;
+			}
+
+			__stosq((SIZE_T*)&Pml3Directory->PML3[0], VMM_EPT_NOT_PRESENT_ENTRY, VMM_EPT_PML3E_COUNT);
+
+			PageTable->PML3Directory[PML4Index] = Pml3Directory;
+
+			PageTable->PML4[PML4Index].Flags = 0;
+			PageTable->PML4[PML4Index].PageFrameNumber = HvEptPagePoolVirtualToPhysical(PageTable->TablePool, &Pml3Directory->PML3[0]) / PAGE_SIZE;
+			PageTable->PML4[PML4Index].ReadAccess = 1;
+			PageTable->PML4[PML4Index].WriteAccess = 1;
+			PageTable->PML4[PML4Index].ExecuteAccess = 1;
+		}
+
+		Pml3Entry = &Pml3Directory->PML3[DirectoryPointer];
+	}
+
+	if (!VMM_EPT_ENTRY_PRESENT(*Pml3Entry))
+	{
+		Run = HvEptGetUniformMemoryRun(GlobalContext, PhysicalAddress & ~(SIZE_1_GB - 1), SIZE_1_GB);
+
+		/* The first gigabyte always has a directory, so the fixed range MTRRs do not matter here */
+		if (GlobalContext->EptIdentityMap->LargePage1GbSupported && Run)
+		{
+			LargePageEntry.Flags = 0;
+			LargePageEntry.ReadAccess = 1;
+			LargePageEntry.WriteAccess = 1;
+			LargePageEntry.ExecuteAccess = 1;
+			LargePageEntry.LargePage = 1;
+			LargePageEntry.MemoryType = HvEptGetRunMemoryType(Run);
+			LargePageEntry.PageFrameNumber = PhysicalAddress / SIZE_1_GB;
+
+			Pml3Entry->Flags = LargePageEntry.Flags;
+
+			PageTable->OnDemandMappedCount++;
+			return TRUE;
+		}
+
+		/* Otherwise, give the gigabyte a directory with nothing present in it yet, and map the 2MB region below */
+		Directory = HvEptPagePoolAllocate(PageTable->TablePool);
+		if (!Directory)
+		{
+			HvUtilLogError("HvEptMapOnDemand: Table pool exhausted. Increase VMM_SETTING_EPT_TABLE_POOL_SIZE.\n");
+			return FALSE;
+		}
+
+		__stosq((SIZE_T*)&Directory->PML2[0], VMM_EPT_NOT_PRESENT_ENTRY, VMM_EPT_PML2E_COUNT);
+
+		if (!Pml3Directory)
+		{
+			PageTable->PML2[DirectoryPointer] = Directory;
+			PageTable->PML2Private[DirectoryPointer] = TRUE;
+			PageTable->PrivatePML2Count++;
+		}
+
+		NewPointer.Flags = 0;
+		NewPointer.ReadAccess = 1;
+		NewPointer.WriteAccess = 1;
+		NewPointer.ExecuteAccess = 1;
+		NewPointer.PageFrameNumber = HvEptPagePoolVirtualToPhysical(PageTable->TablePool, &Directory->PML2[0]) / PAGE_SIZE;
+
+		Pml3Entry->Flags = NewPointer.Flags;
+	}
+	else
+	{
+		/* Mapped by a 1GB page, so already present */
+		LargePageEntry.Flags = Pml3Entry->Flags;
+		if (LargePageEntry.LargePage)
+		{
+			return FALSE;
+		}
+	}
+
+	/*
+	 * A 2MB region split for its memory types leaves its pages which are not backed by RAM not present, so map just
+	 * the page. The split may be the identity map's own, but every processor would write the same identity entry.
 	 */
-	NewSplit->Entry = TargetEntry;
+	Pml1Entry = HvEptGetPml1Entry(PageTable, PhysicalAddress);
+	if (Pml1Entry)
+	{
+		/* Already mapped, so this violation is not ours to handle */
+		if (VMM_EPT_ENTRY_PRESENT(*Pml1Entry))
+		{
+			return FALSE;
+		}
 
-	/* Make a template for RWX */
-	EntryTemplate.Flags = 0;
-	EntryTemplate.ReadAccess = 1;
-	EntryTemplate.WriteAccess = 1;
-	EntryTemplate.ExecuteAccess = 1;
-	EntryTemplate.MemoryType = TargetEntry->MemoryType;
-	EntryTemplate.IgnorePat = TargetEntry->IgnorePat;
-	EntryTemplate.SuppressVe = TargetEntry->SuppressVe;
+		NewPageEntry.Flags = 0;
+		NewPageEntry.ReadAccess = 1;
+		NewPageEntry.WriteAccess = 1;
+		NewPageEntry.ExecuteAccess = 1;
+		NewPageEntry.MemoryType = HvEptGetPageMemoryType(GlobalContext, PhysicalAddress);
+		NewPageEntry.PageFrameNumber = PhysicalAddress / PAGE_SIZE;
 
-	/* Copy the template into all the PML1 entries */
-	__stosq((SIZE_T*)&NewSplit->PML1[0], EntryTemplate.Flags, VMM_EPT_PML1E_COUNT);
+		Pml1Entry->Flags = NewPageEntry.Flags;
 
-	/**
-	 * Set the page frame numbers for identity mapping.
+		PageTable->OnDemandMappedCount++;
+		return TRUE;
+	}
+
+	Directory = HvEptGetPml2DirectoryForWrite(PageTable, PhysicalAddress);
+	if (!Directory)
+	{
+		return FALSE;
+	}
+
+	Pml2Entry = &Directory->PML2[ADDRMASK_EPT_PML2_INDEX(PhysicalAddress)];
+
+	/* Already mapped, so this violation is not ours to handle */
+	if (VMM_EPT_ENTRY_PRESENT(*Pml2Entry))
+	{
+		return FALSE;
+	}
+
+	if (!HvEptGetUniformMemoryType(GlobalContext, PhysicalAddress & ~(SIZE_2_MB - 1), SIZE_2_MB, &MemoryType))
+	{
+		MemoryType = MEMORY_TYPE_UNCACHEABLE;
+	}
+
+	NewEntry.Flags = 0;
+	NewEntry.ReadAccess = 1;
+	NewEntry.WriteAccess = 1;
+	NewEntry.ExecuteAccess = 1;
+	NewEntry.LargePage = 1;
+	NewEntry.MemoryType = MemoryType;
+	NewEntry.PageFrameNumber = PhysicalAddress / SIZE_2_MB;
+
+	Pml2Entry->Flags = NewEntry.Flags;
+
+	PageTable->OnDemandMappedCount++;
+
+	return TRUE;
+}
+
+/**
+ * Map the region of physical memory containing PhysicalAddress in every view of this processor, see
+ * HvEptMapPageTableOnDemand. Returns FALSE if no view needed it mapped.
+ * 
+ * Addresses which are not RAM are logged and counted, so that stray accesses to memory that doesn't exist do not
+ * go unnoticed.
+ */
+BOOL HvEptMapOnDemand(PVMM_PROCESSOR_CONTEXT ProcessorContext, SIZE_T PhysicalAddress)
+{
+	BOOL Mapped;
+	SIZE_T View;
+
+	Mapped = HvEptMapPageTableOnDemand(ProcessorContext->GlobalContext, ProcessorContext->EptPageTable, PhysicalAddress);
+
+	/* The read view is EptPageTable, which was just mapped */
+	for (View = VmmEptViewExecute; View < VMM_SETTING_EPT_VIEW_COUNT; View++)
+	{
+		if (ProcessorContext->EptViews[View])
+		{
+			Mapped |= HvEptMapPageTableOnDemand(ProcessorContext->GlobalContext, ProcessorContext->EptViews[View], PhysicalAddress);
+		}
+	}
+
+	if (Mapped && !HvEptIsInPhysicalRanges(ProcessorContext->GlobalContext->PhysicalMemoryRanges,
+		ProcessorContext->GlobalContext->NumberOfPhysicalMemoryRanges, PhysicalAddress))
+	{
+		ProcessorContext->EptPageTable->OnDemandUnbackedCount++;
+		HvUtilLog("EPT: Mapped PA:%p on demand, which is not RAM.\n", PhysicalAddress);
+	}
+
+	return Mapped;
+}
+
+/**
+ * Get the PML2 entry for this physical address. The entry may be shared with other processors
+ * and must not be modified. Returns NULL if the address is not mapped or is mapped by a 1GB large page.
+ */
+PEPT_PML2_ENTRY HvEptGetPml2Entry(PVMM_EPT_PAGE_TABLE PageTable, SIZE_T PhysicalAddress)
+{
+	PVMM_EPT_PML2_DIRECTORY Directory;
+
+	Directory = HvEptGetPml2Directory(PageTable, PhysicalAddress);
+	if (!Directory)
+	{
+		return NULL;
+	}
+
+	return &Directory->PML2[ADDRMASK_EPT_PML2_INDEX(PhysicalAddress)];
+}
+
+/**
+ * Get the dynamic split that entry EntryIndex of a directory of PageTable points to, or NULL if the entry is not
+ * split.
+ * 
+ * Splits made by the views of this processor come from its split pool, so the split is the metadata of the pool
+ * frame the entry points to. Otherwise it is one of the splits of the identity map, of which there is one per 2MB
+ * region with mixed memory types, so there are few enough of them to search.
+ */
+PVMM_EPT_DYNAMIC_SPLIT HvEptGetSplit(PVMM_EPT_PAGE_TABLE PageTable, PVMM_EPT_PML2_DIRECTORY Directory, SIZE_T EntryIndex)
+{
+	PEPT_PML2_POINTER Pointer;
+	PVMM_EPT_DYNAMIC_SPLIT Split;
+	PLIST_ENTRY ListEntry;
+	PVOID Frame;
+
+	if (!VMM_EPT_ENTRY_PRESENT(Directory->PML2[EntryIndex]) || Directory->PML2[EntryIndex].LargePage)
+	{
+		return NULL;
+	}
+
+	Pointer = (PEPT_PML2_POINTER)&Directory->PML2[EntryIndex];
+
+	Frame = HvEptPagePoolPhysicalToVirtual(PageTable->SplitPool, Pointer->PageFrameNumber * PAGE_SIZE);
+	if (Frame)
+	{
+		return (PVMM_EPT_DYNAMIC_SPLIT)HvEptPagePoolGetMetadata(PageTable->SplitPool, Frame);
+	}
+
+	for (ListEntry = PageTable->IdentityMap->DynamicSplitList.Flink;
+		ListEntry != &PageTable->IdentityMap->DynamicSplitList;
+		ListEntry = ListEntry->Flink)
+	{
+		Split = CONTAINING_RECORD(ListEntry, VMM_EPT_DYNAMIC_SPLIT, DynamicSplitList);
+
+		if (Split->PML1Physical == Pointer->PageFrameNumber * PAGE_SIZE)
+		{
+			return Split;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Get the PML1 entry for this physical address if the page is split. Return NULL if the address is invalid
+ * or the page wasn't already split.
+ */
+PEPT_PML1_ENTRY HvEptGetPml1Entry(PVMM_EPT_PAGE_TABLE PageTable, SIZE_T PhysicalAddress)
+{
+	PVMM_EPT_PML2_DIRECTORY Directory;
+	PVMM_EPT_DYNAMIC_SPLIT Split;
+	SIZE_T EntryIndex;
+
+	Directory = HvEptGetPml2Directory(PageTable, PhysicalAddress);
+	if (!Directory)
+	{
+		return NULL;
+	}
+
+	EntryIndex = ADDRMASK_EPT_PML2_INDEX(PhysicalAddress);
+
+	/* Check to ensure the page is mapped and split */
+	if (!VMM_EPT_ENTRY_PRESENT(Directory->PML2[EntryIndex]) || Directory->PML2[EntryIndex].LargePage)
+	{
+		return NULL;
+	}
+
+	/* If it is, find the split holding the PML1 entries */
+	Split = HvEptGetSplit(PageTable, Directory, EntryIndex);
+
+	if (!Split)
+	{
+		HvUtilLogError("Failed to get PML1 entry: No split recorded for PA:%p.", PhysicalAddress);
+		return NULL;
+	}
+
+	/* Index into PML1 for that address */
+	return &Split->PML1[ADDRMASK_EPT_PML1_INDEX(PhysicalAddress)];
+}
+
+/**
+ * Split a large 2MB page into 512 smaller 4096 pages.
+ * 
+ * In order to set discrete EPT permissions on a singular 4096 byte page, we need to split our
+ * default 2MB entries into 512 smaller 4096 byte entries. This function will replace the default
+ * 2MB entry created for the page table at the specified PhysicalAddress and replace it with a 2MB
+ * pointer entry. That pointer will point to a set of 512 smaller 4096 byte pages taken from the
+ * split pool of the processor, which will become the new permission structures for that 2MB region.
+ * Taking a frame from the pool is O(1) and does not call into the OS, so this is safe from VMX root.
+ * 
+ * The split only affects PageTable, not the other views or processors. If the 2MB region was already split by the
+ * identity map (for example, the first 2MB which is typed by the fixed range MTRRs), that split is copied instead,
+ * so that every page keeps its memory type.
+ */
+BOOL HvEptSplitLargePage(PVMM_EPT_PAGE_TABLE PageTable, SIZE_T PhysicalAddress)
+{
+	PVMM_EPT_DYNAMIC_SPLIT NewSplit;
+	PVMM_EPT_DYNAMIC_SPLIT SharedSplit;
+	PEPT_PML1_ENTRY NewPML1;
+	EPT_PML1_ENTRY EntryTemplate;
+	SIZE_T EntryIndex;
+	PVMM_EPT_PML2_DIRECTORY Directory;
+	PEPT_PML2_ENTRY TargetEntry;
+	EPT_PML2_POINTER NewPointer;
+
+	HvUtilLog("Splitting large page @ PA:%p", PhysicalAddress);
+
+	/* Find the PML2 entry that's currently used*/
+	TargetEntry = HvEptGetPml2Entry(PageTable, PhysicalAddress);
+
+	/* If this large page is not marked a large page, that means it's a pointer already.
+	 * That page is therefore already split. If the split belongs to the identity map, it is copied below.
+	 */
+	if(TargetEntry && VMM_EPT_ENTRY_PRESENT(*TargetEntry) && !TargetEntry->LargePage)
+	{
+		Directory = HvEptGetPml2Directory(PageTable, PhysicalAddress);
+		SharedSplit = HvEptGetSplit(PageTable, Directory, ADDRMASK_EPT_PML2_INDEX(PhysicalAddress));
+
+		if (SharedSplit && SharedSplit->Owner == PageTable)
+		{
+			return TRUE;
+		}
+	}
+
+	/* We are about to modify the directory, so make sure this processor owns it. This also demotes a 1GB page. */
+	Directory = HvEptGetPml2DirectoryForWrite(PageTable, PhysicalAddress);
+	if (!Directory)
+	{
+		HvUtilLogError("HvEptSplitLargePage: Invalid physical address or could not get a writable PML2 directory.\n");
+		return FALSE;
+	}
+
+	TargetEntry = &Directory->PML2[ADDRMASK_EPT_PML2_INDEX(PhysicalAddress)];
+
+	/* Nothing to split if the region is not mapped yet */
+	if (!VMM_EPT_ENTRY_PRESENT(*TargetEntry))
+	{
+		HvUtilLogError("HvEptSplitLargePage: PA:%p is not mapped.\n", PhysicalAddress);
+		return FALSE;
+	}
+
+	/* Find the shared split before the entry is pointed away from it */
+	SharedSplit = HvEptGetSplit(PageTable, Directory, ADDRMASK_EPT_PML2_INDEX(PhysicalAddress));
+	if (!TargetEntry->LargePage && !SharedSplit)
+	{
+		HvUtilLogError("HvEptSplitLargePage: No split found for PA:%p.\n", PhysicalAddress);
+		return FALSE;
+	}
+
+	/* Take the PML1 entries for the split from the pool, which makes splitting legal from VMX root. */
+	NewPML1 = (PEPT_PML1_ENTRY)HvEptPagePoolAllocate(PageTable->SplitPool);
+	if(!NewPML1)
+	{
+		HvUtilLogError("HvEptSplitLargePage: Split pool exhausted. Increase VMM_SETTING_EPT_SPLIT_POOL_SIZE.\n");
+		return FALSE;
+	}
+
+	/* The rest of the split is kept with the frame, out of line */
+	NewSplit = (PVMM_EPT_DYNAMIC_SPLIT)HvEptPagePoolGetMetadata(PageTable->SplitPool, NewPML1);
+	NewSplit->PML1 = NewPML1;
+	NewSplit->PML1Physical = HvEptPagePoolVirtualToPhysical(PageTable->SplitPool, NewPML1);
+
+	/*
+	 * Point back to the entry in the dynamic split for easy reference for which entry that
+	 * dynamic split is for.
 	 */
-	for(EntryIndex = 0; EntryIndex < VMM_EPT_PML1E_COUNT; EntryIndex++)
+	NewSplit->Entry = TargetEntry;
+	NewSplit->Owner = PageTable;
+
+	if (!TargetEntry->LargePage)
+	{
+		/* Copy the shared split, which already has the exact memory type of each page. */
+		RtlCopyMemory(&NewSplit->PML1[0], &SharedSplit->PML1[0], VMM_EPT_PML1E_COUNT * sizeof(EPT_PML1_ENTRY));
+	}
+	else
 	{
-		/* Convert the 2MB page frame number to the 4096 page entry number plus the offset into the frame. */
-		NewSplit->PML1[EntryIndex].PageFrameNumber = ( (TargetEntry->PageFrameNumber * SIZE_2_MB) / PAGE_SIZE ) + EntryIndex;
+		/* Make a template with the permissions of the large page, which are RWX unless a view restricted them */
+		EntryTemplate.Flags = 0;
+		EntryTemplate.ReadAccess = TargetEntry->ReadAccess;
+		EntryTemplate.WriteAccess = TargetEntry->WriteAccess;
+		EntryTemplate.ExecuteAccess = TargetEntry->ExecuteAccess;
+		EntryTemplate.MemoryType = TargetEntry->MemoryType;
+		EntryTemplate.IgnorePat = TargetEntry->IgnorePat;
+		EntryTemplate.SuppressVe = TargetEntry->SuppressVe;
+
+		/* Copy the template into all the PML1 entries */
+		__stosq((SIZE_T*)&NewSplit->PML1[0], EntryTemplate.Flags, VMM_EPT_PML1E_COUNT);
+
+		/**
+		 * Set the page frame numbers for identity mapping.
+		 */
+		for(EntryIndex = 0; EntryIndex < VMM_EPT_PML1E_COUNT; EntryIndex++)
+		{
+			/* Convert the 2MB page frame number to the 4096 page entry number plus the offset into the frame. */
+			NewSplit->PML1[EntryIndex].PageFrameNumber = ( (TargetEntry->PageFrameNumber * SIZE_2_MB) / PAGE_SIZE ) + EntryIndex;
+		}
 	}
 
 	/* Allocate a new pointer which will replace the 2MB entry with a pointer to 512 4096 byte entries. */
@@ -436,10 +1190,10 @@ BOOL HvEptSplitLargePage(PVMM_PROCESSOR_CONTEXT ProcessorContext, SIZE_T Physica
 	/*
 	* Create an EPT pointer to the new PML2 entry we just created
 	*/
-	NewPointer.PageFrameNumber = (SIZE_T)OsVirtualToPhysical(&NewSplit->PML1[0]) / PAGE_SIZE;
+	NewPointer.PageFrameNumber = NewSplit->PML1Physical / PAGE_SIZE;
 
-	/* Add our allocation to the linked list of dynamic splits for later deallocation */
-	InsertHeadList(&ProcessorContext->EptPageTable->DynamicSplitList, &NewSplit->DynamicSplitList);
+	/* Add our allocation to the linked list of dynamic splits */
+	InsertHeadList(&PageTable->DynamicSplitList, &NewSplit->DynamicSplitList);
 
 	/**
 	 * Now, replace the entry in the page table with our new split pointer.
@@ -449,22 +1203,893 @@ BOOL HvEptSplitLargePage(PVMM_PROCESSOR_CONTEXT ProcessorContext, SIZE_T Physica
 	return TRUE;
 }
 
-NTSTATUS (*NtCreateFileOrig)(
-	PHANDLE            FileHandle,
-	ACCESS_MASK        DesiredAccess,
-	POBJECT_ATTRIBUTES ObjectAttributes,
-	PIO_STATUS_BLOCK   IoStatusBlock,
-	PLARGE_INTEGER     AllocationSize,
-	ULONG              FileAttributes,
-	ULONG              ShareAccess,
-	ULONG              CreateDisposition,
-	ULONG              CreateOptions,
-	PVOID              EaBuffer,
-	ULONG              EaLength
-	);
-
-NTSTATUS NtCreateFileHook(
-	PHANDLE            FileHandle,
+/**
+ * Invalidate every translation cached from the page tables of this processor. Required before a paging structure is
+ * reused and whenever an entry loses permissions or maps different memory. Nothing is cached before the processor
+ * launches.
+ * 
+ * Translations are cached per EPTP, so each view is flushed on its own.
+ */
+VOID HvEptInvalidateProcessor(PVMM_PROCESSOR_CONTEXT ProcessorContext)
+{
+	INVEPT_DESCRIPTOR Descriptor;
+	SIZE_T View;
+
+	if (!ProcessorContext->HasLaunched)
+	{
+		return;
+	}
+
+	/* Single-context invalidation of the translations derived from our EPTP */
+	Descriptor.EptPointer = ProcessorContext->EptPointer.Flags;
+	Descriptor.Reserved = 0;
+	__invept(1, &Descriptor);
+
+	for (View = VmmEptViewExecute; View < VMM_SETTING_EPT_VIEW_COUNT; View++)
+	{
+		if (ProcessorContext->EptViews[View])
+		{
+			Descriptor.EptPointer = ProcessorContext->EptpList[View].Flags;
+			__invept(1, &Descriptor);
+		}
+	}
+}
+
+/**
+ * Invalidate the translations cached from a single view of this processor.
+ */
+VOID HvEptInvalidateView(PVMM_PROCESSOR_CONTEXT ProcessorContext, VMM_EPT_VIEW View)
+{
+	INVEPT_DESCRIPTOR Descriptor;
+
+	if (!ProcessorContext->HasLaunched)
+	{
+		return;
+	}
+
+	Descriptor.EptPointer = (View == VmmEptViewRead) ? ProcessorContext->EptPointer.Flags : ProcessorContext->EptpList[View].Flags;
+	Descriptor.Reserved = 0;
+	__invept(1, &Descriptor);
+}
+
+/**
+ * Get the page table of the view currently installed on this processor. The guest may have switched views with
+ * VMFUNC since the last exit, so the EPTP is read back from the VMCS. Must be called from VMX root.
+ */
+PVMM_EPT_PAGE_TABLE HvEptGetCurrentView(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext)
+{
+	SIZE_T EptPointer;
+	SIZE_T View;
+
+	if (!ProcessorContext->EptpList)
+	{
+		return ProcessorContext->EptPageTable;
+	}
+
+	/* Not kept in the exit context like its other fields, since HvEptSetCurrentView may switch views during the exit */
+	__vmx_vmread(VMCS_CTRL_EPT_POINTER, &EptPointer);
+	ExitContext->VmreadCount++;
+
+	for (View = VmmEptViewExecute; View < VMM_SETTING_EPT_VIEW_COUNT; View++)
+	{
+		if (ProcessorContext->EptViews[View] && EptPointer == ProcessorContext->EptpList[View].Flags)
+		{
+			return ProcessorContext->EptViews[View];
+		}
+	}
+
+	return ProcessorContext->EptPageTable;
+}
+
+/**
+ * Check whether View has been created on this processor.
+ */
+BOOL HvEptIsViewValid(PVMM_PROCESSOR_CONTEXT ProcessorContext, VMM_EPT_VIEW View)
+{
+	return ProcessorContext->EptpList && (SIZE_T)View < VMM_SETTING_EPT_VIEW_COUNT && ProcessorContext->EptViews[View];
+}
+
+/**
+ * Check whether the view installed on this processor is one created with HvEptCreateView rather than one of the
+ * views of page hooks. Must be called from VMX root.
+ */
+BOOL HvEptIsCustomViewCurrent(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext)
+{
+	PVMM_EPT_PAGE_TABLE PageTable;
+
+	PageTable = HvEptGetCurrentView(ProcessorContext, ExitContext);
+
+	return PageTable != ProcessorContext->EptPageTable && PageTable != ProcessorContext->EptViews[VmmEptViewExecute];
+}
+
+/**
+ * Install a view on this processor from VMX root. Translations are cached per EPTP, so switching views needs no
+ * invalidation, however many pages the views map differently.
+ * 
+ * Returns FALSE if the view does not exist, including when the processor has no views at all.
+ */
+BOOL HvEptSetCurrentView(PVMM_PROCESSOR_CONTEXT ProcessorContext, VMM_EPT_VIEW View)
+{
+	if (!HvEptIsViewValid(ProcessorContext, View))
+	{
+		return FALSE;
+	}
+
+	__vmx_vmwrite(VMCS_CTRL_EPT_POINTER, ProcessorContext->EptpList[View].Flags);
+
+	/* Only VMFUNC updates the EPTP index on its own, which the #VE handler relies on to know the current view */
+	if (ProcessorContext->VeInformation)
+	{
+		__vmx_vmwrite(VMCS_CTRL_EPTP_INDEX, View);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Switch the current processor to View from the guest with VMFUNC, without a VM exit. Code which is about to read
+ * or write hooked pages can switch to the read view itself, and switch back to the execute view before running them.
+ * 
+ * The view belongs to the processor rather than the thread, so this must be called at DISPATCH_LEVEL or above.
+ * Returns FALSE if the view does not exist, or the processor has no views, in which case page hooks keep swapping on
+ * their own.
+ */
+BOOL HvEptSwitchView(PVMM_CONTEXT GlobalContext, VMM_EPT_VIEW View)
+{
+	PVMM_PROCESSOR_CONTEXT ProcessorContext;
+
+	ProcessorContext = HvGetCurrentCPUContext(GlobalContext);
+
+	/* VMFUNC is undefined outside of VMX, and raises #UD unless it was enabled in the VMCS */
+	if (!ProcessorContext->HasLaunched || !HvEptIsViewValid(ProcessorContext, View))
+	{
+		return FALSE;
+	}
+
+	/* Leaf 0 is EPTP switching */
+	__vmfunc(0, View);
+
+	return TRUE;
+}
+
+/**
+ * Determine whether the 512 entries of a split can be replaced by a single 2MB large page, and if so build that
+ * entry in LargePageEntry.
+ * 
+ * This is the case when every entry has the same permissions and memory type and together they map one
+ * contiguous, 2MB aligned region of physical memory.
+ */
+BOOL HvEptGetCoalescedEntry(PVMM_EPT_DYNAMIC_SPLIT Split, PEPT_PML2_ENTRY LargePageEntry)
+{
+	EPT_PML1_ENTRY FirstEntry;
+	EPT_PML1_ENTRY Entry;
+	SIZE_T PageIndex;
+
+	FirstEntry = Split->PML1[0];
+
+	/* A large page can only map a 2MB aligned frame */
+	if (FirstEntry.PageFrameNumber % VMM_EPT_PML1E_COUNT)
+	{
+		return FALSE;
+	}
+
+	for (PageIndex = 1; PageIndex < VMM_EPT_PML1E_COUNT; PageIndex++)
+	{
+		Entry = Split->PML1[PageIndex];
+
+		if (Entry.PageFrameNumber != FirstEntry.PageFrameNumber + PageIndex)
+		{
+			return FALSE;
+		}
+
+		/* Compare everything but the frame */
+		Entry.PageFrameNumber = FirstEntry.PageFrameNumber;
+		if (Entry.Flags != FirstEntry.Flags)
+		{
+			return FALSE;
+		}
+	}
+
+	LargePageEntry->Flags = 0;
+	LargePageEntry->ReadAccess = FirstEntry.ReadAccess;
+	LargePageEntry->WriteAccess = FirstEntry.WriteAccess;
+	LargePageEntry->ExecuteAccess = FirstEntry.ExecuteAccess;
+	LargePageEntry->MemoryType = FirstEntry.MemoryType;
+	LargePageEntry->IgnorePat = FirstEntry.IgnorePat;
+	LargePageEntry->SuppressVe = FirstEntry.SuppressVe;
+	LargePageEntry->LargePage = 1;
+	LargePageEntry->PageFrameNumber = FirstEntry.PageFrameNumber / VMM_EPT_PML1E_COUNT;
+
+	return TRUE;
+}
+
+/**
+ * Collapse the split of the 2MB region containing PhysicalAddress in PageTable, one of the views of this processor,
+ * undoing HvEptSplitLargePage.
+ * 
+ * If the split is identical to the identity map's own split of the region, the shared split is pointed to again.
+ * Otherwise, if all 512 of its entries are identical and contiguous, it is replaced by a 2MB large page.
+ * Either way the split's frame goes back to the split pool after the processor's cached translations are flushed,
+ * and the region gets its TLB reach back.
+ * 
+ * Returns FALSE if the region is not split by PageTable or its pages still differ from each other.
+ */
+BOOL HvEptCoalesceLargePage(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_PAGE_TABLE PageTable, SIZE_T PhysicalAddress)
+{
+	PVMM_EPT_PML2_DIRECTORY Directory;
+	PVMM_EPT_PML2_DIRECTORY IdentityDirectory;
+	PVMM_EPT_DYNAMIC_SPLIT Split;
+	PVMM_EPT_DYNAMIC_SPLIT IdentitySplit;
+	PEPT_PML2_ENTRY TargetEntry;
+	EPT_PML2_ENTRY NewEntry;
+	SIZE_T EntryIndex;
+
+	EntryIndex = ADDRMASK_EPT_PML2_INDEX(PhysicalAddress);
+
+	Directory = HvEptGetPml2Directory(PageTable, PhysicalAddress);
+	if (!Directory)
+	{
+		return FALSE;
+	}
+
+	TargetEntry = &Directory->PML2[EntryIndex];
+
+	if (!VMM_EPT_ENTRY_PRESENT(*TargetEntry) || TargetEntry->LargePage)
+	{
+		return FALSE;
+	}
+
+	/* Splits shared from the identity map are never modified, so there is nothing to undo */
+	Split = HvEptGetSplit(PageTable, Directory, EntryIndex);
+	if (!Split || Split->Owner != PageTable)
+	{
+		return FALSE;
+	}
+
+	/* Find the identity map's split of this region, if it has one. Only the first 512GB is identity mapped. */
+	IdentitySplit = NULL;
+	if (ADDRMASK_EPT_PML4_INDEX(PhysicalAddress) == 0)
+	{
+		IdentityDirectory = PageTable->IdentityMap->PML2[ADDRMASK_EPT_PML3_INDEX(PhysicalAddress)];
+
+		if (IdentityDirectory)
+		{
+			IdentitySplit = HvEptGetSplit(PageTable, IdentityDirectory, EntryIndex);
+		}
+	}
+
+	if (IdentitySplit && RtlEqualMemory(&Split->PML1[0], &IdentitySplit->PML1[0], VMM_EPT_PML1E_COUNT * sizeof(EPT_PML1_ENTRY)))
+	{
+		/* Share the identity map's split again, which has the exact memory type of each page */
+		NewEntry.Flags = IdentitySplit->Entry->Flags;
+	}
+	else if (!HvEptGetCoalescedEntry(Split, &NewEntry))
+	{
+		return FALSE;
+	}
+
+	TargetEntry->Flags = NewEntry.Flags;
+
+	/* The split may still be cached as a paging structure, so flush before its frame can be handed out again */
+	HvEptInvalidateProcessor(ProcessorContext);
+
+	RemoveEntryList(&Split->DynamicSplitList);
+	HvEptPagePoolRelease(PageTable->SplitPool, Split->PML1);
+
+	PageTable->CoalescedSplitCount++;
+
+	return TRUE;
+}
+
+/**
+ * Give the 4096 byte page containing PhysicalAddress back the entry the identity map gives it in PageTable, one of
+ * the views of this processor: readable, writable and executable, mapping its own frame with the memory type from
+ * the MTRRs. The 2MB region is then coalesced if that leaves all of its pages identical again.
+ * 
+ * Returns FALSE if the page is not split by PageTable, in which case it already has its identity entry.
+ */
+BOOL HvEptResetPagePermissions(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_PAGE_TABLE PageTable, SIZE_T PhysicalAddress)
+{
+	PVMM_EPT_PML2_DIRECTORY Directory;
+	PVMM_EPT_DYNAMIC_SPLIT Split;
+	PEPT_PML1_ENTRY TargetPage;
+	EPT_PML1_ENTRY IdentityEntry;
+	EPT_PML1_ENTRY OldEntry;
+
+	TargetPage = HvEptGetPml1Entry(PageTable, PhysicalAddress);
+	if (!TargetPage)
+	{
+		return FALSE;
+	}
+
+	/* HvEptGetPml1Entry already found the directory, so it can't fail here */
+	Directory = HvEptGetPml2Directory(PageTable, PhysicalAddress);
+	Split = HvEptGetSplit(PageTable, Directory, ADDRMASK_EPT_PML2_INDEX(PhysicalAddress));
+
+	if (Split->Owner != PageTable)
+	{
+		return FALSE;
+	}
+
+	IdentityEntry.Flags = 0;
+	IdentityEntry.ReadAccess = 1;
+	IdentityEntry.WriteAccess = 1;
+	IdentityEntry.ExecuteAccess = 1;
+	IdentityEntry.MemoryType = HvEptGetPageMemoryType(ProcessorContext->GlobalContext, PhysicalAddress);
+	IdentityEntry.PageFrameNumber = PhysicalAddress / PAGE_SIZE;
+
+	OldEntry = *TargetPage;
+	TargetPage->Flags = IdentityEntry.Flags;
+
+	/*
+	 * Coalescing flushes anyway. If the region stays split, the old entry must still be flushed if it changed, as
+	 * a stale entry with less permissions would raise EPT violations the violation handler does not expect.
+	 */
+	if (!HvEptCoalesceLargePage(ProcessorContext, PageTable, PhysicalAddress) && OldEntry.Flags != IdentityEntry.Flags)
+	{
+		HvEptInvalidateProcessor(ProcessorContext);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Check whether a PML2 entry is a 2MB large page which already has the bits of VMM_EPT_VIEW_ENTRY_MASK in Permissions.
+ */
+BOOLEAN HvEptIsLargePageWithPermissions(PEPT_PML2_ENTRY Entry, SIZE_T Permissions)
+{
+	return Entry && VMM_EPT_ENTRY_PRESENT(*Entry) && Entry->LargePage && (Entry->Flags & VMM_EPT_VIEW_ENTRY_MASK) == Permissions;
+}
+
+/**
+ * Set the permissions of every 4096 byte page in [PhysicalAddress, PhysicalAddress + Size) in View, one of the
+ * views created with HvEptCreateView. The read and execute views belong to page hooks and can't be changed here.
+ * 
+ * A whole 2MB region mapped by a large page keeps it and only changes its permissions, so that restricting a large
+ * range such as a driver image costs one entry per 2MB instead of a split. Other pages are split off, and their region
+ * is coalesced again once all of its pages are identical, such as when the range is given every permission back.
+ * 
+ * Restricted pages suppress #VE, so an access the view does not allow always exits to HvExitHandleEptViolation. At
+ * least one permission must be given, as an entry without any is not present and would be mapped again on demand,
+ * and a page can't be writable without being readable.
+ * 
+ * Takes splits from the pool, but flushes with INVEPT, so it must be called from VMX root once the processor has
+ * launched. Returns FALSE if the view does not exist or part of the range could not be changed, in which case the
+ * pages before it keep their new permissions.
+ */
+BOOL HvEptSetViewPermissions(PVMM_PROCESSOR_CONTEXT ProcessorContext, VMM_EPT_VIEW View, SIZE_T PhysicalAddress, SIZE_T Size, BOOLEAN ReadAccess, BOOLEAN WriteAccess, BOOLEAN ExecuteAccess)
+{
+	PVMM_EPT_PAGE_TABLE PageTable;
+	PVMM_EPT_PML2_DIRECTORY Directory;
+	PEPT_PML2_ENTRY LargePage;
+	PEPT_PML1_ENTRY TargetPage;
+	EPT_PML1_ENTRY Template;
+	SIZE_T Permissions;
+	SIZE_T CurrentAddress;
+	SIZE_T RegionAddress;
+	SIZE_T RegionEnd;
+	SIZE_T EndAddress;
+	BOOL Success;
+
+	if (View < VmmEptViewFirstCustom || !HvEptIsViewValid(ProcessorContext, View))
+	{
+		HvUtilLogError("HvEptSetViewPermissions: View %d does not exist or belongs to page hooks.\n", View);
+		return FALSE;
+	}
+
+	if ((!ReadAccess && !WriteAccess && !ExecuteAccess) || (WriteAccess && !ReadAccess))
+	{
+		HvUtilLogError("HvEptSetViewPermissions: Invalid permissions.\n");
+		return FALSE;
+	}
+
+	PageTable = ProcessorContext->EptViews[View];
+
+	Template.Flags = 0;
+	Template.ReadAccess = ReadAccess;
+	Template.WriteAccess = WriteAccess;
+	Template.ExecuteAccess = ExecuteAccess;
+	Template.SuppressVe = !(ReadAccess && WriteAccess && ExecuteAccess);
+	Permissions = Template.Flags;
+
+	Success = TRUE;
+	CurrentAddress = PhysicalAddress & ~(PAGE_SIZE - 1);
+	EndAddress = PhysicalAddress + Size;
+
+	while (Success && CurrentAddress < EndAddress)
+	{
+		RegionAddress = CurrentAddress & ~(SIZE_2_MB - 1);
+		RegionEnd = RegionAddress + SIZE_2_MB;
+
+		if (RegionEnd > EndAddress)
+		{
+			RegionEnd = EndAddress;
+		}
+
+		LargePage = HvEptGetPml2Entry(PageTable, CurrentAddress);
+
+		/* A whole region which is not split changes as a single entry. A 1GB page is demoted to 2MB pages first. */
+		if (CurrentAddress == RegionAddress && RegionEnd - RegionAddress == SIZE_2_MB && (!LargePage || LargePage->LargePage))
+		{
+			if (!HvEptIsLargePageWithPermissions(LargePage, Permissions))
+			{
+				Directory = HvEptGetPml2DirectoryForWrite(PageTable, CurrentAddress);
+				LargePage = Directory ? &Directory->PML2[ADDRMASK_EPT_PML2_INDEX(CurrentAddress)] : NULL;
+
+				if (!LargePage || !VMM_EPT_ENTRY_PRESENT(*LargePage))
+				{
+					HvUtilLogError("HvEptSetViewPermissions: PA:%p is not mapped.\n", CurrentAddress);
+					Success = FALSE;
+					break;
+				}
+
+				LargePage->Flags = (LargePage->Flags & ~VMM_EPT_VIEW_ENTRY_MASK) | Permissions;
+			}
+
+			CurrentAddress = RegionEnd;
+			continue;
+		}
+
+		for (; CurrentAddress < RegionEnd; CurrentAddress += PAGE_SIZE)
+		{
+			/* Don't split a large page for pages which already have these permissions */
+			if (HvEptIsLargePageWithPermissions(HvEptGetPml2Entry(PageTable, CurrentAddress), Permissions))
+			{
+				continue;
+			}
+
+			/* A split inherits the permissions of its large page, so the rest of the region keeps them */
+			TargetPage = HvEptSplitLargePage(PageTable, CurrentAddress) ? HvEptGetPml1Entry(PageTable, CurrentAddress) : NULL;
+			if (!TargetPage)
+			{
+				Success = FALSE;
+				break;
+			}
+
+			TargetPage->Flags = (TargetPage->Flags & ~VMM_EPT_VIEW_ENTRY_MASK) | Permissions;
+		}
+
+		/* Flushes on its own if it does coalesce */
+		HvEptCoalesceLargePage(ProcessorContext, PageTable, RegionAddress);
+	}
+
+	/* Permissions which were taken away may still be cached */
+	HvEptInvalidateProcessor(ProcessorContext);
+
+	return Success;
+}
+
+/**
+ * Get the page table of View on this processor. The read view is the page table of the processor, which exists
+ * even if the processor has no views.
+ */
+PVMM_EPT_PAGE_TABLE HvEptGetViewPageTable(PVMM_PROCESSOR_CONTEXT ProcessorContext, VMM_EPT_VIEW View)
+{
+	return (View == VmmEptViewRead) ? ProcessorContext->EptPageTable : ProcessorContext->EptViews[View];
+}
+
+/**
+ * Prepare an empty edit batch for the views of this processor. The batch is too large for the stack of a VM exit,
+ * so callers in VMX root must keep it in memory allocated beforehand.
+ */
+VOID HvEptBeginEditBatch(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_EDIT_BATCH Batch)
+{
+	Batch->ProcessorContext = ProcessorContext;
+	Batch->EditCount = 0;
+}
+
+/**
+ * Queue a change of the bits of Mask in the entry mapping PhysicalAddress in View. Nothing is changed until the
+ * batch is committed. Returns FALSE if the view does not exist or the batch is full.
+ */
+BOOL HvEptQueueEdit(PVMM_EPT_EDIT_BATCH Batch, VMM_EPT_VIEW View, SIZE_T PhysicalAddress, BOOLEAN LargePage, SIZE_T Mask, SIZE_T Value)
+{
+	PVMM_EPT_EDIT Edit;
+
+	/* Without views, the read view is the only page table */
+	if (View != VmmEptViewRead && !HvEptIsViewValid(Batch->ProcessorContext, View))
+	{
+		HvUtilLogError("HvEptQueueEdit: View %d does not exist.\n", View);
+		return FALSE;
+	}
+
+	if (Batch->EditCount == VMM_SETTING_EPT_EDIT_BATCH_SIZE)
+	{
+		HvUtilLogError("HvEptQueueEdit: Batch is full. Increase VMM_SETTING_EPT_EDIT_BATCH_SIZE.\n");
+		return FALSE;
+	}
+
+	Edit = &Batch->Edits[Batch->EditCount++];
+
+	Edit->View = View;
+	Edit->PhysicalAddress = PhysicalAddress;
+	Edit->LargePage = LargePage;
+	Edit->Split = FALSE;
+	Edit->Mask = Mask;
+	Edit->Value = Value & Mask;
+	Edit->Entry = NULL;
+
+	return TRUE;
+}
+
+/**
+ * Queue a change of the permissions of the page containing PhysicalAddress in View, or of its whole 2MB large page
+ * if LargePage is set. At least one permission must be given, as an entry without any is not present, and a page
+ * can't be writable without being readable.
+ * 
+ * Entries of hooked pages belong to their page hooks and must not be changed.
+ */
+BOOL HvEptQueuePermissions(PVMM_EPT_EDIT_BATCH Batch, VMM_EPT_VIEW View, SIZE_T PhysicalAddress, BOOLEAN LargePage, BOOLEAN ReadAccess, BOOLEAN WriteAccess, BOOLEAN ExecuteAccess)
+{
+	EPT_PML1_ENTRY Permissions;
+
+	if ((!ReadAccess && !WriteAccess && !ExecuteAccess) || (WriteAccess && !ReadAccess))
+	{
+		HvUtilLogError("HvEptQueuePermissions: Invalid permissions.\n");
+		return FALSE;
+	}
+
+	/* The permissions are the same bits at every level */
+	Permissions.Flags = 0;
+	Permissions.ReadAccess = ReadAccess;
+	Permissions.WriteAccess = WriteAccess;
+	Permissions.ExecuteAccess = ExecuteAccess;
+
+	return HvEptQueueEdit(Batch, View, PhysicalAddress, LargePage, 7ULL, Permissions.Flags);
+}
+
+/**
+ * Queue a change of the frame mapped by the page containing PhysicalAddress in View, or by its whole 2MB large page
+ * if LargePage is set, to the frame containing TargetPhysicalAddress. The memory type stays the same.
+ * 
+ * Entries of hooked pages belong to their page hooks and must not be changed.
+ */
+BOOL HvEptQueueFrame(PVMM_EPT_EDIT_BATCH Batch, VMM_EPT_VIEW View, SIZE_T PhysicalAddress, BOOLEAN LargePage, SIZE_T TargetPhysicalAddress)
+{
+	EPT_PML1_ENTRY Page;
+	EPT_PML2_ENTRY Large;
+	SIZE_T Mask;
+
+	if (LargePage)
+	{
+		Large.Flags = 0;
+		Large.PageFrameNumber = ~0ULL;
+		Mask = Large.Flags;
+
+		Large.PageFrameNumber = TargetPhysicalAddress / SIZE_2_MB;
+
+		return HvEptQueueEdit(Batch, View, PhysicalAddress, TRUE, Mask, Large.Flags);
+	}
+
+	Page.Flags = 0;
+	Page.PageFrameNumber = ~0ULL;
+	Mask = Page.Flags;
+
+	Page.PageFrameNumber = TargetPhysicalAddress / PAGE_SIZE;
+
+	return HvEptQueueEdit(Batch, View, PhysicalAddress, FALSE, Mask, Page.Flags);
+}
+
+/**
+ * Find the entry changed by Edit, splitting its large page first if it changes a 4096 byte page. The split only
+ * takes a frame from the pool and keeps every page as it was, so it is safe in VMX root and can be undone.
+ */
+BOOL HvEptResolveEdit(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_EDIT Edit)
+{
+	PVMM_EPT_PAGE_TABLE PageTable;
+	PVMM_EPT_PML2_DIRECTORY Directory;
+	PEPT_PML2_ENTRY LargePage;
+	PEPT_PML1_ENTRY TargetPage;
+	PLIST_ENTRY FirstSplit;
+
+	PageTable = HvEptGetViewPageTable(ProcessorContext, Edit->View);
+
+	/* A batch published to every processor may change a view which this processor does not have */
+	if (!PageTable)
+	{
+		HvUtilLogError("HvEptResolveEdit: View %d does not exist on this processor.\n", Edit->View);
+		return FALSE;
+	}
+
+	if (Edit->LargePage)
+	{
+		Directory = HvEptGetPml2DirectoryForWrite(PageTable, Edit->PhysicalAddress);
+		LargePage = Directory ? &Directory->PML2[ADDRMASK_EPT_PML2_INDEX(Edit->PhysicalAddress)] : NULL;
+
+		if (!LargePage || !VMM_EPT_ENTRY_PRESENT(*LargePage) || !LargePage->LargePage)
+		{
+			HvUtilLogError("HvEptResolveEdit: PA:%p is not mapped by a large page.\n", Edit->PhysicalAddress);
+			return FALSE;
+		}
+
+		Edit->Entry = &LargePage->Flags;
+		return TRUE;
+	}
+
+	/* A new split goes to the head of the list */
+	FirstSplit = PageTable->DynamicSplitList.Flink;
+
+	if (!HvEptSplitLargePage(PageTable, Edit->PhysicalAddress))
+	{
+		return FALSE;
+	}
+
+	Edit->Split = (PageTable->DynamicSplitList.Flink != FirstSplit);
+
+	TargetPage = HvEptGetPml1Entry(PageTable, Edit->PhysicalAddress);
+	if (!TargetPage)
+	{
+		return FALSE;
+	}
+
+	Edit->Entry = &TargetPage->Flags;
+	return TRUE;
+}
+
+/**
+ * Apply every change of the batch at once, then empty it. Must be called from VMX root once the processor has
+ * launched, or before it launches.
+ * 
+ * Every entry is found first, splitting large pages as needed, and nothing changes until all of them are. If any
+ * can't be, such as when the split pool is exhausted, the splits made for the batch are undone and none of its
+ * changes are applied. A batch can't change a 2MB large page as a whole and split it for one of its pages.
+ * 
+ * Each view with a changed entry is invalidated once, with a single-context INVEPT of its EPTP, however many of its
+ * entries changed.
+ */
+BOOL HvEptCommitEditBatch(PVMM_EPT_EDIT_BATCH Batch)
+{
+	PVMM_PROCESSOR_CONTEXT ProcessorContext;
+	PVMM_EPT_EDIT Edit;
+	UINT64 OldEntry;
+	BOOLEAN ChangedViews[VMM_SETTING_EPT_VIEW_COUNT];
+	SIZE_T EditIndex;
+	SIZE_T ResolvedCount;
+	SIZE_T View;
+
+	ProcessorContext = Batch->ProcessorContext;
+
+	for (ResolvedCount = 0; ResolvedCount < Batch->EditCount; ResolvedCount++)
+	{
+		if (!HvEptResolveEdit(ProcessorContext, &Batch->Edits[ResolvedCount]))
+		{
+			break;
+		}
+	}
+
+	/* A later split turns a large page into a pointer, which must not be changed as one */
+	for (EditIndex = 0; ResolvedCount == Batch->EditCount && EditIndex < Batch->EditCount; EditIndex++)
+	{
+		Edit = &Batch->Edits[EditIndex];
+
+		if (Edit->LargePage && !((PEPT_PML2_ENTRY)Edit->Entry)->LargePage)
+		{
+			HvUtilLogError("HvEptCommitEditBatch: PA:%p was split by the same batch.\n", Edit->PhysicalAddress);
+			ResolvedCount = EditIndex;
+			break;
+		}
+	}
+
+	if (ResolvedCount != Batch->EditCount)
+	{
+		/* Nothing was changed yet, so every new split is still uniform and coalesces back */
+		for (EditIndex = 0; EditIndex < Batch->EditCount; EditIndex++)
+		{
+			Edit = &Batch->Edits[EditIndex];
+
+			if (Edit->Split)
+			{
+				HvEptCoalesceLargePage(ProcessorContext, HvEptGetViewPageTable(ProcessorContext, Edit->View), Edit->PhysicalAddress);
+			}
+		}
+
+		Batch->EditCount = 0;
+		return FALSE;
+	}
+
+	OsZeroMemory(ChangedViews, sizeof(ChangedViews));
+
+	for (EditIndex = 0; EditIndex < Batch->EditCount; EditIndex++)
+	{
+		Edit = &Batch->Edits[EditIndex];
+
+		OldEntry = *Edit->Entry;
+		*Edit->Entry = (OldEntry & ~Edit->Mask) | Edit->Value;
+
+		if (*Edit->Entry != OldEntry)
+		{
+			ChangedViews[Edit->View] = TRUE;
+		}
+	}
+
+	for (View = 0; View < VMM_SETTING_EPT_VIEW_COUNT; View++)
+	{
+		if (ChangedViews[View])
+		{
+			HvEptInvalidateView(ProcessorContext, (VMM_EPT_VIEW)View);
+		}
+	}
+
+	Batch->EditCount = 0;
+	return TRUE;
+}
+
+/**
+ * Get the oldest generation of shared EPT edits applied by any launched processor. Processors which have not
+ * launched have no EPT in use.
+ */
+LONG64 HvEptGetOldestAppliedGeneration(PVMM_CONTEXT GlobalContext)
+{
+	PVMM_PROCESSOR_CONTEXT ProcessorContext;
+	LONG64 Oldest;
+	SIZE_T ProcessorNumber;
+
+	Oldest = GlobalContext->EptGeneration;
+
+	for (ProcessorNumber = 0; ProcessorNumber < GlobalContext->ProcessorCount; ProcessorNumber++)
+	{
+		ProcessorContext = GlobalContext->AllProcessorContexts[ProcessorNumber];
+
+		if (ProcessorContext && ProcessorContext->HasLaunched && ProcessorContext->AppliedEptGeneration < Oldest)
+		{
+			Oldest = ProcessorContext->AppliedEptGeneration;
+		}
+	}
+
+	return Oldest;
+}
+
+/**
+ * IPI run on every processor by HvEptKickProcessors.
+ */
+ULONG_PTR NTAPI HvEptpKickProcessorIpi(_In_ ULONG_PTR Argument)
+{
+	/* The hypercall applies the pending edits. VMCALL is undefined outside of VMX. */
+	if (HvGetCurrentCPUContext((PVMM_CONTEXT)Argument)->HasLaunched)
+	{
+		__vmcall(VmmHypercallApplySharedEdits, 0, 0);
+	}
+
+	return 0;
+}
+
+/**
+ * Make every processor apply the shared edits published so far right away, rather than on its next VM exit.
+ * Returns once all of them have.
+ */
+VOID HvEptKickProcessors(PVMM_CONTEXT GlobalContext)
+{
+	KeIpiGenericCall(HvEptpKickProcessorIpi, (ULONG_PTR)GlobalContext);
+}
+
+/**
+ * Publish an edit batch to every processor. Build the batch with HvEptBeginEditBatch on the context of any
+ * processor, as long as the views it changes exist on every processor. The batch is emptied.
+ * 
+ * Publishing only bumps the global EPT generation. Each processor notices that it is behind on its next VM exit and
+ * commits the batch to its own views then, so processors busy in the guest are not interrupted, and each flushes
+ * its own EPT without a cross-processor invalidation. If Urgent is set, every processor is kicked with an IPI to
+ * apply it before this returns.
+ * 
+ * A processor which can't apply a batch skips it and counts itself in SharedEditFailures. Returns FALSE if any
+ * processor failed to apply a batch whose failure no earlier call has returned yet. With Urgent set, every processor
+ * is done with this batch by then, so that includes its own failures. Otherwise they are returned by the next call.
+ * 
+ * Must be called at or below DISPATCH_LEVEL after the hypervisor has launched.
+ */
+BOOL HvEptPublishEditBatch(PVMM_CONTEXT GlobalContext, PVMM_EPT_EDIT_BATCH Batch, BOOLEAN Urgent)
+{
+	KIRQL OldIrql;
+	LONG64 Generation;
+	SIZE_T Slot;
+	LONG FailedCount;
+
+	if (Batch->EditCount == 0)
+	{
+		return TRUE;
+	}
+
+	KeAcquireSpinLock(&GlobalContext->SharedEditLock, &OldIrql);
+
+	/*
+	 * The slot of the next generation is reused from an older one, which every processor must be done with. The
+	 * processors are kicked without holding the lock, which another publisher may take meanwhile, so check again.
+	 */
+	while (GlobalContext->EptGeneration + 1 - HvEptGetOldestAppliedGeneration(GlobalContext) > VMM_SETTING_EPT_SHARED_EDIT_LOG_SIZE)
+	{
+		KeReleaseSpinLock(&GlobalContext->SharedEditLock, OldIrql);
+		HvEptKickProcessors(GlobalContext);
+		KeAcquireSpinLock(&GlobalContext->SharedEditLock, &OldIrql);
+	}
+
+	Generation = GlobalContext->EptGeneration + 1;
+	Slot = (SIZE_T)(Generation % VMM_SETTING_EPT_SHARED_EDIT_LOG_SIZE);
+
+	RtlCopyMemory(&GlobalContext->SharedEditLog[Slot], Batch, sizeof(VMM_EPT_EDIT_BATCH));
+	GlobalContext->SharedEditFailures[Slot] = 0;
+
+	/* Only visible to the processors once the batch is in the log */
+	InterlockedExchange64(&GlobalContext->EptGeneration, Generation);
+
+	KeReleaseSpinLock(&GlobalContext->SharedEditLock, OldIrql);
+
+	Batch->EditCount = 0;
+
+	if (Urgent)
+	{
+		/* Kicked without holding the lock, so other publishers are not stuck waiting on every processor */
+		HvEptKickProcessors(GlobalContext);
+
+		/* The slot can't be reused before every processor has applied this generation, which they all have now */
+		FailedCount = GlobalContext->SharedEditFailures[Slot];
+		if (FailedCount != 0)
+		{
+			HvUtilLogError("HvEptPublishEditBatch: %d processors could not apply generation %lld.\n", FailedCount, Generation);
+		}
+	}
+
+	FailedCount = InterlockedExchange(&GlobalContext->UnreportedSharedEditFailures, 0);
+	if (FailedCount != 0)
+	{
+		HvUtilLogError("HvEptPublishEditBatch: Shared edits failed to apply %d times up to generation %lld.\n", FailedCount, Generation);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Commit every edit batch published since this processor last caught up, in the order they were published. Called
+ * from VMX root on any VM exit which finds the processor behind the global EPT generation.
+ * 
+ * A batch which can't be applied on this processor, such as when its split pool is exhausted, is skipped, so that
+ * the processor never falls behind for good, but its views keep missing those edits. The failure is counted in the
+ * batch's slot of SharedEditFailures and in UnreportedSharedEditFailures, for HvEptPublishEditBatch to return.
+ */
+VOID HvEptApplySharedEdits(PVMM_PROCESSOR_CONTEXT ProcessorContext)
+{
+	PVMM_CONTEXT GlobalContext;
+	PVMM_EPT_EDIT_BATCH Batch;
+	LONG64 Generation;
+	LONG64 TargetGeneration;
+
+	GlobalContext = ProcessorContext->GlobalContext;
+	Batch = &ProcessorContext->SharedEditBatch;
+
+	TargetGeneration = GlobalContext->EptGeneration;
+
+	for (Generation = ProcessorContext->AppliedEptGeneration + 1; Generation <= TargetGeneration; Generation++)
+	{
+		RtlCopyMemory(Batch, &GlobalContext->SharedEditLog[Generation % VMM_SETTING_EPT_SHARED_EDIT_LOG_SIZE], sizeof(VMM_EPT_EDIT_BATCH));
+		Batch->ProcessorContext = ProcessorContext;
+
+		if (!HvEptCommitEditBatch(Batch))
+		{
+			InterlockedIncrement(&GlobalContext->SharedEditFailures[Generation % VMM_SETTING_EPT_SHARED_EDIT_LOG_SIZE]);
+			InterlockedIncrement(&GlobalContext->UnreportedSharedEditFailures);
+			HvUtilLogError("EPT: Could not apply the shared edits of generation %lld on this processor.\n", Generation);
+		}
+
+		ProcessorContext->AppliedEptGeneration = Generation;
+	}
+}
+
+NTSTATUS (*NtCreateFileOrig)(
+	PHANDLE            FileHandle,
+	ACCESS_MASK        DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	PIO_STATUS_BLOCK   IoStatusBlock,
+	PLARGE_INTEGER     AllocationSize,
+	ULONG              FileAttributes,
+	ULONG              ShareAccess,
+	ULONG              CreateDisposition,
+	ULONG              CreateOptions,
+	PVOID              EaBuffer,
+	ULONG              EaLength
+	);
+
+NTSTATUS NtCreateFileHook(
+	PHANDLE            FileHandle,
 	ACCESS_MASK        DesiredAccess,
 	POBJECT_ATTRIBUTES ObjectAttributes,
 	PIO_STATUS_BLOCK   IoStatusBlock,
@@ -477,325 +2102,2092 @@ NTSTATUS NtCreateFileHook(
 	ULONG              EaLength
 )
 {
-	static WCHAR BlockedFileName[] = L"test.txt";
-	static SIZE_T BlockedFileNameLength = (sizeof(BlockedFileName) / sizeof(BlockedFileName[0])) - 1;
+	static WCHAR BlockedFileName[] = L"test.txt";
+	static SIZE_T BlockedFileNameLength = (sizeof(BlockedFileName) / sizeof(BlockedFileName[0])) - 1;
+
+	PWCH NameBuffer;
+	USHORT NameLength;
+
+	__try
+	{
+
+		ProbeForRead(ObjectAttributes, sizeof(OBJECT_ATTRIBUTES), 1);
+		ProbeForRead(ObjectAttributes->ObjectName, sizeof(UNICODE_STRING), 1);
+
+		NameBuffer = ObjectAttributes->ObjectName->Buffer;
+		NameLength = ObjectAttributes->ObjectName->Length;
+
+		ProbeForRead(NameBuffer, NameLength, 1);
+
+		/* Convert to length in WCHARs */
+		NameLength /= sizeof(WCHAR);
+
+		/* Does the file path (ignoring case and null terminator) end with our blocked file name? */
+		if (NameLength >= BlockedFileNameLength && 
+			_wcsnicmp(&NameBuffer[NameLength - BlockedFileNameLength], BlockedFileName, BlockedFileNameLength) == 0)
+		{
+			HvUtilLogSuccess("Blocked access to %ws\n", BlockedFileName);
+			return STATUS_ACCESS_DENIED;
+		}
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		NOTHING;
+	}
+
+	return NtCreateFileOrig(FileHandle, DesiredAccess, ObjectAttributes, IoStatusBlock, AllocationSize, FileAttributes,
+		ShareAccess, CreateDisposition, CreateOptions, EaBuffer, EaLength);
+}
+
+
+/**
+ * Log how much memory the page tables of this processor use compared to each owning a full copy of the identity map.
+ * The pools are reserved whether or not their frames are used, so all of them count against the savings.
+ */
+VOID HvEptReportMemoryUsage(PVMM_PROCESSOR_CONTEXT ProcessorContext)
+{
+	PVMM_EPT_PAGE_TABLE PageTable;
+	SIZE_T PageTableCount;
+	SIZE_T PrivatePML2Count;
+	SIZE_T PoolBytes;
+	SIZE_T PrivateBytes;
+	LONG64 SavedBytes;
+	SIZE_T View;
+
+	PageTableCount = 0;
+	PrivatePML2Count = 0;
+
+	for (View = 0; View < VMM_SETTING_EPT_VIEW_COUNT; View++)
+	{
+		PageTable = HvEptGetViewPageTable(ProcessorContext, (VMM_EPT_VIEW)View);
+		if (PageTable)
+		{
+			PageTableCount++;
+			PrivatePML2Count += PageTable->PrivatePML2Count;
+		}
+	}
+
+	/* Private directories and splits live in the pools */
+	PoolBytes = HvEptPagePoolGetReservedSize(&ProcessorContext->EptTablePool) + HvEptPagePoolGetReservedSize(&ProcessorContext->EptSplitPool);
+	PrivateBytes = (PageTableCount * sizeof(VMM_EPT_PAGE_TABLE)) + PoolBytes;
+
+	SavedBytes = (LONG64)(PageTableCount * ProcessorContext->GlobalContext->EptIdentityMap->SizeInBytes) - (LONG64)PoolBytes;
+
+	HvUtilLog("EPT: %lld page tables use %lld KB (%lld private PML2 directories, %lld KB of pools), %lld KB saved by sharing the identity map.\n",
+		PageTableCount, PrivateBytes / 1024, PrivatePML2Count, PoolBytes / 1024, SavedBytes / 1024);
+}
+
+/**
+ * Log the number of exits a page hook has cost, so the strategies can be compared.
+ */
+VOID HvEptReportPageHookExits(PVMM_EPT_PAGE_HOOK PageHook)
+{
+	HvUtilLog("EPT: Page hook on 0x%llX (%s) took %lld EPT violation exits, %lld #VE (%lld exec swaps, %lld RW swaps) and %lld monitor trap exits, switched strategy %lld times.\n",
+		PageHook->PhysicalBaseAddress,
+		PageHook->Strategy == VmmEptHookStrategyMonitorTrap ? "monitor trap" : "swap",
+		PageHook->Statistics.ViolationExitCount,
+		PageHook->Statistics.VirtualizationExceptionCount,
+		PageHook->Statistics.ExecuteSwapCount,
+		PageHook->Statistics.ReadWriteSwapCount,
+		PageHook->Statistics.MonitorTrapExitCount,
+		PageHook->Statistics.StrategySwitchCount);
+}
+
+/**
+ * Build the EPTP which installs PageTable as the active EPT.
+ */
+EPT_POINTER HvEptBuildPointer(PVMM_EPT_PAGE_TABLE PageTable)
+{
+	EPT_POINTER EPTP;
+
+	EPTP.Flags = 0;
+
+	/* For performance, we let the processor know it can cache the EPT. */
+	EPTP.MemoryType = MEMORY_TYPE_WRITE_BACK;
+
+	/* We are not utilizing the 'access' and 'dirty' flag features. */
+	EPTP.EnableAccessAndDirtyFlags = FALSE;
+
+	/* 
+	 * Bits 5:3 (1 less than the EPT page-walk length) must be 3, indicating an EPT page-walk length of 4; 
+	 * see Section 28.2.2 
+	 */
+	EPTP.PageWalkLength = 3;
+
+	/* The physical page number of the page table we will be using */
+	EPTP.PageFrameNumber = (SIZE_T)OsVirtualToPhysical(&PageTable->PML4) / PAGE_SIZE;
+
+	return EPTP;
+}
+
+/**
+ * Create a page table for the view at index View of the EPTP list of this processor. Like every page table, it
+ * references the directories of the identity map until one of its entries is changed, and takes anything private
+ * from the pools of the processor, so a new view costs little more than its PML4 and PML3. Regions the other views
+ * have mapped on demand are mapped in this one the first time it touches them, since HvEptMapOnDemand maps every
+ * view that is missing them.
+ */
+BOOL HvEptAllocateView(PVMM_PROCESSOR_CONTEXT ProcessorContext, VMM_EPT_VIEW View)
+{
+	PVMM_EPT_PAGE_TABLE PageTable;
+
+	PageTable = HvEptAllocatePageTable(ProcessorContext);
+	if (!PageTable)
+	{
+		HvUtilLogError("HvEptAllocateView: Failed to allocate memory for view %d.\n", View);
+		return FALSE;
+	}
+
+	/* The view is only considered created once VMFUNC can switch to it */
+	ProcessorContext->EptpList[View] = HvEptBuildPointer(PageTable);
+	ProcessorContext->EptViews[View] = PageTable;
+
+	return TRUE;
+}
+
+/**
+ * Create the EPTP list of this processor, which lets the guest switch between views with VMFUNC, along with the
+ * execute view. The read view is EptPageTable, which must already exist.
+ */
+BOOL HvEptCreateViews(PVMM_PROCESSOR_CONTEXT ProcessorContext)
+{
+	PEPT_POINTER EptpList;
+
+	EptpList = OsAllocateContiguousAlignedPages(1);
+	if (!EptpList)
+	{
+		HvUtilLogError("HvEptCreateViews: Failed to allocate memory for the EPTP list.\n");
+		return FALSE;
+	}
+
+	/*
+	 * Every entry without a view is filled with an invalid EPTP, which has a page walk length of 1. VMFUNC with its
+	 * index causes a VM exit, and HvExitHandleVmfunc raises #UD, the same as VMFUNC with an unsupported function.
+	 */
+	OsZeroMemory(EptpList, PAGE_SIZE);
+
+	EptpList[VmmEptViewRead] = ProcessorContext->EptPointer;
+
+	ProcessorContext->EptpList = EptpList;
+	ProcessorContext->EptViews[VmmEptViewRead] = ProcessorContext->EptPageTable;
+
+	return HvEptAllocateView(ProcessorContext, VmmEptViewExecute);
+}
+
+/**
+ * Create a new view on this processor, at first mapping all memory like the identity map, and return its index in
+ * View. Page hooks are not part of the new view, so while it is installed, hooked pages run their original code.
+ * Change the view with HvEptSetViewPermissions, and install it with HvEptSetCurrentView or HvEptSwitchView.
+ * 
+ * Allocates the page table from the OS, so it can't be called from VMX root. Returns FALSE if the processor has no
+ * views or all VMM_SETTING_EPT_VIEW_COUNT of them are taken.
+ */
+BOOL HvEptCreateView(PVMM_PROCESSOR_CONTEXT ProcessorContext, VMM_EPT_VIEW* View)
+{
+	SIZE_T Index;
+
+	if (!ProcessorContext->EptpList)
+	{
+		HvUtilLogError("HvEptCreateView: This processor does not support EPT views.\n");
+		return FALSE;
+	}
+
+	for (Index = VmmEptViewFirstCustom; Index < VMM_SETTING_EPT_VIEW_COUNT; Index++)
+	{
+		if (!ProcessorContext->EptViews[Index])
+		{
+			if (!HvEptAllocateView(ProcessorContext, (VMM_EPT_VIEW)Index))
+			{
+				return FALSE;
+			}
+
+			*View = (VMM_EPT_VIEW)Index;
+			return TRUE;
+		}
+	}
+
+	HvUtilLogError("HvEptCreateView: Out of views. Increase VMM_SETTING_EPT_VIEW_COUNT.\n");
+	return FALSE;
+}
+
+/**
+ * Initialize EPT for an individual logical processor.
+ * 
+ * Reserves the pools shared by every view of the processor, creates a page table referencing the shared identity
+ * map and sets up an EPTP to be applied to the VMCS later. If the processor supports EPTP switching, the execute
+ * view is created as well.
+ */
+BOOL HvEptLogicalProcessorInitialize(PVMM_PROCESSOR_CONTEXT ProcessorContext)
+{
+	PVMM_EPT_PAGE_TABLE PageTable;
+
+	/* Reserve the frames used for private directories, such as to map memory above 512GB on demand */
+	if (!HvEptPagePoolInitialize(&ProcessorContext->EptTablePool, 0, VMM_SETTING_EPT_TABLE_POOL_SIZE))
+	{
+		HvUtilLogError("Unable to allocate memory for the EPT table pool!\n");
+		return FALSE;
+	}
+
+	/* Reserve the frames used to split large pages, each with the rest of its split out of line */
+	if (!HvEptPagePoolInitialize(&ProcessorContext->EptSplitPool, sizeof(VMM_EPT_DYNAMIC_SPLIT), VMM_SETTING_EPT_SPLIT_POOL_SIZE))
+	{
+		HvUtilLogError("Unable to allocate memory for the EPT split pool!\n");
+		HvEptFreeLogicalProcessorContext(ProcessorContext);
+		return FALSE;
+	}
+
+	/* Allocate the identity mapped page table*/
+	PageTable = HvEptAllocatePageTable(ProcessorContext);
+	if (PageTable == NULL)
+	{
+		HvUtilLogError("Unable to allocate memory for EPT!\n");
+		HvEptFreeLogicalProcessorContext(ProcessorContext);
+		return FALSE;
+	}
+
+	/* Virtual address to the page table to keep track of it for later freeing */
+	ProcessorContext->EptPageTable = PageTable;
+
+	/* We will write the EPTP to the VMCS later */
+	ProcessorContext->EptPointer = HvEptBuildPointer(PageTable);
+
+#if VMM_SETTING_EPT_USE_VIEWS
+	/* Without EPTP switching, page hooks swap entries within the one page table */
+	if (HvVmcsIsEptpSwitchingSupported() && !HvEptCreateViews(ProcessorContext))
+	{
+		HvEptFreeLogicalProcessorContext(ProcessorContext);
+		return FALSE;
+	}
+#endif
+
+#if VMM_SETTING_EPT_USE_VIRTUALIZATION_EXCEPTIONS
+	/* The #VE handler swaps page hooks by switching views, so there is no use for #VE without them */
+	if (ProcessorContext->EptpList && !ProcessorContext->GlobalContext->KernelVaShadowEnabled && HvVmcsIsEptViolationVeSupported())
+	{
+		ProcessorContext->VeInformation = OsAllocateContiguousAlignedPages(1);
+		if (!ProcessorContext->VeInformation)
+		{
+			HvUtilLogError("Unable to allocate memory for the #VE information area!\n");
+			HvEptFreeLogicalProcessorContext(ProcessorContext);
+			return FALSE;
+		}
+
+		/* A busy area suppresses #VE, so it must start out cleared */
+		OsZeroMemory(ProcessorContext->VeInformation, PAGE_SIZE);
+
+		ProcessorContext->VeStack = OsAllocateNonpagedMemory(VMM_EPT_VE_STACK_SIZE);
+		if (!ProcessorContext->VeStack)
+		{
+			HvUtilLogError("Unable to allocate memory for the #VE stack!\n");
+			HvEptFreeLogicalProcessorContext(ProcessorContext);
+			return FALSE;
+		}
+	}
+#endif
+
+	/* The views and #VE are set up, so page hooks can be cached */
+	HvEptInitializeFastSwapCache(ProcessorContext);
+
+	/*
+	 * On each logical processor, create an EPT hook on NtCreateFile to intercept the system call.
+	 */
+	if (!HvEptAddPageHook(ProcessorContext, (PVOID)NtCreateFile, (PVOID)NtCreateFileHook, (PVOID*)&NtCreateFileOrig))
+	{
+		HvUtilLogError("Failed to build page hook for NtCreateFile");
+		HvEptFreeLogicalProcessorContext(ProcessorContext);
+		return FALSE;
+	}
+
+	HvEptReportMemoryUsage(ProcessorContext);
+
+	return TRUE;
+}
+
+/*
+ * Free a page table created by HvEptAllocatePageTable. Its page hooks must already be freed. Its private directories
+ * and splits are left in the pools of the processor, which are freed with them.
+ */
+VOID HvEptFreePageTable(PVMM_EPT_PAGE_TABLE PageTable)
+{
+	/* Free the hook index */
+	HvEptHookIndexFree(&PageTable->HookIndex);
+
+	HvUtilLogDebug("EPT: %lld splits were coalesced.\n", PageTable->CoalescedSplitCount);
+
+	/* Free the actual page table */
+	OsFreeContiguousAlignedPages(PageTable);
+}
+
+/**
+ * Free a page hook which EPT no longer uses, along with the hooks of the functions within it and their trampolines.
+ */
+VOID HvEptFreePageHook(PVMM_EPT_PAGE_HOOK PageHook)
+{
+	PVMM_EPT_FUNCTION_HOOK FunctionHook;
+
+	while (!IsListEmpty(&PageHook->FunctionHookList))
+	{
+		FunctionHook = CONTAINING_RECORD(RemoveHeadList(&PageHook->FunctionHookList), VMM_EPT_FUNCTION_HOOK, FunctionHookList);
+		HvEptReleaseTrampoline(FunctionHook->Trampoline);
+		OsFreeNonpagedMemory(FunctionHook);
+	}
+
+	OsFreeNonpagedMemory(PageHook);
+}
+
+/*
+ * Free memory allocated by EPT functions.
+ */
+VOID HvEptFreeLogicalProcessorContext(PVMM_PROCESSOR_CONTEXT ProcessorContext)
+{
+	PVMM_EPT_PAGE_HOOK PageHook;
+	SIZE_T View;
+
+	if (ProcessorContext->EptPageTable)
+	{
+		/* No races because we are above DPC IRQL */
+
+		/* Free each page hook and the hooks of the functions within it */
+		while (!IsListEmpty(&ProcessorContext->EptPageTable->PageHookList))
+		{
+			PageHook = CONTAINING_RECORD(RemoveHeadList(&ProcessorContext->EptPageTable->PageHookList), VMM_EPT_PAGE_HOOK, PageHookList);
+
+			/* Their exits were already logged by HvExitReportStatistics */
+			HvEptFreePageHook(PageHook);
+		}
+
+		HvUtilLogDebug("EPT: %lld regions mapped on demand, %lld accesses to memory other than RAM.\n",
+			ProcessorContext->EptPageTable->OnDemandMappedCount, ProcessorContext->EptPageTable->OnDemandUnbackedCount);
+
+		HvEptFreePageTable(ProcessorContext->EptPageTable);
+	}
+
+	/* The read view is EptPageTable, which was just freed */
+	for (View = VmmEptViewExecute; View < VMM_SETTING_EPT_VIEW_COUNT; View++)
+	{
+		if (ProcessorContext->EptViews[View])
+		{
+			HvEptFreePageTable(ProcessorContext->EptViews[View]);
+		}
+	}
+
+	if (ProcessorContext->EptpList)
+	{
+		OsFreeContiguousAlignedPages(ProcessorContext->EptpList);
+	}
+
+	/* Free every private directory and split of every view. Shared directories belong to the identity map. */
+	HvUtilLogDebug("EPT: Split pool high-water mark was %d of %lld frames.\n",
+		ProcessorContext->EptSplitPool.HighWaterMark, ProcessorContext->EptSplitPool.FrameCount);
+	HvUtilLogDebug("EPT: Table pool high-water mark was %d of %lld frames.\n",
+		ProcessorContext->EptTablePool.HighWaterMark, ProcessorContext->EptTablePool.FrameCount);
+
+	if (ProcessorContext->EptTablePool.ExhaustedCount != 0 || ProcessorContext->EptSplitPool.ExhaustedCount != 0)
+	{
+		HvUtilLogError("EPT: The table pool ran out %d times and the split pool %d times. Increase VMM_SETTING_EPT_TABLE_POOL_SIZE and VMM_SETTING_EPT_SPLIT_POOL_SIZE.\n",
+			ProcessorContext->EptTablePool.ExhaustedCount, ProcessorContext->EptSplitPool.ExhaustedCount);
+	}
+
+	HvEptPagePoolFree(&ProcessorContext->EptTablePool);
+	HvEptPagePoolFree(&ProcessorContext->EptSplitPool);
+
+	if (ProcessorContext->VeInformation)
+	{
+		OsFreeContiguousAlignedPages(ProcessorContext->VeInformation);
+	}
+
+	if (ProcessorContext->VeStack)
+	{
+		OsFreeNonpagedMemory(ProcessorContext->VeStack);
+	}
+}
+
+/* Write an absolute x64 jump to an arbitrary address to a buffer. */
+VOID HvEptHookWriteAbsoluteJump(PCHAR TargetBuffer, SIZE_T TargetAddress)
+{
+    /**
+     *   Use 'push ret' instead of 'jmp qword[rip+0]',
+     *   Because 'jmp qword[rip+0]' will read hooked page 8bytes.
+     *
+     *   14 bytes hook:
+     *   0x68 0x12345678 ......................push 'low 32bit of TargetAddress'
+     *   0xC7 0x44 0x24 0x04 0x12345678........mov dword[rsp + 4], 'high 32bit of TargetAddress'
+     *   0xC3..................................ret
+     */
+
+    UINT32  Low32;
+    UINT32  High32;
+
+    Low32 = (UINT32)TargetAddress;
+    High32 = (UINT32)(TargetAddress >> 32);
+
+    /* push 'low 32bit of TargetAddress' */
+    TargetBuffer[0] = 0x68;
+    *((UINT32*)&TargetBuffer[1]) = Low32;
+
+    /* mov dword[rsp + 4], 'high 32bit of TargetAddress' */
+    *((UINT32*)&TargetBuffer[5]) = 0x042444C7;
+    *((UINT32*)&TargetBuffer[9]) = High32;
+
+    /* ret */
+    TargetBuffer[13] = 0xC3;
+}
+
+
+/**
+ * Check whether a patch of PatchSize bytes at OffsetIntoPage would overlap the patch of a function already hooked
+ * in PageHook. Every instruction a patch overwrites must still be intact in the shadow page.
+ */
+BOOL HvEptIsPatchOverlapping(PVMM_EPT_PAGE_HOOK PageHook, SIZE_T OffsetIntoPage, SIZE_T PatchSize)
+{
+	FOR_EACH_LIST_ENTRY(PageHook, FunctionHookList, VMM_EPT_FUNCTION_HOOK, OtherHook)
+		if (OffsetIntoPage < OtherHook->OffsetIntoPage + OtherHook->PatchSize
+			&& OtherHook->OffsetIntoPage < OffsetIntoPage + PatchSize)
+		{
+			HvUtilLogError("Function overlaps the patch of a function already hooked at page offset 0x%llx.\n", OtherHook->OffsetIntoPage);
+			return TRUE;
+		}
+	FOR_EACH_LIST_ENTRY_END();
+
+	return FALSE;
+}
+
+/**
+ * Take a reference on the trampoline of TargetFunction, building it if no processor hooks the function yet. The
+ * trampoline runs the first PatchSize bytes of the function, which must be whole instructions, before jumping back
+ * into the function.
+ * 
+ * Every processor hooking the same function gets the same trampoline, so the one returned to the caller through
+ * OrigFunction stays valid for as long as any processor still hooks the function.
+ */
+PVMM_EPT_TRAMPOLINE HvEptAcquireTrampoline(PVMM_CONTEXT GlobalContext, PVOID TargetFunction, SIZE_T PatchSize)
+{
+	PVMM_EPT_TRAMPOLINE Trampoline;
+	KIRQL OldIrql;
+
+	KeAcquireSpinLock(&GlobalContext->TrampolineLock, &OldIrql);
+
+	FOR_EACH_LIST_ENTRY(GlobalContext, TrampolineList, VMM_EPT_TRAMPOLINE, Candidate)
+		if (Candidate->TargetFunction == TargetFunction)
+		{
+			Candidate->ReferenceCount++;
+			KeReleaseSpinLock(&GlobalContext->TrampolineLock, OldIrql);
+			return Candidate;
+		}
+	FOR_EACH_LIST_ENTRY_END();
+
+	Trampoline = (PVMM_EPT_TRAMPOLINE)OsAllocateNonpagedMemory(sizeof(VMM_EPT_TRAMPOLINE));
+	if (!Trampoline)
+	{
+		KeReleaseSpinLock(&GlobalContext->TrampolineLock, OldIrql);
+		HvUtilLogError("Could not allocate trampoline.\n");
+		return NULL;
+	}
+
+	/* Allocate some executable memory for the trampoline */
+	Trampoline->Code = OsAllocateExecutableNonpagedMemory(PatchSize + 14);
+	if (!Trampoline->Code)
+	{
+		KeReleaseSpinLock(&GlobalContext->TrampolineLock, OldIrql);
+		HvUtilLogError("Could not allocate trampoline function buffer.\n");
+		OsFreeNonpagedMemory(Trampoline);
+		return NULL;
+	}
+
+	/* Copy the trampoline instructions in. */
+	RtlCopyMemory(Trampoline->Code, TargetFunction, PatchSize);
+
+	/* Add the absolute jump back to the original function. */
+	HvEptHookWriteAbsoluteJump(&Trampoline->Code[PatchSize], (SIZE_T)TargetFunction + PatchSize);
+
+	Trampoline->GlobalContext = GlobalContext;
+	Trampoline->TargetFunction = TargetFunction;
+	Trampoline->ReferenceCount = 1;
+	InsertTailList(&GlobalContext->TrampolineList, &Trampoline->TrampolineList);
+
+	KeReleaseSpinLock(&GlobalContext->TrampolineLock, OldIrql);
+
+	return Trampoline;
+}
+
+/**
+ * Take another reference on a trampoline which is already referenced.
+ */
+VOID HvEptReferenceTrampoline(PVMM_EPT_TRAMPOLINE Trampoline)
+{
+	KIRQL OldIrql;
+
+	KeAcquireSpinLock(&Trampoline->GlobalContext->TrampolineLock, &OldIrql);
+	Trampoline->ReferenceCount++;
+	KeReleaseSpinLock(&Trampoline->GlobalContext->TrampolineLock, OldIrql);
+}
+
+/**
+ * Drop a reference on a trampoline, and free it if that was the last one. Can't be called from VMX root.
+ * 
+ * The last reference is dropped once no processor hooks the function anymore, but a thread which entered the hook
+ * function before that may still be about to call the trampoline. Making sure no such thread is left is up to the
+ * code removing the hook.
+ */
+VOID HvEptReleaseTrampoline(PVMM_EPT_TRAMPOLINE Trampoline)
+{
+	PVMM_CONTEXT GlobalContext;
+	KIRQL OldIrql;
+
+	GlobalContext = Trampoline->GlobalContext;
+
+	KeAcquireSpinLock(&GlobalContext->TrampolineLock, &OldIrql);
+
+	Trampoline->ReferenceCount--;
+	if (Trampoline->ReferenceCount != 0)
+	{
+		KeReleaseSpinLock(&GlobalContext->TrampolineLock, OldIrql);
+		return;
+	}
+
+	RemoveEntryList(&Trampoline->TrampolineList);
+
+	KeReleaseSpinLock(&GlobalContext->TrampolineLock, OldIrql);
+
+	OsFreeNonpagedMemory(Trampoline->Code);
+	OsFreeNonpagedMemory(Trampoline);
+}
+
+/**
+ * Patch the function at TargetFunction in the shadow page of PageHook to jump to HookFunction, and take a reference
+ * on the trampoline of the function for FunctionHook, which runs the overwritten instructions before jumping back
+ * into the original function.
+ * 
+ * Fails if the patch would overlap the patch of another function hooked in the same page.
+ */
+BOOL HvEptHookInstructionMemory(PVMM_CONTEXT GlobalContext, PVMM_EPT_PAGE_HOOK PageHook, PVMM_EPT_FUNCTION_HOOK FunctionHook, PVOID TargetFunction, PVOID HookFunction, PVOID* OrigFunction)
+{
+	SIZE_T SizeOfHookedInstructions;
+	SIZE_T OffsetIntoPage;
+
+	OffsetIntoPage = ADDRMASK_EPT_PML1_OFFSET((SIZE_T)TargetFunction);
+	HvUtilLogDebug("OffsetIntoPage: 0x%llx\n", OffsetIntoPage);
+
+	if ((OffsetIntoPage + 14) > PAGE_SIZE-1)
+	{
+		HvUtilLogError("Function extends past a page boundary. We just don't have the technology to solve this.....\n");
+		return FALSE;
+	}
+
+	/* Determine the number of instructions necessary to overwrite using Length Disassembler Engine */
+	for(SizeOfHookedInstructions = 0; 
+		SizeOfHookedInstructions < 14; 
+		SizeOfHookedInstructions += LDE((PCHAR)TargetFunction + SizeOfHookedInstructions, 64))
+	{
+		// Get the full size of instructions necessary to copy
+	}
+
+	HvUtilLogDebug("Number of bytes of instruction mem: %d\n", SizeOfHookedInstructions);
+
+	if (HvEptIsPatchOverlapping(PageHook, OffsetIntoPage, SizeOfHookedInstructions))
+	{
+		return FALSE;
+	}
+
+	/* Build a trampoline, or share the one of another processor */
+	FunctionHook->Trampoline = HvEptAcquireTrampoline(GlobalContext, TargetFunction, SizeOfHookedInstructions);
+
+	if (!FunctionHook->Trampoline)
+	{
+		return FALSE;
+	}
+
+	HvUtilLogDebug("Trampoline: 0x%llx\n", FunctionHook->Trampoline->Code);
+	HvUtilLogDebug("HookFunction: 0x%llx\n", HookFunction);
+
+	FunctionHook->PageHook = PageHook;
+	FunctionHook->OffsetIntoPage = OffsetIntoPage;
+	FunctionHook->PatchSize = SizeOfHookedInstructions;
+
+	/* Let the hook function call the original function */
+	*OrigFunction = FunctionHook->Trampoline->Code;
+
+	/* Write the absolute jump to our shadow page memory to jump to our hook. */
+	HvEptHookWriteAbsoluteJump(&PageHook->FakePage[OffsetIntoPage], (SIZE_T)HookFunction);
+
+	return TRUE;
+}
+
+/**
+ * Point FakePage and SparePage of a page hook at its own ShadowPages and translate them. Returns FALSE if either
+ * page could not be translated.
+ */
+BOOL HvEptInitializeShadowPages(PVMM_EPT_PAGE_HOOK PageHook)
+{
+	PageHook->FakePage = &PageHook->ShadowPages[0][0];
+	PageHook->SparePage = &PageHook->ShadowPages[1][0];
+
+	PageHook->FakePageFrameNumber = (SIZE_T)OsVirtualToPhysical(PageHook->FakePage) / PAGE_SIZE;
+	PageHook->SparePageFrameNumber = (SIZE_T)OsVirtualToPhysical(PageHook->SparePage) / PAGE_SIZE;
+
+	return PageHook->FakePageFrameNumber && PageHook->SparePageFrameNumber;
+}
+
+/**
+ * Allocate the page hook for the 4096 byte page at PhysicalAddress, mapped at VirtualTarget, with a copy of the
+ * page as its shadow page and without any functions hooked in it yet. The page hook is not tied to the EPT of any
+ * processor until HvEptBindPageHook is called. Must not be called from VMX root.
+ */
+PVMM_EPT_PAGE_HOOK HvEptAllocatePageHook(PVOID VirtualTarget, SIZE_T PhysicalAddress, VMM_EPT_HOOK_STRATEGY Strategy)
+{
+	PVMM_EPT_PAGE_HOOK NewHook;
+
+	/* Create a hook object*/
+	NewHook = (PVMM_EPT_PAGE_HOOK) OsAllocateNonpagedMemory(sizeof(VMM_EPT_PAGE_HOOK));
+
+	if (!NewHook)
+	{
+		HvUtilLogError("HvEptAllocatePageHook: Could not allocate memory for new hook.\n");
+		return NULL;
+	}
+
+	/* Zero our newly allocated memory */
+	OsZeroMemory(NewHook, sizeof(VMM_EPT_PAGE_HOOK));
+
+	if (!HvEptInitializeShadowPages(NewHook))
+	{
+		HvUtilLogError("HvEptAllocatePageHook: Could not translate the shadow page.\n");
+		OsFreeNonpagedMemory(NewHook);
+		return NULL;
+	}
+
+	RtlCopyMemory(NewHook->FakePage, VirtualTarget, PAGE_SIZE);
+
+	InitializeListHead(&NewHook->FunctionHookList);
+
+	/* Base address of the 4096 page. */
+	NewHook->PhysicalBaseAddress = (SIZE_T) PAGE_ALIGN(PhysicalAddress);
+
+	/* Adaptive hooks start out swapping */
+	NewHook->RequestedStrategy = Strategy;
+	NewHook->Strategy = (Strategy == VmmEptHookStrategyMonitorTrap) ? VmmEptHookStrategyMonitorTrap : VmmEptHookStrategySwap;
+	NewHook->Statistics.WindowStart = __rdtsc();
+
+	return NewHook;
+}
+
+/**
+ * Undo HvEptBindPageHook for a page hook which was never installed. Nothing in the splits it made was changed, so
+ * they coalesce back into large pages and their frames go back to the split pool. Safe to call from VMX root.
+ */
+VOID HvEptUnbindPageHook(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_PAGE_HOOK PageHook)
+{
+	HvEptCoalesceLargePage(ProcessorContext, ProcessorContext->EptPageTable, PageHook->PhysicalBaseAddress);
+
+	if (ProcessorContext->EptpList)
+	{
+		HvEptCoalesceLargePage(ProcessorContext, ProcessorContext->EptViews[VmmEptViewExecute], PageHook->PhysicalBaseAddress);
+	}
+
+	PageHook->TargetPage = NULL;
+	PageHook->ExecuteTargetPage = NULL;
+}
+
+/**
+ * Tie an allocated page hook to the EPT of this processor: split its page out of the large page in each view and
+ * build the entries the hook swaps between. Nothing is allocated, so this can be done in VMX root. The entries are
+ * not installed until HvEptInstallPageHook is called.
+ */
+BOOL HvEptBindPageHook(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_PAGE_HOOK PageHook)
+{
+	EPT_PML1_ENTRY FakeEntry;
+	EPT_PML1_ENTRY OriginalEntry;
+	SIZE_T PhysicalAddress;
+
+	PhysicalAddress = PageHook->PhysicalBaseAddress;
+
+	/* 
+	 * Ensure the page is split into 512 4096 byte page entries. We can only hook a 4096 byte page, not a 2MB page.
+	 * This is due to performance hit we would get from hooking a 2MB page.
+	 */
+	if (!HvEptSplitLargePage(ProcessorContext->EptPageTable, PhysicalAddress))
+	{
+		HvUtilLogError("HvEptBindPageHook: Could not split page for address 0x%llX.\n", PhysicalAddress);
+		return FALSE;
+	}
+
+	/* The page needs its own entry in the execute view as well */
+	if (ProcessorContext->EptpList && !HvEptSplitLargePage(ProcessorContext->EptViews[VmmEptViewExecute], PhysicalAddress))
+	{
+		HvUtilLogError("HvEptBindPageHook: Could not split page for address 0x%llX in the execute view.\n", PhysicalAddress);
+		HvEptUnbindPageHook(ProcessorContext, PageHook);
+		return FALSE;
+	}
+
+	/* Pointer to the page entry in the page table. */
+	PageHook->TargetPage = HvEptGetPml1Entry(ProcessorContext->EptPageTable, PhysicalAddress);
+
+	/* Ensure the target is valid. */
+	if (!PageHook->TargetPage)
+	{
+		HvUtilLogError("HvEptBindPageHook: Failed to get PML1 entry for target address.\n");
+		HvEptUnbindPageHook(ProcessorContext, PageHook);
+		return FALSE;
+	}
+
+	if (ProcessorContext->EptpList)
+	{
+		PageHook->ExecuteTargetPage = HvEptGetPml1Entry(ProcessorContext->EptViews[VmmEptViewExecute], PhysicalAddress);
+
+		if (!PageHook->ExecuteTargetPage)
+		{
+			HvUtilLogError("HvEptBindPageHook: Failed to get PML1 entry for target address in the execute view.\n");
+			HvEptUnbindPageHook(ProcessorContext, PageHook);
+			return FALSE;
+		}
+	}
+
+	/* Save the original permissions of the page */
+	PageHook->OriginalEntry = *PageHook->TargetPage;
+	OriginalEntry = *PageHook->TargetPage;
+
+	/* Setup the new fake page table entry */
+	FakeEntry.Flags = 0;
+
+	/* We want this page to raise an EPT violation on RW so we can handle by swapping in the original page. */
+	FakeEntry.ReadAccess = 0;
+	FakeEntry.WriteAccess = 0;
+	FakeEntry.ExecuteAccess = 1;
+
+	/* Point to our fake page we just made */
+	FakeEntry.PageFrameNumber = PageHook->FakePageFrameNumber;
+
+	/* Save a copy of the fake entry. */
+	PageHook->ShadowEntry.Flags = FakeEntry.Flags;
+
+	/* 
+	 * Lastly, mark the entry in the table as no execute. This will cause the next time that an instruction is
+	 * fetched from this page to cause an EPT violation exit. This will allow us to swap in the fake page with our
+	 * hook.
+	 */
+	OriginalEntry.ReadAccess = 1;
+	OriginalEntry.WriteAccess = 1;
+	OriginalEntry.ExecuteAccess = 0;
+
+	/* The hooked entry will be swapped in first. */
+	PageHook->HookedEntry.Flags = OriginalEntry.Flags;
+
+	/* The monitor trap strategy briefly maps the original page with every permission instead */
+	OriginalEntry.ExecuteAccess = 1;
+	PageHook->MonitorTrapEntry.Flags = OriginalEntry.Flags;
+
+	/*
+	 * The #VE handler can swap views for the swap strategy on its own. Every other violation on the page exits,
+	 * since the monitor trap strategy needs the monitor trap flag.
+	 */
+	if (ProcessorContext->VeInformation)
+	{
+		PageHook->HookedEntry.SuppressVe = (PageHook->Strategy != VmmEptHookStrategySwap);
+		PageHook->ShadowEntry.SuppressVe = (PageHook->Strategy != VmmEptHookStrategySwap);
+		PageHook->MonitorTrapEntry.SuppressVe = 1;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Create the page hook of this processor for the 4096 byte page at PhysicalAddress, mapped at VirtualTarget,
+ * without any functions hooked in it yet. The hook is not applied to EPT until HvEptApplyPageHook is called.
+ */
+PVMM_EPT_PAGE_HOOK HvEptCreatePageHook(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVOID VirtualTarget, SIZE_T PhysicalAddress, VMM_EPT_HOOK_STRATEGY Strategy)
+{
+	PVMM_EPT_PAGE_HOOK NewHook;
+
+	NewHook = HvEptAllocatePageHook(VirtualTarget, PhysicalAddress, Strategy);
+
+	if (!NewHook)
+	{
+		return NULL;
+	}
+
+	if (!HvEptBindPageHook(ProcessorContext, NewHook))
+	{
+		OsFreeNonpagedMemory(NewHook);
+		return NULL;
+	}
+
+	return NewHook;
+}
+
+/**
+ * Set up the fast swap cache of this processor, empty. Must be called once its views exist.
+ */
+VOID HvEptInitializeFastSwapCache(PVMM_PROCESSOR_CONTEXT ProcessorContext)
+{
+	PVMM_EPT_FAST_SWAP_CACHE Cache;
+	SIZE_T Index;
+
+	Cache = &ProcessorContext->FastSwapCache;
+
+	Cache->ReadEptPointer = ProcessorContext->EptPointer.Flags;
+	Cache->ExecuteEptPointer = ProcessorContext->EptpList ? ProcessorContext->EptpList[VmmEptViewExecute].Flags : ProcessorContext->EptPointer.Flags;
+	Cache->AppliedGeneration = &ProcessorContext->AppliedEptGeneration;
+	Cache->PublishedGeneration = &ProcessorContext->GlobalContext->EptGeneration;
+	Cache->SwapCount = 0;
+	Cache->SlotMask = VMM_SETTING_EPT_FAST_SWAP_CACHE_SIZE - 1;
+
+	for (Index = 0; Index < VMM_SETTING_EPT_FAST_SWAP_CACHE_SIZE; Index++)
+	{
+		Cache->Slots[Index].PhysicalPage = VMM_EPT_FAST_SWAP_EMPTY;
+	}
+}
+
+/**
+ * The slot of the fast swap cache for the page at PhysicalAddress. HvEnterFromGuest computes the same slot.
+ */
+PVMM_EPT_FAST_SWAP_SLOT HvEptpGetFastSwapSlot(PVMM_EPT_FAST_SWAP_CACHE Cache, SIZE_T PhysicalAddress)
+{
+	return &Cache->Slots[(PhysicalAddress >> PAGE_SHIFT) & Cache->SlotMask];
+}
+
+/**
+ * Add an installed page hook to the fast swap cache of this processor, if its slot is free.
+ * 
+ * Only hooks which currently swap are cached, since the cache swaps them without looking at the hook. Adaptive hooks
+ * are sampled, see HvEptpSampleFastSwap. The #VE handler needs the EPTP index updated with the view, which the cache
+ * doesn't do, so nothing is cached if #VE is enabled.
+ */
+VOID HvEptpFastSwapCacheInsert(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_PAGE_HOOK PageHook)
+{
+	PVMM_EPT_FAST_SWAP_SLOT Slot;
+
+	if (PageHook->Strategy != VmmEptHookStrategySwap || ProcessorContext->VeInformation)
+	{
+		return;
+	}
+
+	/* A hook colliding with a cached one is swapped by HvExitHandlePageHookExit */
+	Slot = HvEptpGetFastSwapSlot(&ProcessorContext->FastSwapCache, PageHook->PhysicalBaseAddress);
+	if (Slot->PhysicalPage != VMM_EPT_FAST_SWAP_EMPTY)
+	{
+		return;
+	}
+
+	if (PageHook->ExecuteTargetPage)
+	{
+		Slot->TargetPage = NULL;
+		Slot->ExecuteValue = ProcessorContext->EptpList[VmmEptViewExecute].Flags;
+		Slot->ReadWriteValue = ProcessorContext->EptpList[VmmEptViewRead].Flags;
+	}
+	else
+	{
+		Slot->TargetPage = PageHook->TargetPage;
+		Slot->ExecuteValue = PageHook->ShadowEntry.Flags;
+		Slot->ReadWriteValue = PageHook->HookedEntry.Flags;
+	}
+
+	Slot->SampleCountdown = (PageHook->RequestedStrategy == VmmEptHookStrategyAdaptive) ? VMM_SETTING_EPT_FAST_SWAP_SAMPLE_INTERVAL : 0;
+
+	/* This may run in the guest, which can exit between any two instructions, so the slot is only published once complete */
+	InterlockedExchange64((volatile LONG64*)&Slot->PhysicalPage, (LONG64)PageHook->PhysicalBaseAddress);
+}
+
+/**
+ * Remove the page at PhysicalAddress from the fast swap cache of this processor, if it is cached. Must be called
+ * before its entries change.
+ */
+VOID HvEptpFastSwapCacheRemove(PVMM_PROCESSOR_CONTEXT ProcessorContext, SIZE_T PhysicalAddress)
+{
+	PVMM_EPT_FAST_SWAP_SLOT Slot;
+
+	Slot = HvEptpGetFastSwapSlot(&ProcessorContext->FastSwapCache, PhysicalAddress);
+
+	if ((Slot->PhysicalPage >> PAGE_SHIFT) == (PhysicalAddress >> PAGE_SHIFT))
+	{
+		InterlockedExchange64((volatile LONG64*)&Slot->PhysicalPage, (LONG64)VMM_EPT_FAST_SWAP_EMPTY);
+	}
+}
+
+/**
+ * Make SparePage of PageHook, which the caller has filled with the new contents of the shadow page, the shadow page
+ * of this processor. Each entry mapping the old shadow page is switched with a single store, so an instruction
+ * fetch sees either the old page or the new one, never a patch written halfway. Called from VMX root.
+ * 
+ * The old page becomes the spare and is left untouched until the caller flushes the EPT of the processor, so a
+ * stale translation still runs the old contents whole.
+ */
+VOID HvEptSwitchShadowPage(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_PAGE_HOOK PageHook)
+{
+	EPT_PML1_ENTRY Entry;
+	PCHAR OldPage;
+	SIZE_T OldPageFrameNumber;
+
+	HvEptpFastSwapCacheRemove(ProcessorContext, PageHook->PhysicalBaseAddress);
+
+	OldPage = PageHook->FakePage;
+	OldPageFrameNumber = PageHook->FakePageFrameNumber;
+
+	PageHook->FakePage = PageHook->SparePage;
+	PageHook->FakePageFrameNumber = PageHook->SparePageFrameNumber;
+	PageHook->SparePage = OldPage;
+	PageHook->SparePageFrameNumber = OldPageFrameNumber;
+
+	PageHook->ShadowEntry.PageFrameNumber = PageHook->FakePageFrameNumber;
+
+	/* The hooked entry may be installed instead, which maps the original page */
+	Entry = *PageHook->TargetPage;
+	if (Entry.PageFrameNumber == OldPageFrameNumber)
+	{
+		Entry.PageFrameNumber = PageHook->FakePageFrameNumber;
+		PageHook->TargetPage->Flags = Entry.Flags;
+	}
+
+	if (PageHook->ExecuteTargetPage)
+	{
+		Entry = *PageHook->ExecuteTargetPage;
+		Entry.PageFrameNumber = PageHook->FakePageFrameNumber;
+		PageHook->ExecuteTargetPage->Flags = Entry.Flags;
+	}
+
+	HvEptpFastSwapCacheInsert(ProcessorContext, PageHook);
+}
+
+/**
+ * Number of swaps an EPT violation on an adaptive page hook stands for, not counting those of the #VE handler.
+ * HvEnterFromGuest only hands one in VMM_SETTING_EPT_FAST_SWAP_SAMPLE_INTERVAL swaps of a cached hook to the exit
+ * handler, once its countdown runs out, and swaps the rest itself. The countdown is restarted here.
+ */
+SIZE_T HvEptpSampleFastSwap(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_PAGE_HOOK PageHook)
+{
+	PVMM_EPT_FAST_SWAP_SLOT Slot;
+
+	Slot = HvEptpGetFastSwapSlot(&ProcessorContext->FastSwapCache, PageHook->PhysicalBaseAddress);
+
+	/* Other exits on a cached hook, such as while shared edits are pending, are not sampled */
+	if (Slot->PhysicalPage != PageHook->PhysicalBaseAddress || Slot->SampleCountdown != 0)
+	{
+		return 1;
+	}
+
+	Slot->SampleCountdown = VMM_SETTING_EPT_FAST_SWAP_SAMPLE_INTERVAL;
+
+	return VMM_SETTING_EPT_FAST_SWAP_SAMPLE_INTERVAL;
+}
+
+/**
+ * Make a bound page hook visible to the EPT violation handler and install its entries, without flushing the
+ * processor's EPT.
+ */
+BOOL HvEptInstallPageHook(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_PAGE_HOOK PageHook)
+{
+	/* Make the hook visible to the EPT violation handler */
+	if (!HvEptHookIndexInsert(&ProcessorContext->EptPageTable->HookIndex, PageHook))
+	{
+		HvUtilLogError("HvEptInstallPageHook: Could not index hook.\n");
+		return FALSE;
+	}
+
+	/* Keep a record of the page hook */
+	InsertHeadList(&ProcessorContext->EptPageTable->PageHookList, &PageHook->PageHookList);
+
+	/*
+	 * Apply the hook to EPT. With views, each view keeps its entry for good and the hook swaps by switching views.
+	 * Otherwise, the monitor trap strategy only ever leaves the shadow page installed.
+	 */
+	if (PageHook->ExecuteTargetPage)
+	{
+		PageHook->TargetPage->Flags = PageHook->HookedEntry.Flags;
+		PageHook->ExecuteTargetPage->Flags = PageHook->ShadowEntry.Flags;
+	}
+	else if (PageHook->Strategy == VmmEptHookStrategyMonitorTrap)
+	{
+		PageHook->TargetPage->Flags = PageHook->ShadowEntry.Flags;
+	}
+	else
+	{
+		PageHook->TargetPage->Flags = PageHook->HookedEntry.Flags;
+	}
+
+	/* Let HvEnterFromGuest swap the page itself */
+	HvEptpFastSwapCacheInsert(ProcessorContext, PageHook);
+
+	return TRUE;
+}
+
+/**
+ * Make a newly created page hook visible to the EPT violation handler and apply it to EPT.
+ */
+BOOL HvEptApplyPageHook(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_PAGE_HOOK PageHook)
+{
+	if (!HvEptInstallPageHook(ProcessorContext, PageHook))
+	{
+		return FALSE;
+	}
+
+	/*
+	 * Invalidate the entry in the TLB caches so it will not conflict with the actual paging structure.
+	 */
+	HvEptInvalidateProcessor(ProcessorContext);
+
+	return TRUE;
+}
+
+/**
+ * Fall back from the strategies which need the monitor trap flag if the processor does not support it. Adaptive
+ * hooks can then only ever swap, while VmmEptHookStrategyMonitorTrap fails.
+ */
+BOOL HvEptResolveHookStrategy(PVMM_CONTEXT GlobalContext, VMM_EPT_HOOK_STRATEGY* Strategy)
+{
+	if (*Strategy != VmmEptHookStrategySwap && !HvVmcsIsMonitorTrapFlagSupported(GlobalContext))
+	{
+		if (*Strategy == VmmEptHookStrategyMonitorTrap)
+		{
+			HvUtilLogError("EPT: The monitor trap flag is not supported by this processor.\n");
+			return FALSE;
+		}
+
+		/* Adaptive hooks can only ever swap */
+		*Strategy = VmmEptHookStrategySwap;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Hook the function at TargetFunction so that HookFunction runs instead when it is executed, without changing
+ * its memory as seen by reads and writes. OrigFunction receives a trampoline which calls the original function.
+ * 
+ * Every function hooked within the same 4096 byte page shares one page hook, whose shadow page carries the patches
+ * of all of them. Hooking another function in an already hooked page needs no change to EPT at all.
+ * 
+ * The page uses VmmEptHookStrategySwap, see HvEptAddPageHookEx to choose another strategy.
+ */
+BOOL HvEptAddPageHook(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVOID TargetFunction, PVOID HookFunction, PVOID* OrigFunction)
+{
+	return HvEptAddPageHookEx(ProcessorContext, TargetFunction, HookFunction, OrigFunction, VmmEptHookStrategySwap);
+}
+
+/**
+ * Same as HvEptAddPageHook, choosing how the hooked page swaps between the shadow page and the original page.
+ * All functions hooked in the same page must use the same strategy.
+ * 
+ * VmmEptHookStrategyMonitorTrap should be used for pages whose code reads data from the page itself, such as
+ * jump tables or constants embedded in .text, which would otherwise cause a swap on nearly every instruction.
+ * VmmEptHookStrategyAdaptive measures the swap rate of the page and switches between the two by itself, for pages
+ * where that is not known in advance.
+ * 
+ * Only for use before the processor launches. The patch is written into the shadow page with plain stores, which
+ * another processor could execute halfway through once the page is live. Use HvEptAddHookToTransaction after launch.
+ */
+BOOL HvEptAddPageHookEx(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVOID TargetFunction, PVOID HookFunction, PVOID* OrigFunction, VMM_EPT_HOOK_STRATEGY Strategy)
+{
+	PVMM_EPT_PAGE_HOOK PageHook;
+	PVMM_EPT_PAGE_HOOK NewPageHook;
+	PVMM_EPT_FUNCTION_HOOK FunctionHook;
+	SIZE_T PhysicalAddress;
+	PVOID VirtualTarget;
+
+	if (ProcessorContext->HasLaunched)
+	{
+		HvUtilLogError("HvEptAddPageHook: Processor has already launched, use HvEptAddHookToTransaction instead.\n");
+		return FALSE;
+	}
+
+	/* Translate the page from a physical address to virtual so we can read its memory. 
+	 * This function will return NULL if the physical address was not already mapped in
+	 * virtual memory.
+	 */
+	VirtualTarget = PAGE_ALIGN(TargetFunction);
+
+	PhysicalAddress = (SIZE_T) OsVirtualToPhysical(VirtualTarget);
+
+	if(!PhysicalAddress)
+	{
+		HvUtilLogError("HvEptAddPageHook: Target address could not be mapped to physical memory!\n");
+		return FALSE;
+	}
+
+	if (!HvEptResolveHookStrategy(ProcessorContext->GlobalContext, &Strategy))
+	{
+		return FALSE;
+	}
+
+	/* Share the page hook of any other function already hooked in this page */
+	NewPageHook = NULL;
+	PageHook = HvEptHookIndexLookup(&ProcessorContext->EptPageTable->HookIndex, PhysicalAddress);
+
+	if (PageHook && PageHook->RequestedStrategy != Strategy)
+	{
+		HvUtilLogError("HvEptAddPageHook: Page 0x%llX is already hooked with a different strategy.\n", PhysicalAddress);
+		return FALSE;
+	}
+
+	if (!PageHook)
+	{
+		PageHook = NewPageHook = HvEptCreatePageHook(ProcessorContext, VirtualTarget, PhysicalAddress, Strategy);
+		if (!PageHook)
+		{
+			return FALSE;
+		}
+	}
+
+	FunctionHook = (PVMM_EPT_FUNCTION_HOOK)OsAllocateNonpagedMemory(sizeof(VMM_EPT_FUNCTION_HOOK));
+	if (!FunctionHook)
+	{
+		HvUtilLogError("HvEptAddPageHook: Could not allocate memory for new function hook.\n");
+		if (NewPageHook)
+		{
+			HvEptUnbindPageHook(ProcessorContext, NewPageHook);
+			OsFreeNonpagedMemory(NewPageHook);
+		}
+		return FALSE;
+	}
+
+	OsZeroMemory(FunctionHook, sizeof(VMM_EPT_FUNCTION_HOOK));
+
+	if(!HvEptHookInstructionMemory(ProcessorContext->GlobalContext, PageHook, FunctionHook, TargetFunction, HookFunction, OrigFunction))
+	{
+		HvUtilLogError("HvEptAddPageHook: Could not build hook.\n");
+		OsFreeNonpagedMemory(FunctionHook);
+		if (NewPageHook)
+		{
+			HvEptUnbindPageHook(ProcessorContext, NewPageHook);
+			OsFreeNonpagedMemory(NewPageHook);
+		}
+		return FALSE;
+	}
+
+	/* A new page hook only takes effect once its first function is patched in */
+	if (NewPageHook && !HvEptApplyPageHook(ProcessorContext, NewPageHook))
+	{
+		HvEptUnbindPageHook(ProcessorContext, NewPageHook);
+		HvEptReleaseTrampoline(FunctionHook->Trampoline);
+		OsFreeNonpagedMemory(FunctionHook);
+		OsFreeNonpagedMemory(NewPageHook);
+		return FALSE;
+	}
+
+	InsertTailList(&PageHook->FunctionHookList, &FunctionHook->FunctionHookList);
+	PageHook->FunctionHookCount++;
+
+	return TRUE;
+}
+
+/**
+ * Remove the hook of this processor on the function at PhysicalAddress. Called from VMX root by the
+ * VmmHypercallRemovePageHook hypercall.
+ * 
+ * If other functions stay hooked in the page, a copy of the shadow page with the overwritten instructions put back
+ * from the trampoline is switched in, and the EPT is flushed. If that was the last function hooked in the page, the
+ * page hook is removed as well: the page gets its original entry back and the 2MB region around it is coalesced if
+ * that leaves it uniform. Invalidation is only done when it is required:
+ * putting back the hooked entry only gives the page execute permission again, so a stale translation can at worst
+ * raise a spurious EPT violation, which the violation handler retries. The shadow entry maps the fake page, so it
+ * is always flushed before the page hook can be freed.
+ * 
+ * Nothing is freed here, as that can't be done from VMX root. Returns the unlinked function hook for the caller to
+ * free once it is back in the guest, or NULL if the function was not hooked. Its PageHook is left set only if
+ * the page hook was removed too and must also be freed.
+ */
+PVMM_EPT_FUNCTION_HOOK HvEptRemovePageHook(PVMM_PROCESSOR_CONTEXT ProcessorContext, SIZE_T PhysicalAddress)
+{
+	PVMM_EPT_PAGE_HOOK Hook;
+	PVMM_EPT_FUNCTION_HOOK FunctionHook;
+	EPT_PML1_ENTRY CurrentEntry;
+	BOOL Coalesced;
 
-	PWCH NameBuffer;
-	USHORT NameLength;
+	Hook = HvEptHookIndexLookup(&ProcessorContext->EptPageTable->HookIndex, PhysicalAddress);
+	if (!Hook)
+	{
+		return NULL;
+	}
 
-	__try
+	FunctionHook = NULL;
+	FOR_EACH_LIST_ENTRY(Hook, FunctionHookList, VMM_EPT_FUNCTION_HOOK, Candidate)
+		if (Candidate->OffsetIntoPage == ADDRMASK_EPT_PML1_OFFSET(PhysicalAddress))
+		{
+			FunctionHook = Candidate;
+			break;
+		}
+	FOR_EACH_LIST_ENTRY_END();
+
+	if (!FunctionHook)
+	{
+		return NULL;
+	}
+
+	RemoveEntryList(&FunctionHook->FunctionHookList);
+	Hook->FunctionHookCount--;
+
+	/* The trampoline starts with the original instructions */
+	if (Hook->FunctionHookCount != 0)
+	{
+		RtlCopyMemory(Hook->SparePage, Hook->FakePage, PAGE_SIZE);
+		RtlCopyMemory(&Hook->SparePage[FunctionHook->OffsetIntoPage], FunctionHook->Trampoline->Code, FunctionHook->PatchSize);
+
+		HvEptSwitchShadowPage(ProcessorContext, Hook);
+		HvEptInvalidateProcessor(ProcessorContext);
+
+		FunctionHook->PageHook = NULL;
+		return FunctionHook;
+	}
+
+	/* Stop servicing violations on the page before the entry changes */
+	HvEptpFastSwapCacheRemove(ProcessorContext, PhysicalAddress);
+	HvEptHookIndexRemove(&ProcessorContext->EptPageTable->HookIndex, PhysicalAddress);
+	RemoveEntryList(&Hook->PageHookList);
+
+	CurrentEntry = *Hook->TargetPage;
+	Hook->TargetPage->Flags = Hook->OriginalEntry.Flags;
+
+	if (Hook->ExecuteTargetPage)
+	{
+		Hook->ExecuteTargetPage->Flags = Hook->OriginalEntry.Flags;
+	}
+
+	/* Coalescing flushes every view on its own */
+	Coalesced = HvEptCoalesceLargePage(ProcessorContext, ProcessorContext->EptPageTable, PhysicalAddress);
+
+	if (Hook->ExecuteTargetPage)
+	{
+		Coalesced |= HvEptCoalesceLargePage(ProcessorContext, ProcessorContext->EptViews[VmmEptViewExecute], PhysicalAddress);
+	}
+
+	if (Coalesced)
+	{
+		return FunctionHook;
+	}
+
+	/*
+	 * Flush if the old entry mapped other memory or had permissions that the original entry doesn't. The execute
+	 * view always mapped the shadow page.
+	 */
+	if (Hook->ExecuteTargetPage
+		|| CurrentEntry.PageFrameNumber != Hook->OriginalEntry.PageFrameNumber
+		|| CurrentEntry.MemoryType != Hook->OriginalEntry.MemoryType
+		|| (CurrentEntry.ReadAccess && !Hook->OriginalEntry.ReadAccess)
+		|| (CurrentEntry.WriteAccess && !Hook->OriginalEntry.WriteAccess)
+		|| (CurrentEntry.ExecuteAccess && !Hook->OriginalEntry.ExecuteAccess))
+	{
+		HvEptInvalidateProcessor(ProcessorContext);
+	}
+
+	return FunctionHook;
+}
+
+/**
+ * Context of a hook removal broadcast to every processor.
+ */
+typedef struct _VMM_EPT_REMOVE_HOOK_REQUEST
+{
+	/*
+	 * The global context, to find the context of each processor.
+	 */
+	PVMM_CONTEXT GlobalContext;
+
+	/*
+	 * Physical address of the hooked function.
+	 */
+	SIZE_T PhysicalAddress;
+
+	/*
+	 * Number of processors that had a hook on the function.
+	 */
+	volatile LONG RemovedCount;
+} VMM_EPT_REMOVE_HOOK_REQUEST, *PVMM_EPT_REMOVE_HOOK_REQUEST;
+
+/**
+ * DPC run on every processor by HvEptRemovePageHookOnAllProcessors.
+ */
+VOID NTAPI HvEptpRemovePageHookDpc(_In_ struct _KDPC *Dpc,
+	_In_opt_ PVOID DeferredContext,
+	_In_opt_ PVOID SystemArgument1,
+	_In_opt_ PVOID SystemArgument2)
+{
+	PVMM_EPT_REMOVE_HOOK_REQUEST Request;
+	PVMM_EPT_FUNCTION_HOOK FunctionHook;
+
+	UNREFERENCED_PARAMETER(Dpc);
+
+	Request = (PVMM_EPT_REMOVE_HOOK_REQUEST)DeferredContext;
+
+	/* Have the hypervisor unhook the function in this processor's EPT. VMCALL is undefined outside of VMX. */
+	FunctionHook = NULL;
+	if (HvGetCurrentCPUContext(Request->GlobalContext)->HasLaunched)
+	{
+		FunctionHook = (PVMM_EPT_FUNCTION_HOOK)__vmcall(VmmHypercallRemovePageHook, Request->PhysicalAddress, 0);
+	}
+
+	/*
+	 * Every processor shares the trampoline returned to the caller of HvEptAddPageHook. Wait until the hook is gone
+	 * from every processor, and every processor has left the guest code it was running for this DPC, before any of
+	 * them drops its reference. Whichever drops the last one frees it.
+	 */
+	KeSignalCallDpcSynchronize(SystemArgument2);
+
+	if (FunctionHook)
+	{
+		InterlockedIncrement(&Request->RemovedCount);
+
+		if (FunctionHook->PageHook)
+		{
+			HvEptReportPageHookExits(FunctionHook->PageHook);
+			OsFreeNonpagedMemory(FunctionHook->PageHook);
+		}
+
+		HvEptReleaseTrampoline(FunctionHook->Trampoline);
+		OsFreeNonpagedMemory(FunctionHook);
+	}
+
+	KeSignalCallDpcDone(SystemArgument1);
+}
+
+/**
+ * Remove the hook on TargetFunction from every processor while the system keeps running, and free its
+ * trampoline, along with the shadow pages if no other function in the page is hooked. Must be called at
+ * PASSIVE_LEVEL after the hypervisor has launched.
+ * 
+ * Each processor removes its own hook in VMX root through a hypercall, so no processor ever modifies or flushes
+ * the EPT of another. The trampoline is only freed after every processor has unhooked the function, but a thread
+ * which entered the hook function earlier can still call it afterwards. The caller must make sure that no such
+ * thread is left, for example by having the hook function hold a rundown reference while it runs.
+ */
+BOOL HvEptRemovePageHookOnAllProcessors(PVMM_CONTEXT GlobalContext, PVOID TargetFunction)
+{
+	VMM_EPT_REMOVE_HOOK_REQUEST Request;
+
+	Request.GlobalContext = GlobalContext;
+	Request.PhysicalAddress = (SIZE_T)OsVirtualToPhysical(TargetFunction);
+	Request.RemovedCount = 0;
+
+	if (!Request.PhysicalAddress)
+	{
+		HvUtilLogError("HvEptRemovePageHookOnAllProcessors: Target address could not be mapped to physical memory!\n");
+		return FALSE;
+	}
+
+	KeGenericCallDpc(HvEptpRemovePageHookDpc, (PVOID)&Request);
+
+	if (Request.RemovedCount == 0)
+	{
+		HvUtilLogError("HvEptRemovePageHookOnAllProcessors: Function at 0x%llX was not hooked.\n", Request.PhysicalAddress);
+		return FALSE;
+	}
+
+	HvUtilLog("Removed hook on 0x%llX from %d processors.\n", Request.PhysicalAddress, Request.RemovedCount);
+
+	return TRUE;
+}
+
+/**
+ * Begin a hook transaction, which hooks any number of functions on every processor with a single broadcast. Add
+ * functions with HvEptAddHookToTransaction, then install all of them with HvEptCommitHookTransaction or drop them
+ * with HvEptAbortHookTransaction.
+ * 
+ * Must be called at PASSIVE_LEVEL. No hook may be added or removed by other means until the transaction is
+ * committed or aborted.
+ */
+PVMM_EPT_HOOK_TRANSACTION HvEptBeginHookTransaction(PVMM_CONTEXT GlobalContext)
+{
+	PVMM_EPT_HOOK_TRANSACTION Transaction;
+
+	Transaction = (PVMM_EPT_HOOK_TRANSACTION)OsAllocateNonpagedMemory(sizeof(VMM_EPT_HOOK_TRANSACTION));
+
+	if (!Transaction)
+	{
+		HvUtilLogError("HvEptBeginHookTransaction: Could not allocate memory for transaction.\n");
+		return NULL;
+	}
+
+	OsZeroMemory(Transaction, sizeof(VMM_EPT_HOOK_TRANSACTION));
+
+	Transaction->GlobalContext = GlobalContext;
+	InitializeListHead(&Transaction->TransactionPageList);
+
+	return Transaction;
+}
+
+/**
+ * Remove a page from a transaction if no function was added to it.
+ */
+VOID HvEptpDropEmptyTransactionPage(PVMM_EPT_HOOK_TRANSACTION Transaction, PVMM_EPT_HOOK_TRANSACTION_PAGE Page)
+{
+	if (Page->FunctionCount != 0)
+	{
+		return;
+	}
+
+	RemoveEntryList(&Page->TransactionPageList);
+	Transaction->PageCount--;
+
+	OsFreeNonpagedMemory(Page->Targets[0].PageHook);
+	OsFreeNonpagedMemory(Page);
+}
+
+/**
+ * Add a hook on TargetFunction to Transaction, which HvEptCommitHookTransaction installs on every processor as
+ * HvEptAddPageHookEx would. OrigFunction receives a trampoline which calls the original function.
+ * 
+ * The shadow page of each page is patched here, only once for all processors, on the page hook of processor 0.
+ * Committing copies it for every other processor.
+ */
+BOOL HvEptAddHookToTransaction(PVMM_EPT_HOOK_TRANSACTION Transaction, PVOID TargetFunction, PVOID HookFunction, PVOID* OrigFunction, VMM_EPT_HOOK_STRATEGY Strategy)
+{
+	PVMM_EPT_HOOK_TRANSACTION_PAGE Page;
+	PVMM_EPT_HOOK_TRANSACTION_FUNCTION Function;
+	PVMM_EPT_FUNCTION_HOOK FunctionHook;
+	PVMM_EPT_PAGE_HOOK Template;
+	SIZE_T ProcessorCount;
+	SIZE_T PhysicalAddress;
+	PVOID VirtualTarget;
+
+	ProcessorCount = Transaction->GlobalContext->ProcessorCount;
+
+	VirtualTarget = PAGE_ALIGN(TargetFunction);
+
+	PhysicalAddress = (SIZE_T)OsVirtualToPhysical(VirtualTarget);
+
+	if (!PhysicalAddress)
+	{
+		HvUtilLogError("HvEptAddHookToTransaction: Target address could not be mapped to physical memory!\n");
+		return FALSE;
+	}
+
+	if (!HvEptResolveHookStrategy(Transaction->GlobalContext, &Strategy))
+	{
+		return FALSE;
+	}
+
+	/* Functions within the same page share the page of the transaction */
+	Page = NULL;
+	FOR_EACH_LIST_ENTRY(Transaction, TransactionPageList, VMM_EPT_HOOK_TRANSACTION_PAGE, Candidate)
+		if (Candidate->PhysicalBaseAddress == PhysicalAddress)
+		{
+			Page = Candidate;
+			break;
+		}
+	FOR_EACH_LIST_ENTRY_END();
+
+	if (!Page)
+	{
+		Page = (PVMM_EPT_HOOK_TRANSACTION_PAGE)OsAllocateNonpagedMemory(
+			FIELD_OFFSET(VMM_EPT_HOOK_TRANSACTION_PAGE, Targets) + ProcessorCount * sizeof(VMM_EPT_HOOK_TRANSACTION_TARGET));
+
+		if (!Page)
+		{
+			HvUtilLogError("HvEptAddHookToTransaction: Could not allocate memory for transaction page.\n");
+			return FALSE;
+		}
+
+		OsZeroMemory(Page, FIELD_OFFSET(VMM_EPT_HOOK_TRANSACTION_PAGE, Targets) + ProcessorCount * sizeof(VMM_EPT_HOOK_TRANSACTION_TARGET));
+
+		Page->PhysicalBaseAddress = PhysicalAddress;
+		InitializeListHead(&Page->TransactionFunctionList);
+
+		Page->Targets[0].PageHook = HvEptAllocatePageHook(VirtualTarget, PhysicalAddress, Strategy);
+
+		if (!Page->Targets[0].PageHook)
+		{
+			OsFreeNonpagedMemory(Page);
+			return FALSE;
+		}
+
+		InsertTailList(&Transaction->TransactionPageList, &Page->TransactionPageList);
+		Transaction->PageCount++;
+	}
+
+	Template = Page->Targets[0].PageHook;
+
+	if (Template->RequestedStrategy != Strategy)
+	{
+		HvUtilLogError("HvEptAddHookToTransaction: Page 0x%llX is already in the transaction with a different strategy.\n", PhysicalAddress);
+		return FALSE;
+	}
+
+	Function = (PVMM_EPT_HOOK_TRANSACTION_FUNCTION)OsAllocateNonpagedMemory(
+		FIELD_OFFSET(VMM_EPT_HOOK_TRANSACTION_FUNCTION, FunctionHooks) + ProcessorCount * sizeof(PVMM_EPT_FUNCTION_HOOK));
+	FunctionHook = (PVMM_EPT_FUNCTION_HOOK)OsAllocateNonpagedMemory(sizeof(VMM_EPT_FUNCTION_HOOK));
+
+	if (!Function || !FunctionHook)
+	{
+		HvUtilLogError("HvEptAddHookToTransaction: Could not allocate memory for new function hook.\n");
+	}
+	else
+	{
+		OsZeroMemory(Function, FIELD_OFFSET(VMM_EPT_HOOK_TRANSACTION_FUNCTION, FunctionHooks) + ProcessorCount * sizeof(PVMM_EPT_FUNCTION_HOOK));
+		OsZeroMemory(FunctionHook, sizeof(VMM_EPT_FUNCTION_HOOK));
+
+		if (HvEptHookInstructionMemory(Transaction->GlobalContext, Template, FunctionHook, TargetFunction, HookFunction, OrigFunction))
+		{
+			InsertTailList(&Template->FunctionHookList, &FunctionHook->FunctionHookList);
+			Template->FunctionHookCount++;
+
+			Function->OrigFunction = OrigFunction;
+			Function->FunctionHooks[0] = FunctionHook;
+
+			InsertTailList(&Page->TransactionFunctionList, &Function->TransactionFunctionList);
+			Page->FunctionCount++;
+			Transaction->FunctionCount++;
+
+			return TRUE;
+		}
+
+		HvUtilLogError("HvEptAddHookToTransaction: Could not build hook.\n");
+	}
+
+	if (Function)
+	{
+		OsFreeNonpagedMemory(Function);
+	}
+
+	if (FunctionHook)
+	{
+		OsFreeNonpagedMemory(FunctionHook);
+	}
+
+	HvEptpDropEmptyTransactionPage(Transaction, Page);
+
+	return FALSE;
+}
+
+/**
+ * Copy the page hook of processor 0 in a transaction page for the processor ProcessorNumber. Its function hooks
+ * share the trampolines of processor 0.
+ */
+BOOL HvEptpCloneTransactionPage(PVMM_EPT_HOOK_TRANSACTION_PAGE Page, SIZE_T ProcessorNumber)
+{
+	PVMM_EPT_PAGE_HOOK PageHook;
+	PVMM_EPT_FUNCTION_HOOK FunctionHook;
+
+	PageHook = (PVMM_EPT_PAGE_HOOK)OsAllocateNonpagedMemory(sizeof(VMM_EPT_PAGE_HOOK));
+
+	if (!PageHook)
+	{
+		return FALSE;
+	}
+
+	RtlCopyMemory(PageHook, Page->Targets[0].PageHook, sizeof(VMM_EPT_PAGE_HOOK));
+
+	/* Translated here, as the copy is bound from VMX root */
+	if (!HvEptInitializeShadowPages(PageHook))
+	{
+		OsFreeNonpagedMemory(PageHook);
+		return FALSE;
+	}
+
+	/* The shadow page already carries the patch of every function */
+	RtlCopyMemory(PageHook->FakePage, Page->Targets[0].PageHook->FakePage, PAGE_SIZE);
+
+	InitializeListHead(&PageHook->FunctionHookList);
+	PageHook->FunctionHookCount = 0;
+
+	Page->Targets[ProcessorNumber].PageHook = PageHook;
+
+	FOR_EACH_LIST_ENTRY(Page, TransactionFunctionList, VMM_EPT_HOOK_TRANSACTION_FUNCTION, Function)
+		FunctionHook = (PVMM_EPT_FUNCTION_HOOK)OsAllocateNonpagedMemory(sizeof(VMM_EPT_FUNCTION_HOOK));
+
+		if (!FunctionHook)
+		{
+			return FALSE;
+		}
+
+		RtlCopyMemory(FunctionHook, Function->FunctionHooks[0], sizeof(VMM_EPT_FUNCTION_HOOK));
+
+		HvEptReferenceTrampoline(FunctionHook->Trampoline);
+
+		FunctionHook->PageHook = PageHook;
+		InsertTailList(&PageHook->FunctionHookList, &FunctionHook->FunctionHookList);
+		PageHook->FunctionHookCount++;
+
+		Function->FunctionHooks[ProcessorNumber] = FunctionHook;
+	FOR_EACH_LIST_ENTRY_END();
+
+	return TRUE;
+}
+
+/**
+ * Move the function hooks of NewHook, prepared for a page which this processor already hooks, into ExistingHook
+ * and switch in a shadow page which carries their patches too. NewHook is left empty. Fails without changing
+ * anything if the page is hooked with a different strategy or a patch would overlap one already in the page.
+ * 
+ * The caller must flush the EPT of the processor before ExistingHook changes again.
+ */
+BOOL HvEptMergePageHook(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_PAGE_HOOK ExistingHook, PVMM_EPT_PAGE_HOOK NewHook)
+{
+	PVMM_EPT_FUNCTION_HOOK FunctionHook;
+
+	if (ExistingHook->RequestedStrategy != NewHook->RequestedStrategy)
+	{
+		HvUtilLogError("HvEptMergePageHook: Page 0x%llX is already hooked with a different strategy.\n", ExistingHook->PhysicalBaseAddress);
+		return FALSE;
+	}
+
+	FOR_EACH_LIST_ENTRY(NewHook, FunctionHookList, VMM_EPT_FUNCTION_HOOK, NewFunctionHook)
+		if (HvEptIsPatchOverlapping(ExistingHook, NewFunctionHook->OffsetIntoPage, NewFunctionHook->PatchSize))
+		{
+			return FALSE;
+		}
+	FOR_EACH_LIST_ENTRY_END();
+
+	RtlCopyMemory(ExistingHook->SparePage, ExistingHook->FakePage, PAGE_SIZE);
+
+	while (!IsListEmpty(&NewHook->FunctionHookList))
+	{
+		FunctionHook = CONTAINING_RECORD(RemoveHeadList(&NewHook->FunctionHookList), VMM_EPT_FUNCTION_HOOK, FunctionHookList);
+		NewHook->FunctionHookCount--;
+
+		RtlCopyMemory(&ExistingHook->SparePage[FunctionHook->OffsetIntoPage], &NewHook->FakePage[FunctionHook->OffsetIntoPage], FunctionHook->PatchSize);
+
+		FunctionHook->PageHook = ExistingHook;
+		InsertTailList(&ExistingHook->FunctionHookList, &FunctionHook->FunctionHookList);
+		ExistingHook->FunctionHookCount++;
+	}
+
+	HvEptSwitchShadowPage(ProcessorContext, ExistingHook);
+
+	return TRUE;
+}
+
+/**
+ * Apply every page of Transaction to the EPT of this processor, whose number is ProcessorNumber. Called from VMX
+ * root by the VmmHypercallCommitHookTransaction hypercall.
+ * 
+ * A page which the processor does not hook yet gets the page hook prepared for it bound and installed. A page which
+ * it already hooks takes the new function hooks into its existing page hook instead, leaving the prepared one empty.
+ * Nothing is allocated or freed here, and the processor flushes its EPT only once for the whole transaction.
+ * 
+ * Returns the number of pages applied.
+ */
+SIZE_T HvEptApplyHookTransaction(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_HOOK_TRANSACTION Transaction, SIZE_T ProcessorNumber)
+{
+	PVMM_EPT_HOOK_TRANSACTION_TARGET Target;
+	PVMM_EPT_PAGE_HOOK ExistingHook;
+	SIZE_T AppliedCount;
+
+	if (ProcessorNumber >= Transaction->GlobalContext->ProcessorCount
+		|| Transaction->GlobalContext->AllProcessorContexts[ProcessorNumber] != ProcessorContext)
 	{
+		HvUtilLogError("HvEptApplyHookTransaction: Processor number %lld is not this processor.\n", ProcessorNumber);
+		return 0;
+	}
 
-		ProbeForRead(ObjectAttributes, sizeof(OBJECT_ATTRIBUTES), 1);
-		ProbeForRead(ObjectAttributes->ObjectName, sizeof(UNICODE_STRING), 1);
+	AppliedCount = 0;
 
-		NameBuffer = ObjectAttributes->ObjectName->Buffer;
-		NameLength = ObjectAttributes->ObjectName->Length;
+	FOR_EACH_LIST_ENTRY(Transaction, TransactionPageList, VMM_EPT_HOOK_TRANSACTION_PAGE, Page)
+		Target = &Page->Targets[ProcessorNumber];
 
-		ProbeForRead(NameBuffer, NameLength, 1);
+		ExistingHook = HvEptHookIndexLookup(&ProcessorContext->EptPageTable->HookIndex, Page->PhysicalBaseAddress);
 
-		/* Convert to length in WCHARs */
-		NameLength /= sizeof(WCHAR);
+		if (ExistingHook)
+		{
+			Target->Applied = HvEptMergePageHook(ProcessorContext, ExistingHook, Target->PageHook);
+		}
+		else if (HvEptBindPageHook(ProcessorContext, Target->PageHook))
+		{
+			Target->Applied = HvEptInstallPageHook(ProcessorContext, Target->PageHook);
 
-		/* Does the file path (ignoring case and null terminator) end with our blocked file name? */
-		if (NameLength >= BlockedFileNameLength && 
-			_wcsnicmp(&NameBuffer[NameLength - BlockedFileNameLength], BlockedFileName, BlockedFileNameLength) == 0)
+			/* Give back the splits made for a hook that will never be installed, as HvEptCommitEditBatch does */
+			if (!Target->Applied)
+			{
+				HvEptUnbindPageHook(ProcessorContext, Target->PageHook);
+			}
+		}
+		else
 		{
-			HvUtilLogSuccess("Blocked access to %ws\n", BlockedFileName);
-			return STATUS_ACCESS_DENIED;
+			Target->Applied = FALSE;
 		}
-	}
-	__except (EXCEPTION_EXECUTE_HANDLER)
+
+		if (Target->Applied)
+		{
+			AppliedCount++;
+		}
+	FOR_EACH_LIST_ENTRY_END();
+
+	/* One flush covers every entry installed above */
+	if (AppliedCount != 0)
 	{
-		NOTHING;
+		HvEptInvalidateProcessor(ProcessorContext);
 	}
 
-	return NtCreateFileOrig(FileHandle, DesiredAccess, ObjectAttributes, IoStatusBlock, AllocationSize, FileAttributes,
-		ShareAccess, CreateDisposition, CreateOptions, EaBuffer, EaLength);
+	return AppliedCount;
 }
 
-
 /**
- * Initialize EPT for an individual logical processor.
+ * Undo every page of Transaction which this processor, whose number is ProcessorNumber, applied. Called from VMX
+ * root by the VmmHypercallRollBackHookTransaction hypercall once a commit did not reach every processor.
+ * 
+ * Each function of the transaction is removed with HvEptRemovePageHook, which gives a page the transaction hooked its
+ * original entry back and puts the original instructions back in a page it merged into. The removed function hooks
+ * go back to the page hook prepared for the processor, which is marked as not applied so that
+ * HvEptpFinishHookTransaction frees them along with it.
  * 
- * Creates an identity mapped page table and sets up an EPTP to be applied to the VMCS later.
+ * Returns the number of pages rolled back.
  */
-BOOL HvEptLogicalProcessorInitialize(PVMM_PROCESSOR_CONTEXT ProcessorContext)
+SIZE_T HvEptRollBackHookTransaction(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_HOOK_TRANSACTION Transaction, SIZE_T ProcessorNumber)
 {
-	PVMM_EPT_PAGE_TABLE PageTable;
-	EPT_POINTER EPTP;
-
-	/* Allocate the identity mapped page table*/
-	PageTable = HvEptAllocateAndCreateIdentityPageTable(ProcessorContext->GlobalContext);
-	if (PageTable == NULL)
+	PVMM_EPT_HOOK_TRANSACTION_TARGET Target;
+	PVMM_EPT_HOOK_TRANSACTION_FUNCTION Function;
+	PVMM_EPT_FUNCTION_HOOK FunctionHook;
+	PLIST_ENTRY FunctionEntry;
+	LIST_ENTRY RemovedList;
+	SIZE_T RolledBackCount;
+
+	if (ProcessorNumber >= Transaction->GlobalContext->ProcessorCount
+		|| Transaction->GlobalContext->AllProcessorContexts[ProcessorNumber] != ProcessorContext)
 	{
-		HvUtilLogError("Unable to allocate memory for EPT!\n");
-		return FALSE;
+		HvUtilLogError("HvEptRollBackHookTransaction: Processor number %lld is not this processor.\n", ProcessorNumber);
+		return 0;
 	}
 
-	/* Virtual address to the page table to keep track of it for later freeing */
-	ProcessorContext->EptPageTable = PageTable;
+	RolledBackCount = 0;
 
-	EPTP.Flags = 0;
+	FOR_EACH_LIST_ENTRY(Transaction, TransactionPageList, VMM_EPT_HOOK_TRANSACTION_PAGE, Page)
+		Target = &Page->Targets[ProcessorNumber];
 
-	/* For performance, we let the processor know it can cache the EPT. */
-	EPTP.MemoryType = MEMORY_TYPE_WRITE_BACK;
+		if (!Target->Applied)
+		{
+			continue;
+		}
 
-	/* We are not utilizing the 'access' and 'dirty' flag features. */
-	EPTP.EnableAccessAndDirtyFlags = FALSE;
+		/* Kept apart until the whole page is done, so the page hook is removed along with its last function */
+		InitializeListHead(&RemovedList);
 
-	/* 
-	 * Bits 5:3 (1 less than the EPT page-walk length) must be 3, indicating an EPT page-walk length of 4; 
-	 * see Section 28.2.2 
-	 */
-	EPTP.PageWalkLength = 3;
+		/* Not FOR_EACH_LIST_ENTRY, whose loop variable would shadow the one of the loop over the pages */
+		for (FunctionEntry = Page->TransactionFunctionList.Flink; FunctionEntry != &Page->TransactionFunctionList; FunctionEntry = FunctionEntry->Flink)
+		{
+			Function = CONTAINING_RECORD(FunctionEntry, VMM_EPT_HOOK_TRANSACTION_FUNCTION, TransactionFunctionList);
 
-	/* The physical page number of the page table we will be using */
-	EPTP.PageFrameNumber = (SIZE_T)OsVirtualToPhysical(&PageTable->PML4) / PAGE_SIZE;
+			FunctionHook = HvEptRemovePageHook(ProcessorContext,
+				Page->PhysicalBaseAddress + Function->FunctionHooks[ProcessorNumber]->OffsetIntoPage);
 
-	/* We will write the EPTP to the VMCS later */
-	ProcessorContext->EptPointer.Flags = EPTP.Flags;
+			if (FunctionHook)
+			{
+				InsertTailList(&RemovedList, &FunctionHook->FunctionHookList);
+			}
+		}
 
-	/*
-	 * On each logical processor, create an EPT hook on NtCreateFile to intercept the system call.
-	 */
-	if (!HvEptAddPageHook(ProcessorContext, (PVOID)NtCreateFile, (PVOID)NtCreateFileHook, (PVOID*)&NtCreateFileOrig))
-	{
-		HvUtilLogError("Failed to build page hook for NtCreateFile");
-		HvEptFreeLogicalProcessorContext(ProcessorContext);
-		return FALSE;
-	}
+		while (!IsListEmpty(&RemovedList))
+		{
+			FunctionHook = CONTAINING_RECORD(RemoveHeadList(&RemovedList), VMM_EPT_FUNCTION_HOOK, FunctionHookList);
 
-	return TRUE;
+			FunctionHook->PageHook = Target->PageHook;
+			InsertTailList(&Target->PageHook->FunctionHookList, &FunctionHook->FunctionHookList);
+			Target->PageHook->FunctionHookCount++;
+		}
+
+		Target->Applied = FALSE;
+		RolledBackCount++;
+	FOR_EACH_LIST_ENTRY_END();
+
+	return RolledBackCount;
 }
 
-/*
- * Free memory allocated by EPT functions.
+/**
+ * DPC run on every processor by HvEptCommitHookTransaction.
  */
-VOID HvEptFreeLogicalProcessorContext(PVMM_PROCESSOR_CONTEXT ProcessorContext)
+VOID NTAPI HvEptpCommitHookTransactionDpc(_In_ struct _KDPC *Dpc,
+	_In_opt_ PVOID DeferredContext,
+	_In_opt_ PVOID SystemArgument1,
+	_In_opt_ PVOID SystemArgument2)
 {
-	if (ProcessorContext->EptPageTable)
-	{
-		/* No races because we are above DPC IRQL */
+	PVMM_EPT_HOOK_TRANSACTION Transaction;
+	SIZE_T AppliedCount;
+
+	UNREFERENCED_PARAMETER(Dpc);
 
-		/* Free each split */
-		FOR_EACH_LIST_ENTRY(ProcessorContext->EptPageTable, DynamicSplitList, VMM_EPT_DYNAMIC_SPLIT, Split)
-			OsFreeNonpagedMemory(Split);
-		FOR_EACH_LIST_ENTRY_END();
+	Transaction = (PVMM_EPT_HOOK_TRANSACTION)DeferredContext;
 
-		/* Free each page hook */
-		FOR_EACH_LIST_ENTRY(ProcessorContext->EptPageTable, PageHookList, VMM_EPT_PAGE_HOOK, Hook)
-			OsFreeNonpagedMemory(Hook->Trampoline);
-			OsFreeNonpagedMemory(Hook);
-		FOR_EACH_LIST_ENTRY_END();
+	/* Have the hypervisor apply the transaction to this processor's EPT. VMCALL is undefined outside of VMX. */
+	AppliedCount = 0;
+	if (HvGetCurrentCPUContext(Transaction->GlobalContext)->HasLaunched)
+	{
+		AppliedCount = __vmcall(VmmHypercallCommitHookTransaction, (SIZE_T)Transaction, OsGetCurrentProcessorNumber());
+	}
 
-		/* Free the actual page table */
-		OsFreeContiguousAlignedPages(ProcessorContext->EptPageTable);
+	if (AppliedCount == Transaction->PageCount)
+	{
+		InterlockedIncrement(&Transaction->CommittedCount);
 	}
+
+	/* Release every processor at once, so the hooks take effect on all of them at the same point */
+	KeSignalCallDpcSynchronize(SystemArgument2);
+
+	KeSignalCallDpcDone(SystemArgument1);
 }
 
-/* Write an absolute x64 jump to an arbitrary address to a buffer. */
-VOID HvEptHookWriteAbsoluteJump(PCHAR TargetBuffer, SIZE_T TargetAddress)
+/**
+ * DPC run on every processor by HvEptCommitHookTransaction when the transaction did not commit on all of them.
+ */
+VOID NTAPI HvEptpRollBackHookTransactionDpc(_In_ struct _KDPC *Dpc,
+	_In_opt_ PVOID DeferredContext,
+	_In_opt_ PVOID SystemArgument1,
+	_In_opt_ PVOID SystemArgument2)
 {
-    /**
-     *   Use 'push ret' instead of 'jmp qword[rip+0]',
-     *   Because 'jmp qword[rip+0]' will read hooked page 8bytes.
-     *
-     *   14 bytes hook:
-     *   0x68 0x12345678 ......................push 'low 32bit of TargetAddress'
-     *   0xC7 0x44 0x24 0x04 0x12345678........mov dword[rsp + 4], 'high 32bit of TargetAddress'
-     *   0xC3..................................ret
-     */
+	PVMM_EPT_HOOK_TRANSACTION Transaction;
 
-    UINT32  Low32;
-    UINT32  High32;
+	UNREFERENCED_PARAMETER(Dpc);
 
-    Low32 = (UINT32)TargetAddress;
-    High32 = (UINT32)(TargetAddress >> 32);
+	Transaction = (PVMM_EPT_HOOK_TRANSACTION)DeferredContext;
 
-    /* push 'low 32bit of TargetAddress' */
-    TargetBuffer[0] = 0x68;
-    *((UINT32*)&TargetBuffer[1]) = Low32;
+	/* A processor which has not launched applied nothing. VMCALL is undefined outside of VMX. */
+	if (HvGetCurrentCPUContext(Transaction->GlobalContext)->HasLaunched)
+	{
+		__vmcall(VmmHypercallRollBackHookTransaction, (SIZE_T)Transaction, OsGetCurrentProcessorNumber());
+	}
 
-    /* mov dword[rsp + 4], 'high 32bit of TargetAddress' */
-    *((UINT32*)&TargetBuffer[5]) = 0x042444C7;
-    *((UINT32*)&TargetBuffer[9]) = High32;
+	KeSignalCallDpcSynchronize(SystemArgument2);
 
-    /* ret */
-    TargetBuffer[13] = 0xC3;
+	KeSignalCallDpcDone(SystemArgument1);
 }
 
-
-BOOL HvEptHookInstructionMemory(PVMM_EPT_PAGE_HOOK Hook, PVOID TargetFunction, PVOID HookFunction, PVOID* OrigFunction)
+/**
+ * Free a transaction once the processors are done with it.
+ * 
+ * A page hook which a processor applied now belongs to that processor, unless it was left empty. Every other page
+ * hook is freed along with its function hooks. Each function gets its trampoline if any processor hooked it, or
+ * NULL if none did.
+ */
+VOID HvEptpFinishHookTransaction(PVMM_EPT_HOOK_TRANSACTION Transaction)
 {
-	SIZE_T SizeOfHookedInstructions;
-	SIZE_T OffsetIntoPage;
+	PVMM_EPT_HOOK_TRANSACTION_PAGE Page;
+	PVMM_EPT_HOOK_TRANSACTION_FUNCTION Function;
+	PVMM_EPT_HOOK_TRANSACTION_TARGET Target;
+	SIZE_T ProcessorCount;
+	SIZE_T ProcessorNumber;
 
-	OffsetIntoPage = ADDRMASK_EPT_PML1_OFFSET((SIZE_T)TargetFunction);
-	HvUtilLogDebug("OffsetIntoPage: 0x%llx\n", OffsetIntoPage);
+	ProcessorCount = Transaction->GlobalContext->ProcessorCount;
 
-	if ((OffsetIntoPage + 14) > PAGE_SIZE-1)
+	while (!IsListEmpty(&Transaction->TransactionPageList))
 	{
-		HvUtilLogError("Function extends past a page boundary. We just don't have the technology to solve this.....\n");
-		return FALSE;
-	}
+		Page = CONTAINING_RECORD(RemoveHeadList(&Transaction->TransactionPageList), VMM_EPT_HOOK_TRANSACTION_PAGE, TransactionPageList);
 
-	/* Determine the number of instructions necessary to overwrite using Length Disassembler Engine */
-	for(SizeOfHookedInstructions = 0; 
-		SizeOfHookedInstructions < 14; 
-		SizeOfHookedInstructions += LDE((PCHAR)TargetFunction + SizeOfHookedInstructions, 64))
-	{
-		// Get the full size of instructions necessary to copy
-	}
+		for (ProcessorNumber = 0; ProcessorNumber < ProcessorCount; ProcessorNumber++)
+		{
+			Target = &Page->Targets[ProcessorNumber];
 
-	HvUtilLogDebug("Number of bytes of instruction mem: %d\n", SizeOfHookedInstructions);
+			if (!Target->PageHook || (Target->Applied && Target->PageHook->FunctionHookCount != 0))
+			{
+				continue;
+			}
 
-	/* Build a trampoline */
-	
-	/* Allocate some executable memory for the trampoline */
-	Hook->Trampoline = OsAllocateExecutableNonpagedMemory(SizeOfHookedInstructions + 14);
+			/* The trampolines of a page hook which was not applied are freed with it */
+			if (!Target->Applied)
+			{
+				FOR_EACH_LIST_ENTRY(Page, TransactionFunctionList, VMM_EPT_HOOK_TRANSACTION_FUNCTION, Candidate)
+					Candidate->FunctionHooks[ProcessorNumber] = NULL;
+				FOR_EACH_LIST_ENTRY_END();
+			}
 
-	if (!Hook->Trampoline)
-	{
-		HvUtilLogError("Could not allocate trampoline function buffer.\n");
-		return FALSE;
-	}
+			HvEptFreePageHook(Target->PageHook);
+		}
 
-	/* Copy the trampoline instructions in. */
-	RtlCopyMemory(Hook->Trampoline, TargetFunction, SizeOfHookedInstructions);
+		while (!IsListEmpty(&Page->TransactionFunctionList))
+		{
+			Function = CONTAINING_RECORD(RemoveHeadList(&Page->TransactionFunctionList), VMM_EPT_HOOK_TRANSACTION_FUNCTION, TransactionFunctionList);
 
-	/* Add the absolute jump back to the original function. */
-	HvEptHookWriteAbsoluteJump(&Hook->Trampoline[SizeOfHookedInstructions], (SIZE_T)TargetFunction + SizeOfHookedInstructions);
+			*Function->OrigFunction = NULL;
 
-	HvUtilLogDebug("Trampoline: 0x%llx\n", Hook->Trampoline);
-	HvUtilLogDebug("HookFunction: 0x%llx\n", HookFunction);
+			for (ProcessorNumber = 0; ProcessorNumber < ProcessorCount; ProcessorNumber++)
+			{
+				if (Function->FunctionHooks[ProcessorNumber])
+				{
+					*Function->OrigFunction = Function->FunctionHooks[ProcessorNumber]->Trampoline->Code;
+					break;
+				}
+			}
 
-	/* Let the hook function call the original function */
-	*OrigFunction = Hook->Trampoline;
+			OsFreeNonpagedMemory(Function);
+		}
 
-	/* Write the absolute jump to our shadow page memory to jump to our hook. */
-	HvEptHookWriteAbsoluteJump(&Hook->FakePage[OffsetIntoPage], (SIZE_T)HookFunction);
+		OsFreeNonpagedMemory(Page);
+	}
 
-	return TRUE;
+	OsFreeNonpagedMemory(Transaction);
 }
 
-
-BOOL HvEptAddPageHook(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVOID TargetFunction, PVOID HookFunction, PVOID* OrigFunction)
+/**
+ * Install every hook of Transaction on every processor with a single broadcast, then free the transaction. Must be
+ * called at PASSIVE_LEVEL after the hypervisor has launched.
+ * 
+ * Everything the processors need is allocated up front, as nothing can be allocated in VMX root. Each processor then
+ * applies every page with one hypercall and flushes its EPT once, where adding the hooks one by one would take a
+ * broadcast and a flush per function.
+ * 
+ * Returns TRUE if every processor applied every page. Otherwise every processor takes back the pages it did apply,
+ * so that no function is left hooked on only some of them, and every hook of the transaction is freed. A thread
+ * which entered a hook function in the meantime can still call its trampoline, as with
+ * HvEptRemovePageHookOnAllProcessors.
+ */
+BOOL HvEptCommitHookTransaction(PVMM_EPT_HOOK_TRANSACTION Transaction)
 {
-	PVMM_EPT_PAGE_HOOK NewHook;
-	EPT_PML1_ENTRY FakeEntry;
-	EPT_PML1_ENTRY OriginalEntry;
-	INVEPT_DESCRIPTOR Descriptor;
-	SIZE_T PhysicalAddress;
-	PVOID VirtualTarget;
+	PVMM_CONTEXT GlobalContext;
+	LARGE_INTEGER Frequency;
+	LARGE_INTEGER Start;
+	LARGE_INTEGER End;
+	SIZE_T ProcessorNumber;
+	BOOL Success;
+
+	GlobalContext = Transaction->GlobalContext;
+
+	/* Copy the page hooks of processor 0 for every other processor */
+	FOR_EACH_LIST_ENTRY(Transaction, TransactionPageList, VMM_EPT_HOOK_TRANSACTION_PAGE, Page)
+		for (ProcessorNumber = 1; ProcessorNumber < GlobalContext->ProcessorCount; ProcessorNumber++)
+		{
+			if (!HvEptpCloneTransactionPage(Page, ProcessorNumber))
+			{
+				HvUtilLogError("HvEptCommitHookTransaction: Could not allocate page hook of 0x%llX for processor %lld.\n", Page->PhysicalBaseAddress, ProcessorNumber);
+				HvEptpFinishHookTransaction(Transaction);
+				return FALSE;
+			}
+		}
+	FOR_EACH_LIST_ENTRY_END();
 
-	/* Translate the page from a physical address to virtual so we can read its memory. 
-	 * This function will return NULL if the physical address was not already mapped in
-	 * virtual memory.
-	 */
-	VirtualTarget = PAGE_ALIGN(TargetFunction);
+	Start = KeQueryPerformanceCounter(&Frequency);
 
-	PhysicalAddress = (SIZE_T) OsVirtualToPhysical(VirtualTarget);
+	KeGenericCallDpc(HvEptpCommitHookTransactionDpc, (PVOID)Transaction);
 
-	if(!PhysicalAddress)
-	{
-		HvUtilLogError("HvEptAddPageHook: Target address could not be mapped to physical memory!\n");
-		return FALSE;
-	}
+	End = KeQueryPerformanceCounter(NULL);
 
-	/* Create a hook object*/
-	NewHook = (PVMM_EPT_PAGE_HOOK) OsAllocateNonpagedMemory(sizeof(VMM_EPT_PAGE_HOOK));
+	Success = ((SIZE_T)Transaction->CommittedCount == GlobalContext->ProcessorCount);
 
-	if (!NewHook)
-	{
-		HvUtilLogError("HvEptAddPageHook: Could not allocate memory for new hook.\n");
-		return FALSE;
-	}
+	HvUtilLog("EPT: Committed %lld function hooks in %lld pages on %d of %lld processors in %lld us.\n",
+		Transaction->FunctionCount, Transaction->PageCount, Transaction->CommittedCount, GlobalContext->ProcessorCount,
+		((End.QuadPart - Start.QuadPart) * 1000000) / Frequency.QuadPart);
 
-	/* 
-	 * Ensure the page is split into 512 4096 byte page entries. We can only hook a 4096 byte page, not a 2MB page.
-	 * This is due to performance hit we would get from hooking a 2MB page.
-	 */
-	if (!HvEptSplitLargePage(ProcessorContext, PhysicalAddress))
+	if (!Success)
 	{
-		HvUtilLogError("HvEptAddPageHook: Could not split page for address 0x%llX.\n", PhysicalAddress);
-		OsFreeNonpagedMemory(NewHook);
-		return FALSE;
+		HvUtilLogError("HvEptCommitHookTransaction: Not every processor applied the transaction, rolling it back.\n");
+		KeGenericCallDpc(HvEptpRollBackHookTransactionDpc, (PVOID)Transaction);
 	}
 
-	/* Zero our newly allocated memory */
-	OsZeroMemory(NewHook, sizeof(VMM_EPT_PAGE_HOOK));
+	HvEptpFinishHookTransaction(Transaction);
 
-	RtlCopyMemory(&NewHook->FakePage[0], VirtualTarget, PAGE_SIZE);
+	return Success;
+}
 
-	/* Base address of the 4096 page. */
-	NewHook->PhysicalBaseAddress = (SIZE_T) PAGE_ALIGN(PhysicalAddress);
+/**
+ * Drop every hook of a transaction which was not committed, and free the transaction. OrigFunction of each of
+ * its functions is set to NULL.
+ */
+VOID HvEptAbortHookTransaction(PVMM_EPT_HOOK_TRANSACTION Transaction)
+{
+	HvEptpFinishHookTransaction(Transaction);
+}
 
-	/* Pointer to the page entry in the page table. */
-	NewHook->TargetPage = HvEptGetPml1Entry(ProcessorContext, PhysicalAddress);
+/**
+ * Count Count swaps in the sliding window of the swap rate of a page hook, and return the number of swaps estimated
+ * to have happened within the last VMM_SETTING_EPT_HOOK_THRASH_WINDOW_CYCLES. Only called by
+ * HvEptAdaptPageHookStrategy.
+ * 
+ * The window slides over two fixed buckets: the count of the previous bucket is weighed by how much of it the
+ * window still covers, which needs no history of individual exits.
+ */
+SIZE_T HvEptCountHookExit(PVMM_EPT_HOOK_STATISTICS Statistics, SIZE_T Count)
+{
+	SIZE_T Now;
+	SIZE_T Elapsed;
 
-	/* Ensure the target is valid. */
-	if (!NewHook->TargetPage)
+	Now = __rdtsc();
+	Elapsed = Now - Statistics->WindowStart;
+
+	if (Elapsed >= VMM_SETTING_EPT_HOOK_THRASH_WINDOW_CYCLES)
 	{
-		HvUtilLogError("HvEptAddPageHook: Failed to get PML1 entry for target address.\n");
-		OsFreeNonpagedMemory(NewHook);
-		return FALSE;
+		/* If more than a whole window went by, the previous bucket saw nothing */
+		Statistics->PreviousWindowCount = (Elapsed < 2 * VMM_SETTING_EPT_HOOK_THRASH_WINDOW_CYCLES) ? Statistics->CurrentWindowCount : 0;
+		Statistics->CurrentWindowCount = 0;
+
+		Elapsed %= VMM_SETTING_EPT_HOOK_THRASH_WINDOW_CYCLES;
+		Statistics->WindowStart = Now - Elapsed;
 	}
 
-	/* Save the original permissions of the page */
-	NewHook->OriginalEntry = *NewHook->TargetPage;
-	OriginalEntry = *NewHook->TargetPage;
+	Statistics->CurrentWindowCount += Count;
 
-	/* Setup the new fake page table entry */
-	FakeEntry.Flags = 0;
+	return Statistics->CurrentWindowCount
+		+ (Statistics->PreviousWindowCount * (VMM_SETTING_EPT_HOOK_THRASH_WINDOW_CYCLES - Elapsed)) / VMM_SETTING_EPT_HOOK_THRASH_WINDOW_CYCLES;
+}
 
-	/* We want this page to raise an EPT violation on RW so we can handle by swapping in the original page. */
-	FakeEntry.ReadAccess = 0;
-	FakeEntry.WriteAccess = 0;
-	FakeEntry.ExecuteAccess = 1;
+/**
+ * Choose whether EPT violations on a page hook exit to the hypervisor, or are raised as #VE in the guest so that its
+ * handler can swap views without an exit. Updates the entries the hook swaps in as well as the ones installed in
+ * each view. Does nothing unless #VE is enabled on the processor.
+ */
+VOID HvEptSetPageHookSuppressVe(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_PAGE_HOOK PageHook, BOOLEAN SuppressVe)
+{
+	if (!ProcessorContext->VeInformation)
+	{
+		return;
+	}
 
-	/* Point to our fake page we just made */
-	FakeEntry.PageFrameNumber = (SIZE_T)OsVirtualToPhysical(&NewHook->FakePage) / PAGE_SIZE;
+	PageHook->HookedEntry.SuppressVe = SuppressVe;
+	PageHook->ShadowEntry.SuppressVe = SuppressVe;
 
-	/* Save a copy of the fake entry. */
-	NewHook->ShadowEntry.Flags = FakeEntry.Flags;
+	/* The original page mapped by the monitor trap strategy is never left for the #VE handler */
+	if (PageHook->TargetPage->Flags != PageHook->MonitorTrapEntry.Flags)
+	{
+		PageHook->TargetPage->SuppressVe = SuppressVe;
+	}
 
-	/* Keep a record of the page hook */
-	InsertHeadList(&ProcessorContext->EptPageTable->PageHookList, &NewHook->PageHookList);
+	if (PageHook->ExecuteTargetPage && PageHook->ExecuteTargetPage->Flags != PageHook->MonitorTrapEntry.Flags)
+	{
+		PageHook->ExecuteTargetPage->SuppressVe = SuppressVe;
+	}
 
-	/* 
-	 * Lastly, mark the entry in the table as no execute. This will cause the next time that an instruction is
-	 * fetched from this page to cause an EPT violation exit. This will allow us to swap in the fake page with our
-	 * hook.
-	 */
-	OriginalEntry.ReadAccess = 1;
-	OriginalEntry.WriteAccess = 1;
-	OriginalEntry.ExecuteAccess = 0;
+	/* A cached translation may still carry the old bit */
+	HvEptInvalidateProcessor(ProcessorContext);
+}
+
+/**
+ * Switch an adaptive page hook to the cheaper strategy for how often it currently swaps. Called on every EPT
+ * violation on the page, exited or forwarded by the #VE handler.
+ * 
+ * This is the only place the swap rate is counted, in swaps: the one of this violation, plus those the fast swap
+ * cache and the #VE handler did since the last one without telling the hypervisor. Under the monitor trap strategy
+ * each read or write counts as the swap it would have needed.
+ * 
+ * Either strategy can take over with any entry installed: the swap strategy handles the shadow page being
+ * installed as usual, and the monitor trap strategy swaps the shadow page back in on the next execution. The hook
+ * is only in the fast swap cache while it swaps.
+ * 
+ * Only the swap strategy is left to the #VE handler, since the monitor trap strategy needs the hypervisor.
+ * 
+ * Called without the IRQL raised, so it is only raised to log a switch, which is rare.
+ */
+VOID HvEptAdaptPageHookStrategy(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext, PVMM_EPT_PAGE_HOOK PageHook)
+{
+	SIZE_T Swaps;
+	SIZE_T Rate;
 
-	/* The hooked entry will be swapped in first. */
-	NewHook->HookedEntry.Flags = OriginalEntry.Flags;
+	Swaps = HvEptpSampleFastSwap(ProcessorContext, PageHook) + PageHook->Statistics.DeferredSwapCount;
+	PageHook->Statistics.DeferredSwapCount = 0;
 
-	if(!HvEptHookInstructionMemory(NewHook, TargetFunction, HookFunction, OrigFunction))
+	Rate = HvEptCountHookExit(&PageHook->Statistics, Swaps);
+
+	if (PageHook->Strategy == VmmEptHookStrategySwap && Rate >= VMM_SETTING_EPT_HOOK_THRASH_HIGH_THRESHOLD)
 	{
-		HvUtilLogError("HvEptAddPageHook: Could not build hook.\n");
-		OsFreeNonpagedMemory(NewHook);
-		return FALSE;
-	}
+		HvEptpFastSwapCacheRemove(ProcessorContext, PageHook->PhysicalBaseAddress);
 
-	/* Apply the hook to EPT */
-	NewHook->TargetPage->Flags = OriginalEntry.Flags;
+		PageHook->Strategy = VmmEptHookStrategyMonitorTrap;
+		PageHook->Statistics.StrategySwitchCount++;
+		HvEptSetPageHookSuppressVe(ProcessorContext, PageHook, TRUE);
 
-	/*
-	 * Invalidate the entry in the TLB caches so it will not conflict with the actual paging structure.
-	 */
-	if (ProcessorContext->HasLaunched)
+		HvExitRaiseIrql(ExitContext);
+		HvUtilLogDebug("EPT: Page hook on 0x%llX is thrashing, switched to monitor trap.\n", PageHook->PhysicalBaseAddress);
+	}
+	else if (PageHook->Strategy == VmmEptHookStrategyMonitorTrap && Rate < VMM_SETTING_EPT_HOOK_THRASH_LOW_THRESHOLD)
 	{
-		Descriptor.EptPointer = ProcessorContext->EptPointer.Flags;
-		Descriptor.Reserved = 0;
-		__invept(1, &Descriptor);
+		PageHook->Strategy = VmmEptHookStrategySwap;
+		PageHook->Statistics.StrategySwitchCount++;
+		HvEptSetPageHookSuppressVe(ProcessorContext, PageHook, FALSE);
+
+		HvEptpFastSwapCacheInsert(ProcessorContext, PageHook);
+
+		HvExitRaiseIrql(ExitContext);
+		HvUtilLogDebug("EPT: Page hook on 0x%llX calmed down, switched to swap.\n", PageHook->PhysicalBaseAddress);
 	}
-	
-	return TRUE;
+}
+
+/**
+ * Get the entry of a page hook that maps the shadow page while the page is executed: its entry in the execute view
+ * if the processor has one, otherwise its only entry.
+ */
+PEPT_PML1_ENTRY HvEptGetShadowTargetPage(PVMM_EPT_PAGE_HOOK PageHook)
+{
+	return PageHook->ExecuteTargetPage ? PageHook->ExecuteTargetPage : PageHook->TargetPage;
 }
 
 /* Check if this exit is due to a violation caused by a currently hooked page. Returns FALSE
@@ -806,6 +4198,8 @@ BOOL HvEptAddPageHook(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVOID TargetFunct
  * 
  * If the memory access attempt was execute and the page was marked not executable, the page is swapped with
  * the hooked page.
+ * 
+ * If the processor has views, the entries stay as they are and the view holding the right page is installed instead.
  */
 BOOL HvExitHandlePageHookExit(
 	PVMM_PROCESSOR_CONTEXT ProcessorContext,
@@ -814,8 +4208,6 @@ BOOL HvExitHandlePageHookExit(
 {
 	PVMM_EPT_PAGE_HOOK PageHook;
 
-	PageHook = NULL;
-
 	/*
 	 * The only kind of EPT violations we should expect are ones related to address translation.
 	 * If this is not one of those, something went terribly wrong with EPT and we need to try
@@ -827,17 +4219,13 @@ BOOL HvExitHandlePageHookExit(
 	}
 
 	/* Resolve the hook if there is one */
-	FOR_EACH_LIST_ENTRY(ProcessorContext->EptPageTable, PageHookList, VMM_EPT_PAGE_HOOK, Hook)
+	PageHook = HvEptHookIndexLookup(&ProcessorContext->EptPageTable->HookIndex, HvExitGetGuestPhysicalAddress(ExitContext));
+
+	/* Views created with HvEptCreateView don't hook the page, so the violation is the view's own */
+	if (PageHook && HvEptIsCustomViewCurrent(ProcessorContext, ExitContext))
 	{
-		/* Check if our access happened inside a page we are currently hooking. */
-		if ( Hook->PhysicalBaseAddress == (SIZE_T)PAGE_ALIGN(ExitContext->GuestPhysicalAddress) )
-		{
-			PageHook = Hook;
-			break;
-		}
+		return FALSE;
 	}
-	FOR_EACH_LIST_ENTRY_END();
-
 
 	/* If a violation happened outside of one of our hooked pages we don't
 	 * want to try to handle it.
@@ -847,6 +4235,38 @@ BOOL HvExitHandlePageHookExit(
 		return FALSE;
 	}
 
+	PageHook->Statistics.ViolationExitCount++;
+
+	if (PageHook->RequestedStrategy == VmmEptHookStrategyAdaptive)
+	{
+		HvEptAdaptPageHookStrategy(ProcessorContext, ExitContext, PageHook);
+	}
+
+	/*
+	 * With the monitor trap strategy the shadow page is always installed, so this is a read or write. Map the
+	 * original page for the one instruction doing it. HvExitHandleMonitorTrapFlag puts the shadow page back.
+	 */
+	if (PageHook->Strategy == VmmEptHookStrategyMonitorTrap
+		&& (ViolationQualification.ReadAccess | ViolationQualification.WriteAccess))
+	{
+		/* An instruction touching several hooked pages leaves each of them mapped until it is done */
+		if (!ProcessorContext->EptPageTable->MonitorTrapHooks)
+		{
+			HvVmcsSetMonitorTrapFlag(ProcessorContext, TRUE);
+		}
+
+		PageHook->NextMonitorTrapHook = ProcessorContext->EptPageTable->MonitorTrapHooks;
+		ProcessorContext->EptPageTable->MonitorTrapHooks = PageHook;
+
+		/* Adding permissions needs no invalidation, the violation already invalidated the faulting translation */
+		HvEptGetShadowTargetPage(PageHook)->Flags = PageHook->MonitorTrapEntry.Flags;
+
+		/* Redo the instruction */
+		ExitContext->ShouldIncrementRIP = FALSE;
+
+		return TRUE;
+	}
+
 	/* If the violation was due to trying to execute a non-executable page, that means that the currently
 	 * swapped in page is our original RW page. We need to swap in the hooked executable page (fake page)
 	 */
@@ -854,13 +4274,20 @@ BOOL HvExitHandlePageHookExit(
 	if(!ViolationQualification.EptExecutable && ViolationQualification.ExecuteAccess)
 	{
 		/* Swap out the non-executable page and swap in the executable page */
-		PageHook->TargetPage->Flags = PageHook->ShadowEntry.Flags;
+		if (PageHook->ExecuteTargetPage)
+		{
+			HvEptSetCurrentView(ProcessorContext, VmmEptViewExecute);
+		}
+		else
+		{
+			PageHook->TargetPage->Flags = PageHook->ShadowEntry.Flags;
+		}
+
+		PageHook->Statistics.ExecuteSwapCount++;
 
 		/* Redo the instruction */
 		ExitContext->ShouldIncrementRIP = FALSE;
 
-		HvUtilLogSuccess("Made Exec\n");
-
 		return TRUE;
 	}
 
@@ -871,37 +4298,168 @@ BOOL HvExitHandlePageHookExit(
 		&& (ViolationQualification.ReadAccess | ViolationQualification.WriteAccess) )
 	{
 		/* Otherwise, the executable page is swapped */
-		PageHook->TargetPage->Flags = PageHook->HookedEntry.Flags;
+		if (PageHook->ExecuteTargetPage)
+		{
+			HvEptSetCurrentView(ProcessorContext, VmmEptViewRead);
+		}
+		else
+		{
+			PageHook->TargetPage->Flags = PageHook->HookedEntry.Flags;
+		}
+
+		PageHook->Statistics.ReadWriteSwapCount++;
 
 		/* Redo the instruction */
 		ExitContext->ShouldIncrementRIP = FALSE;
 
-		HvUtilLogSuccess("Made RW\n");
-
 		return TRUE;
 	}
 
+	HvExitRaiseIrql(ExitContext);
 	HvUtilLogError("Hooked page had invalid page swapping logic?!\n");
 
 	return FALSE;
 }
+/**
+ * Handle the VM exit taken after the guest executed the single instruction it was given access to the original
+ * page of monitor trap strategy page hooks for. Puts the shadow page of every such hook back.
+ */
+VOID HvExitHandleMonitorTrapFlag(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext)
+{
+	PVMM_EPT_PAGE_HOOK PageHook;
+
+	/* The instruction has already completed, so RIP points at the next one */
+	ExitContext->ShouldIncrementRIP = FALSE;
+
+	if (!ProcessorContext->EptPageTable->MonitorTrapHooks)
+	{
+		/* Monitor trap exits are handled without the IRQL raised, which logging needs */
+		HvExitRaiseIrql(ExitContext);
+		HvUtilLogError("Unexpected monitor trap exit!\n");
+		HvVmcsSetMonitorTrapFlag(ProcessorContext, FALSE);
+		return;
+	}
+
+	while (ProcessorContext->EptPageTable->MonitorTrapHooks)
+	{
+		PageHook = ProcessorContext->EptPageTable->MonitorTrapHooks;
+		ProcessorContext->EptPageTable->MonitorTrapHooks = PageHook->NextMonitorTrapHook;
+
+		PageHook->NextMonitorTrapHook = NULL;
+		PageHook->Statistics.MonitorTrapExitCount++;
+		HvEptGetShadowTargetPage(PageHook)->Flags = PageHook->ShadowEntry.Flags;
+	}
+
+	HvVmcsSetMonitorTrapFlag(ProcessorContext, FALSE);
+
+	/* The original page is still cached as readable and writable, which must not outlive this exit */
+	HvEptInvalidateProcessor(ProcessorContext);
+}
+
+/**
+ * Determine whether the access that caused an EPT violation is allowed by the current entry for the page, meaning
+ * the violation was raised by a stale cached translation. An EPT violation invalidates any cached
+ * translation for the faulting address, so the access will succeed when it is retried.
+ */
+BOOL HvEptIsSpuriousViolation(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext, SIZE_T PhysicalAddress, VMX_EXIT_QUALIFICATION_EPT_VIOLATION ViolationQualification)
+{
+	PVMM_EPT_PAGE_TABLE PageTable;
+	PEPT_PML2_ENTRY Pml2Entry;
+	PEPT_PML1_ENTRY Pml1Entry;
+	BOOLEAN ReadAccess;
+	BOOLEAN WriteAccess;
+	BOOLEAN ExecuteAccess;
+
+	PageTable = HvEptGetCurrentView(ProcessorContext, ExitContext);
+
+	Pml2Entry = HvEptGetPml2Entry(PageTable, PhysicalAddress);
+	if (!Pml2Entry || !VMM_EPT_ENTRY_PRESENT(*Pml2Entry))
+	{
+		return FALSE;
+	}
+
+	if (Pml2Entry->LargePage)
+	{
+		ReadAccess = (BOOLEAN)Pml2Entry->ReadAccess;
+		WriteAccess = (BOOLEAN)Pml2Entry->WriteAccess;
+		ExecuteAccess = (BOOLEAN)Pml2Entry->ExecuteAccess;
+	}
+	else
+	{
+		Pml1Entry = HvEptGetPml1Entry(PageTable, PhysicalAddress);
+		if (!Pml1Entry)
+		{
+			return FALSE;
+		}
+
+		ReadAccess = (BOOLEAN)Pml1Entry->ReadAccess;
+		WriteAccess = (BOOLEAN)Pml1Entry->WriteAccess;
+		ExecuteAccess = (BOOLEAN)Pml1Entry->ExecuteAccess;
+	}
+
+	if ((ViolationQualification.ReadAccess && !ReadAccess)
+		|| (ViolationQualification.WriteAccess && !WriteAccess)
+		|| (ViolationQualification.ExecuteAccess && !ExecuteAccess))
+	{
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 /**
  * Handle VM exits for EPT violations. Violations are thrown whenever an operation is performed
  * on an EPT entry that does not provide permissions to access that page.
+ *
+ * Violations of hooked pages never get here, HvExitHandlePageHookExit swaps their pages without raising the IRQL.
  */
 VOID HvExitHandleEptViolation(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext)
 {
 	VMX_EXIT_QUALIFICATION_EPT_VIOLATION ViolationQualification;
 
-	UNREFERENCED_PARAMETER(ProcessorContext);
+	ViolationQualification.Flags = HvExitGetExitQualification(ExitContext);
+
+	HvUtilLogDebug("EPT Violation => 0x%llX\n", HvExitGetGuestPhysicalAddress(ExitContext));
+
+	/* Nothing is mapped at this address yet. Some memory is only mapped once the guest touches it. */
+	if(!ViolationQualification.EptReadable && !ViolationQualification.EptWriteable && !ViolationQualification.EptExecutable)
+	{
+		/*
+		 * Above 512GB there is nothing but RAM and device memory, so anything else is a stray access. It is given
+		 * back to the guest as a fault, rather than mapping memory that doesn't exist.
+		 */
+		if (ADDRMASK_EPT_PML4_INDEX(HvExitGetGuestPhysicalAddress(ExitContext)) != 0
+			&& !HvEptIsKnownPhysicalAddress(ProcessorContext->GlobalContext, HvExitGetGuestPhysicalAddress(ExitContext)))
+		{
+			HvUtilLogError("EPT: Access to PA:%p, where there is neither RAM nor a device. Raising #GP.\n", HvExitGetGuestPhysicalAddress(ExitContext));
+			HvExitInjectExceptionWithErrorCode(ExitContext, VMM_EXIT_VECTOR_GENERAL_PROTECTION, 0);
+			return;
+		}
 
-	ViolationQualification.Flags = ExitContext->ExitQualification;
+		if (HvEptMapOnDemand(ProcessorContext, HvExitGetGuestPhysicalAddress(ExitContext)))
+		{
+			/* Redo the instruction, which will now find the memory mapped. */
+			ExitContext->ShouldIncrementRIP = FALSE;
+			return;
+		}
+	}
 
-	HvUtilLogDebug("EPT Violation => 0x%llX\n", ExitContext->GuestPhysicalAddress);
+	/*
+	 * Permissions added to an entry without a flush, such as when a hook is removed, may still be cached without them.
+	 * The violation already invalidated that cached translation, so retrying the access is all that is needed.
+	 */
+	if(HvEptIsSpuriousViolation(ProcessorContext, ExitContext, HvExitGetGuestPhysicalAddress(ExitContext), ViolationQualification))
+	{
+		ExitContext->ShouldIncrementRIP = FALSE;
+		return;
+	}
 
-	if(HvExitHandlePageHookExit(ProcessorContext, ExitContext, ViolationQualification))
+	/* The guest left a view it switched to for code it was not supposed to touch. Let it go on in the read view. */
+	if (HvEptIsCustomViewCurrent(ProcessorContext, ExitContext))
 	{
-		// Handled by page hook code.
+		HvUtilLogDebug("EPT: Access to PA:%p not allowed by the current view, switching to the read view.\n", HvExitGetGuestPhysicalAddress(ExitContext));
+		HvEptSetCurrentView(ProcessorContext, VmmEptViewRead);
+		ExitContext->ShouldIncrementRIP = FALSE;
 		return;
 	}
 
@@ -910,3 +4468,276 @@ VOID HvExitHandleEptViolation(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_C
 	/* Redo the instruction that caused the exception. */
 	ExitContext->ShouldStopExecution = TRUE;
 }
+
+/**
+ * Handle an EPT violation the #VE handler of the guest could not resolve, which it forwards with
+ * VmmHypercallForwardEptViolation. Resolved the same way as HvExitHandleEptViolation would have, except that RIP
+ * points past the VMCALL in the #VE handler rather than at the faulting instruction, which the guest retries once
+ * the handler returns.
+ * 
+ * The monitor trap strategy can't be handled from here, since the monitor trap flag would trap the #VE handler
+ * rather than the faulting instruction. Its hooks never raise #VE, so the retry exits into HvExitHandlePageHookExit.
+ * Neither do not present entries, so memory mapped on demand never ends up here either.
+ */
+VOID HvExitHandleForwardedEptViolation(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext)
+{
+	SIZE_T PhysicalAddress;
+	VMX_EXIT_QUALIFICATION_EPT_VIOLATION ViolationQualification;
+	PVMM_EPT_PAGE_HOOK PageHook;
+
+	PhysicalAddress = ExitContext->GuestContext->GuestRDX;
+	ViolationQualification.Flags = ExitContext->GuestContext->GuestR8;
+
+	ExitContext->GuestContext->GuestRAX = TRUE;
+
+	PageHook = HvEptHookIndexLookup(&ProcessorContext->EptPageTable->HookIndex, PhysicalAddress);
+	if (PageHook)
+	{
+		PageHook->Statistics.ViolationExitCount++;
+
+		/* The #VE handler forwards adaptive hooks once they start thrashing, which may switch them to monitor trap */
+		if (PageHook->RequestedStrategy == VmmEptHookStrategyAdaptive)
+		{
+			HvEptAdaptPageHookStrategy(ProcessorContext, ExitContext, PageHook);
+		}
+
+		/* Views stay installed through the return to the guest, so the swap strategy can still swap from here */
+		if (PageHook->Strategy == VmmEptHookStrategySwap)
+		{
+			if (ViolationQualification.ExecuteAccess)
+			{
+				HvEptSetCurrentView(ProcessorContext, VmmEptViewExecute);
+				PageHook->Statistics.ExecuteSwapCount++;
+			}
+			else
+			{
+				HvEptSetCurrentView(ProcessorContext, VmmEptViewRead);
+				PageHook->Statistics.ReadWriteSwapCount++;
+			}
+		}
+
+		return;
+	}
+
+	if (HvEptIsSpuriousViolation(ProcessorContext, ExitContext, PhysicalAddress, ViolationQualification))
+	{
+		return;
+	}
+
+	HvUtilLogError("Unexpected EPT violation!\n");
+
+	ExitContext->GuestContext->GuestRAX = FALSE;
+	ExitContext->ShouldStopExecution = TRUE;
+}
+
+/*
+ * The global context the #VE handler finds the context of its processor in. #VE is an interrupt with no context of
+ * its own.
+ */
+static PVMM_CONTEXT HvEptVirtualizationExceptionContext;
+
+/**
+ * Resolve a #VE raised in the guest by an EPT violation, without leaving VMX non-root. Called by
+ * HvEptVirtualizationExceptionEntry with interrupts disabled, so it must only touch nonpaged memory.
+ * 
+ * Swap strategy page hooks are swapped by switching views with VMFUNC. Anything else is forwarded to the hypervisor
+ * with VmmHypercallForwardEptViolation, as is one in VMM_SETTING_EPT_FAST_SWAP_SAMPLE_INTERVAL swaps of an adaptive
+ * hook, so that HvEptAdaptPageHookStrategy counts them towards its swap rate.
+ */
+VOID HvEptHandleVirtualizationException()
+{
+	PVMM_PROCESSOR_CONTEXT ProcessorContext;
+	PVMM_EPT_VE_INFORMATION VeInformation;
+	VMX_EXIT_QUALIFICATION_EPT_VIOLATION ViolationQualification;
+	PVMM_EPT_PAGE_HOOK PageHook;
+	BOOL Resolved;
+
+	ProcessorContext = HvGetCurrentCPUContext(HvEptVirtualizationExceptionContext);
+	VeInformation = ProcessorContext->VeInformation;
+
+	ViolationQualification.Flags = VeInformation->ExitQualification;
+	Resolved = FALSE;
+
+	PageHook = HvEptHookIndexLookup(&ProcessorContext->EptPageTable->HookIndex, VeInformation->GuestPhysicalAddress);
+
+	if (PageHook)
+	{
+		PageHook->Statistics.VirtualizationExceptionCount++;
+	}
+
+	/* The swaps of an adaptive hook are left for the hypervisor to count, the last one of each sample forwarded */
+	if (PageHook
+		&& PageHook->Strategy == VmmEptHookStrategySwap
+		&& (PageHook->RequestedStrategy != VmmEptHookStrategyAdaptive
+			|| PageHook->Statistics.DeferredSwapCount < VMM_SETTING_EPT_FAST_SWAP_SAMPLE_INTERVAL - 1))
+	{
+		/* Executing the original page, so switch to the view that maps the shadow page */
+		if (VeInformation->EptpIndex == VmmEptViewRead && ViolationQualification.ExecuteAccess)
+		{
+			__vmfunc(0, VmmEptViewExecute);
+			PageHook->Statistics.ExecuteSwapCount++;
+			Resolved = TRUE;
+		}
+		/* Reading or writing the shadow page, so switch to the view that maps the original page */
+		else if (VeInformation->EptpIndex == VmmEptViewExecute
+			&& (ViolationQualification.ReadAccess | ViolationQualification.WriteAccess))
+		{
+			__vmfunc(0, VmmEptViewRead);
+			PageHook->Statistics.ReadWriteSwapCount++;
+			Resolved = TRUE;
+		}
+
+		if (Resolved && PageHook->RequestedStrategy == VmmEptHookStrategyAdaptive)
+		{
+			PageHook->Statistics.DeferredSwapCount++;
+		}
+	}
+
+	if (!Resolved)
+	{
+		__vmcall(VmmHypercallForwardEptViolation, VeInformation->GuestPhysicalAddress, VeInformation->ExitQualification);
+	}
+
+	/* Until the area is released, further EPT violations cause VM exits instead */
+	VeInformation->Busy = 0;
+}
+
+/**
+ * Write an interrupt gate to the IDT of the current processor. The IDT may be mapped read-only, so it is written
+ * through a writable mapping of its own, see OsWriteProtectedMemory. Returns FALSE if the gate could not be written.
+ * 
+ * Kernel patch protection checks the IDT itself, so this only avoids clearing CR0.WP, see
+ * VMM_SETTING_EPT_USE_VIRTUALIZATION_EXCEPTIONS.
+ */
+BOOL HvEptWriteInterruptGate(PVMM_PROCESSOR_CONTEXT ProcessorContext, SIZE_T Vector, PSEGMENT_DESCRIPTOR_INTERRUPT_GATE_64 Gate)
+{
+	PSEGMENT_DESCRIPTOR_INTERRUPT_GATE_64 InterruptDescriptorTable;
+
+	InterruptDescriptorTable = (PSEGMENT_DESCRIPTOR_INTERRUPT_GATE_64)ProcessorContext->InitialSpecialRegisters.InterruptDescriptorTableRegister.BaseAddress;
+
+	return OsWriteProtectedMemory(&InterruptDescriptorTable[Vector], Gate, sizeof(SEGMENT_DESCRIPTOR_INTERRUPT_GATE_64));
+}
+
+/**
+ * Get the interrupt stack table entry StackIndex, from 1 to VMM_EPT_TSS_IST_COUNT, of the TSS of the current
+ * processor.
+ */
+PUINT64 HvEptGetInterruptStackTableEntry(PVMM_PROCESSOR_CONTEXT ProcessorContext, SIZE_T StackIndex)
+{
+	VMX_SEGMENT_DESCRIPTOR TaskStateSegment;
+
+	VmxGetSegmentDescriptorFromSelector(&TaskStateSegment, ProcessorContext->InitialSpecialRegisters.GlobalDescriptorTableRegister,
+		ProcessorContext->InitialSpecialRegisters.TaskRegister, TRUE);
+
+	return (PUINT64)(TaskStateSegment.BaseAddress + VMM_EPT_TSS_IST_OFFSET + (StackIndex - 1) * sizeof(UINT64));
+}
+
+/**
+ * Point the #VE vector of the IDT of the current processor at HvEptVirtualizationExceptionEntry, saving the
+ * original gate. Must run on the processor before it launches, so that no #VE can be raised before the handler
+ * is in place. Does nothing unless #VE is enabled on the processor.
+ * 
+ * The handler gets a stack of its own through an interrupt stack table entry the OS does not use, like the OS does
+ * for NMIs. A #VE can be raised wherever the kernel touches a hooked page, including right after SYSCALL where RSP
+ * is still the user stack.
+ * 
+ * Returns FALSE if the handler could not be installed, in which case the processor must not launch.
+ */
+BOOL HvEptInstallVirtualizationExceptionHandler(PVMM_PROCESSOR_CONTEXT ProcessorContext)
+{
+	PSEGMENT_DESCRIPTOR_INTERRUPT_GATE_64 InterruptDescriptorTable;
+	SEGMENT_DESCRIPTOR_INTERRUPT_GATE_64 Gate;
+	PUINT64 StackEntry;
+	SIZE_T StackIndex;
+	SIZE_T Handler;
+
+	if (!ProcessorContext->VeInformation)
+	{
+		return TRUE;
+	}
+
+	/* The OS fills its entries from the first one, so look for a free one from the last */
+	for (StackIndex = VMM_EPT_TSS_IST_COUNT; StackIndex > 0; StackIndex--)
+	{
+		StackEntry = HvEptGetInterruptStackTableEntry(ProcessorContext, StackIndex);
+		if (*StackEntry == 0)
+		{
+			break;
+		}
+	}
+
+	if (StackIndex == 0)
+	{
+		HvUtilLogError("HvEptInstallVirtualizationExceptionHandler: No free interrupt stack table entry for the #VE stack.\n");
+		return FALSE;
+	}
+
+	HvEptVirtualizationExceptionContext = ProcessorContext->GlobalContext;
+
+	InterruptDescriptorTable = (PSEGMENT_DESCRIPTOR_INTERRUPT_GATE_64)ProcessorContext->InitialSpecialRegisters.InterruptDescriptorTableRegister.BaseAddress;
+	ProcessorContext->OriginalVeGate = InterruptDescriptorTable[VMM_EPT_VE_VECTOR];
+
+	Handler = (SIZE_T)HvEptVirtualizationExceptionEntry;
+
+	OsZeroMemory(&Gate, sizeof(Gate));
+
+	/* A kernel interrupt gate on the #VE stack, so that interrupts stay disabled until the handler returns */
+	Gate.SegmentSelector = ProcessorContext->InitialRegisters.SegCS.Flags;
+	Gate.Type = SEGMENT_DESCRIPTOR_TYPE_INTERRUPT_GATE;
+	Gate.DescriptorPrivilegeLevel = 0;
+	Gate.Present = 1;
+	Gate.InterruptStackTable = (UINT32)StackIndex;
+	Gate.OffsetLow = Handler & 0xFFFF;
+	Gate.OffsetMiddle = (Handler >> 16) & 0xFFFF;
+	Gate.OffsetHigh = (Handler >> 32) & 0xFFFFFFFF;
+
+	/* The processor aligns the stack of an interrupt to 16 bytes anyway */
+	*StackEntry = ((SIZE_T)ProcessorContext->VeStack + VMM_EPT_VE_STACK_SIZE) & ~0xFULL;
+
+	if (!HvEptWriteInterruptGate(ProcessorContext, VMM_EPT_VE_VECTOR, &Gate))
+	{
+		HvUtilLogError("HvEptInstallVirtualizationExceptionHandler: Could not write the #VE gate.\n");
+		*StackEntry = 0;
+		return FALSE;
+	}
+
+	ProcessorContext->VeStackIndex = StackIndex;
+
+	return TRUE;
+}
+
+/**
+ * Put back the #VE gate HvEptInstallVirtualizationExceptionHandler replaced on the current processor. Does nothing
+ * if the handler is not installed.
+ */
+VOID HvEptRestoreVirtualizationExceptionHandler(PVMM_PROCESSOR_CONTEXT ProcessorContext)
+{
+	PSEGMENT_DESCRIPTOR_INTERRUPT_GATE_64 InterruptDescriptorTable;
+	PSEGMENT_DESCRIPTOR_INTERRUPT_GATE_64 Gate;
+	SIZE_T Handler;
+
+	if (!ProcessorContext->VeInformation || ProcessorContext->VeStackIndex == 0)
+	{
+		return;
+	}
+
+	InterruptDescriptorTable = (PSEGMENT_DESCRIPTOR_INTERRUPT_GATE_64)ProcessorContext->InitialSpecialRegisters.InterruptDescriptorTableRegister.BaseAddress;
+	Gate = &InterruptDescriptorTable[VMM_EPT_VE_VECTOR];
+
+	Handler = Gate->OffsetLow | ((SIZE_T)Gate->OffsetMiddle << 16) | ((SIZE_T)Gate->OffsetHigh << 32);
+	if (Handler != (SIZE_T)HvEptVirtualizationExceptionEntry)
+	{
+		return;
+	}
+
+	if (!HvEptWriteInterruptGate(ProcessorContext, VMM_EPT_VE_VECTOR, &ProcessorContext->OriginalVeGate))
+	{
+		/* Without VMX no #VE can be raised anymore, but the gate is left pointing into this driver */
+		HvUtilLogError("HvEptRestoreVirtualizationExceptionHandler: Could not restore the #VE gate.\n");
+		return;
+	}
+
+	/* Nothing can use the #VE stack anymore, so give the entry back */
+	*HvEptGetInterruptStackTableEntry(ProcessorContext, ProcessorContext->VeStackIndex) = 0;
+	ProcessorContext->VeStackIndex = 0;
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include "arch.h"
+#include "vmm_settings.h"
 
 
 typedef struct _VMX_VMM_CONTEXT VMX_VMM_CONTEXT, *PVMM_CONTEXT;
@@ -8,16 +9,38 @@ typedef struct _VMM_PROCESSOR_CONTEXT VMM_PROCESSOR_CONTEXT, *PVMM_PROCESSOR_CON
 
 typedef struct _VMEXIT_CONTEXT VMEXIT_CONTEXT, *PVMEXIT_CONTEXT;
 
+typedef struct _VMM_EPT_PAGE_TABLE VMM_EPT_PAGE_TABLE, *PVMM_EPT_PAGE_TABLE;
+
 BOOL HvEptGlobalInitialize(PVMM_CONTEXT GlobalContext);
 
+VOID HvEptGlobalFree(PVMM_CONTEXT GlobalContext);
+
 BOOL HvEptLogicalProcessorInitialize(PVMM_PROCESSOR_CONTEXT ProcessorContext);
 
 VOID HvEptFreeLogicalProcessorContext(PVMM_PROCESSOR_CONTEXT ProcessorContext);
 
 VOID HvExitHandleEptViolation(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext);
 
+VOID HvEptInitializeFastSwapCache(PVMM_PROCESSOR_CONTEXT ProcessorContext);
+
+BOOL HvExitHandlePageHookExit(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext, VMX_EXIT_QUALIFICATION_EPT_VIOLATION ViolationQualification);
+
 BOOL HvEptAddPageHook(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVOID TargetFunction, PVOID HookFunction, PVOID* OrigFunction);
 
+VOID HvExitHandleMonitorTrapFlag(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext);
+
+BOOL HvEptRemovePageHookOnAllProcessors(PVMM_CONTEXT GlobalContext, PVOID TargetFunction);
+
+BOOL HvEptResetPagePermissions(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_PAGE_TABLE PageTable, SIZE_T PhysicalAddress);
+
+BOOL HvEptCoalesceLargePage(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_PAGE_TABLE PageTable, SIZE_T PhysicalAddress);
+
+BOOL HvEptInstallVirtualizationExceptionHandler(PVMM_PROCESSOR_CONTEXT ProcessorContext);
+
+VOID HvEptRestoreVirtualizationExceptionHandler(PVMM_PROCESSOR_CONTEXT ProcessorContext);
+
+VOID HvExitHandleForwardedEptViolation(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext);
+
 typedef struct _MTRR_RANGE_DESCRIPTOR
 {
 	SIZE_T PhysicalBaseAddress;
@@ -25,6 +48,35 @@ typedef struct _MTRR_RANGE_DESCRIPTOR
 	UCHAR MemoryType;
 } MTRR_RANGE_DESCRIPTOR, *PMTRR_RANGE_DESCRIPTOR;
 
+/**
+ * A run of physical memory with a single memory type. The runs built from the MTRRs are sorted, never overlap and
+ * together cover all of the physical memory managed by the identity map, so the memory type of any address is the
+ * type of the one run containing it.
+ */
+typedef struct _MTRR_MEMORY_RUN
+{
+	SIZE_T PhysicalBaseAddress;
+	SIZE_T PhysicalEndAddress;
+	UCHAR MemoryType;
+
+	/*
+	 * FALSE if the run is not backed by RAM, in which case it is not mapped at load and anything found
+	 * there is treated as MMIO. Always TRUE unless MapPhysicalMemoryOnly is set in the global context.
+	 */
+	BOOLEAN Backed;
+} MTRR_MEMORY_RUN, *PMTRR_MEMORY_RUN;
+
+/**
+ * Describes one fixed range MTRR. Each of the eight bytes of the MSR is the memory type of
+ * RangeSize bytes of memory, starting at BaseAddress.
+ */
+typedef struct _MTRR_FIXED_RANGE_DESCRIPTOR
+{
+	ULONG Msr;
+	SIZE_T BaseAddress;
+	SIZE_T RangeSize;
+} MTRR_FIXED_RANGE_DESCRIPTOR, *PMTRR_FIXED_RANGE_DESCRIPTOR;
+
 /**
  * Okay, you can totally shoot me here but I *hate* the naming scheme of PDE PTE PDPTE and PML4 that Intel uses.
  * It just makes way more sense to me to simply annotate each level of the table by its number.
@@ -61,11 +113,61 @@ typedef struct _MTRR_RANGE_DESCRIPTOR
   */
 #define VMM_EPT_PML1E_COUNT 512
 
+/**
+ * Integer 1MB
+ */
+#define SIZE_1_MB ((SIZE_T)(256 * PAGE_SIZE))
+
 /**
  * Integer 2MB
  */
 #define SIZE_2_MB ((SIZE_T)(512 * PAGE_SIZE))
 
+/**
+ * Integer 1GB
+ */
+#define SIZE_1_GB ((SIZE_T)(512 * SIZE_2_MB))
+
+/**
+ * Amount of physical memory described by the identity map (one PML4 entry, 512GB).
+ */
+#define VMM_EPT_IDENTITY_MAP_SIZE ((SIZE_T)VMM_EPT_PML3E_COUNT * SIZE_1_GB)
+
+/**
+ * Amount of physical memory which can be described by a 4-level EPT (512 PML4 entries).
+ */
+#define VMM_EPT_PHYSICAL_ADDRESS_LIMIT ((SIZE_T)VMM_EPT_PML4E_COUNT * VMM_EPT_IDENTITY_MAP_SIZE)
+
+/**
+ * Maximum number of variable range MTRRs. IA32_MTRR_CAP reports the count in 8 bits.
+ */
+#define VMM_EPT_MTRR_VARIABLE_RANGE_MAX 255
+
+/**
+ * Maximum number of RAM ranges read from the OS.
+ */
+#define VMM_EPT_PHYSICAL_MEMORY_RANGE_MAX 64
+
+/**
+ * Maximum number of device memory ranges read from the OS.
+ */
+#define VMM_EPT_DEVICE_MEMORY_RANGE_MAX 512
+
+/**
+ * Maximum number of memory type runs. Each variable range and each RAM range can start and end at most one new run.
+ */
+#define VMM_EPT_MEMORY_RUN_MAX (((VMM_EPT_MTRR_VARIABLE_RANGE_MAX + VMM_EPT_PHYSICAL_MEMORY_RANGE_MAX) * 2) + 1)
+
+/**
+ * Number of 4096 byte pages described by the fixed range MTRRs (the first 1MB of physical memory).
+ */
+#define VMM_EPT_FIXED_RANGE_PAGE_COUNT (SIZE_1_MB / PAGE_SIZE)
+
+/**
+ * Number of fixed range MTRRs: one for 64KB ranges, two for 16KB ranges and eight for 4KB ranges.
+ */
+#define VMM_EPT_FIXED_RANGE_MTRR_COUNT 11
+
 /**
  * Offset into the 1st paging structure (4096 byte)
  */
@@ -91,120 +193,1060 @@ typedef struct _MTRR_RANGE_DESCRIPTOR
  */
 #define ADDRMASK_EPT_PML4_INDEX(_VAR_) ((_VAR_ & 0xFF8000000000ULL) >> 39)
 
+/**
+ * An EPT entry of any level is present if any of its read, write or execute bits are set.
+ */
+#define VMM_EPT_ENTRY_PRESENT(_ENTRY_) (((_ENTRY_).Flags & 7ULL) != 0)
+
+/**
+ * The value of a not present EPT entry of any level. Suppress #VE (bit 63) is set, so that an access to memory which
+ * is not mapped always exits to the hypervisor to be mapped on demand, instead of raising #VE in the guest.
+ */
+#define VMM_EPT_NOT_PRESENT_ENTRY (1ULL << 63)
+
+/**
+ * The bits of an EPT entry that HvEptSetViewPermissions changes: read, write and execute access (bits 2:0), and
+ * suppress #VE (bit 63). The same bits in entries of every level.
+ */
+#define VMM_EPT_VIEW_ENTRY_MASK (7ULL | (1ULL << 63))
+
 typedef EPT_PML4 EPT_PML4_POINTER, *PEPT_PML4_POINTER;
 typedef EPDPTE EPT_PML3_POINTER, *PEPT_PML3_POINTER;
+typedef EPDPTE_1GB EPT_PML3_ENTRY, *PEPT_PML3_ENTRY;
 typedef EPDE_2MB EPT_PML2_ENTRY, *PEPT_PML2_ENTRY;
 typedef EPDE EPT_PML2_POINTER, *PEPT_PML2_POINTER;
 typedef EPTE EPT_PML1_ENTRY, *PEPT_PML1_ENTRY;
 
-typedef struct _VMM_EPT_PAGE_TABLE
+typedef struct _VMM_EPT_PAGE_HOOK VMM_EPT_PAGE_HOOK, *PVMM_EPT_PAGE_HOOK;
+
+typedef struct _VMM_EPT_FUNCTION_HOOK VMM_EPT_FUNCTION_HOOK, *PVMM_EPT_FUNCTION_HOOK;
+
+typedef struct _VMM_EPT_TRAMPOLINE VMM_EPT_TRAMPOLINE, *PVMM_EPT_TRAMPOLINE;
+
+/**
+ * How a page hook lets code in the hooked page read and write the original page while executing the shadow page.
+ */
+typedef enum _VMM_EPT_HOOK_STRATEGY
 {
 	/**
-	 * 28.2.2 Describes 512 contiguous 512GB memory regions each with 512 1GB regions.
+	 * Swap between the execute-only shadow page and the readable and writable original page on every EPT violation.
+	 * Costs one exit per swap, which becomes an exit on every instruction when code reads data from its own page.
 	 */
-	DECLSPEC_ALIGN(PAGE_SIZE) EPT_PML4_POINTER PML4[VMM_EPT_PML4E_COUNT];
-	
+	VmmEptHookStrategySwap,
+
 	/**
-	 * Describes exactly 512 contiguous 1GB memory regions within a our singular 512GB PML4 region.
+	 * Keep the execute-only shadow page installed. When the page is read or written, map the original page RWX for
+	 * exactly one instruction using the monitor trap flag, then put the shadow page back. Costs two exits for each
+	 * read or write, but never for execution.
 	 */
-	DECLSPEC_ALIGN(PAGE_SIZE) EPT_PML3_POINTER PML3[VMM_EPT_PML3E_COUNT];
+	VmmEptHookStrategyMonitorTrap,
 
 	/**
-	 * For each 1GB PML3 entry, create 512 2MB entries to map identity. 
-	 * NOTE: We are using 2MB pages as the smallest paging size in our map, so we do not manage individiual 4096 byte pages.
-	 * Therefore, we do not allocate any PML1 (4096 byte) paging structures.
+	 * Use the swap strategy, but switch to the monitor trap strategy while the page swaps more often than
+	 * VMM_SETTING_EPT_HOOK_THRASH_HIGH_THRESHOLD times per window, and back once it calms down. Behaves like
+	 * VmmEptHookStrategySwap if the processor does not support the monitor trap flag.
+	 */
+	VmmEptHookStrategyAdaptive,
+
+} VMM_EPT_HOOK_STRATEGY;
+
+/**
+ * Index of each view of physical memory in the EPTP list of a processor. Every view is a page table of its own,
+ * and the guest can switch between them with VMFUNC leaf 0 without a VM exit.
+ * 
+ * Views from VmmEptViewFirstCustom up to VMM_SETTING_EPT_VIEW_COUNT are created with HvEptCreateView and changed
+ * with HvEptSetViewPermissions. Switching to one changes the permissions of every page it restricts at once, for
+ * the cost of a single EPTP switch.
+ */
+typedef enum _VMM_EPT_VIEW
+{
+	/**
+	 * The view installed at launch. Hooked pages map the original page, readable and writable but not executable.
 	 */
-	DECLSPEC_ALIGN(PAGE_SIZE) EPT_PML2_ENTRY PML2[VMM_EPT_PML3E_COUNT][VMM_EPT_PML2E_COUNT];
+	VmmEptViewRead,
 
 	/**
-	 * List of all allocated dynamic splits. Used to free dynamic entries at the end of execution.
-	 * A dynamic split is a 2MB page that's been split into 512 4096 size pages.
-	 * This is used only on request when a specific page's protections need to be split.
+	 * Hooked pages map their execute-only shadow page. Every other page is mapped as in the read view.
 	 */
-	LIST_ENTRY DynamicSplitList;
+	VmmEptViewExecute,
 
 	/**
-	 * List of currently active page hooks. Page hooks are a shadow hooking mechanism which is capable of transparently swapping
-	 * instructions when instructions of a page are executed. But, when the page is read or written to, the shadow page will be updated
-	 * to reflect the changes without affecting the hook. This creates an invisible hook that the kernel cannot detect through typical means,
-	 * such as code checksum analysis.
+	 * The first view available to HvEptCreateView.
 	 */
-	LIST_ENTRY PageHookList;
+	VmmEptViewFirstCustom
 
-} VMM_EPT_PAGE_TABLE, *PVMM_EPT_PAGE_TABLE;
+} VMM_EPT_VIEW;
 
-#pragma warning(push, 0)
-typedef struct _VMM_EPT_DYNAMIC_SPLIT
+C_ASSERT(VMM_SETTING_EPT_VIEW_COUNT >= VmmEptViewFirstCustom && VMM_SETTING_EPT_VIEW_COUNT <= PAGE_SIZE / sizeof(EPT_POINTER));
+
+/**
+ * A change to a single EPT entry queued in an edit batch: the bits of Mask in the entry are replaced by Value.
+ */
+typedef struct _VMM_EPT_EDIT
 {
-	/*
-	 * The 4096 byte page table entries that correspond to the split 2MB table entry.
+	/**
+	 * The view whose entry changes.
 	 */
-	DECLSPEC_ALIGN(PAGE_SIZE) EPT_PML1_ENTRY PML1[VMM_EPT_PML1E_COUNT];
+	VMM_EPT_VIEW View;
 
-	/*
-	 * The pointer to the 2MB entry in the page table which this split is servicing.
+	/**
+	 * Address within the page or the 2MB region mapped by the entry.
 	 */
-	union
-	{
-		PEPT_PML2_ENTRY Entry;
-		PEPT_PML2_POINTER Pointer;
-	};
+	SIZE_T PhysicalAddress;
 
-	/*
-	 * Linked list entries for each dynamic split
+	/**
+	 * TRUE to change the PML2 entry of a 2MB large page, FALSE to change the PML1 entry of a 4096 byte page.
 	 */
-	LIST_ENTRY DynamicSplitList;
+	BOOLEAN LargePage;
 
-} VMM_EPT_DYNAMIC_SPLIT, *PVMM_EPT_DYNAMIC_SPLIT;
-#pragma warning(pop, 0)
+	/**
+	 * Set once committing splits the large page of a PML1 entry, so that the split can be undone.
+	 */
+	BOOLEAN Split;
 
-typedef struct _VMM_EPT_PAGE_HOOK
+	/**
+	 * The bits of the entry that change, and their new value.
+	 */
+	SIZE_T Mask;
+	SIZE_T Value;
+
+	/**
+	 * The entry, once the batch is being committed.
+	 */
+	PUINT64 Entry;
+} VMM_EPT_EDIT, *PVMM_EPT_EDIT;
+
+/**
+ * Changes to the EPT entries of a processor which take effect together, with a single invalidation of each view
+ * they change. Prepare one with HvEptBeginEditBatch.
+ */
+typedef struct _VMM_EPT_EDIT_BATCH
 {
-	/*
-	 * The fake page we copied from physical memory. This page will be swapped in
-	 * with our changes when executed and swapped out when read.
+	/**
+	 * The processor whose views the batch changes.
 	 */
-	DECLSPEC_ALIGN(PAGE_SIZE) CHAR FakePage[PAGE_SIZE];
+	PVMM_PROCESSOR_CONTEXT ProcessorContext;
 
 	/**
-	 * Linked list entires for each page hook.
+	 * Number of changes in Edits.
 	 */
-	LIST_ENTRY PageHookList;
+	SIZE_T EditCount;
 
 	/**
-	 * The base address of the page. Used to find this structure in the list of page hooks
-	 * when a hook is hit.
+	 * The changes, in the order they were queued.
 	 */
-	SIZE_T PhysicalBaseAddress;
+	VMM_EPT_EDIT Edits[VMM_SETTING_EPT_EDIT_BATCH_SIZE];
+} VMM_EPT_EDIT_BATCH, *PVMM_EPT_EDIT_BATCH;
 
-	/*
-	 * The page entry in the page tables that this page is targetting.  
+/**
+ * The IDT vector of the virtualization exception (#VE).
+ */
+#define VMM_EPT_VE_VECTOR 20
+
+/**
+ * Size of the stack of the #VE handler. The handler only looks up the page hook and switches views, and a #VE can't be
+ * raised again until it has returned, so a single small stack per processor is enough.
+ */
+#define VMM_EPT_VE_STACK_SIZE (2 * PAGE_SIZE)
+
+/**
+ * Offset of the first of the seven interrupt stack table entries in the 64-bit TSS. Each entry is the 8 byte top of
+ * a stack.
+ */
+#define VMM_EPT_TSS_IST_OFFSET 0x24
+
+/**
+ * Number of interrupt stack table entries in the 64-bit TSS. Entry 0 in a gate means the current stack.
+ */
+#define VMM_EPT_TSS_IST_COUNT 7
+
+/**
+ * The virtualization exception information area, written by the processor when an EPT violation raises a #VE in
+ * the guest instead of causing a VM exit.
+ */
+typedef struct _VMM_EPT_VE_INFORMATION
+{
+	/**
+	 * Always VMX_EXIT_REASON_EPT_VIOLATION.
+	 */
+	UINT32 ExitReason;
+
+	/**
+	 * Set to FFFFFFFFH by the processor when it raises a #VE. Until the guest clears it again, EPT violations cause
+	 * VM exits instead, so a #VE can never be raised while the last one is being handled.
+	 */
+	volatile UINT32 Busy;
+
+	/**
+	 * The exit qualification the EPT violation would have had, as a VMX_EXIT_QUALIFICATION_EPT_VIOLATION.
+	 */
+	UINT64 ExitQualification;
+
+	UINT64 GuestLinearAddress;
+
+	UINT64 GuestPhysicalAddress;
+
+	/**
+	 * The view the violation happened in, as an index into the EPTP list.
+	 */
+	UINT16 EptpIndex;
+
+} VMM_EPT_VE_INFORMATION, *PVMM_EPT_VE_INFORMATION;
+
+/**
+ * Exit statistics of a page hook. As every processor has its own page hooks, the statistics of a processor are never
+ * written by another one.
+ */
+typedef struct _VMM_EPT_HOOK_STATISTICS
+{
+	/**
+	 * Number of EPT violation exits taken on the page.
+	 */
+	SIZE_T ViolationExitCount;
+
+	/**
+	 * Number of swaps from the original page to the shadow page, caused by executing the page.
+	 */
+	SIZE_T ExecuteSwapCount;
+
+	/**
+	 * Number of swaps from the shadow page to the original page, caused by reading or writing the page.
+	 */
+	SIZE_T ReadWriteSwapCount;
+
+	/**
+	 * Number of monitor trap exits taken to restore the shadow page.
+	 */
+	SIZE_T MonitorTrapExitCount;
+
+	/**
+	 * Number of times an adaptive hook switched strategy.
+	 */
+	SIZE_T StrategySwitchCount;
+
+	/**
+	 * Number of EPT violations delivered to the guest as #VE instead, whether or not the guest could resolve them.
+	 */
+	SIZE_T VirtualizationExceptionCount;
+
+	/**
+	 * Swaps of an adaptive hook the #VE handler did since it last forwarded one, which are not counted in the window
+	 * yet. See HvEptAdaptPageHookStrategy.
+	 */
+	SIZE_T DeferredSwapCount;
+
+	/**
+	 * TSC at which the current window of the swap rate started.
+	 */
+	SIZE_T WindowStart;
+
+	/**
+	 * Swaps, or reads and writes under the monitor trap strategy, counted in the current and previous window.
+	 */
+	SIZE_T CurrentWindowCount;
+	SIZE_T PreviousWindowCount;
+
+} VMM_EPT_HOOK_STATISTICS, *PVMM_EPT_HOOK_STATISTICS;
+
+/**
+ * A single slot of the page hook index.
+ */
+typedef struct _VMM_EPT_HOOK_INDEX_SLOT
+{
+	/**
+	 * The 4096 byte physical page frame number of the hooked page.
+	 */
+	SIZE_T PageFrameNumber;
+
+	/**
+	 * The hook servicing that page, or NULL if this slot is empty.
+	 */
+	PVMM_EPT_PAGE_HOOK Hook;
+} VMM_EPT_HOOK_INDEX_SLOT, *PVMM_EPT_HOOK_INDEX_SLOT;
+
+/**
+ * Open-addressed hash index of page hooks, keyed by the physical page frame of the hooked page.
+ * 
+ * Every EPT violation on a hooked page needs to find its hook, so walking PageHookList on each exit would
+ * make the cost of a page swap grow with the number of installed hooks. Instead, the frame number is hashed
+ * into a power of two sized array of slots and collisions are resolved by linear probing. The index is never
+ * allowed to fill past three quarters of its slots, so probe sequences stay short and always hit an empty slot.
+ */
+typedef struct _VMM_EPT_HOOK_INDEX
+{
+	/**
+	 * Array of SlotCount slots.
+	 */
+	PVMM_EPT_HOOK_INDEX_SLOT Slots;
+
+	/**
+	 * Number of slots in the index. Always a power of two.
+	 */
+	SIZE_T SlotCount;
+
+	/**
+	 * Shift applied to the multiplicative hash to produce a slot number.
+	 */
+	SIZE_T HashShift;
+
+	/**
+	 * Number of occupied slots.
+	 */
+	SIZE_T HookCount;
+} VMM_EPT_HOOK_INDEX, *PVMM_EPT_HOOK_INDEX;
+
+/**
+ * PhysicalPage of an empty slot of the fast swap cache.
+ */
+#define VMM_EPT_FAST_SWAP_EMPTY ((SIZE_T)-1)
+
+/**
+ * A single slot of the fast swap cache.
+ */
+typedef struct _VMM_EPT_FAST_SWAP_SLOT
+{
+	/**
+	 * The physical address of the hooked page, or VMM_EPT_FAST_SWAP_EMPTY. Written last, once the rest of the slot
+	 * is complete.
+	 */
+	volatile SIZE_T PhysicalPage;
+
+	/**
+	 * The entry the hook swaps, or NULL if the hook swaps by switching between the read and execute views.
 	 */
 	PEPT_PML1_ENTRY TargetPage;
 
 	/**
-	 * The original page entry. Will be copied back when the hook is removed
-	 * from the page.
+	 * The value installed when the page is executed, and when it is read or written. These are the shadow and
+	 * original entries, or the EPTPs of the execute and read views if TargetPage is NULL.
 	 */
-	EPT_PML1_ENTRY OriginalEntry;
+	UINT64 ExecuteValue;
+	UINT64 ReadWriteValue;
 
 	/**
-	 * The fake entry which points the page entry to FakePage in this structure. This is
-	 * the entry that will be installed when the shadow entry is not currently swapped in.
-	 * This page is marked executable only. If this page is read or written to, the HookedEntry
-	 * will be swapped in.
+	 * Swaps left before the next one is handed to HvHandleVmExit, so the swap rate of an adaptive hook is still
+	 * measured. Zero for hooks which don't adapt, which are always swapped by the cache.
 	 */
-	EPT_PML1_ENTRY ShadowEntry;
+	volatile SIZE_T SampleCountdown;
 
 	/**
-	 * This entry points back to the original page of physical memory. This entry is modified
-	 * to not be executable. When this entry is swapped in and instructions are fetched from this
-	 * page, the ShadowEntry will be swapped in.
+	 * Pads the slot to a power of two, so that HvEnterFromGuest finds it with a shift.
 	 */
-	EPT_PML1_ENTRY HookedEntry;
+	SIZE_T Reserved[3];
+} VMM_EPT_FAST_SWAP_SLOT, *PVMM_EPT_FAST_SWAP_SLOT;
+
+/**
+ * Direct-mapped cache of the swap strategy page hooks of a processor, indexed by page frame number. Adaptive hooks
+ * are cached while they swap, and removed when they switch to the monitor trap strategy.
+ * 
+ * HvEnterFromGuest looks up EPT violations here before saving any guest state. On a hit, it swaps the page just as
+ * HvExitHandlePageHookExit would and resumes the guest, using only RAX, RCX and RDX. Anything else, including a page
+ * missing from the cache, is handled by HvHandleVmExit. The cache is found through the host stack and walked by
+ * assembly, so its layout is fixed by the C_ASSERTs below.
+ */
+typedef struct _VMM_EPT_FAST_SWAP_CACHE
+{
+	/**
+	 * The EPTPs of the read and execute views. Equal if the processor has no views. Other views don't hook pages,
+	 * so the cache is not used while one of them is installed.
+	 */
+	UINT64 ReadEptPointer;
+	UINT64 ExecuteEptPointer;
+
+	/**
+	 * The generation of shared EPT edits the processor has applied, and the latest one published. The cache is not
+	 * used while they differ, so HvHandleVmExit applies the edits first.
+	 */
+	volatile LONG64* AppliedGeneration;
+	volatile LONG64* PublishedGeneration;
 
 	/**
-	 * The buffer of the trampoline function which is used in the inline hook.
+	 * Number of pages swapped through the cache.
 	 */
-	PCHAR Trampoline;
-} VMM_EPT_PAGE_HOOK, *PVMM_EPT_PAGE_HOOK;
\ No newline at end of file
+	SIZE_T SwapCount;
+
+	/**
+	 * VMM_SETTING_EPT_FAST_SWAP_CACHE_SIZE - 1.
+	 */
+	SIZE_T SlotMask;
+
+	VMM_EPT_FAST_SWAP_SLOT Slots[VMM_SETTING_EPT_FAST_SWAP_CACHE_SIZE];
+} VMM_EPT_FAST_SWAP_CACHE, *PVMM_EPT_FAST_SWAP_CACHE;
+
+/* Offsets used by HvEnterFromGuest in vmxdefs.asm */
+C_ASSERT((VMM_SETTING_EPT_FAST_SWAP_CACHE_SIZE & (VMM_SETTING_EPT_FAST_SWAP_CACHE_SIZE - 1)) == 0);
+C_ASSERT(sizeof(VMM_EPT_FAST_SWAP_SLOT) == 0x40);
+C_ASSERT(FIELD_OFFSET(VMM_EPT_FAST_SWAP_SLOT, PhysicalPage) == 0x00);
+C_ASSERT(FIELD_OFFSET(VMM_EPT_FAST_SWAP_SLOT, TargetPage) == 0x08);
+C_ASSERT(FIELD_OFFSET(VMM_EPT_FAST_SWAP_SLOT, ExecuteValue) == 0x10);
+C_ASSERT(FIELD_OFFSET(VMM_EPT_FAST_SWAP_SLOT, ReadWriteValue) == 0x18);
+C_ASSERT(FIELD_OFFSET(VMM_EPT_FAST_SWAP_SLOT, SampleCountdown) == 0x20);
+C_ASSERT(VMM_SETTING_EPT_FAST_SWAP_SAMPLE_INTERVAL > 0 && VMM_SETTING_EPT_FAST_SWAP_SAMPLE_INTERVAL < VMM_SETTING_EPT_HOOK_THRASH_LOW_THRESHOLD);
+C_ASSERT(FIELD_OFFSET(VMM_EPT_FAST_SWAP_CACHE, ReadEptPointer) == 0x00);
+C_ASSERT(FIELD_OFFSET(VMM_EPT_FAST_SWAP_CACHE, ExecuteEptPointer) == 0x08);
+C_ASSERT(FIELD_OFFSET(VMM_EPT_FAST_SWAP_CACHE, AppliedGeneration) == 0x10);
+C_ASSERT(FIELD_OFFSET(VMM_EPT_FAST_SWAP_CACHE, PublishedGeneration) == 0x18);
+C_ASSERT(FIELD_OFFSET(VMM_EPT_FAST_SWAP_CACHE, SwapCount) == 0x20);
+C_ASSERT(FIELD_OFFSET(VMM_EPT_FAST_SWAP_CACHE, SlotMask) == 0x28);
+C_ASSERT(FIELD_OFFSET(VMM_EPT_FAST_SWAP_CACHE, Slots) == 0x30);
+C_ASSERT(VMCS_EXIT_REASON == 0x4402);
+C_ASSERT(VMCS_EXIT_QUALIFICATION == 0x6400);
+C_ASSERT(VMCS_GUEST_PHYSICAL_ADDRESS == 0x2400);
+C_ASSERT(VMCS_CTRL_EPT_POINTER == 0x201A);
+C_ASSERT(VMX_EXIT_REASON_EPT_VIOLATION == 48);
+
+typedef struct _VMM_EPT_DYNAMIC_SPLIT VMM_EPT_DYNAMIC_SPLIT, *PVMM_EPT_DYNAMIC_SPLIT;
+
+/**
+ * A 4096 byte page of 512 PML2 entries, describing one 1GB region of physical memory.
+ * 
+ * The dynamic split an entry points to is found from the frame it points to, see HvEptGetSplit, so the directory
+ * needs nothing besides its entries.
+ */
+typedef struct _VMM_EPT_PML2_DIRECTORY
+{
+	/**
+	 * The 512 2MB entries of this 1GB region. Entries that have been split are PML2 pointers instead.
+	 */
+	DECLSPEC_ALIGN(PAGE_SIZE) EPT_PML2_ENTRY PML2[VMM_EPT_PML2E_COUNT];
+
+} VMM_EPT_PML2_DIRECTORY, *PVMM_EPT_PML2_DIRECTORY;
+
+/**
+ * The PML3 of one 512GB PML4 entry above the first 512GB.
+ * 
+ * Only allocated, from the processor's table pool, once the guest touches memory in that 512GB region. Owned by a
+ * single page table, so it and its directories are always private, and its directories are found from the frames
+ * its entries point to.
+ */
+typedef struct _VMM_EPT_PML3_DIRECTORY
+{
+	/**
+	 * The 512 1GB entries of this 512GB region. Not present until the guest touches that 1GB region.
+	 */
+	DECLSPEC_ALIGN(PAGE_SIZE) EPT_PML3_POINTER PML3[VMM_EPT_PML3E_COUNT];
+
+} VMM_EPT_PML3_DIRECTORY, *PVMM_EPT_PML3_DIRECTORY;
+
+/* Both kinds of directory are allocated from the same pool of 4096 byte frames. */
+C_ASSERT(sizeof(VMM_EPT_PML3_DIRECTORY) == PAGE_SIZE);
+C_ASSERT(sizeof(VMM_EPT_PML2_DIRECTORY) == PAGE_SIZE);
+
+/**
+ * A fixed set of 4096 byte frames reserved up front, each with an optional block of metadata.
+ * 
+ * VMX root mode cannot call into the memory manager, so any paging structure that has to be created while
+ * handling a VM exit must come from memory that was reserved at load. Allocation and release are lock-free,
+ * so they are O(1) and safe even if a VM exit interrupts the guest while it is using the same pool.
+ * 
+ * Metadata is kept out of line, so that frames hold nothing but paging structures and only they need to be
+ * physically contiguous.
+ */
+typedef struct _VMM_EPT_PAGE_POOL
+{
+	/**
+	 * Virtual and physical address of the physically contiguous block holding every frame.
+	 */
+	PCHAR Frames;
+	SIZE_T FramesPhysical;
+
+	/**
+	 * The metadata of each frame, in frame order, or NULL if MetadataSize is zero.
+	 */
+	PCHAR Metadata;
+
+	/**
+	 * Size of the metadata of each frame.
+	 */
+	SIZE_T MetadataSize;
+
+	/**
+	 * Number of frames in the pool.
+	 */
+	SIZE_T FrameCount;
+
+	/**
+	 * Head of the list of free frames, which are linked through the first ULONG of each free frame.
+	 * The low 32 bits are the index of the first free frame plus one, or zero if there are none. The high 32 bits
+	 * are a tag that changes on every update, so that a stale head can never be swapped back in (the ABA problem).
+	 */
+	volatile LONG64 FreeHead;
+
+	/**
+	 * Number of frames currently allocated.
+	 */
+	volatile LONG InUseCount;
+
+	/**
+	 * The most frames that have ever been allocated at once.
+	 */
+	volatile LONG HighWaterMark;
+
+	/**
+	 * Number of allocations that failed because every frame was in use.
+	 */
+	volatile LONG ExhaustedCount;
+
+} VMM_EPT_PAGE_POOL, *PVMM_EPT_PAGE_POOL;
+
+/**
+ * The identity mapping of physical memory shared by every logical processor.
+ * 
+ * Every processor starts with exactly the same identity map, so there is no reason for each of them to build and
+ * store its own copy of every PML2 entry. The identity map is built once, is never modified afterwards, and each
+ * processor's page table references its directories directly. When a processor needs to change an entry (for example,
+ * to split a large page for a hook), it first copies only the affected 1GB directory into memory of its own.
+ */
+typedef struct _VMM_EPT_IDENTITY_MAP
+{
+	/**
+	 * Template 1GB PML3 entries. Copied into the PML3 of each processor's page table.
+	 * 
+	 * If the processor supports 1GB EPT pages and the memory type of a whole gigabyte is uniform, the entry is
+	 * a 1GB large page (EPT_PML3_ENTRY) and no directory is allocated for it at all. Otherwise, it points to the
+	 * shared directory of the same index.
+	 */
+	DECLSPEC_ALIGN(PAGE_SIZE) EPT_PML3_POINTER PML3[VMM_EPT_PML3E_COUNT];
+
+	/**
+	 * The shared directory of 512 2MB entries for each 1GB PML3 entry, or NULL if that entry is a 1GB large page.
+	 */
+	PVMM_EPT_PML2_DIRECTORY PML2[VMM_EPT_PML3E_COUNT];
+
+	/**
+	 * List of dynamic splits made while building the identity map, for 2MB regions which cannot be described
+	 * by a single memory type. Like the directories, these are shared by all processors and never modified,
+	 * except for mapping a page not backed by RAM on demand. Processors copy a split before changing any of its entries.
+	 */
+	LIST_ENTRY DynamicSplitList;
+
+	/**
+	 * TRUE if the processor supports mapping 1GB of memory with a single PML3 entry.
+	 */
+	BOOLEAN LargePage1GbSupported;
+
+	/**
+	 * Number of PML3 entries mapped as 1GB large pages.
+	 */
+	SIZE_T LargePage1GbCount;
+
+	/**
+	 * Number of 2MB regions split into 4096 byte pages because they have more than one memory type.
+	 */
+	SIZE_T MixedRegionSplitCount;
+
+	/**
+	 * Total size of the paging structures of the identity map. Used to report memory savings.
+	 */
+	SIZE_T SizeInBytes;
+
+} VMM_EPT_IDENTITY_MAP, *PVMM_EPT_IDENTITY_MAP;
+
+struct _VMM_EPT_PAGE_TABLE
+{
+	/**
+	 * 28.2.2 Describes 512 contiguous 512GB memory regions each with 512 1GB regions.
+	 */
+	DECLSPEC_ALIGN(PAGE_SIZE) EPT_PML4_POINTER PML4[VMM_EPT_PML4E_COUNT];
+	
+	/**
+	 * Describes exactly 512 contiguous 1GB memory regions within a our singular 512GB PML4 region.
+	 */
+	DECLSPEC_ALIGN(PAGE_SIZE) EPT_PML3_POINTER PML3[VMM_EPT_PML3E_COUNT];
+
+	/**
+	 * The directory of 512 2MB entries that each 1GB PML3 entry currently points to. This is the shared directory
+	 * of the identity map until this processor modifies an entry within it, after which it is a private copy.
+	 * NULL while the PML3 entry is a 1GB large page.
+	 * NOTE: We are using 2MB pages as the smallest paging size in our map, so we do not manage individiual 4096 byte pages.
+	 * Therefore, we do not allocate any PML1 (4096 byte) paging structures unless a page is split.
+	 */
+	PVMM_EPT_PML2_DIRECTORY PML2[VMM_EPT_PML3E_COUNT];
+
+	/**
+	 * The PML3 directory of each 512GB PML4 entry above the first, or NULL if the guest has not yet touched it.
+	 * Entry 0 is always NULL, as the first 512GB is described by PML3 and PML2 above.
+	 */
+	PVMM_EPT_PML3_DIRECTORY PML3Directory[VMM_EPT_PML4E_COUNT];
+
+	/**
+	 * Frames for every private PML3 and PML2 directory of this page table, so that they can be created from VMX root.
+	 * Shared with the other views of the processor.
+	 */
+	PVMM_EPT_PAGE_POOL TablePool;
+
+	/**
+	 * Frames for the dynamic splits of this page table, so that pages can be split from VMX root. Shared with the
+	 * other views of the processor.
+	 */
+	PVMM_EPT_PAGE_POOL SplitPool;
+
+	/**
+	 * Number of 1GB and 2MB regions that have been mapped on demand.
+	 */
+	SIZE_T OnDemandMappedCount;
+
+	/**
+	 * Number of accesses to memory the OS does not report as RAM which were mapped on demand, such as MMIO or
+	 * stray accesses to memory that doesn't exist. Only counted in the page table of the processor, not its views.
+	 */
+	SIZE_T OnDemandUnbackedCount;
+
+	/**
+	 * Number of dynamic splits collapsed back into a single 2MB entry after their pages became identical again.
+	 */
+	SIZE_T CoalescedSplitCount;
+
+	/**
+	 * TRUE if the directory in PML2 of the same index is a private copy owned by this page table.
+	 * Shared directories must never be written to.
+	 */
+	BOOLEAN PML2Private[VMM_EPT_PML3E_COUNT];
+
+	/**
+	 * Number of private directories in PML2, copied from the identity map or created on demand.
+	 */
+	SIZE_T PrivatePML2Count;
+
+	/**
+	 * The shared identity map that this page table was created from.
+	 */
+	PVMM_EPT_IDENTITY_MAP IdentityMap;
+
+	/**
+	 * List of all allocated dynamic splits.
+	 * A dynamic split is a 2MB page that's been split into 512 4096 size pages.
+	 * This is used only on request when a specific page's protections need to be split, and the split is
+	 * coalesced again once its pages are identical.
+	 */
+	LIST_ENTRY DynamicSplitList;
+
+	/**
+	 * List of currently active page hooks. Page hooks are a shadow hooking mechanism which is capable of transparently swapping
+	 * instructions when instructions of a page are executed. But, when the page is read or written to, the shadow page will be updated
+	 * to reflect the changes without affecting the hook. This creates an invisible hook that the kernel cannot detect through typical means,
+	 * such as code checksum analysis.
+	 */
+	LIST_ENTRY PageHookList;
+
+	/**
+	 * Page hooks whose original page is mapped for the single instruction the guest is stepping with the monitor trap
+	 * flag, linked through NextMonitorTrapHook. NULL when the monitor trap flag is not set.
+	 */
+	PVMM_EPT_PAGE_HOOK MonitorTrapHooks;
+
+	/**
+	 * Index of every hook in PageHookList by physical page frame. Used by the EPT violation handler
+	 * to find the hook for a faulting address without walking the list.
+	 */
+	VMM_EPT_HOOK_INDEX HookIndex;
+
+};
+
+#pragma warning(push, 0)
+struct _VMM_EPT_DYNAMIC_SPLIT
+{
+	/*
+	 * The 4096 byte page table entries that correspond to the split 2MB table entry. A page of its own, apart from
+	 * the rest of the split.
+	 */
+	PEPT_PML1_ENTRY PML1;
+
+	/*
+	 * The physical address of PML1.
+	 */
+	SIZE_T PML1Physical;
+
+	/*
+	 * The pointer to the 2MB entry in the page table which this split is servicing.
+	 */
+	union
+	{
+		PEPT_PML2_ENTRY Entry;
+		PEPT_PML2_POINTER Pointer;
+	};
+
+	/*
+	 * The page table which owns this split and is allowed to modify it, or NULL if the split belongs to the
+	 * shared identity map.
+	 */
+	PVMM_EPT_PAGE_TABLE Owner;
+
+	/*
+	 * Linked list entries for each dynamic split
+	 */
+	LIST_ENTRY DynamicSplitList;
+
+};
+#pragma warning(pop, 0)
+
+struct _VMM_EPT_PAGE_HOOK
+{
+	/*
+	 * Storage of FakePage and SparePage, which trade places each time the shadow page changes.
+	 */
+	DECLSPEC_ALIGN(PAGE_SIZE) CHAR ShadowPages[2][PAGE_SIZE];
+
+	/*
+	 * The fake page we copied from physical memory. This page will be swapped in
+	 * with our changes when executed and swapped out when read. It carries the patches
+	 * of every function hooked within the page.
+	 */
+	PCHAR FakePage;
+
+	/**
+	 * The physical page frame number of FakePage. Translated when the page hook is allocated, since the OS cannot
+	 * translate it from VMX root, where the hook may be bound.
+	 */
+	SIZE_T FakePageFrameNumber;
+
+	/**
+	 * The other page of ShadowPages. Once FakePage is mapped, it is never written again: changes are built here and
+	 * switched in by HvEptSwitchShadowPage.
+	 */
+	PCHAR SparePage;
+
+	/**
+	 * The physical page frame number of SparePage.
+	 */
+	SIZE_T SparePageFrameNumber;
+
+	/**
+	 * Linked list entires for each page hook.
+	 */
+	LIST_ENTRY PageHookList;
+
+	/**
+	 * The base address of the page. Used to find this structure in the list of page hooks
+	 * when a hook is hit.
+	 */
+	SIZE_T PhysicalBaseAddress;
+
+	/*
+	 * The page entry in the page tables that this page is targetting.  
+	 */
+	PEPT_PML1_ENTRY TargetPage;
+
+	/*
+	 * The entry of the page in the execute view, which always maps the shadow page so that the hook swaps by
+	 * switching views instead of entries. NULL if the processor has no execute view.
+	 */
+	PEPT_PML1_ENTRY ExecuteTargetPage;
+
+	/**
+	 * The original page entry. Will be copied back when the hook is removed
+	 * from the page.
+	 */
+	EPT_PML1_ENTRY OriginalEntry;
+
+	/**
+	 * The fake entry which points the page entry to FakePage in this structure. This is
+	 * the entry that will be installed when the shadow entry is not currently swapped in.
+	 * This page is marked executable only. If this page is read or written to, the HookedEntry
+	 * will be swapped in.
+	 */
+	EPT_PML1_ENTRY ShadowEntry;
+
+	/**
+	 * This entry points back to the original page of physical memory. This entry is modified
+	 * to not be executable. When this entry is swapped in and instructions are fetched from this
+	 * page, the ShadowEntry will be swapped in.
+	 */
+	EPT_PML1_ENTRY HookedEntry;
+
+	/**
+	 * The original page mapped readable, writable and executable. Installed for a single instruction by the
+	 * monitor trap strategy.
+	 */
+	EPT_PML1_ENTRY MonitorTrapEntry;
+
+	/**
+	 * How this page hook currently swaps between the shadow page and the original page. Either
+	 * VmmEptHookStrategySwap or VmmEptHookStrategyMonitorTrap.
+	 */
+	VMM_EPT_HOOK_STRATEGY Strategy;
+
+	/**
+	 * The strategy the page was hooked with, which may be VmmEptHookStrategyAdaptive.
+	 */
+	VMM_EPT_HOOK_STRATEGY RequestedStrategy;
+
+	/**
+	 * The next page hook whose MonitorTrapEntry is installed until the pending monitor trap exit, if any.
+	 */
+	PVMM_EPT_PAGE_HOOK NextMonitorTrapHook;
+
+	/**
+	 * Exits and swaps taken on this page, and its current swap rate.
+	 */
+	VMM_EPT_HOOK_STATISTICS Statistics;
+
+	/**
+	 * List of the hooks of every function patched in FakePage.
+	 */
+	LIST_ENTRY FunctionHookList;
+
+	/**
+	 * Number of hooks in FunctionHookList. The page hook is removed along with the last of them.
+	 */
+	SIZE_T FunctionHookCount;
+};
+
+/**
+ * The trampoline of a hooked function, which runs the instructions overwritten by the patch and jumps back into the
+ * function. There is only one per function, shared by the function hooks of every processor, as callers keep a
+ * single pointer to it. It is freed once the function is no longer hooked on any processor.
+ */
+struct _VMM_EPT_TRAMPOLINE
+{
+	/**
+	 * Linked list entries for each trampoline in TrampolineList of the global context.
+	 */
+	LIST_ENTRY TrampolineList;
+
+	/**
+	 * The global context, whose TrampolineLock protects ReferenceCount.
+	 */
+	PVMM_CONTEXT GlobalContext;
+
+	/**
+	 * The hooked function.
+	 */
+	PVOID TargetFunction;
+
+	/**
+	 * Number of function hooks using the trampoline, across all processors.
+	 */
+	SIZE_T ReferenceCount;
+
+	/**
+	 * The executable code: the PatchSize bytes overwritten by the patch, followed by an absolute jump.
+	 */
+	PCHAR Code;
+};
+
+/**
+ * A single hooked function within the page of a page hook.
+ */
+struct _VMM_EPT_FUNCTION_HOOK
+{
+	/**
+	 * Linked list entries for each function hook of the page hook.
+	 */
+	LIST_ENTRY FunctionHookList;
+
+	/**
+	 * The page hook whose shadow page carries the patch of this function.
+	 */
+	PVMM_EPT_PAGE_HOOK PageHook;
+
+	/**
+	 * Offset of the function into the page.
+	 */
+	SIZE_T OffsetIntoPage;
+
+	/**
+	 * Number of bytes of whole instructions overwritten by the patch, which are copied into the trampoline.
+	 */
+	SIZE_T PatchSize;
+
+	/**
+	 * The trampoline function which is used in the inline hook, shared with the hooks of the same function on the
+	 * other processors.
+	 */
+	PVMM_EPT_TRAMPOLINE Trampoline;
+};
+
+/**
+ * A function added to a hook transaction.
+ */
+typedef struct _VMM_EPT_HOOK_TRANSACTION_FUNCTION
+{
+	/**
+	 * Linked list entries for each function of the transaction page.
+	 */
+	LIST_ENTRY TransactionFunctionList;
+
+	/**
+	 * Receives the trampoline of the function once the transaction is done.
+	 */
+	PVOID* OrigFunction;
+
+	/**
+	 * The hook of the function for each processor, indexed by processor number. They all share one trampoline.
+	 */
+	PVMM_EPT_FUNCTION_HOOK FunctionHooks[ANYSIZE_ARRAY];
+} VMM_EPT_HOOK_TRANSACTION_FUNCTION, *PVMM_EPT_HOOK_TRANSACTION_FUNCTION;
+
+/**
+ * A page of a hook transaction, as prepared for a single processor.
+ */
+typedef struct _VMM_EPT_HOOK_TRANSACTION_TARGET
+{
+	/**
+	 * The page hook prepared for the processor. Once applied, it belongs to the processor, unless the processor
+	 * already hooked the page and took its function hooks instead.
+	 */
+	PVMM_EPT_PAGE_HOOK PageHook;
+
+	/**
+	 * Set by the processor once the page is hooked in its EPT.
+	 */
+	BOOLEAN Applied;
+} VMM_EPT_HOOK_TRANSACTION_TARGET, *PVMM_EPT_HOOK_TRANSACTION_TARGET;
+
+/**
+ * Every function of a hook transaction within the same 4096 byte page.
+ */
+typedef struct _VMM_EPT_HOOK_TRANSACTION_PAGE
+{
+	/**
+	 * Linked list entries for each page of the transaction.
+	 */
+	LIST_ENTRY TransactionPageList;
+
+	/**
+	 * Base address of the page.
+	 */
+	SIZE_T PhysicalBaseAddress;
+
+	/**
+	 * List of the functions hooked in the page.
+	 */
+	LIST_ENTRY TransactionFunctionList;
+
+	/**
+	 * Number of functions in TransactionFunctionList.
+	 */
+	SIZE_T FunctionCount;
+
+	/**
+	 * The page as prepared for each processor, indexed by processor number. The page hook of processor 0 is patched
+	 * as functions are added, and copied for every other processor once the transaction is committed.
+	 */
+	VMM_EPT_HOOK_TRANSACTION_TARGET Targets[ANYSIZE_ARRAY];
+} VMM_EPT_HOOK_TRANSACTION_PAGE, *PVMM_EPT_HOOK_TRANSACTION_PAGE;
+
+/**
+ * A batch of function hooks installed on every processor with a single broadcast.
+ */
+typedef struct _VMM_EPT_HOOK_TRANSACTION
+{
+	/**
+	 * The global context, to find the context of each processor.
+	 */
+	PVMM_CONTEXT GlobalContext;
+
+	/**
+	 * List of the pages with functions to hook.
+	 */
+	LIST_ENTRY TransactionPageList;
+
+	/**
+	 * Number of pages in TransactionPageList.
+	 */
+	SIZE_T PageCount;
+
+	/**
+	 * Number of functions in all pages.
+	 */
+	SIZE_T FunctionCount;
+
+	/**
+	 * Number of processors that applied every page.
+	 */
+	volatile LONG CommittedCount;
+} VMM_EPT_HOOK_TRANSACTION, *PVMM_EPT_HOOK_TRANSACTION;
+
+PVMM_EPT_FUNCTION_HOOK HvEptRemovePageHook(PVMM_PROCESSOR_CONTEXT ProcessorContext, SIZE_T PhysicalAddress);
+
+PVMM_EPT_TRAMPOLINE HvEptAcquireTrampoline(PVMM_CONTEXT GlobalContext, PVOID TargetFunction, SIZE_T PatchSize);
+
+VOID HvEptReferenceTrampoline(PVMM_EPT_TRAMPOLINE Trampoline);
+
+VOID HvEptReleaseTrampoline(PVMM_EPT_TRAMPOLINE Trampoline);
+
+BOOL HvEptAddPageHookEx(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVOID TargetFunction, PVOID HookFunction, PVOID* OrigFunction, VMM_EPT_HOOK_STRATEGY Strategy);
+
+PVMM_EPT_HOOK_TRANSACTION HvEptBeginHookTransaction(PVMM_CONTEXT GlobalContext);
+
+BOOL HvEptAddHookToTransaction(PVMM_EPT_HOOK_TRANSACTION Transaction, PVOID TargetFunction, PVOID HookFunction, PVOID* OrigFunction, VMM_EPT_HOOK_STRATEGY Strategy);
+
+BOOL HvEptCommitHookTransaction(PVMM_EPT_HOOK_TRANSACTION Transaction);
+
+VOID HvEptAbortHookTransaction(PVMM_EPT_HOOK_TRANSACTION Transaction);
+
+SIZE_T HvEptApplyHookTransaction(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_HOOK_TRANSACTION Transaction, SIZE_T ProcessorNumber);
+
+SIZE_T HvEptRollBackHookTransaction(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_HOOK_TRANSACTION Transaction, SIZE_T ProcessorNumber);
+
+BOOL HvEptSwitchView(PVMM_CONTEXT GlobalContext, VMM_EPT_VIEW View);
+
+BOOL HvEptCreateView(PVMM_PROCESSOR_CONTEXT ProcessorContext, VMM_EPT_VIEW* View);
+
+BOOL HvEptSetViewPermissions(PVMM_PROCESSOR_CONTEXT ProcessorContext, VMM_EPT_VIEW View, SIZE_T PhysicalAddress, SIZE_T Size, BOOLEAN ReadAccess, BOOLEAN WriteAccess, BOOLEAN ExecuteAccess);
+
+BOOL HvEptSetCurrentView(PVMM_PROCESSOR_CONTEXT ProcessorContext, VMM_EPT_VIEW View);
+
+VOID HvEptBeginEditBatch(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMM_EPT_EDIT_BATCH Batch);
+
+BOOL HvEptQueuePermissions(PVMM_EPT_EDIT_BATCH Batch, VMM_EPT_VIEW View, SIZE_T PhysicalAddress, BOOLEAN LargePage, BOOLEAN ReadAccess, BOOLEAN WriteAccess, BOOLEAN ExecuteAccess);
+
+BOOL HvEptQueueFrame(PVMM_EPT_EDIT_BATCH Batch, VMM_EPT_VIEW View, SIZE_T PhysicalAddress, BOOLEAN LargePage, SIZE_T TargetPhysicalAddress);
+
+BOOL HvEptCommitEditBatch(PVMM_EPT_EDIT_BATCH Batch);
+
+BOOL HvEptPublishEditBatch(PVMM_CONTEXT GlobalContext, PVMM_EPT_EDIT_BATCH Batch, BOOLEAN Urgent);
+
+VOID HvEptApplySharedEdits(PVMM_PROCESSOR_CONTEXT ProcessorContext);
+
+/*
+ * Defined in ept_map.c. These only work on MTRR state that was already read, so they can be run outside of the VMM.
+ */
+extern MTRR_FIXED_RANGE_DESCRIPTOR HvEptFixedRangeMtrrs[VMM_EPT_FIXED_RANGE_MTRR_COUNT];
+
+VOID HvEptDecodeFixedRangeMtrr(PMTRR_FIXED_RANGE_DESCRIPTOR Descriptor, SIZE_T MsrValue, PUCHAR PageMemoryTypes);
+
+BOOL HvEptBuildMemoryRuns(PVMM_CONTEXT GlobalContext, UCHAR DefaultMemoryType);
+
+ULONG HvEptFindMemoryRun(PVMM_CONTEXT GlobalContext, SIZE_T PhysicalAddress);
+
+UCHAR HvEptGetRunMemoryType(PMTRR_MEMORY_RUN Run);
+
+PMTRR_MEMORY_RUN HvEptGetUniformMemoryRun(PVMM_CONTEXT GlobalContext, SIZE_T BaseAddress, SIZE_T Size);
+
+BOOL HvEptGetUniformMemoryType(PVMM_CONTEXT GlobalContext, SIZE_T BaseAddress, SIZE_T Size, PUCHAR MemoryType);
+
+UCHAR HvEptGetPageMemoryType(PVMM_CONTEXT GlobalContext, SIZE_T PhysicalAddress);
+
+BOOLEAN HvEptIsInPhysicalRanges(POS_PHYSICAL_MEMORY_RANGE Ranges, SIZE_T NumberOfRanges, SIZE_T PhysicalAddress);
+
+BOOLEAN HvEptIsPhysicalMemory(PVMM_CONTEXT GlobalContext, SIZE_T PhysicalAddress);
+
+BOOLEAN HvEptIsKnownPhysicalAddress(PVMM_CONTEXT GlobalContext, SIZE_T PhysicalAddress);
+
+VOID HvEptFreeIdentityMap(PVMM_EPT_IDENTITY_MAP IdentityMap);
+
+BOOL HvEptFillPml2Directory(PVMM_CONTEXT GlobalContext, PVMM_EPT_IDENTITY_MAP IdentityMap, PVMM_EPT_PML2_DIRECTORY Directory, SIZE_T EntryGroupIndex);
+
+/*
+ * Defined in ept_index.c.
+ */
+BOOL HvEptHookIndexInitialize(PVMM_EPT_HOOK_INDEX Index, SIZE_T SlotCount);
+
+VOID HvEptHookIndexFree(PVMM_EPT_HOOK_INDEX Index);
+
+BOOL HvEptHookIndexInsert(PVMM_EPT_HOOK_INDEX Index, PVMM_EPT_PAGE_HOOK Hook);
+
+PVMM_EPT_PAGE_HOOK HvEptHookIndexLookup(PVMM_EPT_HOOK_INDEX Index, SIZE_T PhysicalAddress);
+
+BOOL HvEptHookIndexRemove(PVMM_EPT_HOOK_INDEX Index, SIZE_T PhysicalAddress);
+
+VOID HvEptHandleVirtualizationException();
+
+/*
+ * Defined in vmxdefs.asm.
+ *
+ * Guest interrupt handler for #VE. Saves volatile registers and calls HvEptHandleVirtualizationException.
+ */
+VOID HvEptVirtualizationExceptionEntry();
@@ -0,0 +1,184 @@
+#include "util.h"
+#include "vmm.h"
+
+/**
+ * Allocate the slots of a page hook index. SlotCount must be a power of two.
+ */
+BOOL HvEptHookIndexInitialize(PVMM_EPT_HOOK_INDEX Index, SIZE_T SlotCount)
+{
+	ULONG HighestBit;
+
+	if (SlotCount == 0 || (SlotCount & (SlotCount - 1)) != 0)
+	{
+		HvUtilLogError("HvEptHookIndexInitialize: Slot count %lld is not a power of two.\n", SlotCount);
+		return FALSE;
+	}
+
+	Index->Slots = (PVMM_EPT_HOOK_INDEX_SLOT)OsAllocateNonpagedMemory(SlotCount * sizeof(VMM_EPT_HOOK_INDEX_SLOT));
+	if (!Index->Slots)
+	{
+		HvUtilLogError("HvEptHookIndexInitialize: Failed to allocate hook index.\n");
+		return FALSE;
+	}
+
+	/* Empty slots are recognized by a NULL hook pointer. */
+	OsZeroMemory(Index->Slots, SlotCount * sizeof(VMM_EPT_HOOK_INDEX_SLOT));
+
+	_BitScanReverse64(&HighestBit, SlotCount);
+
+	Index->SlotCount = SlotCount;
+	Index->HashShift = 64 - HighestBit;
+	Index->HookCount = 0;
+
+	/* A single slot index would need a 64-bit shift, which is undefined. Keep everything in slot 0 instead. */
+	if (HighestBit == 0)
+	{
+		Index->HashShift = 63;
+	}
+
+	return TRUE;
+}
+
+
+/**
+ * Free the slots of a page hook index. Does not free the hooks themselves.
+ */
+VOID HvEptHookIndexFree(PVMM_EPT_HOOK_INDEX Index)
+{
+	if (Index->Slots)
+	{
+		OsFreeNonpagedMemory(Index->Slots);
+		Index->Slots = NULL;
+	}
+
+	Index->SlotCount = 0;
+	Index->HookCount = 0;
+}
+
+
+/**
+ * Hash a physical page frame number to the slot where its probe sequence starts.
+ * 
+ * Frame numbers of hooked pages tend to be clustered (code pages of the same driver image), so they are
+ * spread across the index with Fibonacci hashing: multiply by 2^64 / golden ratio and keep the top bits.
+ */
+SIZE_T HvEptHookIndexHash(PVMM_EPT_HOOK_INDEX Index, SIZE_T PageFrameNumber)
+{
+	return ((PageFrameNumber * 0x9E3779B97F4A7C15ULL) >> Index->HashShift) & (Index->SlotCount - 1);
+}
+
+
+/**
+ * Add a page hook to the index. Returns FALSE if the index is too full to accept another hook.
+ */
+BOOL HvEptHookIndexInsert(PVMM_EPT_HOOK_INDEX Index, PVMM_EPT_PAGE_HOOK Hook)
+{
+	SIZE_T PageFrameNumber;
+	SIZE_T Slot;
+
+	/* Keep at least a quarter of the slots empty so that lookups for missing pages terminate quickly. */
+	if ((Index->HookCount + 1) * 4 > Index->SlotCount * 3)
+	{
+		HvUtilLogError("HvEptHookIndexInsert: Hook index is full. Increase VMM_SETTING_EPT_HOOK_INDEX_SIZE.\n");
+		return FALSE;
+	}
+
+	PageFrameNumber = Hook->PhysicalBaseAddress / PAGE_SIZE;
+
+	/* Linear probe for the first empty slot. */
+	for (Slot = HvEptHookIndexHash(Index, PageFrameNumber);
+		Index->Slots[Slot].Hook != NULL;
+		Slot = (Slot + 1) & (Index->SlotCount - 1))
+	{
+		if (Index->Slots[Slot].PageFrameNumber == PageFrameNumber)
+		{
+			HvUtilLogError("HvEptHookIndexInsert: Page 0x%llX is already hooked.\n", Hook->PhysicalBaseAddress);
+			return FALSE;
+		}
+	}
+
+	Index->Slots[Slot].PageFrameNumber = PageFrameNumber;
+	Index->Slots[Slot].Hook = Hook;
+	Index->HookCount++;
+
+	return TRUE;
+}
+
+
+/**
+ * Find the page hook servicing the page containing PhysicalAddress. Returns NULL if that page is not hooked.
+ * 
+ * Safe to call from the exit handler, as it does not call into the OS.
+ */
+PVMM_EPT_PAGE_HOOK HvEptHookIndexLookup(PVMM_EPT_HOOK_INDEX Index, SIZE_T PhysicalAddress)
+{
+	SIZE_T PageFrameNumber;
+	SIZE_T Slot;
+
+	PageFrameNumber = PhysicalAddress / PAGE_SIZE;
+
+	/* The probe sequence for a frame ends at the first empty slot. */
+	for (Slot = HvEptHookIndexHash(Index, PageFrameNumber);
+		Index->Slots[Slot].Hook != NULL;
+		Slot = (Slot + 1) & (Index->SlotCount - 1))
+	{
+		if (Index->Slots[Slot].PageFrameNumber == PageFrameNumber)
+		{
+			return Index->Slots[Slot].Hook;
+		}
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Remove the page hook servicing the page containing PhysicalAddress from the index. Returns FALSE if that page is not hooked.
+ * 
+ * Entries further along the probe sequence are shifted back into the freed slot where they are allowed to go, so
+ * that no lookup stops early at the hole and the index never needs tombstones.
+ */
+BOOL HvEptHookIndexRemove(PVMM_EPT_HOOK_INDEX Index, SIZE_T PhysicalAddress)
+{
+	SIZE_T PageFrameNumber;
+	SIZE_T Mask;
+	SIZE_T Hole;
+	SIZE_T Slot;
+	SIZE_T Home;
+
+	PageFrameNumber = PhysicalAddress / PAGE_SIZE;
+	Mask = Index->SlotCount - 1;
+
+	for (Hole = HvEptHookIndexHash(Index, PageFrameNumber);
+		Index->Slots[Hole].Hook != NULL;
+		Hole = (Hole + 1) & Mask)
+	{
+		if (Index->Slots[Hole].PageFrameNumber == PageFrameNumber)
+		{
+			break;
+		}
+	}
+
+	if (Index->Slots[Hole].Hook == NULL)
+	{
+		return FALSE;
+	}
+
+	for (Slot = (Hole + 1) & Mask; Index->Slots[Slot].Hook != NULL; Slot = (Slot + 1) & Mask)
+	{
+		Home = HvEptHookIndexHash(Index, Index->Slots[Slot].PageFrameNumber);
+
+		/* The entry can fill the hole if the hole lies between its home slot and where it is now */
+		if (((Slot - Home) & Mask) >= ((Slot - Hole) & Mask))
+		{
+			Index->Slots[Hole] = Index->Slots[Slot];
+			Hole = Slot;
+		}
+	}
+
+	Index->Slots[Hole].PageFrameNumber = 0;
+	Index->Slots[Hole].Hook = NULL;
+	Index->HookCount--;
+
+	return TRUE;
+}
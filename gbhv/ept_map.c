@@ -0,0 +1,577 @@
+#include "util.h"
+#include "vmm.h"
+
+/**
+ * The fixed range MTRRs, which together describe the memory type of the first 1MB of physical memory.
+ * 11.11.2.2 Fixed Range MTRRs
+ */
+MTRR_FIXED_RANGE_DESCRIPTOR HvEptFixedRangeMtrrs[VMM_EPT_FIXED_RANGE_MTRR_COUNT] =
+{
+	{ IA32_MTRR_FIX64K_00000, 0x00000, 0x10000 },
+	{ IA32_MTRR_FIX16K_80000, 0x80000, 0x4000 },
+	{ IA32_MTRR_FIX16K_A0000, 0xA0000, 0x4000 },
+	{ IA32_MTRR_FIX4K_C0000,  0xC0000, 0x1000 },
+	{ IA32_MTRR_FIX4K_C8000,  0xC8000, 0x1000 },
+	{ IA32_MTRR_FIX4K_D0000,  0xD0000, 0x1000 },
+	{ IA32_MTRR_FIX4K_D8000,  0xD8000, 0x1000 },
+	{ IA32_MTRR_FIX4K_E0000,  0xE0000, 0x1000 },
+	{ IA32_MTRR_FIX4K_E8000,  0xE8000, 0x1000 },
+	{ IA32_MTRR_FIX4K_F0000,  0xF0000, 0x1000 },
+	{ IA32_MTRR_FIX4K_F8000,  0xF8000, 0x1000 },
+};
+
+/**
+ * Decode the value of one fixed range MTRR into the memory type of each 4096 byte page it describes.
+ * 
+ * PageMemoryTypes is indexed by the page frame number of each page in the first 1MB of physical memory.
+ * Does not read any MSRs, so a dump of the MTRRs of any system can be decoded with it.
+ */
+VOID HvEptDecodeFixedRangeMtrr(PMTRR_FIXED_RANGE_DESCRIPTOR Descriptor, SIZE_T MsrValue, PUCHAR PageMemoryTypes)
+{
+	SIZE_T RangeIndex;
+	SIZE_T PageIndex;
+	SIZE_T FirstPage;
+	UCHAR MemoryType;
+
+	/* Eight ranges per MSR, one byte each, starting from the lowest address in the low byte */
+	for (RangeIndex = 0; RangeIndex < 8; RangeIndex++)
+	{
+		MemoryType = (UCHAR)(MsrValue >> (RangeIndex * 8));
+		FirstPage = (Descriptor->BaseAddress + (RangeIndex * Descriptor->RangeSize)) / PAGE_SIZE;
+
+		for (PageIndex = 0; PageIndex < Descriptor->RangeSize / PAGE_SIZE; PageIndex++)
+		{
+			PageMemoryTypes[FirstPage + PageIndex] = MemoryType;
+		}
+	}
+}
+
+
+/**
+ * Resolve the memory type of a single physical address from the variable range MTRRs.
+ * 
+ * Only used while building the memory type runs. Everything else should look up the run containing the address.
+ */
+UCHAR HvEptResolveMemoryType(PVMM_CONTEXT GlobalContext, SIZE_T PhysicalAddress, UCHAR DefaultMemoryType)
+{
+	ULONG CurrentMtrrRange;
+	PMTRR_RANGE_DESCRIPTOR Range;
+	UCHAR TargetMemoryType;
+	BOOL RangeFound;
+
+	TargetMemoryType = DefaultMemoryType;
+	RangeFound = FALSE;
+
+	for (CurrentMtrrRange = 0; CurrentMtrrRange < GlobalContext->NumberOfEnabledMemoryRanges; CurrentMtrrRange++)
+	{
+		Range = &GlobalContext->MemoryRanges[CurrentMtrrRange];
+
+		if (PhysicalAddress < Range->PhysicalBaseAddress || PhysicalAddress > Range->PhysicalEndAddress)
+		{
+			continue;
+		}
+
+		/* The first range covering the address replaces the default type */
+		if (!RangeFound)
+		{
+			TargetMemoryType = Range->MemoryType;
+			RangeFound = TRUE;
+			continue;
+		}
+
+		/* 11.11.4.1 MTRR Precedences */
+		if (TargetMemoryType == Range->MemoryType)
+		{
+			continue;
+		}
+
+		if ((TargetMemoryType == MEMORY_TYPE_WRITE_THROUGH && Range->MemoryType == MEMORY_TYPE_WRITE_BACK)
+			|| (TargetMemoryType == MEMORY_TYPE_WRITE_BACK && Range->MemoryType == MEMORY_TYPE_WRITE_THROUGH))
+		{
+			/* WT and WB overlapping is WT */
+			TargetMemoryType = MEMORY_TYPE_WRITE_THROUGH;
+		}
+		else
+		{
+			/* UC always takes precedence, and any other combination is undefined, so be safe and make it UC. */
+			TargetMemoryType = MEMORY_TYPE_UNCACHEABLE;
+		}
+	}
+
+	return TargetMemoryType;
+}
+
+
+/**
+ * Determine whether a physical address lies within any of NumberOfRanges ranges.
+ */
+BOOLEAN HvEptIsInPhysicalRanges(POS_PHYSICAL_MEMORY_RANGE Ranges, SIZE_T NumberOfRanges, SIZE_T PhysicalAddress)
+{
+	SIZE_T RangeIndex;
+
+	for (RangeIndex = 0; RangeIndex < NumberOfRanges; RangeIndex++)
+	{
+		if (PhysicalAddress >= Ranges[RangeIndex].BaseAddress && PhysicalAddress - Ranges[RangeIndex].BaseAddress < Ranges[RangeIndex].NumberOfBytes)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/**
+ * Determine whether a physical address is backed by RAM according to the OS.
+ * 
+ * Every address counts as backed unless MapPhysicalMemoryOnly is set in the global context.
+ */
+BOOLEAN HvEptIsPhysicalMemory(PVMM_CONTEXT GlobalContext, SIZE_T PhysicalAddress)
+{
+	if (!GlobalContext->MapPhysicalMemoryOnly)
+	{
+		return TRUE;
+	}
+
+	return HvEptIsInPhysicalRanges(GlobalContext->PhysicalMemoryRanges, GlobalContext->NumberOfPhysicalMemoryRanges, PhysicalAddress);
+}
+
+/**
+ * Determine whether the OS knows of anything at a physical address: RAM, or memory assigned to a device when the
+ * hypervisor was loaded. Every address counts as known if the OS could not report all of them.
+ */
+BOOLEAN HvEptIsKnownPhysicalAddress(PVMM_CONTEXT GlobalContext, SIZE_T PhysicalAddress)
+{
+	if (!GlobalContext->PhysicalAddressRangesKnown)
+	{
+		return TRUE;
+	}
+
+	return HvEptIsInPhysicalRanges(GlobalContext->PhysicalMemoryRanges, GlobalContext->NumberOfPhysicalMemoryRanges, PhysicalAddress)
+		|| HvEptIsInPhysicalRanges(GlobalContext->DeviceMemoryRanges, GlobalContext->NumberOfDeviceMemoryRanges, PhysicalAddress);
+}
+
+/**
+ * Build the sorted, non-overlapping runs of memory types of all physical memory that EPT can describe.
+ * 
+ * The variable range MTRRs can overlap and leave gaps which take the default type, so finding the type of an address
+ * from them requires scanning and resolving every range. Instead, this is done once here: every base and end of a range
+ * becomes a boundary, the type between two boundaries is resolved once, and neighbouring runs of the same type are merged.
+ * The identity map builder then simply walks the runs in order.
+ * 
+ * The start and end of every RAM range reported by the OS are boundaries too, so that each run is either entirely
+ * backed by RAM or not at all.
+ */
+BOOL HvEptBuildMemoryRuns(PVMM_CONTEXT GlobalContext, UCHAR DefaultMemoryType)
+{
+	PSIZE_T Boundaries;
+	SIZE_T Boundary;
+	ULONG NumberOfBoundaries;
+	ULONG CurrentMtrrRange;
+	ULONG BoundaryIndex;
+	ULONG SortIndex;
+	SIZE_T RangeIndex;
+	PMTRR_MEMORY_RUN Run;
+	UCHAR MemoryType;
+	BOOLEAN Backed;
+
+	Boundaries = (PSIZE_T)OsAllocateNonpagedMemory(sizeof(SIZE_T) * (VMM_EPT_MEMORY_RUN_MAX + 1));
+	if (!Boundaries)
+	{
+		HvUtilLogError("HvEptBuildMemoryRuns: Failed to allocate boundaries.\n");
+		return FALSE;
+	}
+
+	NumberOfBoundaries = 0;
+	Boundaries[NumberOfBoundaries++] = 0;
+	Boundaries[NumberOfBoundaries++] = VMM_EPT_PHYSICAL_ADDRESS_LIMIT;
+
+	for (CurrentMtrrRange = 0; CurrentMtrrRange < GlobalContext->NumberOfEnabledMemoryRanges; CurrentMtrrRange++)
+	{
+		/* Ranges beyond what EPT can describe do not matter */
+		if (GlobalContext->MemoryRanges[CurrentMtrrRange].PhysicalBaseAddress < VMM_EPT_PHYSICAL_ADDRESS_LIMIT)
+		{
+			Boundaries[NumberOfBoundaries++] = GlobalContext->MemoryRanges[CurrentMtrrRange].PhysicalBaseAddress;
+		}
+
+		if (GlobalContext->MemoryRanges[CurrentMtrrRange].PhysicalEndAddress + 1 < VMM_EPT_PHYSICAL_ADDRESS_LIMIT)
+		{
+			Boundaries[NumberOfBoundaries++] = GlobalContext->MemoryRanges[CurrentMtrrRange].PhysicalEndAddress + 1;
+		}
+	}
+
+	for (RangeIndex = 0; RangeIndex < GlobalContext->NumberOfPhysicalMemoryRanges; RangeIndex++)
+	{
+		if (GlobalContext->PhysicalMemoryRanges[RangeIndex].BaseAddress < VMM_EPT_PHYSICAL_ADDRESS_LIMIT)
+		{
+			Boundaries[NumberOfBoundaries++] = GlobalContext->PhysicalMemoryRanges[RangeIndex].BaseAddress;
+		}
+
+		if (GlobalContext->PhysicalMemoryRanges[RangeIndex].BaseAddress + GlobalContext->PhysicalMemoryRanges[RangeIndex].NumberOfBytes < VMM_EPT_PHYSICAL_ADDRESS_LIMIT)
+		{
+			Boundaries[NumberOfBoundaries++] = GlobalContext->PhysicalMemoryRanges[RangeIndex].BaseAddress + GlobalContext->PhysicalMemoryRanges[RangeIndex].NumberOfBytes;
+		}
+	}
+
+	/* There are only a handful of ranges on real systems, so a simple insertion sort is plenty. */
+	for (BoundaryIndex = 1; BoundaryIndex < NumberOfBoundaries; BoundaryIndex++)
+	{
+		Boundary = Boundaries[BoundaryIndex];
+
+		for (SortIndex = BoundaryIndex; SortIndex > 0 && Boundaries[SortIndex - 1] > Boundary; SortIndex--)
+		{
+			Boundaries[SortIndex] = Boundaries[SortIndex - 1];
+		}
+
+		Boundaries[SortIndex] = Boundary;
+	}
+
+	GlobalContext->NumberOfMemoryRuns = 0;
+
+	/* Resolve the type between each pair of distinct boundaries, merging it into the previous run if nothing changed. */
+	for (BoundaryIndex = 0; BoundaryIndex + 1 < NumberOfBoundaries; BoundaryIndex++)
+	{
+		if (Boundaries[BoundaryIndex] == Boundaries[BoundaryIndex + 1])
+		{
+			continue;
+		}
+
+		MemoryType = HvEptResolveMemoryType(GlobalContext, Boundaries[BoundaryIndex], DefaultMemoryType);
+		Backed = HvEptIsPhysicalMemory(GlobalContext, Boundaries[BoundaryIndex]);
+
+		if (GlobalContext->NumberOfMemoryRuns > 0)
+		{
+			Run = &GlobalContext->MemoryRuns[GlobalContext->NumberOfMemoryRuns - 1];
+
+			if (Run->MemoryType == MemoryType && Run->Backed == Backed)
+			{
+				Run->PhysicalEndAddress = Boundaries[BoundaryIndex + 1] - 1;
+				continue;
+			}
+		}
+
+		Run = &GlobalContext->MemoryRuns[GlobalContext->NumberOfMemoryRuns++];
+		Run->PhysicalBaseAddress = Boundaries[BoundaryIndex];
+		Run->PhysicalEndAddress = Boundaries[BoundaryIndex + 1] - 1;
+		Run->MemoryType = MemoryType;
+		Run->Backed = Backed;
+
+		HvUtilLogDebug("Memory Run: Base=0x%llX End=0x%llX Type=0x%X Backed=%d\n", Run->PhysicalBaseAddress, Run->PhysicalEndAddress, Run->MemoryType, Run->Backed);
+	}
+
+	OsFreeNonpagedMemory(Boundaries);
+
+	HvUtilLogDebug("Total Memory Runs: %d\n", GlobalContext->NumberOfMemoryRuns);
+
+	return TRUE;
+}
+
+
+/**
+ * Find the index of the memory type run containing PhysicalAddress.
+ */
+ULONG HvEptFindMemoryRun(PVMM_CONTEXT GlobalContext, SIZE_T PhysicalAddress)
+{
+	ULONG Low;
+	ULONG High;
+	ULONG Middle;
+
+	Low = 0;
+	High = GlobalContext->NumberOfMemoryRuns - 1;
+
+	/* Binary search for the last run starting at or below the address */
+	while (Low < High)
+	{
+		Middle = (Low + High + 1) / 2;
+
+		if (GlobalContext->MemoryRuns[Middle].PhysicalBaseAddress <= PhysicalAddress)
+		{
+			Low = Middle;
+		}
+		else
+		{
+			High = Middle - 1;
+		}
+	}
+
+	return Low;
+}
+
+
+/**
+ * Get the memory type that EPT should map a run of memory with.
+ * 
+ * Memory which is not backed by RAM can only be MMIO, which must never be cached even if the MTRRs
+ * leave it write-back (for example, when the default type is WB).
+ */
+UCHAR HvEptGetRunMemoryType(PMTRR_MEMORY_RUN Run)
+{
+	if (!Run->Backed && Run->MemoryType == MEMORY_TYPE_WRITE_BACK)
+	{
+		return MEMORY_TYPE_UNCACHEABLE;
+	}
+
+	return Run->MemoryType;
+}
+
+
+/**
+ * Find the run containing all of the physical range [BaseAddress, BaseAddress + Size), or NULL if the range
+ * spans more than one run and so does not have a uniform memory type.
+ * 
+ * Does not consider the fixed range MTRRs, so it must not be used for ranges within the first 1MB.
+ */
+PMTRR_MEMORY_RUN HvEptGetUniformMemoryRun(PVMM_CONTEXT GlobalContext, SIZE_T BaseAddress, SIZE_T Size)
+{
+	PMTRR_MEMORY_RUN Run;
+
+	Run = &GlobalContext->MemoryRuns[HvEptFindMemoryRun(GlobalContext, BaseAddress)];
+
+	if (Run->PhysicalEndAddress < BaseAddress + Size - 1)
+	{
+		return NULL;
+	}
+
+	return Run;
+}
+
+
+/**
+ * Determine whether the memory type of the physical range [BaseAddress, BaseAddress + Size) is uniform according to the
+ * variable range MTRRs and, if it is, return the type to map it with in MemoryType.
+ * 
+ * Does not consider the fixed range MTRRs, so it must not be used for ranges within the first 1MB.
+ */
+BOOL HvEptGetUniformMemoryType(PVMM_CONTEXT GlobalContext, SIZE_T BaseAddress, SIZE_T Size, PUCHAR MemoryType)
+{
+	PMTRR_MEMORY_RUN Run;
+
+	Run = HvEptGetUniformMemoryRun(GlobalContext, BaseAddress, Size);
+	if (!Run)
+	{
+		return FALSE;
+	}
+
+	*MemoryType = HvEptGetRunMemoryType(Run);
+	return TRUE;
+}
+
+
+/**
+ * Get the memory type of a single 4096 byte page of physical memory.
+ */
+UCHAR HvEptGetPageMemoryType(PVMM_CONTEXT GlobalContext, SIZE_T PhysicalAddress)
+{
+	/* 11.11.4.1 The fixed ranges take precedence over the variable ranges within the first 1MB */
+	if (GlobalContext->FixedRangeMtrrsEnabled && PhysicalAddress < SIZE_1_MB)
+	{
+		return GlobalContext->FixedRangeMemoryTypes[PhysicalAddress / PAGE_SIZE];
+	}
+
+	/* Runs are always 4096 byte aligned, as are the MTRRs and RAM ranges they are made from, so a page is always within a single run */
+	return HvEptGetRunMemoryType(&GlobalContext->MemoryRuns[HvEptFindMemoryRun(GlobalContext, PhysicalAddress)]);
+}
+
+
+/**
+ * Free the shared identity map and all of its directories.
+ */
+VOID HvEptFreeIdentityMap(PVMM_EPT_IDENTITY_MAP IdentityMap)
+{
+	PVMM_EPT_DYNAMIC_SPLIT Split;
+	SIZE_T EntryIndex;
+
+	if (!IdentityMap)
+	{
+		return;
+	}
+
+	while (!IsListEmpty(&IdentityMap->DynamicSplitList))
+	{
+		Split = CONTAINING_RECORD(RemoveHeadList(&IdentityMap->DynamicSplitList), VMM_EPT_DYNAMIC_SPLIT, DynamicSplitList);
+		OsFreeContiguousAlignedPages(Split->PML1);
+		OsFreeNonpagedMemory(Split);
+	}
+
+	for (EntryIndex = 0; EntryIndex < VMM_EPT_PML3E_COUNT; EntryIndex++)
+	{
+		if (IdentityMap->PML2[EntryIndex])
+		{
+			OsFreeContiguousAlignedPages(IdentityMap->PML2[EntryIndex]);
+		}
+	}
+
+	OsFreeContiguousAlignedPages(IdentityMap);
+}
+
+
+/**
+ * Split a 2MB entry of the identity map into 512 4096 byte entries, each with the memory type of its own page.
+ * 
+ * Used for 2MB regions that do not have a single memory type, so that none of their pages need to be
+ * mapped with a more restrictive type than the MTRRs specify. The split is owned by the identity map.
+ * 
+ * If MapPhysicalMemoryOnly is set in the global context, pages not backed by RAM are left not present.
+ */
+BOOL HvEptSplitIdentityLargePage(PVMM_CONTEXT GlobalContext, PVMM_EPT_IDENTITY_MAP IdentityMap, PVMM_EPT_PML2_DIRECTORY Directory, SIZE_T EntryIndex)
+{
+	PVMM_EPT_DYNAMIC_SPLIT NewSplit;
+	PEPT_PML2_ENTRY TargetEntry;
+	EPT_PML2_POINTER NewPointer;
+	EPT_PML1_ENTRY EntryTemplate;
+	SIZE_T PageIndex;
+	SIZE_T PageFrameNumber;
+
+	TargetEntry = &Directory->PML2[EntryIndex];
+
+	NewSplit = (PVMM_EPT_DYNAMIC_SPLIT)OsAllocateNonpagedMemory(sizeof(VMM_EPT_DYNAMIC_SPLIT));
+	if (!NewSplit)
+	{
+		HvUtilLogError("HvEptSplitIdentityLargePage: Failed to allocate dynamic split memory.\n");
+		return FALSE;
+	}
+
+	NewSplit->PML1 = (PEPT_PML1_ENTRY)OsAllocateContiguousAlignedPages(1);
+	if (!NewSplit->PML1)
+	{
+		HvUtilLogError("HvEptSplitIdentityLargePage: Failed to allocate dynamic split memory.\n");
+		OsFreeNonpagedMemory(NewSplit);
+		return FALSE;
+	}
+
+	NewSplit->PML1Physical = (SIZE_T)OsVirtualToPhysical(NewSplit->PML1);
+	NewSplit->Entry = TargetEntry;
+	NewSplit->Owner = NULL;
+
+	EntryTemplate.Flags = 0;
+	EntryTemplate.ReadAccess = 1;
+	EntryTemplate.WriteAccess = 1;
+	EntryTemplate.ExecuteAccess = 1;
+
+	__stosq((SIZE_T*)&NewSplit->PML1[0], EntryTemplate.Flags, VMM_EPT_PML1E_COUNT);
+
+	for (PageIndex = 0; PageIndex < VMM_EPT_PML1E_COUNT; PageIndex++)
+	{
+		PageFrameNumber = ((TargetEntry->PageFrameNumber * SIZE_2_MB) / PAGE_SIZE) + PageIndex;
+
+		/* Pages not backed by RAM are left not present, to be mapped on demand like any other unbacked memory */
+		if (!HvEptIsPhysicalMemory(GlobalContext, PageFrameNumber * PAGE_SIZE))
+		{
+			NewSplit->PML1[PageIndex].Flags = VMM_EPT_NOT_PRESENT_ENTRY;
+			continue;
+		}
+
+		NewSplit->PML1[PageIndex].PageFrameNumber = PageFrameNumber;
+		NewSplit->PML1[PageIndex].MemoryType = HvEptGetPageMemoryType(GlobalContext, PageFrameNumber * PAGE_SIZE);
+	}
+
+	NewPointer.Flags = 0;
+	NewPointer.ReadAccess = 1;
+	NewPointer.WriteAccess = 1;
+	NewPointer.ExecuteAccess = 1;
+	NewPointer.PageFrameNumber = NewSplit->PML1Physical / PAGE_SIZE;
+
+	InsertHeadList(&IdentityMap->DynamicSplitList, &NewSplit->DynamicSplitList);
+	IdentityMap->SizeInBytes += PAGE_SIZE + sizeof(VMM_EPT_DYNAMIC_SPLIT);
+
+	RtlCopyMemory(TargetEntry, &NewPointer, sizeof(NewPointer));
+
+	return TRUE;
+}
+
+
+/**
+ * Fill the 512 2MB entries of the directory for the 1GB region EntryGroupIndex by walking the memory type runs covering it.
+ * 
+ * Every 2MB entry lying entirely within a run gets the type of that run, so whole spans of entries are written in
+ * one tight loop without looking at any MTRR state. An entry which a run boundary passes through has more than one
+ * memory type, so it is split into the identity map and each of its 4096 byte pages is typed exactly.
+ * 
+ * Entries of runs which are not backed by RAM are left not present, to be mapped on demand if the guest touches them.
+ * Every entry of the directory must already be VMM_EPT_NOT_PRESENT_ENTRY.
+ */
+BOOL HvEptFillPml2Directory(PVMM_CONTEXT GlobalContext, PVMM_EPT_IDENTITY_MAP IdentityMap, PVMM_EPT_PML2_DIRECTORY Directory, SIZE_T EntryGroupIndex)
+{
+	EPT_PML2_ENTRY EntryTemplate;
+	PMTRR_MEMORY_RUN Run;
+	SIZE_T EntryIndex;
+	SIZE_T SpanEnd;
+	SIZE_T EntryAddress;
+	ULONG RunIndex;
+
+	EntryTemplate.Flags = 0;
+
+	/* All PML2 entries will be RWX and 'present' */
+	EntryTemplate.ReadAccess = 1;
+	EntryTemplate.WriteAccess = 1;
+	EntryTemplate.ExecuteAccess = 1;
+
+	/* We are using 2MB large pages, so we must mark this 1 here. */
+	EntryTemplate.LargePage = 1;
+
+	RunIndex = HvEptFindMemoryRun(GlobalContext, EntryGroupIndex * SIZE_1_GB);
+	EntryIndex = 0;
+
+	while (EntryIndex < VMM_EPT_PML2E_COUNT)
+	{
+		EntryAddress = (EntryGroupIndex * SIZE_1_GB) + (EntryIndex * SIZE_2_MB);
+
+		/* Move to the run containing this entry. Runs are sorted, so this only ever moves forward. */
+		while (GlobalContext->MemoryRuns[RunIndex].PhysicalEndAddress < EntryAddress)
+		{
+			RunIndex++;
+		}
+
+		Run = &GlobalContext->MemoryRuns[RunIndex];
+
+		/* The entries from here which lie entirely within the run, without leaving this directory */
+		SpanEnd = EntryIndex + ((Run->PhysicalEndAddress + 1 - EntryAddress) / SIZE_2_MB);
+		if (SpanEnd > VMM_EPT_PML2E_COUNT)
+		{
+			SpanEnd = VMM_EPT_PML2E_COUNT;
+		}
+
+		/* The first 2MB contains the fixed MTRR section, which describes memory types at 4096 byte granularity
+		 * (typically there is MMIO memory in the first MB), so it always needs to be split.
+		 */
+		if (EntryAddress == 0)
+		{
+			SpanEnd = EntryIndex;
+		}
+
+		if (SpanEnd > EntryIndex && !Run->Backed)
+		{
+			/* Nothing backs this span, so leave it not present */
+			EntryIndex = SpanEnd;
+			continue;
+		}
+
+		if (SpanEnd > EntryIndex)
+		{
+			EntryTemplate.MemoryType = Run->MemoryType;
+
+			/* Only the frame number changes between the entries of a span. */
+			for (; EntryIndex < SpanEnd; EntryIndex++)
+			{
+				Directory->PML2[EntryIndex].Flags = EntryTemplate.Flags;
+				Directory->PML2[EntryIndex].PageFrameNumber = (EntryGroupIndex * VMM_EPT_PML2E_COUNT) + EntryIndex;
+			}
+
+			continue;
+		}
+
+		/* This 2MB region has more than one memory type. It stays UC only until the split below replaces it. */
+		Directory->PML2[EntryIndex].Flags = EntryTemplate.Flags;
+		Directory->PML2[EntryIndex].MemoryType = MEMORY_TYPE_UNCACHEABLE;
+		Directory->PML2[EntryIndex].PageFrameNumber = (EntryGroupIndex * VMM_EPT_PML2E_COUNT) + EntryIndex;
+
+		if (!HvEptSplitIdentityLargePage(GlobalContext, IdentityMap, Directory, EntryIndex))
+		{
+			return FALSE;
+		}
+
+		IdentityMap->MixedRegionSplitCount++;
+		EntryIndex++;
+	}
+
+	return TRUE;
+}
@@ -2,7 +2,8 @@
 #include "ept.h"
 
 /*
- * Intialize fields of the exit context based on values read from the VMCS.
+ * Intialize fields of the exit context. Only the exit reason is read from the VMCS here, every other field is read
+ * the first time a handler asks for it.
  */
 VOID VmxInitializeExitContext(PVMEXIT_CONTEXT ExitContext, PGPREGISTER_CONTEXT GuestRegisters)
 {
@@ -10,8 +11,6 @@ VOID VmxInitializeExitContext(PVMEXIT_CONTEXT ExitContext, PGPREGISTER_CONTEXT G
 
 	VmError = 0;
 
-	OsZeroMemory(ExitContext, sizeof(VMEXIT_CONTEXT));
-
 	/*
 	 * Store pointer of the guest register context on the stack to the context for later access.
 	 */
@@ -22,30 +21,215 @@ VOID VmxInitializeExitContext(PVMEXIT_CONTEXT ExitContext, PGPREGISTER_CONTEXT G
 
 	/* By default, we continue execution. */
 	ExitContext->ShouldStopExecution = FALSE;
+	ExitContext->ShouldLeaveVmx = FALSE;
 
-	// Guest RSP at the time of exit
-	VmxVmreadFieldToImmediate(VMCS_GUEST_RSP, &ExitContext->GuestContext->GuestRSP);
-
-	// Guest RIP at the time of exit
-	VmxVmreadFieldToImmediate(VMCS_GUEST_RIP, &ExitContext->GuestRIP);
+	/* The IRQL is only raised once a handler needs kernel services */
+	ExitContext->HasRaisedIrql = FALSE;
 
-	// Guest RFLAGS at the time of exit
-	VmxVmreadFieldToImmediate(VMCS_GUEST_RFLAGS, &ExitContext->GuestFlags.RFLAGS);
+	/* Nothing else has been read yet */
+	ExitContext->ValidFields = 0;
+	ExitContext->VmreadCount = 1;
 
 	// The type of exit
 	VmxVmreadFieldToRegister(VMCS_EXIT_REASON, &ExitContext->ExitReason);
+}
+
+/*
+ * Read a field of the exit context from the VMCS, unless it was already read during this exit.
+ */
+static SIZE_T* HvExitpReadField(PVMEXIT_CONTEXT ExitContext, VMEXIT_CONTEXT_FIELD Field, SIZE_T Encoding, SIZE_T* Value)
+{
+	VMX_ERROR VmError;
+
+	VmError = 0;
+
+	if (!(ExitContext->ValidFields & Field))
+	{
+		VmxVmreadFieldToImmediate(Encoding, Value);
+
+		ExitContext->ValidFields |= Field;
+		ExitContext->VmreadCount++;
+	}
+
+	return Value;
+}
+
+/*
+ * Guest RSP at the time of exit. Also stored to the guest register context.
+ */
+SIZE_T HvExitGetGuestRsp(PVMEXIT_CONTEXT ExitContext)
+{
+	return *HvExitpReadField(ExitContext, VmexitFieldGuestRsp, VMCS_GUEST_RSP, &ExitContext->GuestContext->GuestRSP);
+}
+
+/*
+ * Guest RIP at the time of exit.
+ */
+SIZE_T HvExitGetGuestRip(PVMEXIT_CONTEXT ExitContext)
+{
+	return *HvExitpReadField(ExitContext, VmexitFieldGuestRip, VMCS_GUEST_RIP, &ExitContext->GuestRIP);
+}
+
+/*
+ * Guest RFLAGS at the time of exit.
+ */
+SIZE_T HvExitGetGuestFlags(PVMEXIT_CONTEXT ExitContext)
+{
+	return *HvExitpReadField(ExitContext, VmexitFieldGuestFlags, VMCS_GUEST_RFLAGS, &ExitContext->GuestFlags.RFLAGS);
+}
+
+/*
+ * Additional information about specific types of exits.
+ */
+SIZE_T HvExitGetExitQualification(PVMEXIT_CONTEXT ExitContext)
+{
+	return *HvExitpReadField(ExitContext, VmexitFieldExitQualification, VMCS_EXIT_QUALIFICATION, &ExitContext->ExitQualification);
+}
+
+/*
+ * Length of the exiting instruction.
+ */
+SIZE_T HvExitGetInstructionLength(PVMEXIT_CONTEXT ExitContext)
+{
+	return *HvExitpReadField(ExitContext, VmexitFieldInstructionLength, VMCS_VMEXIT_INSTRUCTION_LENGTH, &ExitContext->InstructionLength);
+}
+
+/*
+ * Information about the faulting instruction.
+ */
+SIZE_T HvExitGetInstructionInformation(PVMEXIT_CONTEXT ExitContext)
+{
+	return *HvExitpReadField(ExitContext, VmexitFieldInstructionInformation, VMCS_VMEXIT_INSTRUCTION_INFO, &ExitContext->InstructionInformation);
+}
+
+/*
+ * Guest physical address during EPT exits.
+ */
+SIZE_T HvExitGetGuestPhysicalAddress(PVMEXIT_CONTEXT ExitContext)
+{
+	return *HvExitpReadField(ExitContext, VmexitFieldGuestPhysicalAddress, VMCS_GUEST_PHYSICAL_ADDRESS, &ExitContext->GuestPhysicalAddress);
+}
+
+/*
+ * Selector of the guest CS at the time of exit.
+ */
+SIZE_T HvExitGetGuestCs(PVMEXIT_CONTEXT ExitContext)
+{
+	return *HvExitpReadField(ExitContext, VmexitFieldGuestCs, VMCS_GUEST_CS_SELECTOR, &ExitContext->GuestCs);
+}
+
+/*
+ * Raise the IRQL to DISPATCH_LEVEL before calling kernel services from this exit, unless it already was.
+ *
+ * To prevent context switching while enabling interrupts, the IRQL is saved and restored by HvExitRestoreIrql
+ * before returning to the guest.
+ */
+VOID HvExitRaiseIrql(PVMEXIT_CONTEXT ExitContext)
+{
+	if (ExitContext->HasRaisedIrql)
+	{
+		return;
+	}
+
+	ExitContext->HasRaisedIrql = TRUE;
+
+	ExitContext->SavedIRQL = KeGetCurrentIrql();
+	if (ExitContext->SavedIRQL < DISPATCH_LEVEL)
+	{
+		KeRaiseIrqlToDpcLevel();
+	}
+}
+
+/*
+ * If HvExitRaiseIrql raised the IRQL during this exit, lower it before returning to guest.
+ */
+VOID HvExitRestoreIrql(PVMEXIT_CONTEXT ExitContext)
+{
+	if (ExitContext->HasRaisedIrql && ExitContext->SavedIRQL < DISPATCH_LEVEL)
+	{
+		KeLowerIrql(ExitContext->SavedIRQL);
+	}
+}
 
-	// Additional information about specific types of exits
-	VmxVmreadFieldToImmediate(VMCS_EXIT_QUALIFICATION, &ExitContext->ExitQualification);
+/*
+ * Count a handled exit and the VMREADs it took against its exit reason, and the cycles it took against the path it
+ * was handled on.
+ */
+VOID HvExitRecordStatistics(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext, UINT64 Cycles)
+{
+	SIZE_T ExitReason;
 
-	// Length of the exiting instruction
-	VmxVmreadFieldToImmediate(VMCS_VMEXIT_INSTRUCTION_LENGTH, &ExitContext->InstructionLength);
+	if (ExitContext->HasRaisedIrql)
+	{
+		ProcessorContext->KernelPathExitCount++;
+		ProcessorContext->KernelPathCycles += Cycles;
+	}
+	else
+	{
+		ProcessorContext->FastPathExitCount++;
+		ProcessorContext->FastPathCycles += Cycles;
+	}
 
-	// Information about the faulting instruction
-	VmxVmreadFieldToImmediate(VMCS_VMEXIT_INSTRUCTION_INFO, &ExitContext->InstructionInformation);
+	ExitReason = ExitContext->ExitReason.BasicExitReason;
+	if (ExitReason >= VMM_EXIT_REASON_COUNT)
+	{
+		return;
+	}
 
-	// Guest physical address during EPT exits
-	VmxVmreadFieldToImmediate(VMCS_GUEST_PHYSICAL_ADDRESS, &ExitContext->GuestPhysicalAddress);
+	ProcessorContext->ExitCounts[ExitReason]++;
+	ProcessorContext->ExitVmreadCounts[ExitReason] += ExitContext->VmreadCount;
+}
+
+/*
+ * Log the exits this processor handled and the VMREADs they took, per exit reason, and the average latency of the
+ * exits handled with and without raising the IRQL. The swaps and monitor trap exits of each page hook still in place
+ * are logged as well, hooks removed earlier were logged when they were removed.
+ *
+ * Before fields were read on demand, every exit took 8 VMREADs, and one more when RIP was incremented.
+ */
+VOID HvExitReportStatistics(PVMM_PROCESSOR_CONTEXT ProcessorContext)
+{
+	SIZE_T ExitReason;
+
+	if (ProcessorContext->FastSwapCache.SwapCount)
+	{
+		HvUtilLogDebug("Fast swap cache: %llu page hook swaps without calling the exit handler.\n",
+			ProcessorContext->FastSwapCache.SwapCount);
+	}
+
+	if (ProcessorContext->FastPathExitCount)
+	{
+		HvUtilLogDebug("Fast path: %llu exits, %llu cycles on average.\n",
+			ProcessorContext->FastPathExitCount,
+			ProcessorContext->FastPathCycles / ProcessorContext->FastPathExitCount);
+	}
+
+	if (ProcessorContext->KernelPathExitCount)
+	{
+		HvUtilLogDebug("Kernel path: %llu exits, %llu cycles on average.\n",
+			ProcessorContext->KernelPathExitCount,
+			ProcessorContext->KernelPathCycles / ProcessorContext->KernelPathExitCount);
+	}
+
+	for (ExitReason = 0; ExitReason < VMM_EXIT_REASON_COUNT; ExitReason++)
+	{
+		if (ProcessorContext->ExitCounts[ExitReason] == 0)
+		{
+			continue;
+		}
+
+		HvUtilLogDebug("Exit reason %llu: %llu exits, %llu VMREADs.\n",
+			ExitReason,
+			ProcessorContext->ExitCounts[ExitReason],
+			ProcessorContext->ExitVmreadCounts[ExitReason]);
+	}
+
+	if (ProcessorContext->EptPageTable)
+	{
+		FOR_EACH_LIST_ENTRY(ProcessorContext->EptPageTable, PageHookList, VMM_EPT_PAGE_HOOK, PageHook)
+			HvEptReportPageHookExits(PageHook);
+		FOR_EACH_LIST_ENTRY_END();
+	}
 }
 
 
@@ -74,11 +258,109 @@ VOID HvExitHandleCpuid(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT
 	ExitContext->GuestContext->GuestRDX = CPUInfo[3];
 }
 
+/**
+ * Handle a hypercall made by the guest with VMCALL. See VMM_HYPERCALL.
+ */
+VOID HvExitHandleVmcall(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext)
+{
+	/* Only the guest kernel may make hypercalls */
+	if ((HvExitGetGuestCs(ExitContext) & 3) != 0)
+	{
+		ExitContext->GuestContext->GuestRAX = 0;
+		return;
+	}
+
+	switch (ExitContext->GuestContext->GuestRCX)
+	{
+	case VmmHypercallRemovePageHook:
+		ExitContext->GuestContext->GuestRAX = (SIZE_T)HvEptRemovePageHook(ProcessorContext, ExitContext->GuestContext->GuestRDX);
+		break;
+	case VmmHypercallForwardEptViolation:
+		HvExitHandleForwardedEptViolation(ProcessorContext, ExitContext);
+		break;
+	case VmmHypercallCommitHookTransaction:
+		ExitContext->GuestContext->GuestRAX = HvEptApplyHookTransaction(ProcessorContext,
+			(PVMM_EPT_HOOK_TRANSACTION)ExitContext->GuestContext->GuestRDX, ExitContext->GuestContext->GuestR8);
+		break;
+	case VmmHypercallRollBackHookTransaction:
+		ExitContext->GuestContext->GuestRAX = HvEptRollBackHookTransaction(ProcessorContext,
+			(PVMM_EPT_HOOK_TRANSACTION)ExitContext->GuestContext->GuestRDX, ExitContext->GuestContext->GuestR8);
+		break;
+	case VmmHypercallApplySharedEdits:
+		HvEptApplySharedEdits(ProcessorContext);
+		ExitContext->GuestContext->GuestRAX = TRUE;
+		break;
+	case VmmHypercallExitVmx:
+		ExitContext->ShouldLeaveVmx = TRUE;
+		ExitContext->GuestContext->GuestRAX = TRUE;
+		break;
+	default:
+		HvUtilLogError("Unknown hypercall 0x%llX.\n", ExitContext->GuestContext->GuestRCX);
+		ExitContext->GuestContext->GuestRAX = 0;
+		break;
+	}
+}
+
+/*
+ * Leave VMX operation on this processor, and continue the guest outside of VMX at the RIP it would have resumed at,
+ * with the registers it had at the exit. Never returns.
+ *
+ * The exit loaded the host state, so the guest state that differs from it is put back by hand: CR3, DR7 and the
+ * limits of the GDT and IDT, which every exit sets to 0xFFFF.
+ */
+DECLSPEC_NORETURN
+VOID HvExitLeaveVmx(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext)
+{
+	SEGMENT_DESCRIPTOR_REGISTER_64 DescriptorTable;
+	SIZE_T GuestCr3;
+	SIZE_T GuestDr7;
+	SIZE_T GdtBase;
+	SIZE_T GdtLimit;
+	SIZE_T IdtBase;
+	SIZE_T IdtLimit;
+	SIZE_T GuestRip;
+	SIZE_T GuestFlags;
+
+	/* Stores the guest RSP to the register context, where HvResumeGuestOutsideVmx picks it up */
+	HvExitGetGuestRsp(ExitContext);
+
+	/* Already moved past the VMCALL if the exit incremented RIP */
+	GuestRip = HvExitGetGuestRip(ExitContext);
+	GuestFlags = HvExitGetGuestFlags(ExitContext);
+
+	__vmx_vmread(VMCS_GUEST_CR3, &GuestCr3);
+	__vmx_vmread(VMCS_GUEST_DR7, &GuestDr7);
+	__vmx_vmread(VMCS_GUEST_GDTR_BASE, &GdtBase);
+	__vmx_vmread(VMCS_GUEST_GDTR_LIMIT, &GdtLimit);
+	__vmx_vmread(VMCS_GUEST_IDTR_BASE, &IdtBase);
+	__vmx_vmread(VMCS_GUEST_IDTR_LIMIT, &IdtLimit);
+
+	HvUtilLogDebug("HvExitLeaveVmx: Leaving VMX, resuming guest at 0x%llX.\n", GuestRip);
+
+	// Clear the VMCS before VMXOFF (Specification requires this)
+	__vmx_vmclear((ULONGLONG*)&ProcessorContext->VmcsRegionPhysical);
+	__vmx_off();
+	ArchDisableVmxe();
+
+	__writecr3(GuestCr3);
+	__writedr(7, GuestDr7);
+
+	DescriptorTable.BaseAddress = GdtBase;
+	DescriptorTable.Limit = (UINT16)GdtLimit;
+	_lgdt(&DescriptorTable);
+
+	DescriptorTable.BaseAddress = IdtBase;
+	DescriptorTable.Limit = (UINT16)IdtLimit;
+	__lidt(&DescriptorTable);
+
+	HvResumeGuestOutsideVmx(ExitContext->GuestContext, GuestRip, GuestFlags);
+}
+
 VOID HvExitHandleEptMisconfiguration(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext)
 {
 	UNREFERENCED_PARAMETER(ProcessorContext);
 
-	HvUtilLogError("EPT Misconfiguration! A field in the EPT paging structure was invalid. Faulting guest address: 0x%llX\n", ExitContext->GuestPhysicalAddress);
+	HvUtilLogError("EPT Misconfiguration! A field in the EPT paging structure was invalid. Faulting guest address: 0x%llX\n", HvExitGetGuestPhysicalAddress(ExitContext));
 
 	ExitContext->ShouldIncrementRIP = FALSE;
 	ExitContext->ShouldStopExecution = TRUE;
@@ -86,16 +368,339 @@ VOID HvExitHandleEptMisconfiguration(PVMM_PROCESSOR_CONTEXT ProcessorContext, PV
 	// We can't continue now. EPT misconfiguration is a fatal exception that will probably crash the OS if we don't get out *now*.
 }
 
+/*
+ * Raise the hardware exception Vector in the guest on the next entry, at the instruction which exited. Only for
+ * exceptions without an error code.
+ */
+VOID HvExitInjectException(PVMEXIT_CONTEXT ExitContext, SIZE_T Vector)
+{
+	VMENTRY_INTERRUPT_INFORMATION Interruption;
+
+	Interruption.Flags = 0;
+	Interruption.Vector = (UINT32)Vector;
+	Interruption.InterruptionType = HardwareException;
+	Interruption.Valid = 1;
+
+	__vmx_vmwrite(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, Interruption.Flags);
+
+	// Faults are raised with RIP still at the faulting instruction.
+	ExitContext->ShouldIncrementRIP = FALSE;
+}
+
+/*
+ * Same as HvExitInjectException, for exceptions which push an error code.
+ */
+VOID HvExitInjectExceptionWithErrorCode(PVMEXIT_CONTEXT ExitContext, SIZE_T Vector, SIZE_T ErrorCode)
+{
+	VMENTRY_INTERRUPT_INFORMATION Interruption;
+
+	Interruption.Flags = 0;
+	Interruption.Vector = (UINT32)Vector;
+	Interruption.InterruptionType = HardwareException;
+	Interruption.DeliverErrorCode = 1;
+	Interruption.Valid = 1;
+
+	__vmx_vmwrite(VMCS_CTRL_VMENTRY_EXCEPTION_ERROR_CODE, ErrorCode);
+	__vmx_vmwrite(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, Interruption.Flags);
+
+	ExitContext->ShouldIncrementRIP = FALSE;
+}
+
+/*
+ * VMFUNC exits if the function in EAX is not enabled, or if the EPTP list has no valid EPTP at the index in ECX,
+ * including the entries of views which were never created. This is true in guest user mode as well, so it must not
+ * stop execution. Instead the guest gets the #UD that VMFUNC raises when the function is not available.
+ */
+VOID HvExitHandleVmfunc(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext)
+{
+	UNREFERENCED_PARAMETER(ProcessorContext);
+
+	HvExitInjectException(ExitContext, VMM_EXIT_VECTOR_INVALID_OPCODE);
+}
+
 VOID HvExitHandleUnknownExit(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext)
 {
 	UNREFERENCED_PARAMETER(ProcessorContext);
 
-	__debugbreak();
 	HvUtilLogError("Unknown exit reason! An exit was made but no handler was configured to handle it. Reason: 0x%llX\n", ExitContext->ExitReason.BasicExitReason);
 
-	// Try to keep executing, despite the unknown exit.
-	ExitContext->ShouldIncrementRIP = TRUE;
-	
+	// Not every exit is caused by an instruction, so skipping over one could corrupt the guest. Stop execution
+	// instead, which bugchecks with HYPERVISOR_ERROR in HvHandleVmExitFailure.
+	ExitContext->ShouldIncrementRIP = FALSE;
+	ExitContext->ShouldStopExecution = TRUE;
+}
+
+/*
+ * The handlers of the hypervisor itself as PVMM_EXIT_HANDLER. Each handles every exit it is registered for.
+ */
+BOOL HvExitDispatchCpuid(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext, PVOID Context)
+{
+	UNREFERENCED_PARAMETER(Context);
+
+	HvExitHandleCpuid(ProcessorContext, ExitContext);
+	return TRUE;
+}
+
+BOOL HvExitDispatchInvd(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext, PVOID Context)
+{
+	UNREFERENCED_PARAMETER(ProcessorContext);
+	UNREFERENCED_PARAMETER(ExitContext);
+	UNREFERENCED_PARAMETER(Context);
+
+	__wbinvd();
+	return TRUE;
+}
+
+BOOL HvExitDispatchXsetbv(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext, PVOID Context)
+{
+	UNREFERENCED_PARAMETER(ProcessorContext);
+	UNREFERENCED_PARAMETER(Context);
+
+	_xsetbv((UINT32)ExitContext->GuestContext->GuestRCX,
+		ExitContext->GuestContext->GuestRDX << 32 |
+		ExitContext->GuestContext->GuestRAX);
+	return TRUE;
+}
+
+BOOL HvExitDispatchVmcall(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext, PVOID Context)
+{
+	UNREFERENCED_PARAMETER(Context);
+
+	HvExitHandleVmcall(ProcessorContext, ExitContext);
+	return TRUE;
+}
+
+BOOL HvExitDispatchEptMisconfiguration(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext, PVOID Context)
+{
+	UNREFERENCED_PARAMETER(Context);
+
+	HvExitHandleEptMisconfiguration(ProcessorContext, ExitContext);
+	return TRUE;
+}
+
+BOOL HvExitDispatchPageHookSwap(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext, PVOID Context)
+{
+	VMX_EXIT_QUALIFICATION_EPT_VIOLATION ViolationQualification;
+
+	UNREFERENCED_PARAMETER(Context);
+
+	ViolationQualification.Flags = HvExitGetExitQualification(ExitContext);
+
+	return HvExitHandlePageHookExit(ProcessorContext, ExitContext, ViolationQualification);
+}
+
+BOOL HvExitDispatchEptViolation(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext, PVOID Context)
+{
+	UNREFERENCED_PARAMETER(Context);
+
+	HvExitHandleEptViolation(ProcessorContext, ExitContext);
+	return TRUE;
+}
+
+/*
+ * The VMX instructions other than VMCALL and VMFUNC exit unconditionally in the guest, which is not given VMX.
+ * Like VMFUNC, they raise #UD, so VMXOFF or VMCLEAR in the guest can't take VMX away from the hypervisor. The
+ * hypervisor itself leaves VMX with VmmHypercallExitVmx.
+ */
+BOOL HvExitDispatchVmxInstruction(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext, PVOID Context)
+{
+	UNREFERENCED_PARAMETER(ProcessorContext);
+	UNREFERENCED_PARAMETER(Context);
+
+	HvExitInjectException(ExitContext, VMM_EXIT_VECTOR_INVALID_OPCODE);
+	return TRUE;
+}
+
+BOOL HvExitDispatchVmfunc(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext, PVOID Context)
+{
+	UNREFERENCED_PARAMETER(Context);
+
+	HvExitHandleVmfunc(ProcessorContext, ExitContext);
+	return TRUE;
+}
+
+BOOL HvExitDispatchMonitorTrapFlag(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext, PVOID Context)
+{
+	UNREFERENCED_PARAMETER(Context);
+
+	HvExitHandleMonitorTrapFlag(ProcessorContext, ExitContext);
+	return TRUE;
+}
+
+/**
+ * The handlers of the hypervisor itself, registered at VMM_EXIT_HANDLER_PRIORITY_DEFAULT in this order.
+ *
+ * CPUID, INVD, XSETBV, VMFUNC, the other VMX instructions, page hook swaps and monitor traps never call into the
+ * kernel, so they are handled without raising the IRQL. Page hook swaps pass every other EPT violation on to
+ * HvExitDispatchEptViolation.
+ *
+ * The following instructions cause VM exits when they are executed in VMX non-root operation: CPUID, GETSEC,
+ * INVD, and XSETBV. This is also true of instructions introduced with VMX, which include: INVEPT, INVVPID,
+ * VMCALL, VMCLEAR, VMLAUNCH, VMPTRLD, VMPTRST, VMRESUME, VMXOFF, and VMXON.
+ *
+ * GETSEC will never exit because we will never run in SMX mode.
+ */
+static const struct
+{
+	SIZE_T ExitReason;
+	ULONG Flags;
+	PVMM_EXIT_HANDLER Handler;
+} HvExitDefaultHandlers[] =
+{
+	{ VMX_EXIT_REASON_EXECUTE_CPUID, 0, HvExitDispatchCpuid },
+	{ VMX_EXIT_REASON_EXECUTE_INVD, 0, HvExitDispatchInvd },
+	{ VMX_EXIT_REASON_EXECUTE_XSETBV, 0, HvExitDispatchXsetbv },
+	{ VMX_EXIT_REASON_EXECUTE_VMCALL, VMM_EXIT_HANDLER_FLAG_KERNEL, HvExitDispatchVmcall },
+	{ VMX_EXIT_REASON_EPT_MISCONFIGURATION, VMM_EXIT_HANDLER_FLAG_KERNEL, HvExitDispatchEptMisconfiguration },
+	{ VMX_EXIT_REASON_EPT_VIOLATION, 0, HvExitDispatchPageHookSwap },
+	{ VMX_EXIT_REASON_EPT_VIOLATION, VMM_EXIT_HANDLER_FLAG_KERNEL, HvExitDispatchEptViolation },
+	{ VMX_EXIT_REASON_MONITOR_TRAP_FLAG, 0, HvExitDispatchMonitorTrapFlag },
+	{ VMX_EXIT_REASON_EXECUTE_VMFUNC, 0, HvExitDispatchVmfunc },
+	{ VMX_EXIT_REASON_EXECUTE_VMCLEAR, 0, HvExitDispatchVmxInstruction },
+	{ VMX_EXIT_REASON_EXECUTE_VMLAUNCH, 0, HvExitDispatchVmxInstruction },
+	{ VMX_EXIT_REASON_EXECUTE_VMPTRLD, 0, HvExitDispatchVmxInstruction },
+	{ VMX_EXIT_REASON_EXECUTE_VMPTRST, 0, HvExitDispatchVmxInstruction },
+	{ VMX_EXIT_REASON_EXECUTE_VMREAD, 0, HvExitDispatchVmxInstruction },
+	{ VMX_EXIT_REASON_EXECUTE_VMRESUME, 0, HvExitDispatchVmxInstruction },
+	{ VMX_EXIT_REASON_EXECUTE_VMWRITE, 0, HvExitDispatchVmxInstruction },
+	{ VMX_EXIT_REASON_EXECUTE_VMXOFF, 0, HvExitDispatchVmxInstruction },
+	{ VMX_EXIT_REASON_EXECUTE_VMXON, 0, HvExitDispatchVmxInstruction },
+	{ VMX_EXIT_REASON_EXECUTE_INVEPT, 0, HvExitDispatchVmxInstruction },
+	{ VMX_EXIT_REASON_EXECUTE_INVVPID, 0, HvExitDispatchVmxInstruction },
+};
+
+/**
+ * Add Handler to the chain of handlers for ExitReason. Handlers with a higher Priority are called first, and
+ * handlers with the same priority in the order they were registered. Context is passed to every call. Flags
+ * holds VMM_EXIT_HANDLER_FLAG_KERNEL if the handler calls kernel services.
+ * 
+ * The handlers of the hypervisor itself handle every exit they are registered for, so a handler must have a priority
+ * above VMM_EXIT_HANDLER_PRIORITY_DEFAULT to see their exits. A handler returns FALSE to pass an exit it does not
+ * want on to the next handler in the chain.
+ * 
+ * Handlers run in VMX root. They can be registered at any time, at or below DISPATCH_LEVEL. Returns the
+ * registration to pass to HvExitUnregisterHandler, or NULL on failure.
+ */
+PVMM_EXIT_HANDLER_REGISTRATION HvExitRegisterHandler(PVMM_CONTEXT GlobalContext, SIZE_T ExitReason, LONG Priority, ULONG Flags, PVMM_EXIT_HANDLER Handler, PVOID Context)
+{
+	PVMM_EXIT_HANDLER_REGISTRATION Registration;
+	PVMM_EXIT_HANDLER_REGISTRATION* Link;
+	KIRQL OldIrql;
+
+	if (ExitReason >= VMM_EXIT_REASON_COUNT)
+	{
+		HvUtilLogError("HvExitRegisterHandler: Invalid exit reason 0x%llX.\n", ExitReason);
+		return NULL;
+	}
+
+	Registration = (PVMM_EXIT_HANDLER_REGISTRATION)OsAllocateNonpagedMemory(sizeof(VMM_EXIT_HANDLER_REGISTRATION));
+	if (!Registration)
+	{
+		HvUtilLogError("HvExitRegisterHandler: Could not allocate memory for handler.\n");
+		return NULL;
+	}
+
+	Registration->ExitReason = ExitReason;
+	Registration->Priority = Priority;
+	Registration->Flags = Flags;
+	Registration->Handler = Handler;
+	Registration->Context = Context;
+
+	KeAcquireSpinLock(&GlobalContext->ExitHandlerLock, &OldIrql);
+
+	for (Link = &GlobalContext->ExitHandlers[ExitReason]; *Link && (*Link)->Priority >= Priority; Link = &(*Link)->Next)
+	{
+		// Find the first handler with a lower priority
+	}
+
+	Registration->Next = *Link;
+
+	/* Processors in VMX root may be walking the chain, so the registration must be complete before it is linked */
+	InterlockedExchangePointer((PVOID*)Link, Registration);
+
+	KeReleaseSpinLock(&GlobalContext->ExitHandlerLock, OldIrql);
+
+	return Registration;
+}
+
+/**
+ * IPI run on every processor by HvExitUnregisterHandler.
+ */
+ULONG_PTR NTAPI HvExitpUnregisterHandlerIpi(_In_ ULONG_PTR Argument)
+{
+	UNREFERENCED_PARAMETER(Argument);
+
+	return 0;
+}
+
+/**
+ * Remove a handler added with HvExitRegisterHandler and free its registration. Must be called at PASSIVE_LEVEL.
+ * 
+ * Interrupts are only taken in the guest, so once an IPI has run on every processor, none of them can still be
+ * calling the handler from a chain walked before it was unlinked.
+ */
+VOID HvExitUnregisterHandler(PVMM_CONTEXT GlobalContext, PVMM_EXIT_HANDLER_REGISTRATION Registration)
+{
+	PVMM_EXIT_HANDLER_REGISTRATION* Link;
+	KIRQL OldIrql;
+
+	KeAcquireSpinLock(&GlobalContext->ExitHandlerLock, &OldIrql);
+
+	for (Link = &GlobalContext->ExitHandlers[Registration->ExitReason]; *Link && *Link != Registration; Link = &(*Link)->Next)
+	{
+		// Find the link to the registration
+	}
+
+	if (*Link)
+	{
+		InterlockedExchangePointer((PVOID*)Link, Registration->Next);
+	}
+
+	KeReleaseSpinLock(&GlobalContext->ExitHandlerLock, OldIrql);
+
+	KeIpiGenericCall(HvExitpUnregisterHandlerIpi, 0);
+
+	OsFreeNonpagedMemory(Registration);
+}
+
+/**
+ * Register the handlers of the hypervisor itself. Must be called before any processor launches.
+ */
+BOOL HvExitInitializeHandlers(PVMM_CONTEXT GlobalContext)
+{
+	SIZE_T Index;
+
+	KeInitializeSpinLock(&GlobalContext->ExitHandlerLock);
+
+	for (Index = 0; Index < RTL_NUMBER_OF(HvExitDefaultHandlers); Index++)
+	{
+		if (!HvExitRegisterHandler(GlobalContext, HvExitDefaultHandlers[Index].ExitReason, VMM_EXIT_HANDLER_PRIORITY_DEFAULT, HvExitDefaultHandlers[Index].Flags, HvExitDefaultHandlers[Index].Handler, NULL))
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * Free every registered handler. Must only be called once no processor is in VMX operation anymore.
+ */
+VOID HvExitFreeHandlers(PVMM_CONTEXT GlobalContext)
+{
+	PVMM_EXIT_HANDLER_REGISTRATION Registration;
+	SIZE_T ExitReason;
+
+	for (ExitReason = 0; ExitReason < VMM_EXIT_REASON_COUNT; ExitReason++)
+	{
+		while (GlobalContext->ExitHandlers[ExitReason])
+		{
+			Registration = GlobalContext->ExitHandlers[ExitReason];
+			GlobalContext->ExitHandlers[ExitReason] = Registration->Next;
+
+			OsFreeNonpagedMemory(Registration);
+		}
+	}
 }
 
 /**
@@ -104,56 +709,48 @@ VOID HvExitHandleUnknownExit(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CO
 BOOL HvExitDispatchFunction(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext)
 {
 	VMX_ERROR VmError;
-	SIZE_T GuestInstructionLength;
+	PVMM_EXIT_HANDLER_REGISTRATION Registration;
+	SIZE_T ExitReason;
 
 	VmError = 0;
 
 	/*
-	 * Choose an appropriate function to handle our exit.
+	 * Walk the chain of handlers for our exit until one takes it. Usually the first one does.
 	 */
-	switch (ExitContext->ExitReason.BasicExitReason)
-	{
-		/*
-		 * The following instructions cause VM exits when they are executed in VMX non-root operation: CPUID, GETSEC,1
-		 * INVD, and XSETBV. This is also true of instructions introduced with VMX, which include: INVEPT, INVVPID,
-		 * VMCALL, VMCLEAR, VMLAUNCH, VMPTRLD, VMPTRST, VMRESUME, VMXOFF, and VMXON.
-		 *
-		 * GETSEC will never exit because we will never run in SMX mode.
-		 */
-	case VMX_EXIT_REASON_EXECUTE_CPUID:
-		HvExitHandleCpuid(ProcessorContext, ExitContext);
-		break;
-	case VMX_EXIT_REASON_EXECUTE_INVD:
-		__wbinvd();
-		break;
-	case VMX_EXIT_REASON_EXECUTE_XSETBV:
-		_xsetbv((UINT32)ExitContext->GuestContext->GuestRCX,
-			ExitContext->GuestContext->GuestRDX << 32 |
-			ExitContext->GuestContext->GuestRAX);
-		break;
-	case VMX_EXIT_REASON_EPT_MISCONFIGURATION:
-		HvExitHandleEptMisconfiguration(ProcessorContext, ExitContext);
-		break;
-	case VMX_EXIT_REASON_EPT_VIOLATION:
-		HvExitHandleEptViolation(ProcessorContext, ExitContext);
-		break;
-	default:
+	ExitReason = ExitContext->ExitReason.BasicExitReason;
+	Registration = (ExitReason < VMM_EXIT_REASON_COUNT) ? ProcessorContext->GlobalContext->ExitHandlers[ExitReason] : NULL;
+
+	for (; Registration; Registration = Registration->Next)
+	{
+		/* Only handlers which need kernel services pay for raising the IRQL */
+		if (Registration->Flags & VMM_EXIT_HANDLER_FLAG_KERNEL)
+		{
+			HvExitRaiseIrql(ExitContext);
+		}
+
+		if (Registration->Handler(ProcessorContext, ExitContext, Registration->Context))
+		{
+			break;
+		}
+	}
+
+	if (!Registration)
+	{
+		HvExitRaiseIrql(ExitContext);
 		HvExitHandleUnknownExit(ProcessorContext, ExitContext);
-		break;
 	}
 
 	if (ExitContext->ShouldStopExecution)
 	{
-		HvUtilLogError("HvExitDispatchFunction: Leaving VMX mode.\n");
+		HvExitRaiseIrql(ExitContext);
+		HvUtilLogError("HvExitDispatchFunction: Stopping execution.\n");
 		return FALSE;
 	}
 
 	/* If we're an 'instruction' exit, we need to act like a fault handler and move the instruction pointer forward. */
 	if(ExitContext->ShouldIncrementRIP)
 	{
-		VmxVmreadFieldToImmediate(VMCS_VMEXIT_INSTRUCTION_LENGTH, &GuestInstructionLength);
-
-		ExitContext->GuestRIP += GuestInstructionLength;
+		ExitContext->GuestRIP = HvExitGetGuestRip(ExitContext) + HvExitGetInstructionLength(ExitContext);
 
 		VmxVmwriteFieldFromImmediate(VMCS_GUEST_RIP, ExitContext->GuestRIP);
 	}
@@ -3,6 +3,21 @@
 #include "extern.h"
 #include "vmcs.h"
 
+/**
+ * The fields of VMEXIT_CONTEXT which are read from the VMCS on demand.
+ */
+typedef enum _VMEXIT_CONTEXT_FIELD
+{
+	VmexitFieldGuestRsp = 1 << 0,
+	VmexitFieldGuestRip = 1 << 1,
+	VmexitFieldGuestFlags = 1 << 2,
+	VmexitFieldExitQualification = 1 << 3,
+	VmexitFieldInstructionLength = 1 << 4,
+	VmexitFieldInstructionInformation = 1 << 5,
+	VmexitFieldGuestPhysicalAddress = 1 << 6,
+	VmexitFieldGuestCs = 1 << 7,
+} VMEXIT_CONTEXT_FIELD;
+
 typedef struct _VMEXIT_CONTEXT
 {
 	/*
@@ -28,10 +43,16 @@ typedef struct _VMEXIT_CONTEXT
 	} GuestFlags;
 
 	/*
-	 * Saved IRQL during exit handler.
+	 * Saved IRQL during exit handler. Only valid once HasRaisedIrql is set.
 	 */
 	KIRQL SavedIRQL;
 
+	/*
+	 * Set by HvExitRaiseIrql once this exit has reached a handler which needs kernel services. Exits which never do
+	 * are handled without touching the IRQL at all.
+	 */
+	BOOL HasRaisedIrql;
+
 	/*
 	 * The exit reason field.
 	 *
@@ -79,18 +100,186 @@ typedef struct _VMEXIT_CONTEXT
 	SIZE_T GuestPhysicalAddress;
 
 	/**
-	 * If set to 1, execution in VMX root mode will end and return to a non-hijacked system. 
+	 * Selector of the guest CS at the time of exit.
+	 */
+	SIZE_T GuestCs;
+
+	/**
+	 * If set to 1, the guest is not resumed, and HvHandleVmExitFailure bugchecks the system.
 	 */
 	BOOL ShouldStopExecution;
 
+	/**
+	 * If set to 1, the processor leaves VMX operation after this exit, and the guest continues outside of VMX.
+	 * See HvExitLeaveVmx.
+	 */
+	BOOL ShouldLeaveVmx;
+
 	/**
 	 * If set to 1, the instruction pointer will be incremented by the size of the instruction.
 	 */
 	BOOL ShouldIncrementRIP;
 
+	/**
+	 * The VMEXIT_CONTEXT_FIELD bits of the fields above which have been read from the VMCS during this exit. Every
+	 * other field is only read the first time it is asked for, with HvExitGetGuestRip and the like.
+	 */
+	UINT32 ValidFields;
+
+	/**
+	 * Number of VMREADs made for the fields above during this exit.
+	 */
+	UINT32 VmreadCount;
+
 } VMEXIT_CONTEXT, *PVMEXIT_CONTEXT;
 
 
+/**
+ * Services that kernel code running in the guest can request from the hypervisor with VMCALL.
+ * 
+ * The hypercall number is passed in RCX and its arguments in RDX and R8. The result is returned in RAX.
+ * Hypercalls made from user mode are refused and return 0.
+ */
+typedef enum _VMM_HYPERCALL
+{
+	/*
+	 * Remove the hook of the current processor on the function at the physical address in RDX.
+	 * Returns the removed function hook, to be freed by the caller once it is back in the guest, or NULL if there
+	 * was none.
+	 */
+	VmmHypercallRemovePageHook = 0x47420001,
+
+	/*
+	 * Handle the EPT violation at the physical address in RDX, with the exit qualification in R8, which the #VE
+	 * handler of the guest could not resolve. Returns TRUE once the faulting access can be retried.
+	 */
+	VmmHypercallForwardEptViolation = 0x47420002,
+
+	/*
+	 * Apply the hook transaction at RDX to the EPT of the current processor, whose number is in R8. Returns the
+	 * number of pages applied.
+	 */
+	VmmHypercallCommitHookTransaction = 0x47420003,
+
+	/*
+	 * Apply the EPT edits published to every processor which the current processor has not applied yet. Returns
+	 * TRUE.
+	 */
+	VmmHypercallApplySharedEdits = 0x47420004,
+
+	/*
+	 * Leave VMX operation on the current processor. The guest continues right after the VMCALL, outside of VMX.
+	 * Returns TRUE.
+	 */
+	VmmHypercallExitVmx = 0x47420005,
+
+	/*
+	 * Undo the pages of the hook transaction at RDX which the current processor, whose number is in R8, applied.
+	 * Returns the number of pages rolled back.
+	 */
+	VmmHypercallRollBackHookTransaction = 0x47420006,
+
+} VMM_HYPERCALL;
+
+/**
+ * The vector of the invalid opcode exception (#UD), which is raised in the guest in place of instructions it may
+ * not execute.
+ */
+#define VMM_EXIT_VECTOR_INVALID_OPCODE 6
+
+/**
+ * The vector of the general protection exception (#GP), which is raised in the guest for accesses to physical
+ * addresses where there is nothing to access.
+ */
+#define VMM_EXIT_VECTOR_GENERAL_PROTECTION 13
+
+/**
+ * Handles an exit for which it is registered with HvExitRegisterHandler, with the Context it was registered with.
+ * Returns FALSE if the exit is not one it handles, to pass it on to the next handler.
+ */
+typedef BOOL (*PVMM_EXIT_HANDLER)(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext, PVOID Context);
+
+/**
+ * Priority of the handlers of the hypervisor itself.
+ */
+#define VMM_EXIT_HANDLER_PRIORITY_DEFAULT 0
+
+/**
+ * The handler calls kernel services, such as logging or allocating memory, so the IRQL is raised to DISPATCH_LEVEL
+ * before it is called. Handlers without it must only touch the hypervisor's own state.
+ */
+#define VMM_EXIT_HANDLER_FLAG_KERNEL 0x1
+
+/**
+ * A handler in the chain of handlers for an exit reason.
+ */
+struct _VMM_EXIT_HANDLER_REGISTRATION
+{
+	/**
+	 * The next handler in the chain, which has the same or a lower priority.
+	 */
+	PVMM_EXIT_HANDLER_REGISTRATION Next;
+
+	/**
+	 * The handler and the context it is called with.
+	 */
+	PVMM_EXIT_HANDLER Handler;
+	PVOID Context;
+
+	/**
+	 * Handlers with a higher priority are called first.
+	 */
+	LONG Priority;
+
+	/**
+	 * VMM_EXIT_HANDLER_FLAG_* flags of the handler.
+	 */
+	ULONG Flags;
+
+	/**
+	 * The basic exit reason the handler is registered for.
+	 */
+	SIZE_T ExitReason;
+};
+
+SIZE_T HvExitGetGuestRsp(PVMEXIT_CONTEXT ExitContext);
+
+SIZE_T HvExitGetGuestRip(PVMEXIT_CONTEXT ExitContext);
+
+SIZE_T HvExitGetGuestFlags(PVMEXIT_CONTEXT ExitContext);
+
+SIZE_T HvExitGetExitQualification(PVMEXIT_CONTEXT ExitContext);
+
+SIZE_T HvExitGetInstructionLength(PVMEXIT_CONTEXT ExitContext);
+
+SIZE_T HvExitGetInstructionInformation(PVMEXIT_CONTEXT ExitContext);
+
+SIZE_T HvExitGetGuestPhysicalAddress(PVMEXIT_CONTEXT ExitContext);
+
+SIZE_T HvExitGetGuestCs(PVMEXIT_CONTEXT ExitContext);
+
+VOID HvExitInjectException(PVMEXIT_CONTEXT ExitContext, SIZE_T Vector);
+
+VOID HvExitInjectExceptionWithErrorCode(PVMEXIT_CONTEXT ExitContext, SIZE_T Vector, SIZE_T ErrorCode);
+
+DECLSPEC_NORETURN VOID HvExitLeaveVmx(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext);
+
+VOID HvExitRaiseIrql(PVMEXIT_CONTEXT ExitContext);
+
+VOID HvExitRestoreIrql(PVMEXIT_CONTEXT ExitContext);
+
+VOID HvExitRecordStatistics(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext, UINT64 Cycles);
+
+VOID HvExitReportStatistics(PVMM_PROCESSOR_CONTEXT ProcessorContext);
+
+BOOL HvExitInitializeHandlers(PVMM_CONTEXT GlobalContext);
+
+VOID HvExitFreeHandlers(PVMM_CONTEXT GlobalContext);
+
+PVMM_EXIT_HANDLER_REGISTRATION HvExitRegisterHandler(PVMM_CONTEXT GlobalContext, SIZE_T ExitReason, LONG Priority, ULONG Flags, PVMM_EXIT_HANDLER Handler, PVOID Context);
+
+VOID HvExitUnregisterHandler(PVMM_CONTEXT GlobalContext, PVMM_EXIT_HANDLER_REGISTRATION Registration);
+
 BOOL HvExitDispatchFunction(PVMM_PROCESSOR_CONTEXT ProcessorContext, PVMEXIT_CONTEXT ExitContext);
 
 VOID VmxInitializeExitContext(PVMEXIT_CONTEXT ExitContext, PGPREGISTER_CONTEXT GuestRegisters);
\ No newline at end of file
@@ -1,5 +1,70 @@
 #pragma once
 
+#ifdef GBHV_USER_MODE
+
+/*
+ * Defined by the user mode test harness, which compiles the parts of the VMM that do not depend on VMX or the
+ * kernel (see test/EptHarness). Windows.h defines its own BOOL, so keep it out of the way of ours.
+ */
+#define BOOL WINDOWS_BOOL
+#include <windows.h>
+#undef BOOL
+
+#include <intrin.h>
+
+#pragma warning(push, 0)
+
+/*
+ * The few kernel types and helpers the shared headers use that user mode does not have.
+ */
+#define PAGE_SIZE 0x1000
+
+typedef ULONG_PTR KSPIN_LOCK;
+typedef UCHAR KIRQL;
+
+FORCEINLINE VOID InitializeListHead(PLIST_ENTRY ListHead)
+{
+	ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+FORCEINLINE BOOLEAN IsListEmpty(PLIST_ENTRY ListHead)
+{
+	return (BOOLEAN)(ListHead->Flink == ListHead);
+}
+
+FORCEINLINE BOOLEAN RemoveEntryList(PLIST_ENTRY Entry)
+{
+	PLIST_ENTRY Flink;
+	PLIST_ENTRY Blink;
+
+	Flink = Entry->Flink;
+	Blink = Entry->Blink;
+	Blink->Flink = Flink;
+	Flink->Blink = Blink;
+
+	return (BOOLEAN)(Flink == Blink);
+}
+
+FORCEINLINE PLIST_ENTRY RemoveHeadList(PLIST_ENTRY ListHead)
+{
+	PLIST_ENTRY Entry;
+
+	Entry = ListHead->Flink;
+	RemoveEntryList(Entry);
+
+	return Entry;
+}
+
+FORCEINLINE VOID InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+	Entry->Flink = ListHead->Flink;
+	Entry->Blink = ListHead;
+	ListHead->Flink->Blink = Entry;
+	ListHead->Flink = Entry;
+}
+
+#else
+
 // PHNT_MODE_KERNEL
 #define PHNT_MODE 0
 
@@ -19,6 +84,8 @@
  */
 #include "phnt/phnt.h"
 
+#endif
+
 /*
  * IA32-doc has structures for the entire intel SDM... pretty insane tbh.
  */
@@ -50,6 +117,8 @@ typedef CR0* PCR0;
 typedef CR4* PCR4;
 typedef VMX_MSR_BITMAP* PVMX_MSR_BITMAP;
 
+#ifndef GBHV_USER_MODE
+
 /*
  * NT APIs for DPCs Generic Calls (that for some reason aren't in the WDK)
  */
@@ -80,10 +149,22 @@ KeSignalCallDpcSynchronize(
 	_In_ PVOID SystemArgument2
 );
 
+NTSYSAPI
+NTSTATUS
+NTAPI
+ZwQuerySystemInformation(
+	_In_ SYSTEM_INFORMATION_CLASS SystemInformationClass,
+	_Out_writes_bytes_opt_(SystemInformationLength) PVOID SystemInformation,
+	_In_ ULONG SystemInformationLength,
+	_Out_opt_ PULONG ReturnLength
+);
+
 DECLSPEC_NORETURN
 NTSYSAPI
 VOID
 RtlRestoreContext(
 	_In_ PCONTEXT ContextRecord,
 	_In_opt_ struct _EXCEPTION_RECORD * ExceptionRecord
-);
\ No newline at end of file
+);
+
+#endif
\ No newline at end of file
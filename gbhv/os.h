@@ -3,6 +3,15 @@
 #include "extern.h"
 #include "arch.h"
 
+/*
+ * A range of physical memory backed by RAM or assigned to a device, as reported by the OS.
+ */
+typedef struct _OS_PHYSICAL_MEMORY_RANGE
+{
+	SIZE_T BaseAddress;
+	SIZE_T NumberOfBytes;
+} OS_PHYSICAL_MEMORY_RANGE, *POS_PHYSICAL_MEMORY_RANGE;
+
 SIZE_T OsGetCPUCount();
 
 SIZE_T OsGetCurrentProcessorNumber();
@@ -21,6 +30,16 @@ PPHYSVOID OsVirtualToPhysical(PVOID VirtualAddress);
 
 PVOID OsPhysicalToVirtual(PPHYSVOID PhysicalAddress);
 
+BOOLEAN OsWriteProtectedMemory(PVOID Destination, PVOID Source, SIZE_T Length);
+
+SIZE_T OsGetPhysicalMemoryRanges(POS_PHYSICAL_MEMORY_RANGE Ranges, SIZE_T MaxRanges);
+
+SIZE_T OsGetDeviceMemoryRanges(POS_PHYSICAL_MEMORY_RANGE Ranges, SIZE_T MaxRanges);
+
+ULONG OsReadDriverParameter(struct _UNICODE_STRING *RegistryPath, PCWSTR ValueName, ULONG DefaultValue);
+
+BOOLEAN OsIsKernelVaShadowEnabled();
+
 VOID OsZeroMemory(PVOID VirtualAddress, SIZE_T Length);
 
 VOID OsCaptureContext(PREGISTER_CONTEXT ContextRecord);
\ No newline at end of file
@@ -120,6 +120,369 @@ PVOID OsPhysicalToVirtual(PPHYSVOID PhysicalAddressIn)
 	return (PVOID)MmGetVirtualForPhysical(PhysicalAddress);
 }
 
+/*
+ * Copy Length bytes from Source to Destination, which may be mapped read-only, through a writable mapping of its own
+ * rather than by lifting write protection. Destination must be nonpaged. Must be called at or below DISPATCH_LEVEL.
+ * 
+ * Returns FALSE if Destination could not be mapped.
+ */
+BOOLEAN OsWriteProtectedMemory(PVOID Destination, PVOID Source, SIZE_T Length)
+{
+	PMDL Mdl;
+	PVOID Mapping;
+
+	Mdl = IoAllocateMdl(Destination, (ULONG)Length, FALSE, FALSE, NULL);
+	if (!Mdl)
+	{
+		return FALSE;
+	}
+
+	MmBuildMdlForNonPagedPool(Mdl);
+
+	/* System mappings of an MDL are writable no matter how the original address is mapped */
+	Mapping = MmMapLockedPagesSpecifyCache(Mdl, KernelMode, MmCached, NULL, FALSE, NormalPagePriority | MdlMappingNoExecute);
+	if (!Mapping)
+	{
+		IoFreeMdl(Mdl);
+		return FALSE;
+	}
+
+	RtlCopyMemory(Mapping, Source, Length);
+
+	MmUnmapLockedPages(Mapping, Mdl);
+	IoFreeMdl(Mdl);
+
+	return TRUE;
+}
+
+/*
+ * Get the ranges of physical memory backed by RAM, in ascending order, copying up to MaxRanges of them into Ranges.
+ * 
+ * Returns the number of ranges copied, or 0 if the ranges could not be retrieved or there were more than MaxRanges.
+ */
+SIZE_T OsGetPhysicalMemoryRanges(POS_PHYSICAL_MEMORY_RANGE Ranges, SIZE_T MaxRanges)
+{
+	PPHYSICAL_MEMORY_RANGE MemoryRanges;
+	SIZE_T RangeCount;
+
+	MemoryRanges = MmGetPhysicalMemoryRanges();
+	if (MemoryRanges == NULL)
+	{
+		HvUtilLogError("OsGetPhysicalMemoryRanges: Could not get physical memory ranges.\n");
+		return 0;
+	}
+
+	/* The array is terminated by a range of zero length */
+	for (RangeCount = 0; MemoryRanges[RangeCount].NumberOfBytes.QuadPart != 0; RangeCount++)
+	{
+		if (RangeCount == MaxRanges)
+		{
+			HvUtilLogError("OsGetPhysicalMemoryRanges: More than %lld physical memory ranges.\n", MaxRanges);
+			ExFreePool(MemoryRanges);
+			return 0;
+		}
+
+		Ranges[RangeCount].BaseAddress = (SIZE_T)MemoryRanges[RangeCount].BaseAddress.QuadPart;
+		Ranges[RangeCount].NumberOfBytes = (SIZE_T)MemoryRanges[RangeCount].NumberOfBytes.QuadPart;
+	}
+
+	ExFreePool(MemoryRanges);
+
+	return RangeCount;
+}
+
+/*
+ * Registry key under which the PnP manager and drivers record the hardware resources assigned to each device.
+ */
+#define OS_RESOURCE_MAP_KEY L"\\Registry\\Machine\\HARDWARE\\RESOURCEMAP"
+
+/*
+ * Depth of the values below OS_RESOURCE_MAP_KEY, which is keyed by device class and then by driver.
+ */
+#define OS_RESOURCE_MAP_DEPTH 2
+
+/*
+ * Size of the buffer each key and value of the resource map is read into.
+ */
+#define OS_RESOURCE_MAP_BUFFER_SIZE (64 * 1024)
+
+/*
+ * Append the memory resources of a resource list read from the registry to Ranges.
+ * 
+ * Returns FALSE if the list is malformed or there are more than MaxRanges ranges in total.
+ */
+BOOLEAN OspAddResourceListRanges(PCM_RESOURCE_LIST ResourceList, SIZE_T Length, POS_PHYSICAL_MEMORY_RANGE Ranges, SIZE_T MaxRanges, PSIZE_T RangeCount)
+{
+	PCM_FULL_RESOURCE_DESCRIPTOR FullDescriptor;
+	PCM_PARTIAL_RESOURCE_DESCRIPTOR Descriptor;
+	PCHAR End;
+	ULONG ListIndex;
+	ULONG DescriptorIndex;
+	ULONGLONG Start;
+	ULONGLONG NumberOfBytes;
+
+	if (Length < sizeof(CM_RESOURCE_LIST))
+	{
+		return FALSE;
+	}
+
+	End = (PCHAR)ResourceList + Length;
+	FullDescriptor = &ResourceList->List[0];
+
+	for (ListIndex = 0; ListIndex < ResourceList->Count; ListIndex++)
+	{
+		if ((PCHAR)&FullDescriptor->PartialResourceList.PartialDescriptors[0] > End)
+		{
+			return FALSE;
+		}
+
+		Descriptor = &FullDescriptor->PartialResourceList.PartialDescriptors[0];
+
+		for (DescriptorIndex = 0; DescriptorIndex < FullDescriptor->PartialResourceList.Count; DescriptorIndex++)
+		{
+			if ((PCHAR)(Descriptor + 1) > End)
+			{
+				return FALSE;
+			}
+
+			if (Descriptor->Type == CmResourceTypeMemory || Descriptor->Type == CmResourceTypeMemoryLarge)
+			{
+				NumberOfBytes = RtlCmDecodeMemIoResource(Descriptor, &Start);
+				if (NumberOfBytes != 0)
+				{
+					if (*RangeCount == MaxRanges)
+					{
+						HvUtilLogError("OsGetDeviceMemoryRanges: More than %lld device memory ranges.\n", MaxRanges);
+						return FALSE;
+					}
+
+					Ranges[*RangeCount].BaseAddress = (SIZE_T)Start;
+					Ranges[*RangeCount].NumberOfBytes = (SIZE_T)NumberOfBytes;
+					(*RangeCount)++;
+				}
+			}
+
+			/* Device specific data is stored right after its descriptor */
+			if (Descriptor->Type == CmResourceTypeDeviceSpecific)
+			{
+				Descriptor = (PCM_PARTIAL_RESOURCE_DESCRIPTOR)((PCHAR)(Descriptor + 1) + Descriptor->u.DeviceSpecificData.DataSize);
+			}
+			else
+			{
+				Descriptor++;
+			}
+		}
+
+		/* The next full descriptor follows the last partial descriptor of this one */
+		FullDescriptor = (PCM_FULL_RESOURCE_DESCRIPTOR)Descriptor;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Append the memory resources of every translated resource list in the key Name below ParentKey, and in its subkeys
+ * down to OS_RESOURCE_MAP_DEPTH, to Ranges. Buffer holds OS_RESOURCE_MAP_BUFFER_SIZE bytes.
+ * 
+ * Returns FALSE if any of them could not be read.
+ */
+BOOLEAN OspAddResourceMapRanges(HANDLE ParentKey, PUNICODE_STRING Name, SIZE_T Depth, PVOID Buffer, POS_PHYSICAL_MEMORY_RANGE Ranges, SIZE_T MaxRanges, PSIZE_T RangeCount)
+{
+	static UNICODE_STRING TranslatedSuffix = RTL_CONSTANT_STRING(L".Translated");
+	OBJECT_ATTRIBUTES Attributes;
+	PKEY_VALUE_FULL_INFORMATION ValueInformation;
+	PKEY_BASIC_INFORMATION KeyInformation;
+	UNICODE_STRING ValueSuffix;
+	UNICODE_STRING SubkeyName;
+	HANDLE Key;
+	NTSTATUS Status;
+	ULONG ResultLength;
+	ULONG Index;
+	BOOLEAN Success;
+
+	InitializeObjectAttributes(&Attributes, Name, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, ParentKey, NULL);
+
+	Status = ZwOpenKey(&Key, KEY_READ, &Attributes);
+	if (!NT_SUCCESS(Status))
+	{
+		HvUtilLogError("OsGetDeviceMemoryRanges: Could not open %wZ. Status: 0x%X\n", Name, Status);
+		return FALSE;
+	}
+
+	Success = TRUE;
+
+	/* Only the translated lists hold the addresses the processor uses, the raw ones are relative to the bus */
+	for (Index = 0; Success; Index++)
+	{
+		Status = ZwEnumerateValueKey(Key, Index, KeyValueFullInformation, Buffer, OS_RESOURCE_MAP_BUFFER_SIZE, &ResultLength);
+		if (Status == STATUS_NO_MORE_ENTRIES)
+		{
+			break;
+		}
+
+		if (!NT_SUCCESS(Status))
+		{
+			HvUtilLogError("OsGetDeviceMemoryRanges: Could not read a value of the resource map. Status: 0x%X\n", Status);
+			Success = FALSE;
+			break;
+		}
+
+		ValueInformation = (PKEY_VALUE_FULL_INFORMATION)Buffer;
+
+		if (ValueInformation->Type != REG_RESOURCE_LIST || ValueInformation->NameLength < TranslatedSuffix.Length)
+		{
+			continue;
+		}
+
+		ValueSuffix.Buffer = &ValueInformation->Name[(ValueInformation->NameLength - TranslatedSuffix.Length) / sizeof(WCHAR)];
+		ValueSuffix.Length = TranslatedSuffix.Length;
+		ValueSuffix.MaximumLength = TranslatedSuffix.Length;
+
+		if (RtlEqualUnicodeString(&ValueSuffix, &TranslatedSuffix, TRUE))
+		{
+			Success = OspAddResourceListRanges((PCM_RESOURCE_LIST)((PCHAR)ValueInformation + ValueInformation->DataOffset),
+				ValueInformation->DataLength, Ranges, MaxRanges, RangeCount);
+		}
+	}
+
+	for (Index = 0; Success && Depth < OS_RESOURCE_MAP_DEPTH; Index++)
+	{
+		Status = ZwEnumerateKey(Key, Index, KeyBasicInformation, Buffer, OS_RESOURCE_MAP_BUFFER_SIZE, &ResultLength);
+		if (Status == STATUS_NO_MORE_ENTRIES)
+		{
+			break;
+		}
+
+		if (!NT_SUCCESS(Status))
+		{
+			HvUtilLogError("OsGetDeviceMemoryRanges: Could not read a key of the resource map. Status: 0x%X\n", Status);
+			Success = FALSE;
+			break;
+		}
+
+		/* The subkey is opened before Buffer is reused, so its name can stay there */
+		KeyInformation = (PKEY_BASIC_INFORMATION)Buffer;
+		SubkeyName.Buffer = KeyInformation->Name;
+		SubkeyName.Length = (USHORT)KeyInformation->NameLength;
+		SubkeyName.MaximumLength = (USHORT)KeyInformation->NameLength;
+
+		Success = OspAddResourceMapRanges(Key, &SubkeyName, Depth + 1, Buffer, Ranges, MaxRanges, RangeCount);
+	}
+
+	ZwClose(Key);
+
+	return Success;
+}
+
+/*
+ * Get the ranges of physical memory assigned to devices (PCI BARs and the like), copying up to MaxRanges of them into
+ * Ranges. They are read from the resource map in the registry, so they may overlap each other and are in no
+ * particular order. Devices started later are not included. Must be called at PASSIVE_LEVEL.
+ * 
+ * Returns the number of ranges copied, or 0 if the ranges could not all be retrieved or there were more than MaxRanges.
+ */
+SIZE_T OsGetDeviceMemoryRanges(POS_PHYSICAL_MEMORY_RANGE Ranges, SIZE_T MaxRanges)
+{
+	UNICODE_STRING KeyName = RTL_CONSTANT_STRING(OS_RESOURCE_MAP_KEY);
+	PVOID Buffer;
+	SIZE_T RangeCount;
+
+	Buffer = OsAllocateNonpagedMemory(OS_RESOURCE_MAP_BUFFER_SIZE);
+	if (!Buffer)
+	{
+		return 0;
+	}
+
+	RangeCount = 0;
+	if (!OspAddResourceMapRanges(NULL, &KeyName, 0, Buffer, Ranges, MaxRanges, &RangeCount))
+	{
+		RangeCount = 0;
+	}
+
+	OsFreeNonpagedMemory(Buffer);
+
+	return RangeCount;
+}
+
+/*
+ * Read the DWORD value ValueName from the Parameters subkey of the service key of the driver at RegistryPath, for
+ * settings that can be changed without rebuilding the driver. Must be called at PASSIVE_LEVEL.
+ * 
+ * Returns DefaultValue if the key or the value does not exist or the value is not a DWORD.
+ */
+ULONG OsReadDriverParameter(PUNICODE_STRING RegistryPath, PCWSTR ValueName, ULONG DefaultValue)
+{
+	UNICODE_STRING ParametersName = RTL_CONSTANT_STRING(L"Parameters");
+	UNICODE_STRING Name;
+	OBJECT_ATTRIBUTES Attributes;
+	HANDLE ServiceKey;
+	HANDLE ParametersKey;
+	UCHAR Buffer[sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(ULONG)];
+	PKEY_VALUE_PARTIAL_INFORMATION Information;
+	ULONG ResultLength;
+	ULONG Value;
+	NTSTATUS Status;
+
+	Value = DefaultValue;
+
+	InitializeObjectAttributes(&Attributes, RegistryPath, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, NULL);
+	Status = ZwOpenKey(&ServiceKey, KEY_READ, &Attributes);
+	if (!NT_SUCCESS(Status))
+	{
+		return Value;
+	}
+
+	InitializeObjectAttributes(&Attributes, &ParametersName, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, ServiceKey, NULL);
+	Status = ZwOpenKey(&ParametersKey, KEY_READ, &Attributes);
+	ZwClose(ServiceKey);
+	if (!NT_SUCCESS(Status))
+	{
+		return Value;
+	}
+
+	RtlInitUnicodeString(&Name, ValueName);
+	Information = (PKEY_VALUE_PARTIAL_INFORMATION)Buffer;
+
+	Status = ZwQueryValueKey(ParametersKey, &Name, KeyValuePartialInformation, Information, sizeof(Buffer), &ResultLength);
+	if (NT_SUCCESS(Status) && Information->Type == REG_DWORD && Information->DataLength == sizeof(ULONG))
+	{
+		Value = *(PULONG)Information->Data;
+	}
+
+	ZwClose(ParametersKey);
+
+	return Value;
+}
+
+/*
+ * Determine whether the OS runs user mode on page tables of its own, which only map a small part of the kernel
+ * (kernel virtual address shadow, the mitigation for Meltdown). Must be called at PASSIVE_LEVEL.
+ * 
+ * Systems which predate the mitigation do not know the information class, and so do not have it enabled.
+ */
+BOOLEAN OsIsKernelVaShadowEnabled()
+{
+	SYSTEM_KERNEL_VA_SHADOW_INFORMATION Information;
+	NTSTATUS Status;
+
+	Information.Flags = 0;
+
+	Status = ZwQuerySystemInformation(SystemKernelVaShadowInformation, &Information, sizeof(Information), NULL);
+	if (Status == STATUS_INVALID_INFO_CLASS || Status == STATUS_NOT_IMPLEMENTED)
+	{
+		return FALSE;
+	}
+
+	if (!NT_SUCCESS(Status))
+	{
+		/* Assume the worst */
+		HvUtilLogError("OsIsKernelVaShadowEnabled: Could not query KVA shadow information. Status: 0x%X\n", Status);
+		return TRUE;
+	}
+
+	return (BOOLEAN)Information.KvaShadowEnabled;
+}
+
 /*
  * Zero out Length bytes of a region of memory.
  */
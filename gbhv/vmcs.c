@@ -357,7 +357,8 @@ VMX_ERROR HvSetupVmcsControlFields(PVMM_PROCESSOR_CONTEXT Context)
 	VmxVmwriteFieldFromRegister(VMCS_CTRL_PIN_BASED_VM_EXECUTION_CONTROLS, HvSetupVmcsControlPinBased(Context));
 
 	/////////////////////////////// Processor-Based VM-Execution Controls ///////////////////////////////
-	VmxVmwriteFieldFromRegister(VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, HvSetupVmcsControlProcessor(Context));
+	Context->ProcessorBasedControls = HvSetupVmcsControlProcessor(Context);
+	VmxVmwriteFieldFromRegister(VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, Context->ProcessorBasedControls);
 
 	/*
 	 * No vmexits on any exceptions.
@@ -427,6 +428,26 @@ VMX_ERROR HvSetupVmcsControlFields(PVMM_PROCESSOR_CONTEXT Context)
 	/////////////////////////////// Secondary Processor-Based VM-Execution Controls ///////////////////////////////
 	VmxVmwriteFieldFromRegister(VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, HvSetupVmcsControlSecondaryProcessor(Context));
 
+	/*
+	 * Enable EPTP switching, VM function 0, which loads the EPTP at index ECX of the EPTP list. The list holds the
+	 * EPT views of this processor.
+	 */
+	if (Context->EptpList)
+	{
+		VmxVmwriteFieldFromImmediate(VMCS_CTRL_VMFUNC_CONTROLS, 1);
+		VmxVmwriteFieldFromImmediate(VMCS_CTRL_EPTP_LIST_ADDRESS, (SIZE_T)OsVirtualToPhysical(Context->EptpList));
+	}
+
+	/*
+	 * The page the processor describes each #VE in, and the view the guest starts in. VMFUNC keeps the EPTP index
+	 * up to date when the guest switches views itself.
+	 */
+	if (Context->VeInformation)
+	{
+		VmxVmwriteFieldFromImmediate(VMCS_CTRL_VIRTUALIZATION_EXCEPTION_INFORMATION_ADDRESS, (SIZE_T)OsVirtualToPhysical(Context->VeInformation));
+		VmxVmwriteFieldFromImmediate(VMCS_CTRL_EPTP_INDEX, VmmEptViewRead);
+	}
+
 	/*
 	 * MSR bitmap defines which MSRs in a certain usable range will cause exits.
 	 */
@@ -558,8 +579,6 @@ IA32_VMX_PROCBASED_CTLS2_REGISTER HvSetupVmcsControlSecondaryProcessor(PVMM_PROC
 	IA32_VMX_PROCBASED_CTLS2_REGISTER Register;
 	SIZE_T ConfigMSR;
 
-	UNREFERENCED_PARAMETER(Context);
-
 	// Start with default 0 in all bits.
 	Register.Flags = 0;
 
@@ -623,6 +642,32 @@ IA32_VMX_PROCBASED_CTLS2_REGISTER HvSetupVmcsControlSecondaryProcessor(PVMM_PROC
 	 */
 	Register.ConcealVmxFromPt = 1;
 
+	/*
+	 * Let the guest switch between the EPT views of this processor with VMFUNC, without a VM exit. The views are only
+	 * built if HvVmcsIsEptpSwitchingSupported, otherwise page hooks swap entries within a single page table.
+	 *
+	 * ------------------------------------------------------------------------------------------------------------
+	 *
+	 * If this control is 0, any execution of VMFUNC causes a #UD.
+	 */
+	if (Context->EptpList)
+	{
+		Register.EnableVmFunctions = 1;
+	}
+
+	/*
+	 * Raise EPT violations on page hooks in the guest as #VE, so that its handler can switch views without a VM exit.
+	 * Only entries with the "suppress #VE" bit cleared do so, everything else still exits.
+	 *
+	 * ------------------------------------------------------------------------------------------------------------
+	 *
+	 * If this control is 1, EPT violations may cause virtualization exceptions (#VE) instead of VM exits.
+	 */
+	if (Context->VeInformation)
+	{
+		Register.EptViolation = 1;
+	}
+
 	/*
 	 * There is no "true" CTLS2 register.
 	 */
@@ -753,3 +798,80 @@ IA32_VMX_EXIT_CTLS_REGISTER HvSetupVmcsControlVmExit(PVMM_PROCESSOR_CONTEXT Cont
 	return Register;
 }
 
+/*
+ * Check whether the monitor trap flag may be set in the Processor-Based VM-Execution Controls on this processor.
+ */
+BOOL HvVmcsIsMonitorTrapFlagSupported(PVMM_CONTEXT GlobalContext)
+{
+	IA32_VMX_PROCBASED_CTLS_REGISTER AllowedSettings;
+	SIZE_T ConfigMSR;
+
+	if (GlobalContext->VmxCapabilities.VmxControls == 1)
+	{
+		ConfigMSR = ArchGetHostMSR(IA32_VMX_TRUE_PROCBASED_CTLS);
+	}
+	else
+	{
+		ConfigMSR = ArchGetHostMSR(IA32_VMX_PROCBASED_CTLS);
+	}
+
+	// The high 32 bits are the controls which are allowed to be 1.
+	AllowedSettings.Flags = ConfigMSR >> 32;
+
+	return AllowedSettings.MonitorTrapFlag == 1;
+}
+
+/*
+ * Set or clear the monitor trap flag in the current VMCS. While it is set, a VM exit occurs after the guest
+ * executes a single instruction. Must be called from VMX root.
+ * 
+ * The controls are kept in the processor context, so the flag is changed without a VMREAD.
+ */
+VMX_ERROR HvVmcsSetMonitorTrapFlag(PVMM_PROCESSOR_CONTEXT Context, BOOL Enable)
+{
+	VMX_ERROR VmError;
+
+	VmError = 0;
+
+	Context->ProcessorBasedControls.MonitorTrapFlag = Enable ? 1 : 0;
+
+	VmxVmwriteFieldFromRegister(VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, Context->ProcessorBasedControls);
+
+	return VmError;
+}
+
+/*
+ * Check whether VMFUNC may be enabled in the Secondary Processor-Based VM-Execution Controls on this processor, and
+ * whether EPTP switching is one of the VM functions it supports.
+ */
+BOOL HvVmcsIsEptpSwitchingSupported()
+{
+	IA32_VMX_PROCBASED_CTLS2_REGISTER AllowedSettings;
+	IA32_VMX_VMFUNC_REGISTER VmFunctions;
+
+	// The high 32 bits are the controls which are allowed to be 1.
+	AllowedSettings.Flags = ArchGetHostMSR(IA32_VMX_PROCBASED_CTLS2) >> 32;
+
+	// IA32_VMX_VMFUNC only exists if VM functions can be enabled.
+	if (AllowedSettings.EnableVmFunctions == 0)
+	{
+		return FALSE;
+	}
+
+	VmFunctions.Flags = ArchGetHostMSR(IA32_VMX_VMFUNC);
+
+	return VmFunctions.EptpSwitching == 1;
+}
+
+/*
+ * Check whether EPT violations may be raised as virtualization exceptions on this processor.
+ */
+BOOL HvVmcsIsEptViolationVeSupported()
+{
+	IA32_VMX_PROCBASED_CTLS2_REGISTER AllowedSettings;
+
+	// The high 32 bits are the controls which are allowed to be 1.
+	AllowedSettings.Flags = ArchGetHostMSR(IA32_VMX_PROCBASED_CTLS2) >> 32;
+
+	return AllowedSettings.EptViolation == 1;
+}
@@ -19,4 +19,12 @@ IA32_VMX_PROCBASED_CTLS2_REGISTER HvSetupVmcsControlSecondaryProcessor(PVMM_PROC
 
 IA32_VMX_ENTRY_CTLS_REGISTER HvSetupVmcsControlVmEntry(PVMM_PROCESSOR_CONTEXT Context);
 
-IA32_VMX_EXIT_CTLS_REGISTER HvSetupVmcsControlVmExit(PVMM_PROCESSOR_CONTEXT Context);
\ No newline at end of file
+IA32_VMX_EXIT_CTLS_REGISTER HvSetupVmcsControlVmExit(PVMM_PROCESSOR_CONTEXT Context);
+
+BOOL HvVmcsIsMonitorTrapFlagSupported(PVMM_CONTEXT GlobalContext);
+
+VMX_ERROR HvVmcsSetMonitorTrapFlag(PVMM_PROCESSOR_CONTEXT Context, BOOL Enable);
+
+BOOL HvVmcsIsEptpSwitchingSupported();
+
+BOOL HvVmcsIsEptViolationVeSupported();
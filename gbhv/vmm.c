@@ -17,8 +17,10 @@
  *        step of initialization, one for each logical processor for VT-X execution.
  *      - After each DPC is complete, this function returns TRUE if all processors successfully entered
  *        VT-x mode.
+ * 
+ * MapPhysicalMemoryOnly selects whether EPT maps memory not backed by RAM at load, see VMM_CONTEXT.
  */
-PVMM_CONTEXT HvInitializeAllProcessors()
+PVMM_CONTEXT HvInitializeAllProcessors(BOOLEAN MapPhysicalMemoryOnly)
 {
     SIZE_T FeatureMSR;
     PVMM_CONTEXT GlobalContext;
@@ -53,20 +55,13 @@ PVMM_CONTEXT HvInitializeAllProcessors()
     HvUtilLog("Total Processor Count: %i\n", OsGetCPUCount());
 
     // Pre-allocate all logical processor contexts, VMXON regions, VMCS regions
-    GlobalContext = HvAllocateVmmContext();
+    GlobalContext = HvAllocateVmmContext(MapPhysicalMemoryOnly);
 
 	if(!GlobalContext)
 	{
 		return NULL;
 	}
 
-	if (!HvEptGlobalInitialize(GlobalContext))
-	{
-		HvUtilLogError("Processor does not support all necessary EPT features.\n");
-		HvFreeVmmContext(GlobalContext);
-		return NULL;
-	}
-
     // Generates a DPC that makes all processors execute the broadcast function.
     KeGenericCallDpc(HvpDPCBroadcastFunction, (PVOID)GlobalContext);
 
@@ -90,9 +85,10 @@ PVMM_CONTEXT HvInitializeAllProcessors()
  * - Allocates a VMM_PROCESSOR_CONTEXT structure for each logical processor, containing
  *   information about hv operation for only that singular processor.
  */
-PVMM_CONTEXT HvAllocateVmmContext()
+PVMM_CONTEXT HvAllocateVmmContext(BOOLEAN MapPhysicalMemoryOnly)
 {
     PVMM_CONTEXT Context;
+    SIZE_T ProcessorNumber;
 
     // Allocate the global context structure
     Context = (PVMM_CONTEXT)OsAllocateNonpagedMemory(sizeof(VMM_CONTEXT));
@@ -117,31 +113,60 @@ PVMM_CONTEXT HvAllocateVmmContext()
 	 */
     Context->VmxCapabilities = ArchGetBasicVmxCapabilities();
 
-    PVMM_PROCESSOR_CONTEXT *ProcessorContexts = OsAllocateNonpagedMemory(Context->ProcessorCount * sizeof(PVMM_PROCESSOR_CONTEXT));
-    if (!ProcessorContexts)
+	// Must be known before the identity map is built
+	Context->MapPhysicalMemoryOnly = MapPhysicalMemoryOnly;
+
+	/*
+	 * Build the EPT structures shared by all processors. This must happen before the processor contexts
+	 * are allocated, as their page tables are created from the identity map.
+	 */
+	if (!HvEptGlobalInitialize(Context))
+	{
+		HvUtilLogError("HvAllocateVmmContext: Failed to initialize EPT.\n");
+		goto Failure;
+	}
+
+	/*
+	 * Register the exit handlers of the hypervisor before any processor can take an exit.
+	 */
+	if (!HvExitInitializeHandlers(Context))
+	{
+		HvUtilLogError("HvAllocateVmmContext: Failed to register exit handlers.\n");
+		goto Failure;
+	}
+
+    Context->AllProcessorContexts = (PVMM_PROCESSOR_CONTEXT*)OsAllocateNonpagedMemory(Context->ProcessorCount * sizeof(PVMM_PROCESSOR_CONTEXT));
+    if (!Context->AllProcessorContexts)
     {
-        return NULL;
+        goto Failure;
     }
 
+	/* Contexts which are still NULL are skipped when freeing */
+	OsZeroMemory(Context->AllProcessorContexts, Context->ProcessorCount * sizeof(PVMM_PROCESSOR_CONTEXT));
+
     /*
 	 * Allocate a logical processor context structure for each processor on the system.
 	 */
-    for (SIZE_T ProcessorNumber = 0; ProcessorNumber < Context->ProcessorCount; ProcessorNumber++)
+    for (ProcessorNumber = 0; ProcessorNumber < Context->ProcessorCount; ProcessorNumber++)
     {
-        ProcessorContexts[ProcessorNumber] = HvAllocateLogicalProcessorContext(Context);
-        if (ProcessorContexts[ProcessorNumber] == NULL)
+        Context->AllProcessorContexts[ProcessorNumber] = HvAllocateLogicalProcessorContext(Context);
+        if (Context->AllProcessorContexts[ProcessorNumber] == NULL)
         {
             HvUtilLogError("HvInitializeLogicalProcessor[#%i]: Failed to setup processor context.\n", ProcessorNumber);
-            return NULL;
+            goto Failure;
         }
 
-        HvUtilLog("HvInitializeLogicalProcessor[#%i]: Allocated Context [Context = 0x%llx]\n", ProcessorNumber, ProcessorContexts[ProcessorNumber]);
+        HvUtilLog("HvInitializeLogicalProcessor[#%i]: Allocated Context [Context = 0x%llx]\n", ProcessorNumber, Context->AllProcessorContexts[ProcessorNumber]);
     }
 
-    Context->AllProcessorContexts = ProcessorContexts;
     HvUtilLog("VmcsRevisionNumber: %x\n", Context->VmxCapabilities.VmcsRevisionId);
 
     return Context;
+
+Failure:
+	/* Everything the context holds is either built or still zero, which HvFreeVmmContext skips */
+	HvFreeVmmContext(Context);
+	return NULL;
 }
 
 /*
@@ -151,14 +176,23 @@ VOID HvFreeVmmContext(PVMM_CONTEXT Context)
 {
     if (Context)
     {
-        // Free each logical processor context
-        for (SIZE_T ProcessorNumber = 0; ProcessorNumber < Context->ProcessorCount; ProcessorNumber++)
+        if (Context->AllProcessorContexts)
         {
-            HvFreeLogicalProcessorContext(Context->AllProcessorContexts[ProcessorNumber]);
+            // Free each logical processor context
+            for (SIZE_T ProcessorNumber = 0; ProcessorNumber < Context->ProcessorCount; ProcessorNumber++)
+            {
+                HvFreeLogicalProcessorContext(Context->AllProcessorContexts[ProcessorNumber]);
+            }
+
+            // Free the collection of pointers to processor contexts
+            OsFreeNonpagedMemory(Context->AllProcessorContexts);
         }
 
-        // Free the collection of pointers to processor contexts
-        OsFreeNonpagedMemory(Context->AllProcessorContexts);
+		// Free the EPT identity map now that no processor page table references it
+		HvEptGlobalFree(Context);
+
+		// Free the exit handler chains
+		HvExitFreeHandlers(Context);
 
         // Free the actual context struct
         OsFreeNonpagedMemory(Context);
@@ -174,6 +208,10 @@ PVMXON_REGION HvAllocateVmxonRegion(PVMM_CONTEXT GlobalContext)
 
     // See VMX_VMXON_NUMBER_PAGES documentation.
     Region = (PVMXON_REGION)OsAllocateContiguousAlignedPages(VMX_VMXON_NUMBER_PAGES);
+    if (!Region)
+    {
+        return NULL;
+    }
 
     // Zero VMXON region just to be sure...
     OsZeroMemory(Region, VMX_VMXON_NUMBER_PAGES * PAGE_SIZE);
@@ -222,36 +260,47 @@ PVMM_PROCESSOR_CONTEXT HvAllocateLogicalProcessorContext(PVMM_CONTEXT GlobalCont
     // See: vmxdefs.h and the structure definition.
     Context->HostStack.GlobalContext = GlobalContext;
 
+    // Followed by the pointer to this processor context, which is given to every exit handler.
+    Context->HostStack.ProcessorContext = Context;
+
+    // And the fast swap cache of this processor, which HvEnterFromGuest checks before anything else.
+    Context->HostStack.FastSwapCache = &Context->FastSwapCache;
+
     // Allocate and setup the VMXON region for this processor
     Context->VmxonRegion = HvAllocateVmxonRegion(GlobalContext);
     if (!Context->VmxonRegion)
     {
-        return NULL;
+        goto Failure;
     }
 
     Context->VmxonRegionPhysical = OsVirtualToPhysical(Context->VmxonRegion);
     if (!Context->VmxonRegionPhysical)
     {
-        return NULL;
+        goto Failure;
     }
 
     // Allocate and setup a blank VMCS region
     Context->VmcsRegion = HvAllocateVmcsRegion(GlobalContext);
     if (!Context->VmcsRegion)
     {
-        return NULL;
+        goto Failure;
     }
 
     Context->VmcsRegionPhysical = OsVirtualToPhysical(Context->VmcsRegion);
     if (!Context->VmcsRegionPhysical)
     {
-        return NULL;
+        goto Failure;
     }
 
     /*
 	 * Allocate one page for MSR bitmap, all zeroes because we are not exiting on any MSRs.
 	 */
     Context->MsrBitmap = OsAllocateContiguousAlignedPages(1);
+    if (!Context->MsrBitmap)
+    {
+        goto Failure;
+    }
+
     OsZeroMemory(Context->MsrBitmap, PAGE_SIZE);
 
     // Record the physical address of the MSR bitmap
@@ -262,11 +311,14 @@ PVMM_PROCESSOR_CONTEXT HvAllocateLogicalProcessorContext(PVMM_CONTEXT GlobalCont
 	 */
 	if(!HvEptLogicalProcessorInitialize(Context))
 	{
-		OsFreeContiguousAlignedPages(Context);
-		return NULL;
+		goto Failure;
 	}
 
     return Context;
+
+Failure:
+	HvFreeLogicalProcessorContext(Context);
+	return NULL;
 }
 
 /*
@@ -278,6 +330,10 @@ PVMCS HvAllocateVmcsRegion(PVMM_CONTEXT GlobalContext)
 
     // Allocate contiguous physical pages for the VMCS. See VMX_VMCS_NUMBER_PAGES.
     VmcsRegion = (PVMCS)OsAllocateContiguousAlignedPages(VMX_VMCS_NUMBER_PAGES);
+    if (!VmcsRegion)
+    {
+        return NULL;
+    }
 
     // Initialize all fields to zero.
     OsZeroMemory(VmcsRegion, VMX_VMCS_NUMBER_PAGES * PAGE_SIZE);
@@ -297,8 +353,22 @@ VOID HvFreeLogicalProcessorContext(PVMM_PROCESSOR_CONTEXT Context)
 {
     if (Context)
     {
-        OsFreeContiguousAlignedPages(Context->VmxonRegion);
-		OsFreeContiguousAlignedPages(Context->MsrBitmap);
+        // Regions that were never allocated are still NULL
+        if (Context->VmxonRegion)
+        {
+            OsFreeContiguousAlignedPages(Context->VmxonRegion);
+        }
+
+        if (Context->VmcsRegion)
+        {
+            OsFreeContiguousAlignedPages(Context->VmcsRegion);
+        }
+
+        if (Context->MsrBitmap)
+        {
+            OsFreeContiguousAlignedPages(Context->MsrBitmap);
+        }
+
 		HvEptFreeLogicalProcessorContext(Context);
         OsFreeNonpagedMemory(Context);
     }
@@ -397,11 +467,20 @@ VOID HvInitializeLogicalProcessor(PVMM_PROCESSOR_CONTEXT Context, SIZE_T GuestRS
         return;
     }
 
+    // Route #VE to our handler before the guest can raise one.
+    if (!HvEptInstallVirtualizationExceptionHandler(Context))
+    {
+        HvUtilLogError("HvInitializeLogicalProcessor[#%i]: Failed to install the #VE handler.\n", CurrentProcessorNumber);
+        VmxExitRootMode(Context);
+        return;
+    }
+
     // Launch the hypervisor! This function should not return if it is successful, as we continue execution
     // on the guest.
     if (!VmxLaunchProcessor(Context))
     {
         HvUtilLogError("HvInitializeLogicalProcessor[#%i]: Failed to VmxLaunchProcessor.\n", CurrentProcessorNumber);
+        HvEptRestoreVirtualizationExceptionHandler(Context);
         return;
     }
 }
@@ -421,31 +500,34 @@ VOID HvInitializeLogicalProcessor(PVMM_PROCESSOR_CONTEXT Context, SIZE_T GuestRS
  * By reading these two values, the exit handler can know exactly what steps it should take to handle the exit properly.
  * 
  * When the exit handler is called by the CPU, interrupts are disabled. In order to call certain kernel api functions
- * in Type 2, we will need to enable interrupts. Therefore, the first action the handler must take is to ensure execution 
- * of the handler is not executing below DISPATCH_LEVEL. This is to prevent the dispatcher from context switching away 
- * from our exit handler if we enable interrupts, potentially causing serious memory synchronization problems.
+ * in Type 2, we will need to enable interrupts. Therefore, before the first handler which needs kernel services, the
+ * handler must ensure execution of the handler is not executing below DISPATCH_LEVEL. This is to prevent the dispatcher
+ * from context switching away from our exit handler if we enable interrupts, potentially causing serious memory
+ * synchronization problems. Exits whose handlers never call the kernel skip this entirely, see HvExitRaiseIrql.
  * 
  * Next, a VMEXIT_CONTEXT is initialized with the exit information, including certain guest registers (RSP, RIP, RFLAGS) 
  * from the VMCS.
  * 
  * This function is given two arguments from HvEnterFromGuest in vmxdefs.asm:
- *      - The GlobalContext, which was saved to the top of the HostStack
+ *      - The ProcessorContext, which was saved to the top of the HostStack
  *      - The guest register context, which was pushed onto the stack during HvEnterFromGuest.
  * 
  */
-BOOL HvHandleVmExit(PVMM_CONTEXT GlobalContext, PGPREGISTER_CONTEXT GuestRegisters)
+BOOL HvHandleVmExit(PVMM_PROCESSOR_CONTEXT ProcessorContext, PGPREGISTER_CONTEXT GuestRegisters)
 {
     VMEXIT_CONTEXT ExitContext;
-    PVMM_PROCESSOR_CONTEXT ProcessorContext;
+    PVMM_CONTEXT GlobalContext;
 	BOOL Success;
+	UINT64 StartTime;
+
+	StartTime = __rdtsc();
 
 	Success = FALSE;
 
-    // Grab our logical processor context object for this processor
-    ProcessorContext = HvGetCurrentCPUContext(GlobalContext);
+    GlobalContext = ProcessorContext->GlobalContext;
 
     /*
-	 * Initialize all fields of the exit context, including reading relevant fields from the VMCS.
+	 * Initialize the exit context. Only the exit reason is read from the VMCS up front.
 	 */
     VmxInitializeExitContext(&ExitContext, GuestRegisters);
 
@@ -457,14 +539,14 @@ BOOL HvHandleVmExit(PVMM_CONTEXT GlobalContext, PGPREGISTER_CONTEXT GuestRegiste
 		return FALSE;
 	}
 
-    /*
-	 * To prevent context switching while enabling interrupts, save IRQL here.
+	/*
+	 * Pick up the EPT edits published to every processor since the last exit.
 	 */
-    ExitContext.SavedIRQL = KeGetCurrentIrql();
-    if (ExitContext.SavedIRQL < DISPATCH_LEVEL)
-    {
-        KeRaiseIrqlToDpcLevel();
-    }
+	if (ProcessorContext->AppliedEptGeneration != GlobalContext->EptGeneration)
+	{
+		HvExitRaiseIrql(&ExitContext);
+		HvEptApplySharedEdits(ProcessorContext);
+	}
 
 	/*
 	 * Handle our exit using the handler code inside of exit.c
@@ -479,46 +561,45 @@ BOOL HvHandleVmExit(PVMM_CONTEXT GlobalContext, PGPREGISTER_CONTEXT GuestRegiste
     /*
 	 * If we raised IRQL, lower it before returning to guest.
 	 */
-    if (ExitContext.SavedIRQL < DISPATCH_LEVEL)
-    {
-        KeLowerIrql(ExitContext.SavedIRQL);
-    }
+	HvExitRestoreIrql(&ExitContext);
+
+	HvExitRecordStatistics(ProcessorContext, &ExitContext, __rdtsc() - StartTime);
+
+	/*
+	 * The guest asked to leave VMX. This does not return, the guest continues outside of VMX instead.
+	 */
+	if (Success && ExitContext.ShouldLeaveVmx)
+	{
+		HvExitLeaveVmx(ProcessorContext, &ExitContext);
+	}
 
     return Success;
 }
 
 /*
- * If we're at this point, that means HvEnterFromGuest failed to enter back to the guest.
- * Print out the error informaiton and some state of the processor for debugging purposes.
+ * If we're at this point, that means HvEnterFromGuest failed to enter back to the guest, either because VMRESUME
+ * failed or because the exit handler asked to stop executing the guest.
+ * 
+ * The guest state at the time of the exit is gone by now, so there is nothing to return to. Print out the error
+ * information and some state of the processor for debugging purposes, then bugcheck.
  */
-BOOL HvHandleVmExitFailure(PVMM_CONTEXT GlobalContext, PGPREGISTER_CONTEXT GuestRegisters)
+DECLSPEC_NORETURN
+VOID HvHandleVmExitFailure(PVMM_PROCESSOR_CONTEXT ProcessorContext, PGPREGISTER_CONTEXT GuestRegisters, BOOLEAN ResumeFailed)
 {
-    PVMM_PROCESSOR_CONTEXT ProcessorContext;
+    SIZE_T ExitReason;
 
     UNREFERENCED_PARAMETER(GuestRegisters);
-	UNREFERENCED_PARAMETER(GlobalContext);
-	UNREFERENCED_PARAMETER(ProcessorContext);
-
-	// TODO: Fix GlobalContext
-	KeBugCheck(0xDEADBEEF);
-	/*
-    // Grab our logical processor context object for this processor
-    ProcessorContext = HvGetCurrentCPUContext(GlobalContext);
 
-    HvUtilLogError("HvHandleVmExitFailure: Encountered vmexit error.");
+    ExitReason = 0;
+    __vmx_vmread(VMCS_EXIT_REASON, &ExitReason);
 
-    // Print information about the error state
-    VmxPrintErrorState(ProcessorContext);
+    HvUtilLogError("HvHandleVmExitFailure: Encountered vmexit error. Reason: 0x%llX\n", ExitReason);
 
-    // Exit root mode, since we cannot recover here
-    if (!VmxExitRootMode(ProcessorContext))
+    // Only a failed VMRESUME leaves an instruction error in the VMCS. After a failed exit handler, it is stale.
+    if (ResumeFailed)
     {
-        // We can't exit root mode? Ut oh. Things are real bad.
-        // Returning false here will halt the processor.
-        return FALSE;
+        VmxPrintErrorState(ProcessorContext);
     }
 
-    // Continue execution with VMX disabled.
-    return TRUE;
-	*/
+    KeBugCheckEx(HYPERVISOR_ERROR, ExitReason, (ULONG_PTR)ProcessorContext, ResumeFailed, 0);
 }
@@ -28,6 +28,13 @@ typedef struct _VMXON_REGION
 
 typedef struct _VMX_VMM_CONTEXT VMX_VMM_CONTEXT, *PVMM_CONTEXT;
 
+typedef struct _VMM_EXIT_HANDLER_REGISTRATION VMM_EXIT_HANDLER_REGISTRATION, *PVMM_EXIT_HANDLER_REGISTRATION;
+
+/*
+ * Number of basic exit reasons that handlers can be registered for. Every reason defined so far is below it.
+ */
+#define VMM_EXIT_REASON_COUNT 128
+
 typedef struct _VMM_HOST_STACK_REGION
 {
 	/*
@@ -42,8 +49,24 @@ typedef struct _VMM_HOST_STACK_REGION
 	 */
 	PVMM_CONTEXT GlobalContext;
 
+	/*
+	 * Right above it is a pointer to the context of the processor which owns this stack. HvEnterFromGuest passes it
+	 * straight to the exit handler, so exits never need to look up the current processor number.
+	 */
+	PVMM_PROCESSOR_CONTEXT ProcessorContext;
+
+	/*
+	 * And above that, a pointer to the fast swap cache of the processor, used by HvEnterFromGuest before it saves
+	 * any guest state.
+	 */
+	PVMM_EPT_FAST_SWAP_CACHE FastSwapCache;
+
 } VMM_HOST_STACK_REGION, *PVMM_HOST_STACK_REGION;
 
+/* Offsets from the top of the host stack used by HvEnterFromGuest in vmxdefs.asm */
+C_ASSERT(FIELD_OFFSET(VMM_HOST_STACK_REGION, ProcessorContext) - FIELD_OFFSET(VMM_HOST_STACK_REGION, GlobalContext) == 0x08);
+C_ASSERT(FIELD_OFFSET(VMM_HOST_STACK_REGION, FastSwapCache) - FIELD_OFFSET(VMM_HOST_STACK_REGION, GlobalContext) == 0x10);
+
 typedef struct _VMM_PROCESSOR_CONTEXT
 {
 	/*
@@ -114,8 +137,8 @@ typedef struct _VMM_PROCESSOR_CONTEXT
 	 * 
 	 * When the processor enters host mode from the guest, RSP = HostStack.
 	 * 
-	 * At the top of the host stack is the pointer to the global context, used by vmxdefs.asm to
-	 * grab find the logical processor context in host operation.
+	 * At the top of the host stack is the pointer to the global context, and above it the pointer to this
+	 * processor context, used by vmxdefs.asm to find the logical processor context in host operation.
 	 */
 	VMM_HOST_STACK_REGION HostStack;
 
@@ -125,10 +148,93 @@ typedef struct _VMM_PROCESSOR_CONTEXT
 	EPT_POINTER EptPointer;
 
 	/**
-	 * Page table entries for EPT operation.
+	 * The primary processor-based VM-execution controls last written to the VMCS, so that they can be changed
+	 * without reading them back first. See HvVmcsSetMonitorTrapFlag.
+	 */
+	IA32_VMX_PROCBASED_CTLS_REGISTER ProcessorBasedControls;
+
+	/**
+	 * Page table entries for EPT operation. This is the read view, which also keeps the page hooks of the processor.
 	 */
 	PVMM_EPT_PAGE_TABLE EptPageTable;
 
+	/**
+	 * The page table of each view of this processor, indexed by VMM_EPT_VIEW, or NULL for views that were never
+	 * created. EptViews[VmmEptViewRead] is EptPageTable. All NULL if the processor can't switch EPTP with VMFUNC,
+	 * in which case page hooks swap entries within EptPageTable instead.
+	 */
+	PVMM_EPT_PAGE_TABLE EptViews[VMM_SETTING_EPT_VIEW_COUNT];
+
+	/**
+	 * Frames for the private directories and the dynamic splits of every view of this processor.
+	 */
+	VMM_EPT_PAGE_POOL EptTablePool;
+	VMM_EPT_PAGE_POOL EptSplitPool;
+
+	/**
+	 * The page of EPTPs that VMFUNC leaf 0 switches between, indexed by VMM_EPT_VIEW. NULL if the processor has no
+	 * views.
+	 */
+	PEPT_POINTER EptpList;
+
+	/**
+	 * The page the processor writes the details of a #VE to. NULL unless EPT violations on page hooks are delivered
+	 * to the guest as #VE, see VMM_SETTING_EPT_USE_VIRTUALIZATION_EXCEPTIONS.
+	 */
+	PVMM_EPT_VE_INFORMATION VeInformation;
+
+	/**
+	 * The #VE gate of the IDT of this processor, from before HvEptInstallVirtualizationExceptionHandler replaced it.
+	 */
+	SEGMENT_DESCRIPTOR_INTERRUPT_GATE_64 OriginalVeGate;
+
+	/**
+	 * The stack the #VE handler runs on, VMM_EPT_VE_STACK_SIZE bytes. Allocated with VeInformation.
+	 */
+	PVOID VeStack;
+
+	/**
+	 * The interrupt stack table entry of the TSS of this processor that HvEptInstallVirtualizationExceptionHandler
+	 * pointed at VeStack, or 0 if the handler is not installed.
+	 */
+	SIZE_T VeStackIndex;
+
+	/**
+	 * The generation of the shared EPT edits this processor has applied. Behind VMX_VMM_CONTEXT::EptGeneration until
+	 * the processor catches up on its next VM exit.
+	 */
+	volatile LONG64 AppliedEptGeneration;
+
+	/**
+	 * Where each shared edit batch is copied to be committed to the views of this processor, as it is too large for
+	 * the host stack.
+	 */
+	VMM_EPT_EDIT_BATCH SharedEditBatch;
+
+	/**
+	 * The swap strategy page hooks of this processor which HvEnterFromGuest swaps without calling the exit handler.
+	 */
+	VMM_EPT_FAST_SWAP_CACHE FastSwapCache;
+
+	/**
+	 * Number of exits handled on this processor, per basic exit reason.
+	 */
+	SIZE_T ExitCounts[VMM_EXIT_REASON_COUNT];
+
+	/**
+	 * Number of VMREADs of exit context fields made by the exits in ExitCounts, per basic exit reason.
+	 */
+	SIZE_T ExitVmreadCounts[VMM_EXIT_REASON_COUNT];
+
+	/**
+	 * Number of exits handled without and with raising the IRQL, and the time stamp counter cycles they took from
+	 * entering HvHandleVmExit to leaving it.
+	 */
+	SIZE_T FastPathExitCount;
+	UINT64 FastPathCycles;
+	SIZE_T KernelPathExitCount;
+	UINT64 KernelPathCycles;
+
 } VMM_PROCESSOR_CONTEXT, *PVMM_PROCESSOR_CONTEXT;
 
 
@@ -164,27 +270,140 @@ typedef struct _VMX_VMM_CONTEXT
 	SIZE_T SystemDirectoryTableBase;
 
 	/*
-	 * Physical memory ranges described by the BIOS in the MTRRs.
-	 * Used to build the EPT identity mapping.
+	 * Physical memory ranges described by the BIOS in the variable range MTRRs.
+	 * May overlap each other. Used to build MemoryRuns.
 	 */
-	MTRR_RANGE_DESCRIPTOR MemoryRanges[9];
+	MTRR_RANGE_DESCRIPTOR MemoryRanges[VMM_EPT_MTRR_VARIABLE_RANGE_MAX];
 
 	/*
 	 * Number of memory ranges specified in MemoryRanges
 	 */
 	ULONG NumberOfEnabledMemoryRanges;
 
+	/*
+	 * Physical memory backed by RAM, as reported by the OS.
+	 */
+	OS_PHYSICAL_MEMORY_RANGE PhysicalMemoryRanges[VMM_EPT_PHYSICAL_MEMORY_RANGE_MAX];
+
+	/*
+	 * Number of ranges specified in PhysicalMemoryRanges
+	 */
+	SIZE_T NumberOfPhysicalMemoryRanges;
+
+	/*
+	 * Physical memory assigned to devices when the hypervisor was loaded, as reported by the OS.
+	 */
+	OS_PHYSICAL_MEMORY_RANGE DeviceMemoryRanges[VMM_EPT_DEVICE_MEMORY_RANGE_MAX];
+
+	/*
+	 * Number of ranges specified in DeviceMemoryRanges
+	 */
+	SIZE_T NumberOfDeviceMemoryRanges;
+
+	/*
+	 * If TRUE, only memory backed by RAM is identity mapped at load, and everything else below 512GB is mapped on
+	 * demand. Defaults to VMM_SETTING_EPT_MAP_PHYSICAL_MEMORY_ONLY, and is overridden by the MapPhysicalMemoryOnly
+	 * DWORD in the Parameters key of the service of the driver.
+	 */
+	BOOLEAN MapPhysicalMemoryOnly;
+
+	/*
+	 * TRUE if both PhysicalMemoryRanges and DeviceMemoryRanges were read completely, so that an address in neither
+	 * holds nothing. See HvEptIsKnownPhysicalAddress.
+	 */
+	BOOLEAN PhysicalAddressRangesKnown;
+
+	/*
+	 * Memory type of all physical memory with MTRR precedence already resolved, as sorted and non-overlapping runs.
+	 * Used to build the EPT identity mapping.
+	 */
+	MTRR_MEMORY_RUN MemoryRuns[VMM_EPT_MEMORY_RUN_MAX];
+
+	/*
+	 * Number of runs specified in MemoryRuns
+	 */
+	ULONG NumberOfMemoryRuns;
+
+	/*
+	 * TRUE if the fixed range MTRRs are supported and enabled, in which case they describe the first 1MB
+	 * of physical memory instead of the variable ranges.
+	 */
+	BOOL FixedRangeMtrrsEnabled;
+
+	/*
+	 * Memory type of each 4096 byte page of the first 1MB of physical memory, decoded from the fixed range MTRRs.
+	 */
+	UCHAR FixedRangeMemoryTypes[VMM_EPT_FIXED_RANGE_PAGE_COUNT];
+
+	/*
+	 * EPT identity map of physical memory built from MemoryRuns.
+	 * Shared by the page tables of all logical processors.
+	 */
+	PVMM_EPT_IDENTITY_MAP EptIdentityMap;
+
+	/*
+	 * Generation of the EPT edits published to every processor, bumped once per batch published with
+	 * HvEptPublishEditBatch.
+	 */
+	volatile LONG64 EptGeneration;
+
+	/*
+	 * The batch of each recent generation, at index generation modulo VMM_SETTING_EPT_SHARED_EDIT_LOG_SIZE.
+	 */
+	VMM_EPT_EDIT_BATCH SharedEditLog[VMM_SETTING_EPT_SHARED_EDIT_LOG_SIZE];
+
+	/*
+	 * Number of processors which could not apply the batch in the same slot of SharedEditLog.
+	 */
+	volatile LONG SharedEditFailures[VMM_SETTING_EPT_SHARED_EDIT_LOG_SIZE];
+
+	/*
+	 * Number of failures counted in SharedEditFailures which HvEptPublishEditBatch has not returned to a caller yet.
+	 */
+	volatile LONG UnreportedSharedEditFailures;
+
+	/*
+	 * Serializes HvEptPublishEditBatch.
+	 */
+	KSPIN_LOCK SharedEditLock;
+
+	/*
+	 * The trampoline of every hooked function. See VMM_EPT_TRAMPOLINE.
+	 */
+	LIST_ENTRY TrampolineList;
+
+	/*
+	 * Serializes changes to TrampolineList and the reference counts of the trampolines.
+	 */
+	KSPIN_LOCK TrampolineLock;
+
+	/*
+	 * TRUE if the OS runs user mode on separate page tables (KVA shadow), which rules out #VE.
+	 */
+	BOOLEAN KernelVaShadowEnabled;
+
+	/*
+	 * The chain of handlers for each basic exit reason, from the highest priority to the lowest. See
+	 * HvExitRegisterHandler.
+	 */
+	PVMM_EXIT_HANDLER_REGISTRATION ExitHandlers[VMM_EXIT_REASON_COUNT];
+
+	/*
+	 * Serializes changes to ExitHandlers.
+	 */
+	KSPIN_LOCK ExitHandlerLock;
+
 } VMM_CONTEXT, *PVMM_CONTEXT;
 
 PVMCS HvAllocateVmcsRegion(PVMM_CONTEXT GlobalContext);
 
 VOID HvFreeVmmContext(PVMM_CONTEXT Context);
 
-PVMM_CONTEXT HvAllocateVmmContext();
+PVMM_CONTEXT HvAllocateVmmContext(BOOLEAN MapPhysicalMemoryOnly);
 
 PVMM_PROCESSOR_CONTEXT HvGetCurrentCPUContext(PVMM_CONTEXT GlobalContext);
 
-PVMM_CONTEXT HvInitializeAllProcessors();
+PVMM_CONTEXT HvInitializeAllProcessors(BOOLEAN MapPhysicalMemoryOnly);
 
 VOID HvpDPCBroadcastFunction(_In_ struct _KDPC *Dpc,
 	_In_opt_ PVOID DeferredContext,
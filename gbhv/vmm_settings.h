@@ -9,4 +9,119 @@
 /*
  * Stack space allocated for the host during vmexit.
  */
-#define VMM_SETTING_STACK_SPACE (PAGE_SIZE * 8)
\ No newline at end of file
+#define VMM_SETTING_STACK_SPACE (PAGE_SIZE * 8)
+
+/*
+ * Number of slots in the per-processor page hook index used to resolve EPT violations to a page hook.
+ * 
+ * Must be a power of two. The index refuses new hooks once it is three quarters full, so this should be
+ * comfortably larger than the number of pages that will be hooked.
+ */
+#define VMM_SETTING_EPT_HOOK_INDEX_SIZE 1024
+
+/*
+ * Number of 4KB paging structure frames reserved per processor for the private EPT directories of all of its views.
+ * 
+ * A frame is used in each view for every 1GB region in which a page is split or hooked, and for regions that are
+ * mapped on demand when the guest first touches them (memory above 512GB the OS reports as RAM or device memory, and
+ * memory not backed by RAM if MapPhysicalMemoryOnly is set, see VMM_SETTING_EPT_MAP_PHYSICAL_MEMORY_ONLY).
+ * 
+ * The pool can't grow in VMX root. An access that needs a frame once it is empty stops the hypervisor, and the number
+ * of times it ran out is logged when the processor is devirtualized.
+ */
+#define VMM_SETTING_EPT_TABLE_POOL_SIZE 32
+
+/*
+ * If 1, only physical memory backed by RAM (as reported by the OS) is identity mapped by EPT at load. Every other
+ * region is left not present, and is only mapped the first time the guest touches it, typed as MMIO. Every such
+ * mapping is logged and counted, so stray accesses to unbacked memory show up.
+ * 
+ * This keeps the EPT tables small. If 0, all of the first 512GB of physical memory is mapped at load.
+ * 
+ * This is only the default. Set the MapPhysicalMemoryOnly DWORD in the Parameters key of the service of the driver
+ * to choose at load time instead.
+ */
+#define VMM_SETTING_EPT_MAP_PHYSICAL_MEMORY_ONLY 0
+
+/*
+ * Number of 4KB dynamic split frames reserved per processor for all of its views. Every 2MB page split into 4096
+ * byte pages in a view, for example to hook a page within it, uses one frame. The high-water mark of the split pool
+ * is logged when each processor's EPT is freed, and can be used to tune this.
+ */
+#define VMM_SETTING_EPT_SPLIT_POOL_SIZE 64
+
+/*
+ * Length in TSC cycles of the sliding window over which the swap rate of each page hook is measured.
+ */
+#define VMM_SETTING_EPT_HOOK_THRASH_WINDOW_CYCLES 10000000ULL
+
+/*
+ * Number of swaps within the window at which an adaptive page hook switches from the swap strategy to the
+ * monitor trap strategy, because its code keeps reading data from its own page.
+ */
+#define VMM_SETTING_EPT_HOOK_THRASH_HIGH_THRESHOLD 1000
+
+/*
+ * Number of reads and writes within the window below which an adaptive page hook switches back from the monitor trap
+ * strategy to the swap strategy. Must be lower than VMM_SETTING_EPT_HOOK_THRASH_HIGH_THRESHOLD, so that a hook near
+ * the threshold does not switch on every exit.
+ */
+#define VMM_SETTING_EPT_HOOK_THRASH_LOW_THRESHOLD 100
+
+/*
+ * If 1, every processor that supports EPTP switching through VMFUNC gets a second page table, the execute view, in
+ * which hooked pages map their shadow page. Page hooks then swap by switching views, which needs no INVEPT, and the
+ * guest can switch views itself without a VM exit. This doubles the EPT memory of each processor.
+ * 
+ * If 0, or if the processor does not support it, page hooks swap entries within a single page table.
+ */
+#define VMM_SETTING_EPT_USE_VIEWS 1
+
+/*
+ * Maximum number of EPT views per processor, including the read and execute views used by page hooks. Each view
+ * is a page table of its own with its own pools, though it shares every unmodified directory with the identity map.
+ * At most 512, the size of the EPTP list.
+ */
+#define VMM_SETTING_EPT_VIEW_COUNT 4
+
+/*
+ * Maximum number of entry changes queued in a single EPT edit batch. Committing a batch flushes each view it changed
+ * once, however many entries it holds.
+ */
+#define VMM_SETTING_EPT_EDIT_BATCH_SIZE 32
+
+/*
+ * Number of edit batches published to every processor that are kept until all processors have applied them.
+ * Publishing a batch while a processor is this many generations behind kicks every processor with an IPI first.
+ */
+#define VMM_SETTING_EPT_SHARED_EDIT_LOG_SIZE 16
+
+/*
+ * Number of slots in the per-processor cache of swap strategy page hooks that HvEnterFromGuest swaps itself, without
+ * saving the guest state or calling the exit handler. A hook whose page lands in a slot that is already taken is
+ * swapped by the exit handler as usual.
+ * 
+ * Must be a power of two.
+ */
+#define VMM_SETTING_EPT_FAST_SWAP_CACHE_SIZE 64
+
+/*
+ * Adaptive page hooks in the fast swap cache or swapped by the #VE handler leave one in this many swaps to the exit
+ * handler, which counts it as this many towards their swap rate. Must be well below
+ * VMM_SETTING_EPT_HOOK_THRASH_LOW_THRESHOLD, so that the rate is still measured finely enough to switch strategy.
+ */
+#define VMM_SETTING_EPT_FAST_SWAP_SAMPLE_INTERVAL 16
+
+/*
+ * If 1, EPT violations on swap strategy page hooks are raised in the guest as virtualization exceptions (#VE) on
+ * processors that support it, and the #VE handler swaps views with VMFUNC without a VM exit. Anything the handler
+ * can't resolve is forwarded to the hypervisor with a hypercall. Requires VMM_SETTING_EPT_USE_VIEWS.
+ * 
+ * The handler is installed by replacing vector 20 of the IDT of every processor and taking a free interrupt stack
+ * table entry of its TSS for the handler's stack. Kernel patch protection (PatchGuard) checks the IDT and bugchecks
+ * the system with CRITICAL_STRUCTURE_CORRUPTION some time after it finds the changed gate, whichever way the gate
+ * was written. The gate is written through an MDL mapping rather than by clearing CR0.WP, but that does not help
+ * against the check. So this is off by default, and only meant for systems where patch protection is disabled,
+ * such as under a kernel debugger. It is not used at all if KVA shadow is enabled.
+ */
+#define VMM_SETTING_EPT_USE_VIRTUALIZATION_EXCEPTIONS 0
@@ -194,8 +194,20 @@ typedef struct _GPREGISTER_CONTEXT
 
 #pragma warning(pop)
 
+/*
+ * Defined in vmxdefs.asm.
+ *
+ * Restores the guest registers saved by HvEnterFromGuest after VMXOFF, and continues the guest at GuestRip with
+ * GuestFlags.
+ */
+DECLSPEC_NORETURN VOID HvResumeGuestOutsideVmx(PGPREGISTER_CONTEXT GuestRegisters, SIZE_T GuestRip, SIZE_T GuestFlags);
+
 VOID VmxGetSegmentDescriptorFromSelector(PVMX_SEGMENT_DESCRIPTOR VmxSegmentDescriptor, SEGMENT_DESCRIPTOR_REGISTER_64 GdtRegister, SEGMENT_SELECTOR SegmentSelector, BOOL ClearRPL);
 
 VOID VmxPrintErrorState(PVMM_PROCESSOR_CONTEXT Context);
 
-VOID __invept(SIZE_T Type, INVEPT_DESCRIPTOR* Descriptor);
\ No newline at end of file
+VOID __invept(SIZE_T Type, INVEPT_DESCRIPTOR* Descriptor);
+
+SIZE_T __vmcall(SIZE_T HypercallNumber, SIZE_T Argument1, SIZE_T Argument2);
+
+VOID __vmfunc(UINT32 Function, UINT32 Argument);
\ No newline at end of file
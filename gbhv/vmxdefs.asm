@@ -2,6 +2,31 @@
 EXTERN HvInitializeLogicalProcessor : PROC
 EXTERN HvHandleVmExit : PROC
 EXTERN HvHandleVmExitFailure : PROC
+EXTERN HvEptHandleVirtualizationException : PROC
+
+; VMCS field encodings and exit reason used by HvEnterFromGuest. Checked against ia32.h by C_ASSERTs in ept.h.
+VMCS_CTRL_EPT_POINTER EQU 201Ah
+VMCS_GUEST_PHYSICAL_ADDRESS EQU 2400h
+VMCS_EXIT_REASON EQU 4402h
+VMCS_EXIT_QUALIFICATION EQU 6400h
+VMX_EXIT_REASON_EPT_VIOLATION EQU 48
+
+; MSR read by the #VE handler to tell whether GS is the kernel's.
+IA32_GS_BASE EQU 0C0000101h
+
+; Offsets into VMM_EPT_FAST_SWAP_CACHE and VMM_EPT_FAST_SWAP_SLOT. Checked by C_ASSERTs in ept.h.
+FAST_SWAP_READ_EPT_POINTER EQU 00h
+FAST_SWAP_EXECUTE_EPT_POINTER EQU 08h
+FAST_SWAP_APPLIED_GENERATION EQU 10h
+FAST_SWAP_PUBLISHED_GENERATION EQU 18h
+FAST_SWAP_SWAP_COUNT EQU 20h
+FAST_SWAP_SLOT_MASK EQU 28h
+FAST_SWAP_SLOTS EQU 30h
+FAST_SWAP_SLOT_PHYSICAL_PAGE EQU 00h
+FAST_SWAP_SLOT_TARGET_PAGE EQU 08h
+FAST_SWAP_SLOT_EXECUTE_VALUE EQU 10h
+FAST_SWAP_SLOT_READ_WRITE_VALUE EQU 18h
+FAST_SWAP_SLOT_SAMPLE_COUNTDOWN EQU 20h
 
 .CODE
 
@@ -55,6 +80,108 @@ __invept PROC
     ret
 __invept ENDP
 
+; Hypercall number in RCX, arguments in RDX and R8. The result is returned in RAX.
+__vmcall PROC
+    vmcall
+    ret
+__vmcall ENDP
+
+; VM function number in ECX, its argument in EDX. Used by the guest, so it must not be called from VMX root.
+__vmfunc PROC
+    mov eax, ecx
+    mov ecx, edx
+    ; vmfunc
+    db 0fh, 01h, 0d4h
+    ret
+__vmfunc ENDP
+
+; Guest interrupt handler for the virtualization exception (#VE), installed at vector 20 of the IDT of each processor
+; by HvEptInstallVirtualizationExceptionHandler. It runs on a stack of its own from the interrupt stack table, and #VE
+; pushes no error code, so RSP points at the interrupt frame. Saves the volatile registers, since it interrupts whatever
+; the guest was running, and calls HvEptHandleVirtualizationException. Interrupts are disabled by the gate for the
+; whole handler.
+HvEptVirtualizationExceptionEntry PROC
+	push rax
+	push rcx
+	push rdx
+	push r8
+	push r9
+	push r10
+	push r11
+
+	; The processor aligned the interrupt frame, so after the frame and 7 pushes the stack is 16-byte aligned again.
+	; Save XMM registers above the shadow stack space, and whether GS was swapped above those.
+	sub rsp, 90h
+
+	; The saved CS can't tell whether GS is the kernel's, since the kernel runs with the user GS between SYSCALL and
+	; its SWAPGS. Like the NMI handler of the OS, only swap if IA32_GS_BASE is not a kernel address.
+	mov ecx, IA32_GS_BASE
+	rdmsr
+	xor r8d, r8d
+	test edx, edx
+	js ve_kernel_entry
+	swapgs
+	inc r8d
+ve_kernel_entry:
+	mov qword ptr [rsp+80h], r8
+
+	movaps xmmword ptr [rsp+20h], xmm0
+	movaps xmmword ptr [rsp+30h], xmm1
+	movaps xmmword ptr [rsp+40h], xmm2
+	movaps xmmword ptr [rsp+50h], xmm3
+	movaps xmmword ptr [rsp+60h], xmm4
+	movaps xmmword ptr [rsp+70h], xmm5
+
+	cld
+	call HvEptHandleVirtualizationException
+
+	movaps xmm0, xmmword ptr [rsp+20h]
+	movaps xmm1, xmmword ptr [rsp+30h]
+	movaps xmm2, xmmword ptr [rsp+40h]
+	movaps xmm3, xmmword ptr [rsp+50h]
+	movaps xmm4, xmmword ptr [rsp+60h]
+	movaps xmm5, xmmword ptr [rsp+70h]
+
+	cmp qword ptr [rsp+80h], 0
+	je ve_kernel_exit
+	swapgs
+ve_kernel_exit:
+	add rsp, 90h
+
+	pop r11
+	pop r10
+	pop r9
+	pop r8
+	pop rdx
+	pop rcx
+	pop rax
+
+	; Retry the faulting instruction
+	iretq
+HvEptVirtualizationExceptionEntry ENDP
+
+; Continue the guest outside of VMX, after HvExitLeaveVmx executed VMXOFF. RCX points at the GPREGISTER_CONTEXT saved
+; by HvEnterFromGuest, with the guest RSP filled in. RDX is the guest RIP and R8 the guest RFLAGS, which are pushed onto
+; the guest stack so that every guest register can be restored before returning to it.
+HvResumeGuestOutsideVmx PROC
+	mov rax, [rcx+020h]
+	sub rax, 010h
+	mov [rax+08h], rdx
+	mov [rax], r8
+	mov [rcx+020h], rax
+
+	mov rsp, rcx
+
+	; Macro to restore GP registers
+	PopGeneralPurposeRegisterContext
+
+	; Interrupts are still disabled from the exit, so the guest RSP left 0x60 bytes below the stack can't be overwritten
+	mov rsp, [rsp-060h]
+
+	popfq
+	ret
+HvResumeGuestOutsideVmx ENDP
+
 HvBeginInitializeLogicalProcessor PROC
 	; Save EFLAGS
 	pushfq
@@ -110,15 +237,119 @@ HvBeginInitializeLogicalProcessor ENDP
 ; returns to the guest with VMRESUME. If VMRESUME does not take execution, there's an error
 ; and we have to handle the VMRESUME failure.
 ; Interrupts are automatically disabled for us at this point.
+;
+; EPT violations on page hooks in the fast swap cache of the processor are swapped right here, using only RAX, RCX
+; and RDX, and never reach HvHandleVmExit. The checks mirror HvExitHandlePageHookExit.
 HvEnterFromGuest PROC
+	push rax
+	push rcx
+	push rdx
+
+	; Grab the PVMM_EPT_FAST_SWAP_CACHE pointer, 0x10 bytes above the global context at the top of the host stack.
+	; The stack has been moved 0x18 bytes by the pushes.
+	mov rcx, [rsp+028h]
+
+	; Only EPT violations. A failed VM entry sets the top bit of the exit reason, so it doesn't match either.
+	mov edx, VMCS_EXIT_REASON
+	vmread rax, rdx
+	cmp eax, VMX_EXIT_REASON_EPT_VIOLATION
+	jne fast_swap_miss
+
+	; Shared EPT edits not yet applied on this processor are applied by HvHandleVmExit first
+	mov rax, [rcx+FAST_SWAP_APPLIED_GENERATION]
+	mov rdx, [rcx+FAST_SWAP_PUBLISHED_GENERATION]
+	mov rax, [rax]
+	cmp rax, [rdx]
+	jne fast_swap_miss
+
+	; Views other than the read and execute view don't hook pages
+	mov edx, VMCS_CTRL_EPT_POINTER
+	vmread rax, rdx
+	cmp rax, [rcx+FAST_SWAP_READ_EPT_POINTER]
+	je fast_swap_view_hooked
+	cmp rax, [rcx+FAST_SWAP_EXECUTE_EPT_POINTER]
+	jne fast_swap_miss
+fast_swap_view_hooked:
+
+	; RDX = slot of the faulting page, as computed by HvEptpGetFastSwapSlot
+	mov edx, VMCS_GUEST_PHYSICAL_ADDRESS
+	vmread rax, rdx
+	shr rax, 12
+	mov rdx, rax
+	and rdx, [rcx+FAST_SWAP_SLOT_MASK]
+	shl rdx, 6
+	lea rdx, [rcx+rdx+FAST_SWAP_SLOTS]
+	shl rax, 12
+	cmp rax, [rdx+FAST_SWAP_SLOT_PHYSICAL_PAGE]
+	jne fast_swap_miss
+
+	mov eax, VMCS_EXIT_QUALIFICATION
+	vmread rax, rax
+
+	; Only violations caused by the translation of the access itself
+	bt eax, 8
+	jnc fast_swap_miss
+
+	; Executing the page while it's not executable swaps in the shadow page
+	test al, 20h
+	jnz fast_swap_executable
+	test al, 04h
+	jz fast_swap_miss
+	mov rax, [rdx+FAST_SWAP_SLOT_EXECUTE_VALUE]
+	jmp fast_swap_install
+
+fast_swap_executable:
+	; Reading or writing the page while it's executable swaps the original page back in
+	test al, 03h
+	jz fast_swap_miss
+	mov rax, [rdx+FAST_SWAP_SLOT_READ_WRITE_VALUE]
+
+fast_swap_install:
+	; Adaptive hooks hand every Nth swap to HvHandleVmExit, which counts it towards their swap rate
+	cmp qword ptr [rdx+FAST_SWAP_SLOT_SAMPLE_COUNTDOWN], 0
+	je fast_swap_counted
+	dec qword ptr [rdx+FAST_SWAP_SLOT_SAMPLE_COUNTDOWN]
+	jz fast_swap_miss
+
+fast_swap_counted:
+	inc qword ptr [rcx+FAST_SWAP_SWAP_COUNT]
+
+	; Rewrite the entry, or switch views if the hook has none. The violation already invalidated the cached
+	; translation, so no INVEPT is needed.
+	mov rdx, [rdx+FAST_SWAP_SLOT_TARGET_PAGE]
+	test rdx, rdx
+	jz fast_swap_switch_view
+	mov [rdx], rax
+	jmp fast_swap_resume
+
+fast_swap_switch_view:
+	mov edx, VMCS_CTRL_EPT_POINTER
+	vmwrite rdx, rax
+
+fast_swap_resume:
+	pop rdx
+	pop rcx
+	pop rax
+
+	; RIP is left alone, so the guest redoes the access
+	vmresume
+
+	; If we get past vmresume, the stack is back at the top just like after the vmresume below
+	jmp resume_fail
+
+fast_swap_miss:
+	pop rdx
+	pop rcx
+	pop rax
+
 	; Macro to push all GP registers
 	PushGeneralPurposeRegisterContext
 
-	; Grab the PVMM_GLOBAL_CONTEXT pointer from the top of the host stack that we so lovingly put there
-	; for this moment!
-	; First argument (RCX) is the PVMM_GLOBAL_CONTEXT.
+	; Grab the PVMM_PROCESSOR_CONTEXT pointer from above the global context at the top of the host stack
+	; that we so lovingly put there for this moment!
+	; First argument (RCX) is the PVMM_PROCESSOR_CONTEXT.
 	; The stack has been moved 0x80 bytes during PushGeneralPurposeRegisterContext
-	mov rcx, [rsp+080h]
+	mov rcx, [rsp+088h]
 
 	; Second argument (RDX) is stack pointer, which is also the location of the general purpose registers
 	mov rdx, rsp
@@ -160,46 +391,41 @@ HvEnterFromGuest PROC
 	vmresume
 
 	; If we get past vmresume, something bad happened and we need to figure out what
-	jmp handler_fail
+	jmp resume_fail
 
-handler_fail:
+resume_fail:
 	
 	; Save our guest register state again
 	PushGeneralPurposeRegisterContext
 
-	; Grab the PVMM_GLOBAL_CONTEXT pointer
-	; First argument (RCX) is the PVMM_GLOBAL_CONTEXT.
+	; Third argument (R8) is TRUE, as VMRESUME failed and left its error in the VMCS
+	mov r8, 1
+	jmp handle_failure
+
+handler_fail:
+
+	; The guest registers are still on the stack. Third argument (R8) is FALSE, as VMRESUME never ran.
+	xor r8, r8
+
+handle_failure:
+
+	; Grab the PVMM_PROCESSOR_CONTEXT pointer
+	; First argument (RCX) is the PVMM_PROCESSOR_CONTEXT.
 	; The stack has been moved 0x80 bytes during PushGeneralPurposeRegisterContex
-	mov rcx, [rsp+080h]
+	mov rcx, [rsp+088h]
 
 	; Second argument (RDX) is stack pointer, which is also the location of the general purpose registers
 	mov rdx, rsp
 
-	; Save EFLAGS
-	pushfq
-
-	; Shadow space
-	sub rsp, 20h
+	; Shadow space, and another 8 bytes to keep the stack 16-byte aligned
+	sub rsp, 28h
 
-	; Call failure handler. This will go ahead and disable VMX Root mode on this processor.
-	; Afterwards, the processor will remain in non-VMX mode. 
+	; Call failure handler. This prints the error state and bugchecks, as the guest cannot be resumed.
 	call HvHandleVmExitFailure
 
-	; Shadow space
-	add rsp, 20h
-
-	; If HvHandleVmExitFailure returns 0, something is horribly wrong.
+	; HvHandleVmExitFailure never returns. If it somehow does, something is horribly wrong.
 	; In that case, we'll just stick ourselves in a halt loop and hope the processor
 	; doesn't explode.
-	jz fatal_error
-
-	; Restore register context and continue in non-VMX mode.
-	popfq
-	PopGeneralPurposeRegisterContext
-	
-	; TODO: Find some way to actually have this restore Guest RIP?
-	int 3
-	ret
 fatal_error:
 	hlt
 	jmp	fatal_error
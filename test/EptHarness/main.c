@@ -0,0 +1,892 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vmm.h"
+
+/*
+ * User mode test harness for the parts of the EPT code that do not need VMX or the kernel.
+ *
+ * Each test prints its results and returns FALSE if anything did not behave as expected, in which case the
+ * harness exits with a nonzero status. Cycle counts come from the TSC, so run it on an otherwise idle machine
+ * and compare numbers from the same machine only.
+ */
+
+/*
+ * Number of hooked pages in each simulated driver image. The next HARNESS_HOOK_CLUSTER_SIZE pages after
+ * each image are never hooked and are used for lookups that must miss.
+ */
+#define HARNESS_HOOK_CLUSTER_SIZE 64
+
+/*
+ * Distance between the simulated driver images.
+ */
+#define HARNESS_HOOK_CLUSTER_STRIDE SIZE_2_MB
+
+/*
+ * Physical address of the first simulated driver image.
+ */
+#define HARNESS_HOOK_BASE_ADDRESS 0x100000000ULL
+
+/*
+ * Number of lookups timed for each hook count with the index.
+ */
+#define HARNESS_INDEX_LOOKUPS (1 << 22)
+
+/*
+ * Number of pages visited by the list walk for each hook count. The number of lookups is this divided by the
+ * number of hooks, so that the 10k case finishes in reasonable time.
+ */
+#define HARNESS_LIST_VISITS (1 << 24)
+
+/*
+ * Simple xorshift generator, so that every run of the harness uses the same sequence of addresses.
+ */
+SIZE_T HarnessRandom(PSIZE_T State)
+{
+	*State ^= *State << 13;
+	*State ^= *State >> 7;
+	*State ^= *State << 17;
+
+	return *State;
+}
+
+/*
+ * Shuffle an array of addresses so that consecutive lookups do not walk memory in order.
+ */
+VOID HarnessShuffle(PSIZE_T Addresses, SIZE_T Count, PSIZE_T State)
+{
+	SIZE_T Index;
+	SIZE_T Other;
+	SIZE_T Temporary;
+
+	for (Index = Count - 1; Index > 0; Index--)
+	{
+		Other = HarnessRandom(State) % (Index + 1);
+
+		Temporary = Addresses[Index];
+		Addresses[Index] = Addresses[Other];
+		Addresses[Other] = Temporary;
+	}
+}
+
+/*
+ * Find the hook of a page by walking PageHookList, the way the EPT violation handler did before the index.
+ */
+PVMM_EPT_PAGE_HOOK HarnessFindHookInList(PVMM_EPT_PAGE_TABLE PageTable, SIZE_T PhysicalAddress)
+{
+	PVMM_EPT_PAGE_HOOK PageHook;
+
+	PageHook = NULL;
+
+	FOR_EACH_LIST_ENTRY(PageTable, PageHookList, VMM_EPT_PAGE_HOOK, Hook)
+		if (Hook->PhysicalBaseAddress == (PhysicalAddress & ~((SIZE_T)PAGE_SIZE - 1)))
+		{
+			PageHook = Hook;
+			break;
+		}
+	FOR_EACH_LIST_ENTRY_END();
+
+	return PageHook;
+}
+
+/*
+ * Time Iterations lookups of Addresses, cycling through them, with either the hook index or the list of PageTable.
+ *
+ * Returns the average number of cycles per lookup, or 0 if any lookup returned the wrong hook. A lookup is expected
+ * to find a hook if and only if ExpectHook is set.
+ */
+SIZE_T HarnessTimeHookLookups(PVMM_EPT_PAGE_TABLE PageTable, BOOLEAN UseIndex, PSIZE_T Addresses, SIZE_T Count, SIZE_T Iterations, BOOLEAN ExpectHook)
+{
+	PVMM_EPT_PAGE_HOOK PageHook;
+	SIZE_T Iteration;
+	SIZE_T Position;
+	SIZE_T Mismatches;
+	ULONG64 Start;
+	ULONG64 End;
+
+	Mismatches = 0;
+	Position = 0;
+
+	Start = __rdtsc();
+
+	for (Iteration = 0; Iteration < Iterations; Iteration++)
+	{
+		if (UseIndex)
+		{
+			PageHook = HvEptHookIndexLookup(&PageTable->HookIndex, Addresses[Position]);
+		}
+		else
+		{
+			PageHook = HarnessFindHookInList(PageTable, Addresses[Position]);
+		}
+
+		if ((PageHook != NULL) != ExpectHook
+			|| (PageHook && PageHook->PhysicalBaseAddress != (Addresses[Position] & ~((SIZE_T)PAGE_SIZE - 1))))
+		{
+			Mismatches++;
+		}
+
+		if (++Position == Count)
+		{
+			Position = 0;
+		}
+	}
+
+	End = __rdtsc();
+
+	if (Mismatches != 0)
+	{
+		HvUtilLogError("HarnessTimeHookLookups: %lld of %lld lookups returned the wrong hook.\n", Mismatches, Iterations);
+		return 0;
+	}
+
+	/* Never report 0 for a successful run, that means failure */
+	return max((End - Start) / Iterations, 1);
+}
+
+/*
+ * Install HookCount hooks into a simulated page table, then compare the cost of finding the hook of a page through
+ * the hook index against walking the hook list, for pages that are hooked and pages that are not.
+ */
+BOOL HarnessBenchmarkHookIndexSize(SIZE_T HookCount)
+{
+	PVMM_EPT_PAGE_TABLE PageTable;
+	PVMM_EPT_PAGE_HOOK Hooks;
+	PSIZE_T HitAddresses;
+	PSIZE_T MissAddresses;
+	SIZE_T SlotCount;
+	SIZE_T HookIndex;
+	SIZE_T ClusterBase;
+	SIZE_T ListIterations;
+	SIZE_T RandomState;
+	SIZE_T IndexHitCycles;
+	SIZE_T IndexMissCycles;
+	SIZE_T ListHitCycles;
+	SIZE_T ListMissCycles;
+	BOOL Success;
+
+	Success = FALSE;
+	RandomState = 0x9E3779B97F4A7C15ULL;
+
+	PageTable = (PVMM_EPT_PAGE_TABLE)OsAllocateContiguousAlignedPages(sizeof(VMM_EPT_PAGE_TABLE) / PAGE_SIZE);
+	Hooks = (PVMM_EPT_PAGE_HOOK)OsAllocateContiguousAlignedPages(HookCount * sizeof(VMM_EPT_PAGE_HOOK) / PAGE_SIZE);
+	HitAddresses = (PSIZE_T)OsAllocateNonpagedMemory(HookCount * sizeof(SIZE_T));
+	MissAddresses = (PSIZE_T)OsAllocateNonpagedMemory(HookCount * sizeof(SIZE_T));
+
+	if (PageTable)
+	{
+		OsZeroMemory(PageTable, sizeof(VMM_EPT_PAGE_TABLE));
+		InitializeListHead(&PageTable->PageHookList);
+	}
+
+	if (!PageTable || !Hooks || !HitAddresses || !MissAddresses)
+	{
+		HvUtilLogError("HarnessBenchmarkHookIndexSize: Failed to allocate %lld hooks.\n", HookCount);
+	}
+	else
+	{
+		OsZeroMemory(Hooks, HookCount * sizeof(VMM_EPT_PAGE_HOOK));
+
+		/* The same rule the driver sizes VMM_SETTING_EPT_HOOK_INDEX_SIZE by: keep the index at most three quarters full */
+		SlotCount = VMM_SETTING_EPT_HOOK_INDEX_SIZE;
+		while (HookCount * 4 > SlotCount * 3)
+		{
+			SlotCount *= 2;
+		}
+
+		Success = HvEptHookIndexInitialize(&PageTable->HookIndex, SlotCount);
+	}
+
+	for (HookIndex = 0; Success && HookIndex < HookCount; HookIndex++)
+	{
+		/* Hooked pages are clustered like the code pages of a handful of driver images */
+		ClusterBase = HARNESS_HOOK_BASE_ADDRESS + ((HookIndex / HARNESS_HOOK_CLUSTER_SIZE) * HARNESS_HOOK_CLUSTER_STRIDE);
+
+		Hooks[HookIndex].PhysicalBaseAddress = ClusterBase + ((HookIndex % HARNESS_HOOK_CLUSTER_SIZE) * PAGE_SIZE);
+		InsertHeadList(&PageTable->PageHookList, &Hooks[HookIndex].PageHookList);
+		Success = HvEptHookIndexInsert(&PageTable->HookIndex, &Hooks[HookIndex]);
+
+		/* Faults can happen anywhere within the page */
+		HitAddresses[HookIndex] = Hooks[HookIndex].PhysicalBaseAddress + ((HookIndex * 8) % PAGE_SIZE);
+		MissAddresses[HookIndex] = HitAddresses[HookIndex] + (HARNESS_HOOK_CLUSTER_SIZE * PAGE_SIZE);
+	}
+
+	if (Success)
+	{
+		HarnessShuffle(HitAddresses, HookCount, &RandomState);
+		HarnessShuffle(MissAddresses, HookCount, &RandomState);
+
+		ListIterations = min(HARNESS_LIST_VISITS / HookCount, HARNESS_INDEX_LOOKUPS);
+
+		IndexHitCycles = HarnessTimeHookLookups(PageTable, TRUE, HitAddresses, HookCount, HARNESS_INDEX_LOOKUPS, TRUE);
+		IndexMissCycles = HarnessTimeHookLookups(PageTable, TRUE, MissAddresses, HookCount, HARNESS_INDEX_LOOKUPS, FALSE);
+		ListHitCycles = HarnessTimeHookLookups(PageTable, FALSE, HitAddresses, HookCount, ListIterations, TRUE);
+		ListMissCycles = HarnessTimeHookLookups(PageTable, FALSE, MissAddresses, HookCount, ListIterations, FALSE);
+
+		Success = IndexHitCycles && IndexMissCycles && ListHitCycles && ListMissCycles;
+
+		HvUtilLog("%6lld hooks %6lld slots | index hit %5lld miss %5lld | list hit %8lld miss %8lld\n",
+			HookCount, SlotCount, IndexHitCycles, IndexMissCycles, ListHitCycles, ListMissCycles);
+	}
+
+	if (PageTable)
+	{
+		HvEptHookIndexFree(&PageTable->HookIndex);
+		OsFreeContiguousAlignedPages(PageTable);
+	}
+
+	if (Hooks)
+	{
+		OsFreeContiguousAlignedPages(Hooks);
+	}
+
+	if (HitAddresses)
+	{
+		OsFreeNonpagedMemory(HitAddresses);
+	}
+
+	if (MissAddresses)
+	{
+		OsFreeNonpagedMemory(MissAddresses);
+	}
+
+	return Success;
+}
+
+/*
+ * Benchmark page hook lookups in the EPT violation handler at 1, 100 and 10k hooks.
+ */
+BOOL HarnessBenchmarkHookIndex()
+{
+	static const SIZE_T HookCounts[] = { 1, 100, 10000 };
+	SIZE_T CountIndex;
+	BOOL Success;
+
+	HvUtilLog("Page hook lookup, average cycles per lookup:\n");
+
+	Success = TRUE;
+
+	for (CountIndex = 0; CountIndex < RTL_NUMBER_OF(HookCounts); CountIndex++)
+	{
+		if (!HarnessBenchmarkHookIndexSize(HookCounts[CountIndex]))
+		{
+			Success = FALSE;
+		}
+	}
+
+	return Success;
+}
+
+/*
+ * Largest number of spans the expected memory types of a fixed range MTRR test case are written as.
+ */
+#define HARNESS_FIXED_RANGE_MAX_SPANS 24
+
+/*
+ * Fixed range MTRR values repeating a single memory type in all eight ranges.
+ */
+#define HARNESS_MTRR_ALL_UC 0x0000000000000000ULL
+#define HARNESS_MTRR_ALL_WC 0x0101010101010101ULL
+#define HARNESS_MTRR_ALL_WP 0x0505050505050505ULL
+#define HARNESS_MTRR_ALL_WB 0x0606060606060606ULL
+
+/*
+ * A range of physical memory expected to have a single memory type.
+ */
+typedef struct _HARNESS_MEMORY_TYPE_SPAN
+{
+	SIZE_T BaseAddress;
+	SIZE_T Size;
+	UCHAR MemoryType;
+} HARNESS_MEMORY_TYPE_SPAN, *PHARNESS_MEMORY_TYPE_SPAN;
+
+/*
+ * A synthetic dump of the fixed range MTRRs and the memory type every page of the first 1MB should end up with.
+ */
+typedef struct _HARNESS_FIXED_RANGE_CASE
+{
+	/*
+	 * Description printed with the result.
+	 */
+	LPCSTR Name;
+
+	/*
+	 * Value of each fixed range MTRR, in the order of HvEptFixedRangeMtrrs.
+	 */
+	SIZE_T MsrValues[VMM_EPT_FIXED_RANGE_MTRR_COUNT];
+
+	/*
+	 * Expected memory types, covering the first 1MB exactly once. Ends with a span of size 0.
+	 */
+	HARNESS_MEMORY_TYPE_SPAN Expected[HARNESS_FIXED_RANGE_MAX_SPANS];
+} HARNESS_FIXED_RANGE_CASE, *PHARNESS_FIXED_RANGE_CASE;
+
+static HARNESS_FIXED_RANGE_CASE HarnessFixedRangeCases[] =
+{
+	{
+		"Typical desktop: RAM below 640KB, UC legacy video, WP option and system ROMs",
+		{
+			HARNESS_MTRR_ALL_WB, HARNESS_MTRR_ALL_WB, HARNESS_MTRR_ALL_UC,
+			HARNESS_MTRR_ALL_WP, HARNESS_MTRR_ALL_WP, HARNESS_MTRR_ALL_UC, HARNESS_MTRR_ALL_UC,
+			HARNESS_MTRR_ALL_UC, HARNESS_MTRR_ALL_UC, HARNESS_MTRR_ALL_WP, HARNESS_MTRR_ALL_WP,
+		},
+		{
+			{ 0x00000, 0xA0000, MEMORY_TYPE_WRITE_BACK },
+			{ 0xA0000, 0x20000, MEMORY_TYPE_UNCACHEABLE },
+			{ 0xC0000, 0x10000, MEMORY_TYPE_WRITE_PROTECTED },
+			{ 0xD0000, 0x20000, MEMORY_TYPE_UNCACHEABLE },
+			{ 0xF0000, 0x10000, MEMORY_TYPE_WRITE_PROTECTED },
+		},
+	},
+	{
+		"Write combined legacy video, everything else WB",
+		{
+			HARNESS_MTRR_ALL_WB, HARNESS_MTRR_ALL_WB, HARNESS_MTRR_ALL_WC,
+			HARNESS_MTRR_ALL_WB, HARNESS_MTRR_ALL_WB, HARNESS_MTRR_ALL_WB, HARNESS_MTRR_ALL_WB,
+			HARNESS_MTRR_ALL_WB, HARNESS_MTRR_ALL_WB, HARNESS_MTRR_ALL_WB, HARNESS_MTRR_ALL_WB,
+		},
+		{
+			{ 0x00000, 0xA0000, MEMORY_TYPE_WRITE_BACK },
+			{ 0xA0000, 0x20000, MEMORY_TYPE_WRITE_COMBINING },
+			{ 0xC0000, 0x40000, MEMORY_TYPE_WRITE_BACK },
+		},
+	},
+	{
+		"Everything UC",
+		{
+			HARNESS_MTRR_ALL_UC, HARNESS_MTRR_ALL_UC, HARNESS_MTRR_ALL_UC,
+			HARNESS_MTRR_ALL_UC, HARNESS_MTRR_ALL_UC, HARNESS_MTRR_ALL_UC, HARNESS_MTRR_ALL_UC,
+			HARNESS_MTRR_ALL_UC, HARNESS_MTRR_ALL_UC, HARNESS_MTRR_ALL_UC, HARNESS_MTRR_ALL_UC,
+		},
+		{
+			{ 0x00000, SIZE_1_MB, MEMORY_TYPE_UNCACHEABLE },
+		},
+	},
+	{
+		"A different type in each byte of a 64KB, 16KB and 4KB MTRR, lowest address in the lowest byte",
+		{
+			0x0001040506000104ULL, HARNESS_MTRR_ALL_WB, 0x0600000000000001ULL,
+			HARNESS_MTRR_ALL_WB, HARNESS_MTRR_ALL_WB, HARNESS_MTRR_ALL_WB, HARNESS_MTRR_ALL_WB,
+			HARNESS_MTRR_ALL_WB, HARNESS_MTRR_ALL_WB, HARNESS_MTRR_ALL_WB, 0x0605040100060504ULL,
+		},
+		{
+			{ 0x00000, 0x10000, MEMORY_TYPE_WRITE_THROUGH },
+			{ 0x10000, 0x10000, MEMORY_TYPE_WRITE_COMBINING },
+			{ 0x20000, 0x10000, MEMORY_TYPE_UNCACHEABLE },
+			{ 0x30000, 0x10000, MEMORY_TYPE_WRITE_BACK },
+			{ 0x40000, 0x10000, MEMORY_TYPE_WRITE_PROTECTED },
+			{ 0x50000, 0x10000, MEMORY_TYPE_WRITE_THROUGH },
+			{ 0x60000, 0x10000, MEMORY_TYPE_WRITE_COMBINING },
+			{ 0x70000, 0x10000, MEMORY_TYPE_UNCACHEABLE },
+			{ 0x80000, 0x20000, MEMORY_TYPE_WRITE_BACK },
+			{ 0xA0000, 0x04000, MEMORY_TYPE_WRITE_COMBINING },
+			{ 0xA4000, 0x18000, MEMORY_TYPE_UNCACHEABLE },
+			{ 0xBC000, 0x3C000, MEMORY_TYPE_WRITE_BACK },
+			{ 0xF8000, 0x01000, MEMORY_TYPE_WRITE_THROUGH },
+			{ 0xF9000, 0x01000, MEMORY_TYPE_WRITE_PROTECTED },
+			{ 0xFA000, 0x01000, MEMORY_TYPE_WRITE_BACK },
+			{ 0xFB000, 0x01000, MEMORY_TYPE_UNCACHEABLE },
+			{ 0xFC000, 0x01000, MEMORY_TYPE_WRITE_COMBINING },
+			{ 0xFD000, 0x01000, MEMORY_TYPE_WRITE_THROUGH },
+			{ 0xFE000, 0x01000, MEMORY_TYPE_WRITE_PROTECTED },
+			{ 0xFF000, 0x01000, MEMORY_TYPE_WRITE_BACK },
+		},
+	},
+};
+
+/*
+ * Expand the expected spans of a test case into the memory type of each page of the first 1MB.
+ *
+ * Returns FALSE if the spans do not cover the first 1MB exactly once, which is a mistake in the test case itself.
+ */
+BOOL HarnessExpandMemoryTypeSpans(PHARNESS_FIXED_RANGE_CASE Case, PUCHAR PageMemoryTypes)
+{
+	PHARNESS_MEMORY_TYPE_SPAN Span;
+	SIZE_T SpanIndex;
+	SIZE_T PageIndex;
+
+	memset(PageMemoryTypes, 0xFF, VMM_EPT_FIXED_RANGE_PAGE_COUNT);
+
+	for (SpanIndex = 0; SpanIndex < HARNESS_FIXED_RANGE_MAX_SPANS && Case->Expected[SpanIndex].Size != 0; SpanIndex++)
+	{
+		Span = &Case->Expected[SpanIndex];
+
+		for (PageIndex = Span->BaseAddress / PAGE_SIZE; PageIndex < (Span->BaseAddress + Span->Size) / PAGE_SIZE; PageIndex++)
+		{
+			if (PageIndex >= VMM_EPT_FIXED_RANGE_PAGE_COUNT || PageMemoryTypes[PageIndex] != 0xFF)
+			{
+				HvUtilLogError("HarnessExpandMemoryTypeSpans: Span at 0x%llX of '%s' overlaps or leaves the first 1MB.\n", Span->BaseAddress, Case->Name);
+				return FALSE;
+			}
+
+			PageMemoryTypes[PageIndex] = Span->MemoryType;
+		}
+	}
+
+	for (PageIndex = 0; PageIndex < VMM_EPT_FIXED_RANGE_PAGE_COUNT; PageIndex++)
+	{
+		if (PageMemoryTypes[PageIndex] == 0xFF)
+		{
+			HvUtilLogError("HarnessExpandMemoryTypeSpans: Page 0x%llX of '%s' is not covered by any span.\n", PageIndex * PAGE_SIZE, Case->Name);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Build the identity directory of the first 1GB from the decoded fixed range MTRRs, with WB everywhere else, and check
+ * that the first 2MB was split with every page of the first 1MB carrying exactly the type the MTRRs give it.
+ */
+BOOL HarnessCheckFixedRangeSplit(PHARNESS_FIXED_RANGE_CASE Case, PUCHAR ExpectedTypes)
+{
+	PVMM_CONTEXT GlobalContext;
+	PVMM_EPT_IDENTITY_MAP IdentityMap;
+	PVMM_EPT_PML2_DIRECTORY Directory;
+	PVMM_EPT_DYNAMIC_SPLIT Split;
+	SIZE_T PageIndex;
+	UCHAR ExpectedType;
+	BOOL Success;
+
+	Success = FALSE;
+
+	GlobalContext = (PVMM_CONTEXT)OsAllocateNonpagedMemory(sizeof(VMM_CONTEXT));
+	IdentityMap = (PVMM_EPT_IDENTITY_MAP)OsAllocateContiguousAlignedPages(sizeof(VMM_EPT_IDENTITY_MAP) / PAGE_SIZE);
+	Directory = (PVMM_EPT_PML2_DIRECTORY)OsAllocateContiguousAlignedPages(sizeof(VMM_EPT_PML2_DIRECTORY) / PAGE_SIZE);
+
+	if (IdentityMap)
+	{
+		OsZeroMemory(IdentityMap, sizeof(VMM_EPT_IDENTITY_MAP));
+		InitializeListHead(&IdentityMap->DynamicSplitList);
+
+		/* Freed along with the identity map */
+		IdentityMap->PML2[0] = Directory;
+	}
+
+	if (!GlobalContext || !IdentityMap || !Directory)
+	{
+		HvUtilLogError("HarnessCheckFixedRangeSplit: Failed to allocate the identity map.\n");
+	}
+	else
+	{
+		OsZeroMemory(GlobalContext, sizeof(VMM_CONTEXT));
+		__stosq((SIZE_T*)&Directory->PML2[0], VMM_EPT_NOT_PRESENT_ENTRY, VMM_EPT_PML2E_COUNT);
+
+		GlobalContext->FixedRangeMtrrsEnabled = TRUE;
+		RtlCopyMemory(GlobalContext->FixedRangeMemoryTypes, ExpectedTypes, VMM_EPT_FIXED_RANGE_PAGE_COUNT);
+
+		Success = HvEptBuildMemoryRuns(GlobalContext, MEMORY_TYPE_WRITE_BACK)
+			&& HvEptFillPml2Directory(GlobalContext, IdentityMap, Directory, 0);
+	}
+
+	if (Success && (IdentityMap->MixedRegionSplitCount != 1 || IsListEmpty(&IdentityMap->DynamicSplitList)))
+	{
+		HvUtilLogError("HarnessCheckFixedRangeSplit: Expected only the first 2MB of '%s' to be split, got %lld splits.\n", Case->Name, IdentityMap->MixedRegionSplitCount);
+		Success = FALSE;
+	}
+
+	if (Success && (!Directory->PML2[1].LargePage || Directory->PML2[1].MemoryType != MEMORY_TYPE_WRITE_BACK))
+	{
+		HvUtilLogError("HarnessCheckFixedRangeSplit: The second 2MB of '%s' is not a WB large page.\n", Case->Name);
+		Success = FALSE;
+	}
+
+	if (Success)
+	{
+		Split = CONTAINING_RECORD(IdentityMap->DynamicSplitList.Flink, VMM_EPT_DYNAMIC_SPLIT, DynamicSplitList);
+
+		for (PageIndex = 0; PageIndex < VMM_EPT_PML1E_COUNT; PageIndex++)
+		{
+			/* Above the first 1MB, only the variable ranges apply, and there are none */
+			ExpectedType = PageIndex < VMM_EPT_FIXED_RANGE_PAGE_COUNT ? ExpectedTypes[PageIndex] : MEMORY_TYPE_WRITE_BACK;
+
+			if (Split->PML1[PageIndex].PageFrameNumber != PageIndex || Split->PML1[PageIndex].MemoryType != ExpectedType)
+			{
+				HvUtilLogError("HarnessCheckFixedRangeSplit: Page 0x%llX of '%s' mapped to frame 0x%llX as type %d, expected type %d.\n",
+					PageIndex * PAGE_SIZE, Case->Name, (SIZE_T)Split->PML1[PageIndex].PageFrameNumber, (UCHAR)Split->PML1[PageIndex].MemoryType, ExpectedType);
+				Success = FALSE;
+				break;
+			}
+		}
+	}
+
+	if (IdentityMap)
+	{
+		HvEptFreeIdentityMap(IdentityMap);
+	}
+	else if (Directory)
+	{
+		OsFreeContiguousAlignedPages(Directory);
+	}
+
+	if (GlobalContext)
+	{
+		OsFreeNonpagedMemory(GlobalContext);
+	}
+
+	return Success;
+}
+
+/*
+ * Decode each synthetic dump of the fixed range MTRRs with HvEptDecodeFixedRangeMtrr and compare the type of every
+ * page of the first 1MB against the expected one, then check the identity map is built from them page for page.
+ */
+BOOL HarnessTestFixedRangeMtrrs()
+{
+	UCHAR ExpectedTypes[VMM_EPT_FIXED_RANGE_PAGE_COUNT];
+	UCHAR DecodedTypes[VMM_EPT_FIXED_RANGE_PAGE_COUNT];
+	PHARNESS_FIXED_RANGE_CASE Case;
+	SIZE_T CaseIndex;
+	SIZE_T RegisterIndex;
+	SIZE_T PageIndex;
+	BOOL CasePassed;
+	BOOL Success;
+
+	Success = TRUE;
+
+	for (CaseIndex = 0; CaseIndex < RTL_NUMBER_OF(HarnessFixedRangeCases); CaseIndex++)
+	{
+		Case = &HarnessFixedRangeCases[CaseIndex];
+
+		CasePassed = HarnessExpandMemoryTypeSpans(Case, ExpectedTypes);
+
+		/* Anything the decoder does not write stays 0xFF and fails the comparison */
+		memset(DecodedTypes, 0xFF, sizeof(DecodedTypes));
+
+		for (RegisterIndex = 0; RegisterIndex < VMM_EPT_FIXED_RANGE_MTRR_COUNT; RegisterIndex++)
+		{
+			HvEptDecodeFixedRangeMtrr(&HvEptFixedRangeMtrrs[RegisterIndex], Case->MsrValues[RegisterIndex], DecodedTypes);
+		}
+
+		for (PageIndex = 0; CasePassed && PageIndex < VMM_EPT_FIXED_RANGE_PAGE_COUNT; PageIndex++)
+		{
+			if (DecodedTypes[PageIndex] != ExpectedTypes[PageIndex])
+			{
+				HvUtilLogError("HarnessTestFixedRangeMtrrs: Page 0x%llX decoded as type %d, expected type %d.\n",
+					PageIndex * PAGE_SIZE, DecodedTypes[PageIndex], ExpectedTypes[PageIndex]);
+				CasePassed = FALSE;
+			}
+		}
+
+		if (CasePassed)
+		{
+			CasePassed = HarnessCheckFixedRangeSplit(Case, ExpectedTypes);
+		}
+
+		if (CasePassed)
+		{
+			HvUtilLogSuccess("Fixed range MTRRs: %s\n", Case->Name);
+		}
+		else
+		{
+			HvUtilLogError("Fixed range MTRRs: %s\n", Case->Name);
+			Success = FALSE;
+		}
+	}
+
+	return Success;
+}
+
+/*
+ * Number of times each identity map build is timed. The average is reported.
+ */
+#define HARNESS_BUILD_REPETITIONS 8
+
+/*
+ * Variable range MTRRs of a typical desktop with 32GB of RAM. Only ranges that are not WB are listed, as the
+ * original builder dropped WB ranges and took WB as the default.
+ */
+static MTRR_RANGE_DESCRIPTOR HarnessDesktopMtrrRanges[] =
+{
+	/* 32-bit PCI hole */
+	{ 0x80000000, 0xFFFFFFFF, MEMORY_TYPE_UNCACHEABLE },
+	/* Graphics aperture inside the hole, which UC takes precedence over */
+	{ 0xC0000000, 0xCFFFFFFF, MEMORY_TYPE_WRITE_COMBINING },
+	/* Graphics stolen memory just below the hole */
+	{ 0x7F800000, 0x7FFFFFFF, MEMORY_TYPE_UNCACHEABLE },
+	/* 1MB SMM region, which shares its 2MB region with RAM */
+	{ 0x7F700000, 0x7F7FFFFF, MEMORY_TYPE_UNCACHEABLE },
+	/* 64-bit MMIO of a discrete graphics card */
+	{ 0x4000000000, 0x43FFFFFFFF, MEMORY_TYPE_WRITE_COMBINING },
+	/* Flash below 4GB, inside the hole */
+	{ 0xFF000000, 0xFFFFFFFF, MEMORY_TYPE_WRITE_PROTECTED },
+};
+
+/*
+ * Set up the 2MB PML2 entry of the page frame the way the identity page table was built before memory type runs:
+ * by scanning every variable range MTRR for every one of the 262,144 entries.
+ */
+VOID HarnessBaselineSetupPml2Entry(PVMM_CONTEXT GlobalContext, PEPT_PML2_ENTRY NewEntry, SIZE_T PageFrameNumber)
+{
+	SIZE_T AddressOfPage;
+	SIZE_T CurrentMtrrRange;
+	SIZE_T TargetMemoryType;
+
+	NewEntry->PageFrameNumber = PageFrameNumber;
+
+	AddressOfPage = PageFrameNumber * SIZE_2_MB;
+
+	/* The fixed range MTRRs were not parsed, so the first 2MB was always UC */
+	if (PageFrameNumber == 0)
+	{
+		NewEntry->MemoryType = MEMORY_TYPE_UNCACHEABLE;
+		return;
+	}
+
+	TargetMemoryType = MEMORY_TYPE_WRITE_BACK;
+
+	for (CurrentMtrrRange = 0; CurrentMtrrRange < GlobalContext->NumberOfEnabledMemoryRanges; CurrentMtrrRange++)
+	{
+		if (AddressOfPage <= GlobalContext->MemoryRanges[CurrentMtrrRange].PhysicalEndAddress)
+		{
+			if ((AddressOfPage + SIZE_2_MB - 1) >= GlobalContext->MemoryRanges[CurrentMtrrRange].PhysicalBaseAddress)
+			{
+				TargetMemoryType = GlobalContext->MemoryRanges[CurrentMtrrRange].MemoryType;
+
+				if (TargetMemoryType == MEMORY_TYPE_UNCACHEABLE)
+				{
+					break;
+				}
+			}
+		}
+	}
+
+	NewEntry->MemoryType = TargetMemoryType;
+}
+
+/*
+ * Build all 512 * 512 2MB entries of the identity map the way each processor did before memory type runs.
+ * Pml2 is VMM_EPT_PML3E_COUNT * VMM_EPT_PML2E_COUNT entries.
+ */
+VOID HarnessBaselineBuildIdentityTable(PVMM_CONTEXT GlobalContext, PEPT_PML2_ENTRY Pml2)
+{
+	EPT_PML2_ENTRY PML2EntryTemplate;
+	SIZE_T EntryGroupIndex;
+	SIZE_T EntryIndex;
+
+	PML2EntryTemplate.Flags = 0;
+	PML2EntryTemplate.WriteAccess = 1;
+	PML2EntryTemplate.ReadAccess = 1;
+	PML2EntryTemplate.ExecuteAccess = 1;
+	PML2EntryTemplate.LargePage = 1;
+
+	__stosq((SIZE_T*)Pml2, PML2EntryTemplate.Flags, VMM_EPT_PML3E_COUNT * VMM_EPT_PML2E_COUNT);
+
+	for (EntryGroupIndex = 0; EntryGroupIndex < VMM_EPT_PML3E_COUNT; EntryGroupIndex++)
+	{
+		for (EntryIndex = 0; EntryIndex < VMM_EPT_PML2E_COUNT; EntryIndex++)
+		{
+			HarnessBaselineSetupPml2Entry(GlobalContext, &Pml2[(EntryGroupIndex * VMM_EPT_PML2E_COUNT) + EntryIndex], (EntryGroupIndex * VMM_EPT_PML2E_COUNT) + EntryIndex);
+		}
+	}
+}
+
+/*
+ * Build the memory type runs and the shared identity map from them, with a directory for every 1GB region.
+ *
+ * The driver maps uniform gigabytes with a single 1GB entry instead when the processor supports it. That is left out
+ * here so that both builders write all 262,144 2MB entries.
+ */
+PVMM_EPT_IDENTITY_MAP HarnessBuildIdentityMap(PVMM_CONTEXT GlobalContext)
+{
+	PVMM_EPT_IDENTITY_MAP IdentityMap;
+	PVMM_EPT_PML2_DIRECTORY Directory;
+	SIZE_T EntryGroupIndex;
+
+	if (!HvEptBuildMemoryRuns(GlobalContext, MEMORY_TYPE_WRITE_BACK))
+	{
+		return NULL;
+	}
+
+	IdentityMap = (PVMM_EPT_IDENTITY_MAP)OsAllocateContiguousAlignedPages(sizeof(VMM_EPT_IDENTITY_MAP) / PAGE_SIZE);
+	if (!IdentityMap)
+	{
+		return NULL;
+	}
+
+	OsZeroMemory(IdentityMap, sizeof(VMM_EPT_IDENTITY_MAP));
+	InitializeListHead(&IdentityMap->DynamicSplitList);
+
+	for (EntryGroupIndex = 0; EntryGroupIndex < VMM_EPT_PML3E_COUNT; EntryGroupIndex++)
+	{
+		Directory = (PVMM_EPT_PML2_DIRECTORY)OsAllocateContiguousAlignedPages(sizeof(VMM_EPT_PML2_DIRECTORY) / PAGE_SIZE);
+		if (!Directory)
+		{
+			HvEptFreeIdentityMap(IdentityMap);
+			return NULL;
+		}
+
+		__stosq((SIZE_T*)&Directory->PML2[0], VMM_EPT_NOT_PRESENT_ENTRY, VMM_EPT_PML2E_COUNT);
+		IdentityMap->PML2[EntryGroupIndex] = Directory;
+
+		if (!HvEptFillPml2Directory(GlobalContext, IdentityMap, Directory, EntryGroupIndex))
+		{
+			HvEptFreeIdentityMap(IdentityMap);
+			return NULL;
+		}
+	}
+
+	return IdentityMap;
+}
+
+/*
+ * Check that every 2MB entry the identity map did not need to split got the same memory type as the original builder
+ * gave it. Split entries are expected to differ, as the original builder made the whole 2MB UC.
+ */
+BOOL HarnessCompareIdentityMaps(PVMM_EPT_IDENTITY_MAP IdentityMap, PEPT_PML2_ENTRY BaselinePml2)
+{
+	PEPT_PML2_ENTRY Entry;
+	PEPT_PML2_ENTRY BaselineEntry;
+	SIZE_T EntryGroupIndex;
+	SIZE_T EntryIndex;
+
+	for (EntryGroupIndex = 0; EntryGroupIndex < VMM_EPT_PML3E_COUNT; EntryGroupIndex++)
+	{
+		for (EntryIndex = 0; EntryIndex < VMM_EPT_PML2E_COUNT; EntryIndex++)
+		{
+			Entry = &IdentityMap->PML2[EntryGroupIndex]->PML2[EntryIndex];
+			BaselineEntry = &BaselinePml2[(EntryGroupIndex * VMM_EPT_PML2E_COUNT) + EntryIndex];
+
+			if (!Entry->LargePage)
+			{
+				continue;
+			}
+
+			if (Entry->PageFrameNumber != BaselineEntry->PageFrameNumber || Entry->MemoryType != BaselineEntry->MemoryType)
+			{
+				HvUtilLogError("HarnessCompareIdentityMaps: 2MB entry at 0x%llX has type %d, the original builder gave it type %d.\n",
+					((EntryGroupIndex * VMM_EPT_PML2E_COUNT) + EntryIndex) * SIZE_2_MB, (UCHAR)Entry->MemoryType, (UCHAR)BaselineEntry->MemoryType);
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Time building the identity map of the first 512GB from the MTRRs of a typical desktop, before and after memory type runs.
+ *
+ * Before, every processor built its own table. After, the runs and the identity map are built once and shared.
+ */
+BOOL HarnessBenchmarkIdentityMapBuild()
+{
+	PVMM_CONTEXT GlobalContext;
+	PEPT_PML2_ENTRY BaselinePml2;
+	PVMM_EPT_IDENTITY_MAP IdentityMap;
+	SIZE_T Repetition;
+	SIZE_T RegisterIndex;
+	ULONG64 Start;
+	ULONG64 BaselineCycles;
+	ULONG64 RunCycles;
+	SIZE_T SplitCount;
+	BOOL Success;
+
+	GlobalContext = (PVMM_CONTEXT)OsAllocateNonpagedMemory(sizeof(VMM_CONTEXT));
+	if (!GlobalContext)
+	{
+		HvUtilLogError("HarnessBenchmarkIdentityMapBuild: Failed to allocate the global context.\n");
+		return FALSE;
+	}
+
+	OsZeroMemory(GlobalContext, sizeof(VMM_CONTEXT));
+
+	RtlCopyMemory(GlobalContext->MemoryRanges, HarnessDesktopMtrrRanges, sizeof(HarnessDesktopMtrrRanges));
+	GlobalContext->NumberOfEnabledMemoryRanges = RTL_NUMBER_OF(HarnessDesktopMtrrRanges);
+
+	/* The fixed range MTRRs of the typical desktop case of HarnessTestFixedRangeMtrrs */
+	GlobalContext->FixedRangeMtrrsEnabled = TRUE;
+	for (RegisterIndex = 0; RegisterIndex < VMM_EPT_FIXED_RANGE_MTRR_COUNT; RegisterIndex++)
+	{
+		HvEptDecodeFixedRangeMtrr(&HvEptFixedRangeMtrrs[RegisterIndex], HarnessFixedRangeCases[0].MsrValues[RegisterIndex], GlobalContext->FixedRangeMemoryTypes);
+	}
+
+	Success = TRUE;
+	BaselineCycles = 0;
+	RunCycles = 0;
+	SplitCount = 0;
+
+	for (Repetition = 0; Success && Repetition < HARNESS_BUILD_REPETITIONS; Repetition++)
+	{
+		Start = __rdtsc();
+
+		BaselinePml2 = (PEPT_PML2_ENTRY)OsAllocateContiguousAlignedPages((VMM_EPT_PML3E_COUNT * VMM_EPT_PML2E_COUNT * sizeof(EPT_PML2_ENTRY)) / PAGE_SIZE);
+		if (BaselinePml2)
+		{
+			HarnessBaselineBuildIdentityTable(GlobalContext, BaselinePml2);
+		}
+
+		BaselineCycles += __rdtsc() - Start;
+
+		Start = __rdtsc();
+		IdentityMap = HarnessBuildIdentityMap(GlobalContext);
+		RunCycles += __rdtsc() - Start;
+
+		if (!BaselinePml2 || !IdentityMap)
+		{
+			HvUtilLogError("HarnessBenchmarkIdentityMapBuild: Failed to build the identity maps.\n");
+			Success = FALSE;
+		}
+		else
+		{
+			SplitCount = IdentityMap->MixedRegionSplitCount;
+			Success = HarnessCompareIdentityMaps(IdentityMap, BaselinePml2);
+		}
+
+		if (BaselinePml2)
+		{
+			OsFreeContiguousAlignedPages(BaselinePml2);
+		}
+
+		if (IdentityMap)
+		{
+			HvEptFreeIdentityMap(IdentityMap);
+		}
+	}
+
+	if (Success)
+	{
+		HvUtilLog("Identity map build, %lld MTRR ranges, %d memory runs, average of %d builds:\n",
+			(SIZE_T)GlobalContext->NumberOfEnabledMemoryRanges, GlobalContext->NumberOfMemoryRuns, HARNESS_BUILD_REPETITIONS);
+		HvUtilLog("  before (per-entry MTRR scan) %10lld cycles, %5lld per 2MB entry\n",
+			BaselineCycles / HARNESS_BUILD_REPETITIONS, BaselineCycles / HARNESS_BUILD_REPETITIONS / (VMM_EPT_PML3E_COUNT * VMM_EPT_PML2E_COUNT));
+		HvUtilLog("  after  (memory type runs)    %10lld cycles, %5lld per 2MB entry, %lld mixed 2MB regions split\n",
+			RunCycles / HARNESS_BUILD_REPETITIONS, RunCycles / HARNESS_BUILD_REPETITIONS / (VMM_EPT_PML3E_COUNT * VMM_EPT_PML2E_COUNT), SplitCount);
+	}
+
+	OsFreeNonpagedMemory(GlobalContext);
+
+	return Success;
+}
+
+int main()
+{
+	BOOL Success;
+
+	Success = TRUE;
+
+	if (!HarnessTestFixedRangeMtrrs())
+	{
+		Success = FALSE;
+	}
+
+	if (!HarnessBenchmarkHookIndex())
+	{
+		Success = FALSE;
+	}
+
+	if (!HarnessBenchmarkIdentityMapBuild())
+	{
+		Success = FALSE;
+	}
+
+	if (!Success)
+	{
+		HvUtilLogError("EptHarness: FAILED\n");
+		return 1;
+	}
+
+	HvUtilLogSuccess("EptHarness: All tests passed.\n");
+	return 0;
+}
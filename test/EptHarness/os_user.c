@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+
+#include "os.h"
+#include "util.h"
+
+/*
+ * User mode implementations of the parts of os.h and util.h used by the code the harness compiles.
+ *
+ * Physical memory is simulated by treating every virtual address as its own physical address.
+ */
+
+/*
+ * Allocate a number of page-aligned pages of memory and return a pointer to the region.
+ *
+ * Returns NULL if the pages could not be allocated.
+ */
+PVOID OsAllocateContiguousAlignedPages(SIZE_T NumberOfPages)
+{
+	PVOID Output;
+
+	Output = _aligned_malloc(NumberOfPages * PAGE_SIZE, PAGE_SIZE);
+
+	if (Output == NULL)
+	{
+		HvUtilLogError("OsAllocateContiguousAlignedPages: Out of memory!\n");
+	}
+
+	return Output;
+}
+
+/*
+ * Free a region of pages allocated by OsAllocateContiguousAlignedPages.
+ */
+VOID OsFreeContiguousAlignedPages(PVOID PageRegionAddress)
+{
+	_aligned_free(PageRegionAddress);
+}
+
+/*
+ * Allocate generic r/w memory.
+ *
+ * Returns NULL if the bytes could not be allocated.
+ */
+PVOID OsAllocateNonpagedMemory(SIZE_T NumberOfBytes)
+{
+	PVOID Output;
+
+	Output = malloc(NumberOfBytes);
+
+	if (Output == NULL)
+	{
+		HvUtilLogError("OsAllocateNonpagedMemory: Out of memory!\n");
+	}
+
+	return Output;
+}
+
+/*
+ * Free memory allocated with OsAllocateNonpagedMemory.
+ */
+VOID OsFreeNonpagedMemory(PVOID MemoryPointer)
+{
+	free(MemoryPointer);
+}
+
+/*
+ * Convert a virtual address to a physical address. The harness has no physical memory, so they are the same.
+ */
+PPHYSVOID OsVirtualToPhysical(PVOID VirtualAddress)
+{
+	return (PPHYSVOID)VirtualAddress;
+}
+
+/*
+ * Zero a region of memory.
+ */
+VOID OsZeroMemory(PVOID VirtualAddress, SIZE_T Length)
+{
+	RtlSecureZeroMemory(VirtualAddress, Length);
+}
+
+/*
+ * Print a message to the console.
+ */
+VOID HvUtilLog(LPCSTR MessageFormat, ...)
+{
+	va_list ArgumentList;
+
+	va_start(ArgumentList, MessageFormat);
+	printf("[*] ");
+	vprintf(MessageFormat, ArgumentList);
+	va_end(ArgumentList);
+}
+
+/*
+ * Debug messages are dropped, as the code under test prints one for every memory run it builds and
+ * that would only slow down the benchmarks.
+ */
+VOID HvUtilLogDebug(LPCSTR MessageFormat, ...)
+{
+	UNREFERENCED_PARAMETER(MessageFormat);
+}
+
+/*
+ * Print a success message to the console.
+ */
+VOID HvUtilLogSuccess(LPCSTR MessageFormat, ...)
+{
+	va_list ArgumentList;
+
+	va_start(ArgumentList, MessageFormat);
+	printf("[+] ");
+	vprintf(MessageFormat, ArgumentList);
+	va_end(ArgumentList);
+}
+
+/*
+ * Print an error to the console.
+ */
+VOID HvUtilLogError(LPCSTR MessageFormat, ...)
+{
+	va_list ArgumentList;
+
+	va_start(ArgumentList, MessageFormat);
+	printf("[!] ");
+	vprintf(MessageFormat, ArgumentList);
+	va_end(ArgumentList);
+}